@@ -0,0 +1,161 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <ell/ell.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN		(2 * sizeof(void *))
+#define ARENA_ALIGNED(size)	(((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;		/* Usable bytes after the header */
+	size_t used;
+	uint8_t data[] __attribute__((aligned(2 * sizeof(void *))));
+};
+
+struct arena {
+	struct arena_block *head;	/* Current block, first to allocate */
+	struct arena_block *first;	/* Kept across resets */
+	size_t block_size;
+};
+
+static struct arena_block *block_new(size_t size)
+{
+	struct arena_block *block;
+
+	block = l_malloc(sizeof(*block) + size);
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
+
+/**
+ * arena_new:
+ * @block_size: size of each memory block
+ *
+ * Creates an arena. The first block is allocated upfront and reused after
+ * each arena_reset(), so steady state usage doesn't hit the system
+ * allocator at all.
+ *
+ * Returns: a new arena.
+ */
+struct arena *arena_new(size_t block_size)
+{
+	struct arena *arena = l_new(struct arena, 1);
+
+	arena->block_size = ARENA_ALIGNED(block_size);
+	arena->first = block_new(arena->block_size);
+	arena->head = arena->first;
+
+	return arena;
+}
+
+/**
+ * arena_reset:
+ * @arena: arena
+ *
+ * Releases every object allocated from @arena. Blocks allocated on demand
+ * are freed while the first one is kept for reuse.
+ */
+void arena_reset(struct arena *arena)
+{
+	struct arena_block *block, *next;
+
+	if (unlikely(!arena))
+		return;
+
+	for (block = arena->head; block != arena->first; block = next) {
+		next = block->next;
+		l_free(block);
+	}
+
+	arena->first->used = 0;
+	arena->head = arena->first;
+}
+
+void arena_free(struct arena *arena)
+{
+	if (unlikely(!arena))
+		return;
+
+	arena_reset(arena);
+	l_free(arena->first);
+	l_free(arena);
+}
+
+/**
+ * arena_alloc:
+ * @arena: arena
+ * @size: amount of bytes to allocate
+ *
+ * Allocates zeroed memory from @arena. Requests larger than the arena
+ * block size get a block of their own.
+ *
+ * Returns: pointer to the allocated memory, valid until the next
+ * arena_reset().
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_block *block = arena->head;
+	void *ptr;
+
+	size = ARENA_ALIGNED(size ? size : 1);
+
+	if (block->size - block->used < size) {
+		block = block_new(size > arena->block_size ?
+				  size : arena->block_size);
+		block->next = arena->head;
+		arena->head = block;
+	}
+
+	ptr = block->data + block->used;
+	block->used += size;
+
+	return memset(ptr, 0, size);
+}
+
+void *arena_memdup(struct arena *arena, const void *mem, size_t size)
+{
+	if (!mem)
+		return NULL;
+
+	return memcpy(arena_alloc(arena, size), mem, size);
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	if (!str)
+		return NULL;
+
+	return arena_memdup(arena, str, strlen(str) + 1);
+}
@@ -0,0 +1,185 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Allocation free base64 codec (RFC 4648, no line wrapping) writing into
+ * caller provided buffers. Output and error semantics match ELL's
+ * l_base64_encode() and l_base64_decode().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "base64.h"
+
+/* decode_table entries: 0 is invalid, otherwise the 6-bit value plus one */
+#define B64_INVALID	0x00
+#define B64_PAD		0x80 /* '=' */
+#define B64_SPACE	0x81 /* Ignored, as l_ascii_isspace() */
+
+static const char encode_table[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const uint8_t decode_table[256] = {
+	['A'] = 1, ['B'] = 2, ['C'] = 3, ['D'] = 4, ['E'] = 5, ['F'] = 6,
+	['G'] = 7, ['H'] = 8, ['I'] = 9, ['J'] = 10, ['K'] = 11, ['L'] = 12,
+	['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16, ['Q'] = 17, ['R'] = 18,
+	['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+	['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30,
+	['e'] = 31, ['f'] = 32, ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36,
+	['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40, ['o'] = 41, ['p'] = 42,
+	['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+	['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54,
+	['2'] = 55, ['3'] = 56, ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60,
+	['8'] = 61, ['9'] = 62, ['+'] = 63, ['/'] = 64,
+	['='] = B64_PAD,
+	[' '] = B64_SPACE, ['\t'] = B64_SPACE, ['\n'] = B64_SPACE,
+	['\v'] = B64_SPACE, ['\f'] = B64_SPACE, ['\r'] = B64_SPACE,
+};
+
+/**
+ * base64_encode:
+ * @in: data to be encoded
+ * @in_len: length of @in
+ * @out: output buffer
+ * @out_size: size of @out, including room for the terminating null
+ *
+ * Encodes @in as a null-terminated base64 string without line breaks.
+ *
+ * Returns: the encoded length (excluding the null character) or -ENOSPC
+ * if @out is too small.
+ */
+ssize_t base64_encode(const uint8_t *in, size_t in_len,
+		      char *out, size_t out_size)
+{
+	size_t olen = BASE64_ENCODED_LEN(in_len);
+	const uint8_t *end = in + in_len - (in_len % 3);
+	char *ptr = out;
+	uint32_t reg;
+
+	if (out_size < olen + 1)
+		return -ENOSPC;
+
+	for (; in < end; in += 3) {
+		reg = (in[0] << 16) | (in[1] << 8) | in[2];
+
+		*ptr++ = encode_table[(reg >> 18) & 0x3f];
+		*ptr++ = encode_table[(reg >> 12) & 0x3f];
+		*ptr++ = encode_table[(reg >> 6) & 0x3f];
+		*ptr++ = encode_table[reg & 0x3f];
+	}
+
+	switch (in_len % 3) {
+	case 1:
+		reg = in[0] << 16;
+
+		*ptr++ = encode_table[(reg >> 18) & 0x3f];
+		*ptr++ = encode_table[(reg >> 12) & 0x3f];
+		*ptr++ = '=';
+		*ptr++ = '=';
+		break;
+	case 2:
+		reg = (in[0] << 16) | (in[1] << 8);
+
+		*ptr++ = encode_table[(reg >> 18) & 0x3f];
+		*ptr++ = encode_table[(reg >> 12) & 0x3f];
+		*ptr++ = encode_table[(reg >> 6) & 0x3f];
+		*ptr++ = '=';
+		break;
+	}
+
+	*ptr = '\0';
+
+	return olen;
+}
+
+/**
+ * base64_decode:
+ * @in: base64 string, not required to be null-terminated
+ * @in_len: length of @in
+ * @out: output buffer
+ * @out_size: size of @out
+ *
+ * Decodes @in into @out. Whitespace is ignored and padding is mandatory,
+ * as in l_base64_decode().
+ *
+ * Returns: the amount of octets written to @out, -EINVAL if @in is
+ * malformed or empty or -EMSGSIZE if the decoded data doesn't fit in @out.
+ */
+ssize_t base64_decode(const char *in, size_t in_len,
+		      uint8_t *out, size_t out_size)
+{
+	const uint8_t *ptr, *end = (const uint8_t *) in + in_len;
+	size_t base64_len = 0, pad_len = 0;
+	size_t olen, written = 0;
+	unsigned int bits = 0;
+	uint32_t reg = 0;
+	uint8_t val;
+
+	/* First pass: validate and compute the decoded length */
+	for (ptr = (const uint8_t *) in; ptr < end; ptr++) {
+		val = decode_table[*ptr];
+
+		if (val == B64_SPACE)
+			continue;
+		else if (val == B64_PAD)
+			pad_len++;
+		else if (val == B64_INVALID || pad_len)
+			return -EINVAL; /* Bad character or data after padding */
+		else
+			base64_len++;
+	}
+
+	if ((base64_len & 3) == 1)
+		return -EINVAL;
+
+	if (pad_len != ((base64_len + 3) & ~3UL) - base64_len)
+		return -EINVAL;
+
+	olen = base64_len * 3 / 4;
+	if (!olen)
+		return -EINVAL;
+
+	if (olen > out_size)
+		return -EMSGSIZE;
+
+	/* Second pass: decode, skipping whitespace and padding */
+	for (ptr = (const uint8_t *) in; ptr < end && written < olen; ptr++) {
+		val = decode_table[*ptr];
+		if (val >= B64_PAD)
+			continue;
+
+		reg = (reg << 6) | (val - 1);
+		bits += 6;
+
+		if (bits >= 8) {
+			bits -= 8;
+			out[written++] = reg >> bits;
+		}
+	}
+
+	return written;
+}
@@ -36,8 +36,13 @@
 
 #include <knot/knot_protocol.h>
 
+#include "log.h"
 #include "settings.h"
+#include "arena.h"
+#include "schema.h"
 #include "mq.h"
+#include "trace.h"
+#include "metrics.h"
 #include "parser.h"
 #include "cloud.h"
 
@@ -50,9 +55,26 @@
 
 /* Headers */
 #define MQ_AUTHORIZATION_HEADER "Authorization"
+#define MQ_TRACE_ID_HEADER "X-Knot-Trace-Id"
+#define MQ_TRACE_TIME_HEADER "X-Knot-Trace-Time"	/* ns, node recv */
+#define MQ_TRACE_LATENCY_HEADER "X-Knot-Trace-Latency"	/* ns, in knotd */
 
 #define MQ_MSG_EXPIRATION_TIME_MS 2000
 
+/* Messages waiting to be published and published per main loop idle */
+#define OUTBOX_MAX_LEN 1024
+#define OUTBOX_FLUSH_BATCH 64
+
+/* Publish failure backoff while connected, doubled up to the max */
+#define OUTBOX_RETRY_MIN_MS 100
+#define OUTBOX_RETRY_MAX_MS 8000
+
+/* Traced publishes waiting the broker confirm */
+#define CONFIRM_RING_LEN 256
+
+/* Fits a device list of a few dozen devices without extra blocks */
+#define MSG_ARENA_BLOCK_SIZE 8192
+
  /* Southbound traffic (commands) */
 #define MQ_EVENT_DATA_UPDATE "data.update"
 #define MQ_EVENT_DATA_REQUEST "data.request"
@@ -70,58 +92,84 @@
 #define MQ_CMD_SCHEMA_UPDATE "schema.update"
 #define MQ_CMD_DEVICE_LIST "device.cmd.list"
 
+/* Fields validated before handing a message to the read handler */
+#define FIELD_ID	(1 << 0)	/* "id": mandatory string */
+#define FIELD_TOKEN	(1 << 1)	/* "token": mandatory string */
+#define FIELD_ERROR	(1 << 2)	/* "error": optional string or null */
+
+/*
+ * Southbound events: routing key, message type and fields. Each event is
+ * bound to the fog queue and decoded generically by create_msg(); only the
+ * list payloads of UPDATE/REQUEST/LIST need a specific decoder.
+ */
+#define CLOUD_EVENTS(E)							\
+	E(MQ_EVENT_DATA_UPDATE,		UPDATE_MSG,	FIELD_ID)	\
+	E(MQ_EVENT_DATA_REQUEST,	REQUEST_MSG,	FIELD_ID)	\
+	E(MQ_EVENT_DEVICE_REGISTERED,	REGISTER_MSG,			\
+	  FIELD_ID | FIELD_TOKEN | FIELD_ERROR)				\
+	E(MQ_EVENT_DEVICE_UNREGISTERED,	UNREGISTER_MSG,			\
+	  FIELD_ID | FIELD_ERROR)					\
+	E(MQ_EVENT_DEVICE_AUTH,		AUTH_MSG, FIELD_ID | FIELD_ERROR) \
+	E(MQ_EVENT_SCHEMA_UPDATED,	SCHEMA_MSG, FIELD_ID | FIELD_ERROR) \
+	E(MQ_EVENT_DEVICE_LIST,		LIST_MSG,	FIELD_ERROR)
+
+#define CLOUD_EVENT_ENTRY(key, msg_type, msg_fields)			\
+	{ .routing_key = key, .type = msg_type, .fields = msg_fields },
+
+static const struct cloud_event {
+	const char *routing_key;
+	int type;
+	unsigned int fields;
+} cloud_events[] = {
+	CLOUD_EVENTS(CLOUD_EVENT_ENTRY)
+};
+
 cloud_cb_t cloud_cb;
+cloud_schema_cb_t cloud_schema_cb;
 struct settings *conf;
-amqp_table_entry_t headers[1];
+amqp_table_entry_t headers[4];		/* Authorization, then trace */
 
-static void cloud_device_free(void *data)
+/*
+ * Every allocation made to handle a received message comes from msg_arena,
+ * released at once after the message is processed. Only the l_queue nodes
+ * are allocated by ELL.
+ */
+static struct arena *msg_arena;
+
+static void cloud_device_destroy(void *data)
 {
 	struct cloud_device *mydevice = data;
 
-	if (unlikely(!mydevice))
-		return;
-
-	l_queue_destroy(mydevice->schema, l_free);
-	l_free(mydevice->id);
-	l_free(mydevice->uuid);
-	l_free(mydevice->name);
-	l_free(mydevice);
+	schema_unref(mydevice->schema);
 }
 
 static void cloud_msg_destroy(struct cloud_msg *msg)
 {
 	if (msg->type == LIST_MSG)
-		l_queue_destroy(msg->list, cloud_device_free);
+		l_queue_destroy(msg->list, cloud_device_destroy);
 	else if (msg->type == UPDATE_MSG || msg->type == REQUEST_MSG)
-		l_queue_destroy(msg->list, l_free);
-
-	l_free(msg);
+		l_queue_destroy(msg->list, NULL);
 }
 
-static int map_routing_key_to_msg_type(const char *routing_key)
+static const struct cloud_event *find_event(const char *routing_key)
 {
-	if (!strcmp(routing_key, MQ_EVENT_DATA_UPDATE))
-		return UPDATE_MSG;
-	else if (!strcmp(routing_key, MQ_EVENT_DATA_REQUEST))
-		return REQUEST_MSG;
-	else if (!strcmp(routing_key, MQ_EVENT_DEVICE_REGISTERED))
-		return REGISTER_MSG;
-	else if (!strcmp(routing_key, MQ_EVENT_DEVICE_UNREGISTERED))
-		return UNREGISTER_MSG;
-	else if (!strcmp(routing_key, MQ_EVENT_DEVICE_AUTH))
-		return AUTH_MSG;
-	else if (!strcmp(routing_key, MQ_EVENT_SCHEMA_UPDATED))
-		return SCHEMA_MSG;
-	else if (!strcmp(routing_key, MQ_EVENT_DEVICE_LIST))
-		return LIST_MSG;
-	return -1;
+	size_t i;
+
+	for (i = 0; i < L_ARRAY_SIZE(cloud_events); i++) {
+		if (!strcmp(routing_key, cloud_events[i].routing_key))
+			return &cloud_events[i];
+	}
+
+	return NULL;
 }
 
-static void *cloud_device_array_foreach(json_object *array_item)
+static void *cloud_device_array_foreach(json_object *array_item,
+					void *user_data)
 {
+	struct arena *arena = user_data;
 	json_object *jobjkey;
 	struct cloud_device *mydevice;
-	struct l_queue *schema;
+	struct schema *schema;
 	const char *id, *name;
 
 	/* Getting 'Id': Mandatory field for registered device */
@@ -133,124 +181,107 @@ static void *cloud_device_array_foreach(json_object *array_item)
 	if (!json_object_object_get_ex(array_item, "schema", &jobjkey))
 		return NULL;
 
-	schema = parser_schema_to_list(json_object_to_json_string(jobjkey));
+	schema = parser_schema_from_json(jobjkey);
 	if (!schema)
 		return NULL;
 
 	/* Getting 'Name' */
 	name = parser_get_key_str_from_json_obj(array_item, "name");
-	if (!name)
+	if (!name) {
+		schema_unref(schema);
 		return NULL;
+	}
 
-	mydevice = l_new(struct cloud_device, 1);
-	mydevice->id = l_strdup(id);
-	mydevice->name = l_strdup(name);
-	mydevice->uuid = l_strdup(id);
+	mydevice = arena_alloc(arena, sizeof(*mydevice));
+	mydevice->id = arena_strdup(arena, id);
+	mydevice->name = arena_strdup(arena, name);
+	mydevice->uuid = mydevice->id;
 	mydevice->schema = schema;
 
 	return mydevice;
 }
 
-static struct cloud_msg *create_msg(const char *routing_key, json_object *jso)
+static struct cloud_msg *create_msg(const char *routing_key, json_object *jso,
+				    void *user_data)
 {
-	struct cloud_msg *msg = l_new(struct cloud_msg, 1);
-
-	msg->type = map_routing_key_to_msg_type(routing_key);
-
-	switch (msg->type) {
-	case UPDATE_MSG:
-		msg->error = NULL;
-		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
-		if (!msg->device_id) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
-
-		msg->list = parser_update_to_list(jso);
-		if (!msg->list) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
+	const struct cloud_event *event;
+	struct cloud_msg *msg;
+	const struct schema *schema;
 
-		break;
-	case REQUEST_MSG:
-		msg->error = NULL;
-		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
-		if (!msg->device_id) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
+	event = find_event(routing_key);
+	if (!event) {
+		log_error("Unknown event %s", routing_key);
+		return NULL;
+	}
 
-		msg->list = parser_request_to_list(jso);
-		if (!msg->list) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
+	msg = arena_alloc(msg_arena, sizeof(*msg));
+	msg->type = event->type;
 
-		break;
-	case REGISTER_MSG:
+	if (event->fields & FIELD_ID) {
 		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
-		if (!msg->device_id ||
-				!parser_is_key_str_or_null(jso, "error")) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
+		if (!msg->device_id)
+			goto malformed;
+	}
 
+	if (event->fields & FIELD_TOKEN) {
 		msg->token = parser_get_key_str_from_json_obj(jso, "token");
-		if (!msg->token) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
+		if (!msg->token)
+			goto malformed;
+	}
 
-		msg->error = parser_get_key_str_from_json_obj(jso, "error");
-		break;
-	case UNREGISTER_MSG:
-		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
-		if (!msg->device_id ||
-				!parser_is_key_str_or_null(jso, "error")) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
+	if (event->fields & FIELD_ERROR) {
+		if (!parser_is_key_str_or_null(jso, "error"))
+			goto malformed;
 
 		msg->error = parser_get_key_str_from_json_obj(jso, "error");
-		break;
-	case AUTH_MSG:
-		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
-		if (!msg->device_id ||
-				!parser_is_key_str_or_null(jso, "error")) {
-			hal_log_error("Malformed JSON message");
+	}
+
+	switch (msg->type) {
+	case UPDATE_MSG:
+		/*
+		 * Values are validated against the thing's schema. Without
+		 * a session or a schema the list is left empty: the read
+		 * handler requeues the message.
+		 */
+		schema = cloud_schema_cb(msg->device_id, user_data);
+		if (!schema)
+			break;
+
+		msg->list = parser_update_to_list(jso, schema,
+						  msg_arena);
+		if (!msg->list) {
+			log_error("Invalid data update for %s",
+				  msg->device_id);
 			goto err;
 		}
 
-		msg->error = parser_get_key_str_from_json_obj(jso, "error");
 		break;
-	case SCHEMA_MSG:
-		msg->device_id = parser_get_key_str_from_json_obj(jso, "id");
-		if (!msg->device_id ||
-				!parser_is_key_str_or_null(jso, "error")) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
+	case REQUEST_MSG:
+		msg->list = parser_request_to_list(jso, msg_arena);
+		if (!msg->list)
+			goto malformed;
 
-		msg->error = parser_get_key_str_from_json_obj(jso, "error");
 		break;
 	case LIST_MSG:
-		msg->device_id = NULL;
 		msg->list = parser_queue_from_json_array(jso,
-						cloud_device_array_foreach);
-		if (!msg->list || !parser_is_key_str_or_null(jso, "error")) {
-			hal_log_error("Malformed JSON message");
-			goto err;
-		}
+						cloud_device_array_foreach,
+						msg_arena);
+		if (!msg->list)
+			goto malformed;
 
-		msg->error = parser_get_key_str_from_json_obj(jso, "error");
 		break;
+	case REGISTER_MSG:
+	case UNREGISTER_MSG:
+	case AUTH_MSG:
+	case SCHEMA_MSG:
 	default:
-		hal_log_error("Unknown event %s", routing_key);
-		goto err;
+		break;
 	}
 
 	return msg;
+
+malformed:
+	log_error("Malformed JSON message");
 err:
 	cloud_msg_destroy(msg);
 	return NULL;
@@ -273,21 +304,284 @@ static bool on_cloud_receive_message(const char *exchange,
 
 	jso = json_tokener_parse(body);
 	if (!jso) {
-		hal_log_error("Error on parse JSON object");
+		log_error("Error on parse JSON object");
 		return false;
 	}
 
-	msg = create_msg(routing_key, jso);
+	msg = create_msg(routing_key, jso, user_data);
 	if (msg) {
 		consumed = cloud_cb(msg, user_data);
 		cloud_msg_destroy(msg);
 	}
 
 	json_object_put(jso);
+	arena_reset(msg_arena);
 
 	return consumed;
 }
 
+/*
+ * Northbound messages are serialized and queued in the outbox, then
+ * published in batches from an idle callback. Callers (thing requests
+ * handled in msg.c) never wait for the broker: the exchange and queue
+ * bindings are set up once per connection instead of once per message,
+ * and messages are kept while the broker is not connected.
+ */
+struct outbox_msg {
+	const char *routing_key;
+	uint64_t expiration_ms;
+	struct trace trace;		/* Data sent by things, if sampled */
+	char body[];
+};
+
+static struct l_queue *outbox;
+static bool outbox_flush_pending;
+static struct l_timeout *outbox_retry;
+static unsigned int outbox_retry_ms;	/* 0: not armed */
+static amqp_bytes_t queue_cloud;	/* Declared once per connection */
+static const char *routes_bound[8];	/* Routing keys bound to queue_cloud */
+static unsigned int routes_bound_len;
+static cloud_connected_cb_t cloud_connected_cb;
+static void *cloud_connected_data;
+
+/* In publish order: delivery tags only grow on a connection */
+static struct {
+	uint64_t seq;			/* Delivery tag, 0: confirmed */
+	struct trace trace;
+} confirm_ring[CONFIRM_RING_LEN];
+static unsigned int confirm_head;
+static unsigned int confirm_len;
+
+static void confirm_push(uint64_t seq, const struct trace *trace)
+{
+	unsigned int slot;
+
+	/* Broker not confirming: forget the oldest */
+	if (confirm_len == CONFIRM_RING_LEN) {
+		confirm_head = (confirm_head + 1) % CONFIRM_RING_LEN;
+		confirm_len--;
+	}
+
+	slot = (confirm_head + confirm_len) % CONFIRM_RING_LEN;
+	confirm_ring[slot].seq = seq;
+	confirm_ring[slot].trace = *trace;
+	confirm_len++;
+}
+
+/* Not acknowledged messages are lost, as unconfirmed ones always were */
+static void on_mq_confirm(uint64_t delivery_tag, bool multiple, bool ack,
+			  void *user_data)
+{
+	unsigned int i;
+	unsigned int slot;
+
+	for (i = 0; i < confirm_len; i++) {
+		slot = (confirm_head + i) % CONFIRM_RING_LEN;
+		if (confirm_ring[slot].seq > delivery_tag)
+			break;
+
+		if (!confirm_ring[slot].seq ||
+		    (confirm_ring[slot].seq != delivery_tag && !multiple))
+			continue;
+
+		if (ack)
+			trace_ack(&confirm_ring[slot].trace);
+
+		confirm_ring[slot].seq = 0;
+	}
+
+	while (confirm_len && !confirm_ring[confirm_head].seq) {
+		confirm_head = (confirm_head + 1) % CONFIRM_RING_LEN;
+		confirm_len--;
+	}
+}
+
+/* Lets the cloud measure the latency from the thing to the consumer */
+static void outbox_set_trace_headers(const struct trace *trace)
+{
+	uint64_t recv = trace->stamp[TRACE_STAGE_RECV];
+
+	headers[1].value.value.i64 = trace->id;
+	headers[2].value.value.i64 = trace_to_realtime(recv);
+	headers[3].value.value.i64 = trace_now() - recv;
+}
+
+static bool outbox_bind_route(const char *routing_key)
+{
+	unsigned int i;
+
+	for (i = 0; i < routes_bound_len; i++) {
+		/* Routing keys are string literals */
+		if (routes_bound[i] == routing_key)
+			return true;
+	}
+
+	if (mq_bind_queue(queue_cloud, MQ_EXCHANGE_CLOUD, routing_key) < 0)
+		return false;
+
+	if (routes_bound_len < L_ARRAY_SIZE(routes_bound))
+		routes_bound[routes_bound_len++] = routing_key;
+
+	return true;
+}
+
+static void outbox_flush(void *user_data);
+
+static void outbox_retry_cb(struct l_timeout *timeout, void *user_data)
+{
+	outbox_flush(NULL);
+}
+
+/* Nothing else flushes the outbox of a quiet gateway: retry later */
+static void outbox_schedule_retry(void)
+{
+	if (!outbox_retry_ms)
+		outbox_retry_ms = OUTBOX_RETRY_MIN_MS;
+	else if (outbox_retry_ms < OUTBOX_RETRY_MAX_MS / 2)
+		outbox_retry_ms *= 2;
+	else
+		outbox_retry_ms = OUTBOX_RETRY_MAX_MS;
+
+	if (!outbox_retry)
+		outbox_retry = l_timeout_create_ms(outbox_retry_ms,
+						   outbox_retry_cb, NULL,
+						   NULL);
+	else
+		l_timeout_modify_ms(outbox_retry, outbox_retry_ms);
+}
+
+static void outbox_flush(void *user_data)
+{
+	struct outbox_msg *msg;
+	unsigned int sent = 0;
+	size_t num_headers;
+
+	outbox_flush_pending = false;
+
+	/* Flushed again once connected */
+	if (!mq_is_connected())
+		return;
+
+	if (!queue_cloud.bytes) {
+		queue_cloud = mq_declare_new_queue(MQ_QUEUE_CLOUD);
+		if (!queue_cloud.bytes) {
+			log_error("Error on declare a new queue.");
+			outbox_schedule_retry();
+			return;
+		}
+	}
+
+	headers[0].value.value.bytes = amqp_cstring_bytes(conf->token);
+
+	while ((msg = l_queue_peek_head(outbox))) {
+		/* Don't hold the main loop: continue on the next idle */
+		if (sent == OUTBOX_FLUSH_BATCH) {
+			outbox_flush_pending = l_idle_oneshot(outbox_flush,
+							      NULL, NULL);
+			return;
+		}
+
+		num_headers = 1;
+		if (msg->trace.id && trace_headers_enabled()) {
+			outbox_set_trace_headers(&msg->trace);
+			num_headers = L_ARRAY_SIZE(headers);
+		}
+
+		if (!outbox_bind_route(msg->routing_key) ||
+		    mq_publish_persistent_message(MQ_EXCHANGE_CLOUD,
+						  msg->routing_key,
+						  headers, num_headers,
+						  msg->expiration_ms,
+						  msg->body) < 0) {
+			outbox_schedule_retry();
+			log_error("Can't publish %s: %u message(s) queued, "
+				  "retry in %u ms", msg->routing_key,
+				  l_queue_length(outbox), outbox_retry_ms);
+			metrics_add(METRICS_CLOUD_PUBLISH_FAILED, 1);
+			return;
+		}
+
+		metrics_add(METRICS_CLOUD_PUBLISHED, 1);
+		metrics_add(METRICS_CLOUD_OUTBOX, -1);
+		log_event(LOG_EV_CLOUD_TX, l_queue_length(outbox),
+			  strlen(msg->body));
+
+		if (msg->trace.id) {
+			trace_publish(&msg->trace);
+			if (trace_confirms_enabled())
+				confirm_push(mq_get_publish_seq(), &msg->trace);
+		}
+
+		l_free(l_queue_pop_head(outbox));
+		sent++;
+		outbox_retry_ms = 0;
+	}
+}
+
+static void outbox_schedule_flush(void)
+{
+	/* Backing off: the retry flushes the new messages too */
+	if (outbox_flush_pending || outbox_retry_ms)
+		return;
+
+	outbox_flush_pending = l_idle_oneshot(outbox_flush, NULL, NULL);
+}
+
+/* Takes ownership of @jobj */
+static int outbox_push(const char *routing_key, uint64_t expiration_ms,
+		       json_object *jobj)
+{
+	struct outbox_msg *msg;
+	const char *json_str;
+	size_t len;
+
+	if (!jobj)
+		return KNOT_ERR_CLOUD_FAILURE;
+
+	if (l_queue_length(outbox) >= OUTBOX_MAX_LEN) {
+		log_error("Cloud outbox full: %s dropped", routing_key);
+		metrics_add(METRICS_CLOUD_OUTBOX_DROPPED, 1);
+		json_object_put(jobj);
+		return KNOT_ERR_CLOUD_FAILURE;
+	}
+
+	json_str = json_object_to_json_string(jobj);
+	len = strlen(json_str);
+
+	msg = l_malloc(sizeof(*msg) + len + 1);
+	msg->routing_key = routing_key;
+	msg->expiration_ms = expiration_ms;
+	memcpy(msg->body, json_str, len + 1);
+	msg->trace.id = 0;
+
+	json_object_put(jobj);
+
+	l_queue_push_tail(outbox, msg);
+	metrics_add(METRICS_CLOUD_OUTBOX, 1);
+	outbox_schedule_flush();
+
+	return 0;
+}
+
+static void on_mq_connected(void *user_data)
+{
+	/* Queue and bindings must be set up again on the new connection */
+	if (queue_cloud.bytes)
+		amqp_bytes_free(queue_cloud);
+
+	queue_cloud = amqp_empty_bytes;
+	routes_bound_len = 0;
+
+	/* Unconfirmed on the previous connection: never will be */
+	confirm_len = 0;
+
+	cloud_connected_cb(cloud_connected_data);
+
+	/* New connection: no backoff from the previous one */
+	outbox_retry_ms = 0;
+	outbox_schedule_flush();
+}
+
 /**
  * cloud_register_device:
  * @id: device id
@@ -301,39 +595,8 @@ static bool on_cloud_receive_message(const char *exchange,
  */
 int cloud_register_device(const char *id, const char *name)
 {
-	amqp_bytes_t queue_cloud;
-	json_object *jobj_device;
-	const char *json_str;
-	int result;
-
-	queue_cloud = mq_declare_new_queue(MQ_QUEUE_CLOUD);
-	if (!queue_cloud.bytes) {
-		hal_log_error("Error on declare a new queue.\n");
-		return -1;
-	}
-
-	jobj_device = parser_device_json_create(id, name);
-	if (!jobj_device) {
-		amqp_bytes_free(queue_cloud);
-		return KNOT_ERR_CLOUD_FAILURE;
-	}
-	json_str = json_object_to_json_string(jobj_device);
-
-	headers[0].value.value.bytes = amqp_cstring_bytes(conf->token);
-
-	result = mq_publish_persistent_message(queue_cloud,
-					       MQ_EXCHANGE_CLOUD,
-					       MQ_CMD_DEVICE_REGISTER,
-					       headers, 1,
-					       MQ_MSG_EXPIRATION_TIME_MS,
-					       json_str);
-	if (result < 0)
-		result = KNOT_ERR_CLOUD_FAILURE;
-
-	json_object_put(jobj_device);
-	amqp_bytes_free(queue_cloud);
-
-	return result;
+	return outbox_push(MQ_CMD_DEVICE_REGISTER, MQ_MSG_EXPIRATION_TIME_MS,
+			   parser_device_json_create(id, name));
 }
 
 /**
@@ -348,39 +611,8 @@ int cloud_register_device(const char *id, const char *name)
  */
 int cloud_unregister_device(const char *id)
 {
-	amqp_bytes_t queue_cloud;
-	json_object *jobj_unreg;
-	const char *json_str;
-	int result;
-
-	queue_cloud = mq_declare_new_queue(MQ_QUEUE_CLOUD);
-	if (!queue_cloud.bytes) {
-		hal_log_error("Error on declare a new queue.\n");
-		return -1;
-	}
-
-	jobj_unreg = parser_unregister_json_create(id);
-	if (!jobj_unreg) {
-		amqp_bytes_free(queue_cloud);
-		return KNOT_ERR_CLOUD_FAILURE;
-	}
-	json_str = json_object_to_json_string(jobj_unreg);
-
-	headers[0].value.value.bytes = amqp_cstring_bytes(conf->token);
-
-	result = mq_publish_persistent_message(queue_cloud,
-					       MQ_EXCHANGE_CLOUD,
-					       MQ_CMD_DEVICE_UNREGISTER,
-					       headers, 1,
-					       MQ_MSG_EXPIRATION_TIME_MS,
-					       json_str);
-	if (result < 0)
-		return KNOT_ERR_CLOUD_FAILURE;
-
-	json_object_put(jobj_unreg);
-	amqp_bytes_free(queue_cloud);
-
-	return 0;
+	return outbox_push(MQ_CMD_DEVICE_UNREGISTER, MQ_MSG_EXPIRATION_TIME_MS,
+			   parser_unregister_json_create(id));
 }
 
 /**
@@ -396,39 +628,9 @@ int cloud_unregister_device(const char *id)
  */
 int cloud_auth_device(const char *id, const char *token)
 {
-	amqp_bytes_t queue_cloud;
-	json_object *jobj_auth;
-	const char *json_str;
-	int result;
-
-	queue_cloud = mq_declare_new_queue(MQ_QUEUE_CLOUD);
-	if (queue_cloud.bytes == NULL) {
-		hal_log_error("Error on declare a new queue.\n");
-		return -1;
-	}
-
-	jobj_auth = parser_auth_json_create(id, token);
-	if (!jobj_auth) {
-		amqp_bytes_free(queue_cloud);
-		return KNOT_ERR_CLOUD_FAILURE;
-	}
-	json_str = json_object_to_json_string(jobj_auth);
-
-	headers[0].value.value.bytes = amqp_cstring_bytes(conf->token);
-
-	result = mq_publish_persistent_message(queue_cloud,
-					       MQ_EXCHANGE_CLOUD,
-					       MQ_CMD_DEVICE_AUTH,
-					       headers, 1,
-					       0, // Set no expiration time
-					       json_str);
-	if (result < 0)
-		result = KNOT_ERR_CLOUD_FAILURE;
-
-	json_object_put(jobj_auth);
-	amqp_bytes_free(queue_cloud);
-
-	return result;
+	return outbox_push(MQ_CMD_DEVICE_AUTH,
+			   0, // Set no expiration time
+			   parser_auth_json_create(id, token));
 }
 
 /**
@@ -440,41 +642,10 @@ int cloud_auth_device(const char *id, const char *token)
  *
  * Returns: 0 if successful and a KNoT error otherwise.
  */
-int cloud_update_schema(const char *id, struct l_queue *schema_list)
+int cloud_update_schema(const char *id, const struct schema *schema)
 {
-	amqp_bytes_t queue_cloud;
-	json_object *jobj_schema;
-	const char *json_str;
-	int result;
-
-	queue_cloud = mq_declare_new_queue(MQ_QUEUE_CLOUD);
-	if (!queue_cloud.bytes) {
-		hal_log_error("Error on declare a new queue.\n");
-		return -1;
-	}
-
-	jobj_schema = parser_schema_create_object(id, schema_list);
-	if (!jobj_schema) {
-		amqp_bytes_free(queue_cloud);
-		return KNOT_ERR_CLOUD_FAILURE;
-	}
-	json_str = json_object_to_json_string(jobj_schema);
-
-	headers[0].value.value.bytes = amqp_cstring_bytes(conf->token);
-
-	result = mq_publish_persistent_message(queue_cloud,
-					       MQ_EXCHANGE_CLOUD,
-					       MQ_CMD_SCHEMA_UPDATE,
-					       headers, 1,
-					       MQ_MSG_EXPIRATION_TIME_MS,
-					       json_str);
-	if (result < 0)
-		result = KNOT_ERR_CLOUD_FAILURE;
-
-	json_object_put(jobj_schema);
-	amqp_bytes_free(queue_cloud);
-
-	return result;
+	return outbox_push(MQ_CMD_SCHEMA_UPDATE, MQ_MSG_EXPIRATION_TIME_MS,
+			   parser_schema_create_object(id, schema));
 }
 
 /**
@@ -488,35 +659,9 @@ int cloud_update_schema(const char *id, struct l_queue *schema_list)
  */
 int cloud_list_devices(void)
 {
-	amqp_bytes_t queue_cloud;
-	json_object *jobj_empty;
-	const char *json_str;
-	int result;
-
-	queue_cloud = mq_declare_new_queue(MQ_QUEUE_CLOUD);
-	if (!queue_cloud.bytes) {
-		hal_log_error("Error on declare a new queue.\n");
-		return -1;
-	}
-
-	jobj_empty = json_object_new_object();
-	json_str = json_object_to_json_string(jobj_empty);
-
-	headers[0].value.value.bytes = amqp_cstring_bytes(conf->token);
-
-	result = mq_publish_persistent_message(queue_cloud,
-					       MQ_EXCHANGE_CLOUD,
-					       MQ_CMD_DEVICE_LIST,
-					       headers, 1,
-					       0, // Set no expiration time
-					       json_str);
-	if (result < 0)
-		result = KNOT_ERR_CLOUD_FAILURE;
-
-	json_object_put(jobj_empty);
-	amqp_bytes_free(queue_cloud);
-
-	return result;
+	return outbox_push(MQ_CMD_DEVICE_LIST,
+			   0, // Set no expiration time
+			   json_object_new_object());
 }
 
 /**
@@ -527,7 +672,8 @@ int cloud_list_devices(void)
  * @value: value to be sent
  * @kval_len: length of @value
  *
- * Sends device's data to cloud.
+ * Sends device's data to cloud. The data is accepted once queued, the
+ * publish itself happens asynchronously.
  *
  * Returns: 0 if successful and a KNoT error otherwise.
  */
@@ -535,77 +681,54 @@ int cloud_publish_data(const char *id, uint8_t sensor_id, uint8_t value_type,
 		       const knot_value_type *value,
 		       uint8_t kval_len)
 {
-	amqp_bytes_t queue_cloud;
-	json_object *jobj_data;
-	const char *json_str;
-	int result;
+	struct outbox_msg *msg;
+	int err;
 
-	queue_cloud = mq_declare_new_queue(MQ_QUEUE_CLOUD);
-	if (!queue_cloud.bytes) {
-		hal_log_error("Error on declare a new queue.\n");
-		return -1;
-	}
-
-	jobj_data = parser_data_create_object(id, sensor_id, value_type, value,
-					      kval_len);
-	if (!jobj_data) {
-		amqp_bytes_free(queue_cloud);
-		return KNOT_ERR_CLOUD_FAILURE;
-	}
-	json_str = json_object_to_json_string(jobj_data);
+	err = outbox_push(MQ_CMD_DATA_PUBLISH, MQ_MSG_EXPIRATION_TIME_MS,
+			  parser_data_create_object(id, sensor_id, value_type,
+						    value, kval_len));
+	if (err)
+		return err;
 
-	headers[0].value.value.bytes = amqp_cstring_bytes(conf->token);
+	/* Only data sent by things is traced: the thing PDU, if sampled */
+	msg = l_queue_peek_tail(outbox);
+	trace_take(&msg->trace);
 
-	result = mq_publish_persistent_message(queue_cloud,
-					       MQ_EXCHANGE_CLOUD,
-					       MQ_CMD_DATA_PUBLISH,
-					       headers, 1,
-					       MQ_MSG_EXPIRATION_TIME_MS,
-					       json_str);
-	if (result < 0)
-		result = KNOT_ERR_CLOUD_FAILURE;
-
-	json_object_put(jobj_data);
-	amqp_bytes_free(queue_cloud);
-	return result;
+	return 0;
 }
 
 /**
  * cloud_set_read_handler:
  * @cb: callback to handle message received from cloud
+ * @schema_cb: callback to get the schema of a device, used to validate
+ * data updates
  * @user_data: user data provided to callbacks
  *
  * Set callback handler when receive cloud messages.
  *
  * Returns: 0 if successful and -1 otherwise.
  */
-int cloud_set_read_handler(cloud_cb_t read_handler, void *user_data)
+int cloud_set_read_handler(cloud_cb_t read_handler,
+			   cloud_schema_cb_t schema_cb, void *user_data)
 {
-	const char *fog_events[] = {
-		MQ_EVENT_DATA_UPDATE,
-		MQ_EVENT_DATA_REQUEST,
-		MQ_EVENT_DEVICE_REGISTERED,
-		MQ_EVENT_DEVICE_UNREGISTERED,
-		MQ_EVENT_DEVICE_AUTH,
-		MQ_EVENT_SCHEMA_UPDATED,
-		MQ_EVENT_DEVICE_LIST,
-		NULL
-	};
 	amqp_bytes_t queue_fog;
-	int err, i;
+	size_t i;
+	int err;
 
 	cloud_cb = read_handler;
+	cloud_schema_cb = schema_cb;
 
 	queue_fog = mq_declare_new_queue(MQ_QUEUE_FOG);
 	if (queue_fog.bytes == NULL) {
-		hal_log_error("Error on declare a new queue.\n");
+		log_error("Error on declare a new queue.\n");
 		return -1;
 	}
 
-	for (i = 0; fog_events[i] != NULL; i++) {
-		err = mq_bind_queue(queue_fog, MQ_EXCHANGE_FOG, fog_events[i]);
+	for (i = 0; i < L_ARRAY_SIZE(cloud_events); i++) {
+		err = mq_bind_queue(queue_fog, MQ_EXCHANGE_FOG,
+				    cloud_events[i].routing_key);
 		if (err) {
-			hal_log_error("Error on set up queue to consume.\n");
+			log_error("Error on set up queue to consume.\n");
 			amqp_bytes_free(queue_fog);
 			return -1;
 		}
@@ -613,7 +736,7 @@ int cloud_set_read_handler(cloud_cb_t read_handler, void *user_data)
 
 	err = mq_set_read_cb(queue_fog, on_cloud_receive_message, user_data);
 	if (err) {
-		hal_log_error("Error on set up read callback\n");
+		log_error("Error on set up read callback\n");
 		return -1;
 	}
 	amqp_bytes_free(queue_fog);
@@ -625,14 +748,45 @@ int cloud_start(struct settings *settings, cloud_connected_cb_t connected_cb,
 		void *user_data)
 {
 	conf = settings;
+	msg_arena = arena_new(MSG_ARENA_BLOCK_SIZE);
+	outbox = l_queue_new();
+	cloud_connected_cb = connected_cb;
+	cloud_connected_data = user_data;
 	headers[0].key = amqp_cstring_bytes(MQ_AUTHORIZATION_HEADER);
 	headers[0].value.kind = AMQP_FIELD_KIND_UTF8;
 	headers[0].value.value.bytes = amqp_cstring_bytes(settings->token);
+	headers[1].key = amqp_cstring_bytes(MQ_TRACE_ID_HEADER);
+	headers[1].value.kind = AMQP_FIELD_KIND_I64;
+	headers[2].key = amqp_cstring_bytes(MQ_TRACE_TIME_HEADER);
+	headers[2].value.kind = AMQP_FIELD_KIND_I64;
+	headers[3].key = amqp_cstring_bytes(MQ_TRACE_LATENCY_HEADER);
+	headers[3].value.kind = AMQP_FIELD_KIND_I64;
 
-	return mq_start(settings, connected_cb, user_data);
+	if (trace_confirms_enabled())
+		mq_set_confirm_cb(on_mq_confirm, NULL);
+
+	return mq_start(settings, on_mq_connected, NULL);
 }
 
 void cloud_stop(void)
 {
 	mq_stop();
+	arena_free(msg_arena);
+	msg_arena = NULL;
+
+	if (!l_queue_isempty(outbox))
+		log_info("Discarding %u cloud message(s)",
+			 l_queue_length(outbox));
+
+	metrics_add(METRICS_CLOUD_OUTBOX, -(int64_t) l_queue_length(outbox));
+
+	l_queue_destroy(outbox, l_free);
+	outbox = NULL;
+
+	l_timeout_remove(outbox_retry);
+	outbox_retry = NULL;
+	outbox_retry_ms = 0;
+
+	if (queue_cloud.bytes)
+		amqp_bytes_free(queue_cloud);
 }
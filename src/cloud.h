@@ -42,14 +42,16 @@ struct cloud_device {
 	char *uuid;
 	char *name;
 	bool online;
-	struct l_queue *schema;
-	struct l_timeout *unreg_timeout;
+	struct schema *schema;		/* Interned, shared */
 };
 
 typedef bool (*cloud_cb_t) (const struct cloud_msg *msg, void *user_data);
 typedef void (*cloud_connected_cb_t) (void *user_data);
+typedef const struct schema *(*cloud_schema_cb_t) (const char *device_id,
+						   void *user_data);
 
-int cloud_set_read_handler(cloud_cb_t read_handler, void *user_data);
+int cloud_set_read_handler(cloud_cb_t read_handler,
+			   cloud_schema_cb_t schema_cb, void *user_data);
 int cloud_start(struct settings *settings, cloud_connected_cb_t connected_cb,
 		void *user_data);
 void cloud_stop(void);
@@ -60,5 +62,5 @@ int cloud_publish_data(const char *id, uint8_t sensor_id,
 int cloud_register_device(const char *id, const char *name);
 int cloud_unregister_device(const char *id);
 int cloud_auth_device(const char *id, const char *token);
-int cloud_update_schema(const char *id, struct l_queue *schema_list);
+int cloud_update_schema(const char *id, const struct schema *schema);
 int cloud_list_devices(void);
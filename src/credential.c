@@ -0,0 +1,196 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <ell/ell.h>
+
+#include <hal/linux_log.h>
+
+#include "log.h"
+#include "storage.h"
+#include "credential.h"
+
+#define CREDENTIAL_TTL_SEC	3600 /* Default CredentialTTL */
+#define CREDENTIAL_SALT_LEN	16
+#define CREDENTIAL_DIGEST_LEN	32 /* SHA-256 */
+
+struct credential {
+	uint8_t salt[CREDENTIAL_SALT_LEN];
+	uint8_t digest[CREDENTIAL_DIGEST_LEN];
+	uint64_t expires_ms;
+};
+
+static struct l_hashmap *credentials;	/* device id to struct credential */
+static uint64_t ttl_ms = CREDENTIAL_TTL_SEC * 1000ULL;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool credential_digest(const uint8_t *salt, const char *token,
+			      uint8_t *digest)
+{
+	struct l_checksum *checksum;
+	ssize_t len;
+
+	checksum = l_checksum_new(L_CHECKSUM_SHA256);
+	if (!checksum)
+		return false;
+
+	l_checksum_update(checksum, salt, CREDENTIAL_SALT_LEN);
+	l_checksum_update(checksum, token, strlen(token));
+	len = l_checksum_get_digest(checksum, digest, CREDENTIAL_DIGEST_LEN);
+	l_checksum_free(checksum);
+
+	return len == CREDENTIAL_DIGEST_LEN;
+}
+
+/* Doesn't leak the position of the first mismatch */
+static bool digest_equal(const uint8_t *a, const uint8_t *b)
+{
+	uint8_t diff = 0;
+	size_t i;
+
+	for (i = 0; i < CREDENTIAL_DIGEST_LEN; i++)
+		diff |= a[i] ^ b[i];
+
+	return diff == 0;
+}
+
+/**
+ * credential_cache_load:
+ * @fd: configuration file descriptor returned by storage_open()
+ *
+ * Reads CredentialTTL from the "Node" group of the configuration file.
+ * Zero disables the cache: every thing is authenticated by the cloud.
+ *
+ * Returns: 0 on success or a negative errno otherwise.
+ */
+int credential_cache_load(int fd)
+{
+	int ttl;
+
+	if (credentials)
+		return -EALREADY;
+
+	if (storage_read_key_int(fd, "Node", "CredentialTTL", &ttl) == 0 &&
+	    ttl >= 0)
+		ttl_ms = ttl * 1000ULL;
+
+	log_info("Credential cache TTL: %"PRIu64" s", ttl_ms / 1000);
+
+	credentials = l_hashmap_string_new();
+
+	return 0;
+}
+
+void credential_cache_unload(void)
+{
+	l_hashmap_destroy(credentials, l_free);
+	credentials = NULL;
+}
+
+/**
+ * credential_cache_store:
+ * @device_id: device id, as received from the cloud
+ * @token: token the cloud has just accepted for @device_id
+ *
+ * Caches (or refreshes) the credential of @device_id for CredentialTTL
+ * seconds. A fresh salt is drawn at every store.
+ */
+void credential_cache_store(const char *device_id, const char *token)
+{
+	struct credential *cred;
+
+	if (!credentials || !ttl_ms || !device_id || !token)
+		return;
+
+	cred = l_new(struct credential, 1);
+
+	if (!l_getrandom(cred->salt, sizeof(cred->salt)) ||
+	    !credential_digest(cred->salt, token, cred->digest)) {
+		log_error("Can't cache credential of %s", device_id);
+		l_free(cred);
+		credential_cache_forget(device_id);
+		return;
+	}
+
+	cred->expires_ms = now_ms() + ttl_ms;
+
+	l_free(l_hashmap_remove(credentials, device_id));
+	l_hashmap_insert(credentials, device_id, cred);
+}
+
+/**
+ * credential_cache_verify:
+ * @device_id: device id
+ * @token: token sent by the thing, null-terminated
+ *
+ * Returns: true if @token matches a credential cached for @device_id that
+ * hasn't expired. The cloud shall still revalidate it.
+ */
+bool credential_cache_verify(const char *device_id, const char *token)
+{
+	struct credential *cred;
+	uint8_t digest[CREDENTIAL_DIGEST_LEN];
+
+	if (!credentials || !device_id || !token)
+		return false;
+
+	cred = l_hashmap_lookup(credentials, device_id);
+	if (!cred)
+		return false;
+
+	if (now_ms() >= cred->expires_ms) {
+		credential_cache_forget(device_id);
+		return false;
+	}
+
+	if (!credential_digest(cred->salt, token, digest))
+		return false;
+
+	return digest_equal(cred->digest, digest);
+}
+
+/* Unregistered or rejected by the cloud */
+void credential_cache_forget(const char *device_id)
+{
+	if (!credentials || !device_id)
+		return;
+
+	l_free(l_hashmap_remove(credentials, device_id));
+}
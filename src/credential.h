@@ -0,0 +1,33 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Gateway-side cache of the credentials accepted by the cloud, so that a
+ * reconnecting thing is trusted without waiting an authentication round
+ * trip. Only a salted SHA-256 of each token is kept, for CredentialTTL
+ * seconds ("Node" group of the configuration file).
+ */
+
+int credential_cache_load(int fd);
+void credential_cache_unload(void);
+void credential_cache_store(const char *device_id, const char *token);
+bool credential_cache_verify(const char *device_id, const char *token);
+void credential_cache_forget(const char *device_id);
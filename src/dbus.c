@@ -23,6 +23,7 @@
 
 #include "hal/linux_log.h"
 
+#include "log.h"
 #include "dbus.h"
 
 struct setup {
@@ -66,7 +67,7 @@ struct l_dbus_message *dbus_error_failed(struct l_dbus_message *msg,
 
 static void dbus_disconnect_callback(void *user_data)
 {
-	hal_log_info("D-Bus disconnected");
+	log_info("D-Bus disconnected");
 }
 
 static void dbus_request_name_callback(struct l_dbus *dbus, bool success,
@@ -75,12 +76,12 @@ static void dbus_request_name_callback(struct l_dbus *dbus, bool success,
 	struct setup *setup = user_data;
 
 	if (!success) {
-		hal_log_error("Name request failed");
+		log_error("Name request failed");
 		return;
 	}
 
 	if (!l_dbus_object_manager_enable(g_dbus))
-		hal_log_error("Unable to register the ObjectManager");
+		log_error("Unable to register the ObjectManager");
 
 	setup->complete(setup->user_data);
 }
@@ -22,6 +22,7 @@
 #define KNOT_SERVICE			"br.org.cesar.knot"
 #define SETTINGS_INTERFACE		"br.org.cesar.knot.Settings1"
 #define DEVICE_INTERFACE		"br.org.cesar.knot.Device1"
+#define METRICS_INTERFACE		"br.org.cesar.knot.Metrics1"
 
 struct l_dbus_message *dbus_error_invalid_args( struct l_dbus_message *msg);
 struct l_dbus_message *dbus_error_already_exists(struct l_dbus_message *msg);
@@ -26,6 +26,7 @@
 #include <knot/knot_types.h>
 #include <knot/knot_protocol.h>
 
+#include "log.h"
 #include "dbus.h"
 #include "settings.h"
 #include "cloud.h"
@@ -41,6 +42,8 @@ struct knot_device {
 	bool online;			/* Fog 'Online' property */
 	bool paired;			/* Low level pairing state */
 	bool registered;		/* Registered to cloud */
+	uint32_t queue_depth;		/* PDUs waiting to be sent */
+	uint64_t queue_dropped;		/* PDUs dropped: queue full */
 	struct l_dbus_message *msg;	/* Pending operation */
 	uint32_t msg_id;		/* Pending method reply */
 };
@@ -49,7 +52,7 @@ static struct l_hashmap *device_list;
 
 static void device_free(struct knot_device *device)
 {
-	hal_log_info("device_free(%p)", device);
+	log_info("device_free(%p)", device);
 	if (unlikely(!device))
 		return;
 
@@ -73,7 +76,7 @@ static struct knot_device *device_ref(struct knot_device *device)
 
 	__sync_fetch_and_add(&device->refs, 1);
 
-	hal_log_info("device_ref(%p): %d", device, device->refs);
+	log_info("device_ref(%p): %d", device, device->refs);
 
 	return device;
 }
@@ -83,7 +86,7 @@ static void device_unref(struct knot_device *device)
 	if (unlikely(!device))
 		return;
 
-	hal_log_info("device_unref(%p): %d", device, device->refs - 1);
+	log_info("device_unref(%p): %d", device, device->refs - 1);
 	if (__sync_sub_and_fetch(&device->refs, 1))
 		return;
 
@@ -128,9 +131,9 @@ static void method_reply(struct l_dbus_proxy *proxy,
 		if (device->msg == NULL)
 		    goto skip;
 
-		hal_log_error("Failed to %s() device %s: %s" ,
-			      l_dbus_message_get_member(device->msg),
-			      device->id, text);
+		log_error("Failed to %s() device %s: %s" ,
+			  l_dbus_message_get_member(device->msg),
+			  device->id, text);
 
 
 		reply = dbus_error_failed(device->msg, text);
@@ -183,12 +186,12 @@ static struct l_dbus_message *method_forget(struct l_dbus *dbus,
 
 
 	if (!device->paired) {
-		hal_log_error("Forget() error: not paired!");
+		log_error("Forget() error: not paired!");
 		return dbus_error_not_available(msg);
 	}
 
 	if (device->msg) {
-		hal_log_error("Forget() error: in progress!");
+		log_error("Forget() error: in progress!");
 		return dbus_error_busy(msg);
 	}
 
@@ -208,7 +211,7 @@ static struct l_dbus_message *method_forget(struct l_dbus *dbus,
 
 	ellproxy = proxy_get(device->id);
 	if (!ellproxy) {
-		hal_log_error("Forget() error: proxy not available!");
+		log_error("Forget() error: proxy not available!");
 		return dbus_error_not_available(msg);
 	}
 
@@ -227,7 +230,7 @@ static bool property_get_name(struct l_dbus *dbus,
 	struct knot_device *device = user_data;
 
 	l_dbus_message_builder_append_basic(builder, 's', device->name);
-	hal_log_info("%s GetProperty(Name = %s)", device->path, device->name);
+	log_info("%s GetProperty(Name = %s)", device->path, device->name);
 
 	return true;
 }
@@ -241,7 +244,7 @@ static bool property_get_uuid(struct l_dbus *dbus,
 	const char *uuid = (device->uuid ? : ""); /* FIXME */
 
 	l_dbus_message_builder_append_basic(builder, 's', uuid);
-	hal_log_info("%s GetProperty(UUID = %s)", device->path, uuid);
+	log_info("%s GetProperty(UUID = %s)", device->path, uuid);
 
 	return true;
 }
@@ -254,8 +257,8 @@ static bool property_get_id(struct l_dbus *dbus,
 	struct knot_device *device = user_data;
 
 	l_dbus_message_builder_append_basic(builder, 's', device->id);
-	hal_log_info("%s GetProperty(Id = %s)",
-		     device->path, device->id);
+	log_info("%s GetProperty(Id = %s)",
+		 device->path, device->id);
 
 	return true;
 }
@@ -268,8 +271,8 @@ static bool property_get_online(struct l_dbus *dbus,
 	struct knot_device *device = user_data;
 
 	l_dbus_message_builder_append_basic(builder, 'b', &device->online);
-	hal_log_info("%s GetProperty(Online = %d)",
-		     device->path, device->online);
+	log_info("%s GetProperty(Online = %d)",
+		 device->path, device->online);
 
 	return true;
 }
@@ -282,8 +285,8 @@ static bool property_get_registered(struct l_dbus *dbus,
 	struct knot_device *device = user_data;
 
 	l_dbus_message_builder_append_basic(builder, 'b', &device->registered);
-	hal_log_info("%s GetProperty(Registered = %d)",
-		     device->path, device->registered);
+	log_info("%s GetProperty(Registered = %d)",
+		 device->path, device->registered);
 
 	return true;
 }
@@ -296,8 +299,33 @@ static bool property_get_paired(struct l_dbus *dbus,
 	struct knot_device *device = user_data;
 
 	l_dbus_message_builder_append_basic(builder, 'b', &device->paired);
-	hal_log_info("%s GetProperty(Paired = %d)",
-		     device->path, device->paired);
+	log_info("%s GetProperty(Paired = %d)",
+		 device->path, device->paired);
+
+	return true;
+}
+
+static bool property_get_queue_depth(struct l_dbus *dbus,
+				     struct l_dbus_message *msg,
+				     struct l_dbus_message_builder *builder,
+				     void *user_data)
+{
+	struct knot_device *device = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'u', &device->queue_depth);
+
+	return true;
+}
+
+static bool property_get_queue_dropped(struct l_dbus *dbus,
+				       struct l_dbus_message *msg,
+				       struct l_dbus_message_builder *builder,
+				       void *user_data)
+{
+	struct knot_device *device = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 't',
+					    &device->queue_dropped);
 
 	return true;
 }
@@ -314,32 +342,42 @@ static void device_setup_interface(struct l_dbus_interface *interface)
 	if (!l_dbus_interface_property(interface, "Name", 0, "s",
 				       property_get_name,
 				       NULL))
-		hal_log_error("Can't add 'Name' property");
+		log_error("Can't add 'Name' property");
 
 	if (!l_dbus_interface_property(interface, "Uuid", 0, "s",
 				       property_get_uuid,
 				       NULL))
-		hal_log_error("Can't add 'Uuid' property");
+		log_error("Can't add 'Uuid' property");
 
 	if (!l_dbus_interface_property(interface, "Id", 0, "s",
 				       property_get_id,
 				       NULL))
-		hal_log_error("Can't add 'Id' property");
+		log_error("Can't add 'Id' property");
 
 	if (!l_dbus_interface_property(interface, "Online", 0, "b",
 				       property_get_online,
 				       NULL))
-		hal_log_error("Can't add 'Online' property");
+		log_error("Can't add 'Online' property");
 
 	if (!l_dbus_interface_property(interface, "Paired", 0, "b",
 				       property_get_paired,
 				       NULL))
-		hal_log_error("Can't add 'Paired' property");
+		log_error("Can't add 'Paired' property");
 
 	if (!l_dbus_interface_property(interface, "Registered", 0, "b",
 				       property_get_registered,
 				       NULL))
-		hal_log_error("Can't add 'Registered' property");
+		log_error("Can't add 'Registered' property");
+
+	if (!l_dbus_interface_property(interface, "QueueDepth", 0, "u",
+				       property_get_queue_depth,
+				       NULL))
+		log_error("Can't add 'QueueDepth' property");
+
+	if (!l_dbus_interface_property(interface, "QueueDropped", 0, "t",
+				       property_get_queue_dropped,
+				       NULL))
+		log_error("Can't add 'QueueDropped' property");
 }
 
 int device_start(void)
@@ -349,7 +387,7 @@ int device_start(void)
 				       DEVICE_INTERFACE,
 				       device_setup_interface,
 				       NULL, false)) {
-		hal_log_error("dbus: unable to register %s", DEVICE_INTERFACE);
+		log_error("dbus: unable to register %s", DEVICE_INTERFACE);
 		return -EINVAL;
 	}
 	device_list = l_hashmap_string_new();
@@ -519,6 +557,20 @@ bool device_set_online(struct knot_device *device, bool online)
 	return true;
 }
 
+/*
+ * Updated on each output queue flush: PropertiesChanged is not emitted to
+ * keep the data path free of D-Bus traffic.
+ */
+void device_set_queue_stats(struct knot_device *device, uint32_t depth,
+			    uint64_t dropped)
+{
+	if (unlikely(!device))
+		return;
+
+	device->queue_depth = depth;
+	device->queue_dropped = dropped;
+}
+
 struct knot_device *device_get(const char *id)
 {
 	struct knot_device *device;
@@ -557,7 +609,7 @@ bool device_forget(struct knot_device *device)
 
 	ellproxy = proxy_get(device->id);
 	if (!ellproxy) {
-		hal_log_info("Source proxy not found: destroying local object...");
+		log_info("Source proxy not found: destroying local object...");
 		unregister(device);
 		return false;
 	}
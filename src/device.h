@@ -37,6 +37,8 @@ bool device_set_paired(struct knot_device *device, bool paired);
 bool device_get_paired(struct knot_device *device);
 bool device_set_registered(struct knot_device *device, bool registered);
 bool device_set_online(struct knot_device *device, bool online);
+void device_set_queue_stats(struct knot_device *device, uint32_t depth,
+			    uint64_t dropped);
 
 bool device_forget(struct knot_device *device);
 bool device_send_signal_notify(struct knot_device *device, const char *msg);
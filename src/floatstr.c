@@ -0,0 +1,368 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Shortest round trip formatting of binary32 floats, after Ryu (Ulf Adams,
+ * "Ryu: fast float-to-string conversion", PLDI 2018): the decimal digits
+ * are computed with integer arithmetic only, without the repeated printf
+ * and strtof() calls of a precision search.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "floatstr.h"
+
+#define FLOAT_MANTISSA_BITS	23
+#define FLOAT_EXPONENT_BITS	8
+#define FLOAT_BIAS		127
+
+#define POW5_INV_BITCOUNT	59
+#define POW5_BITCOUNT		61
+
+/* floor(2^(pow5bits(i) - 1 + POW5_INV_BITCOUNT) / 5^i) + 1 */
+static const uint64_t pow5_inv_split[31] = {
+	UINT64_C(576460752303423489), UINT64_C(461168601842738791),
+	UINT64_C(368934881474191033), UINT64_C(295147905179352826),
+	UINT64_C(472236648286964522), UINT64_C(377789318629571618),
+	UINT64_C(302231454903657294), UINT64_C(483570327845851670),
+	UINT64_C(386856262276681336), UINT64_C(309485009821345069),
+	UINT64_C(495176015714152110), UINT64_C(396140812571321688),
+	UINT64_C(316912650057057351), UINT64_C(507060240091291761),
+	UINT64_C(405648192073033409), UINT64_C(324518553658426727),
+	UINT64_C(519229685853482763), UINT64_C(415383748682786211),
+	UINT64_C(332306998946228969), UINT64_C(531691198313966350),
+	UINT64_C(425352958651173080), UINT64_C(340282366920938464),
+	UINT64_C(544451787073501542), UINT64_C(435561429658801234),
+	UINT64_C(348449143727040987), UINT64_C(557518629963265579),
+	UINT64_C(446014903970612463), UINT64_C(356811923176489971),
+	UINT64_C(570899077082383953), UINT64_C(456719261665907162),
+	UINT64_C(365375409332725730),
+};
+
+/* 5^i, normalized to its POW5_BITCOUNT most significant bits */
+static const uint64_t pow5_split[47] = {
+	UINT64_C(1152921504606846976), UINT64_C(1441151880758558720),
+	UINT64_C(1801439850948198400), UINT64_C(2251799813685248000),
+	UINT64_C(1407374883553280000), UINT64_C(1759218604441600000),
+	UINT64_C(2199023255552000000), UINT64_C(1374389534720000000),
+	UINT64_C(1717986918400000000), UINT64_C(2147483648000000000),
+	UINT64_C(1342177280000000000), UINT64_C(1677721600000000000),
+	UINT64_C(2097152000000000000), UINT64_C(1310720000000000000),
+	UINT64_C(1638400000000000000), UINT64_C(2048000000000000000),
+	UINT64_C(1280000000000000000), UINT64_C(1600000000000000000),
+	UINT64_C(2000000000000000000), UINT64_C(1250000000000000000),
+	UINT64_C(1562500000000000000), UINT64_C(1953125000000000000),
+	UINT64_C(1220703125000000000), UINT64_C(1525878906250000000),
+	UINT64_C(1907348632812500000), UINT64_C(1192092895507812500),
+	UINT64_C(1490116119384765625), UINT64_C(1862645149230957031),
+	UINT64_C(1164153218269348144), UINT64_C(1455191522836685180),
+	UINT64_C(1818989403545856475), UINT64_C(2273736754432320594),
+	UINT64_C(1421085471520200371), UINT64_C(1776356839400250464),
+	UINT64_C(2220446049250313080), UINT64_C(1387778780781445675),
+	UINT64_C(1734723475976807094), UINT64_C(2168404344971008868),
+	UINT64_C(1355252715606880542), UINT64_C(1694065894508600678),
+	UINT64_C(2117582368135750847), UINT64_C(1323488980084844279),
+	UINT64_C(1654361225106055349), UINT64_C(2067951531382569187),
+	UINT64_C(1292469707114105741), UINT64_C(1615587133892632177),
+	UINT64_C(2019483917365790221),
+};
+
+/* ceil(log2(5^e)), 1 for e = 0 */
+static int32_t pow5bits(int32_t e)
+{
+	return (int32_t) (((uint32_t) e * 1217359) >> 19) + 1;
+}
+
+/* floor(log10(2^e)) */
+static uint32_t log10_pow2(int32_t e)
+{
+	return ((uint32_t) e * 78913) >> 18;
+}
+
+/* floor(log10(5^e)) */
+static uint32_t log10_pow5(int32_t e)
+{
+	return ((uint32_t) e * 732923) >> 20;
+}
+
+static bool multiple_of_pow5(uint32_t value, uint32_t p)
+{
+	uint32_t count = 0;
+
+	while (value % 5 == 0) {
+		value /= 5;
+		count++;
+	}
+
+	return count >= p;
+}
+
+static bool multiple_of_pow2(uint32_t value, uint32_t p)
+{
+	return (value & ((1U << p) - 1)) == 0;
+}
+
+/* (m * factor) >> shift, for shift > 32 */
+static uint32_t mul_shift(uint32_t m, uint64_t factor, int32_t shift)
+{
+	uint64_t lo = (uint64_t) m * (uint32_t) factor;
+	uint64_t hi = (uint64_t) m * (factor >> 32);
+
+	return (uint32_t) (((lo >> 32) + hi) >> (shift - 32));
+}
+
+/*
+ * Shortest decimal output * 10^exp inside the rounding interval of the
+ * float made of the raw @mantissa and @exponent fields.
+ */
+static uint32_t shortest_decimal(uint32_t mantissa, uint32_t exponent,
+				 int32_t *exp)
+{
+	uint32_t m2, mv, mp, mm, mm_shift, vr, vp, vm, q;
+	bool vm_zeros = false, vr_zeros = false, even;
+	uint8_t last_digit = 0;
+	int32_t e2, e10, i, j, k, removed = 0;
+
+	if (exponent == 0) {
+		e2 = 1 - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+		m2 = mantissa;
+	} else {
+		e2 = exponent - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+		m2 = (1U << FLOAT_MANTISSA_BITS) | mantissa;
+	}
+
+	/* Round half to even: an even mantissa owns its interval bounds */
+	even = (m2 & 1) == 0;
+
+	/* Interval bounds, scaled by 4: the lower gap halves at powers of 2 */
+	mv = 4 * m2;
+	mp = 4 * m2 + 2;
+	mm_shift = mantissa != 0 || exponent <= 1;
+	mm = 4 * m2 - 1 - mm_shift;
+
+	/* To a decimal power base, keeping track of trailing zeros */
+	if (e2 >= 0) {
+		q = log10_pow2(e2);
+		e10 = q;
+		k = POW5_INV_BITCOUNT + pow5bits(q) - 1;
+		i = -e2 + (int32_t) q + k;
+		vr = mul_shift(mv, pow5_inv_split[q], i);
+		vp = mul_shift(mp, pow5_inv_split[q], i);
+		vm = mul_shift(mm, pow5_inv_split[q], i);
+
+		if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+			k = POW5_INV_BITCOUNT + pow5bits(q - 1) - 1;
+			last_digit = mul_shift(mv, pow5_inv_split[q - 1],
+					       -e2 + (int32_t) q - 1 + k) % 10;
+		}
+
+		/* Only one of mp, mv and mm can be a multiple of 5 */
+		if (q <= 9) {
+			if (mv % 5 == 0)
+				vr_zeros = multiple_of_pow5(mv, q);
+			else if (even)
+				vm_zeros = multiple_of_pow5(mm, q);
+			else
+				vp -= multiple_of_pow5(mp, q);
+		}
+	} else {
+		q = log10_pow5(-e2);
+		e10 = (int32_t) q + e2;
+		i = -e2 - (int32_t) q;
+		k = pow5bits(i) - POW5_BITCOUNT;
+		j = (int32_t) q - k;
+		vr = mul_shift(mv, pow5_split[i], j);
+		vp = mul_shift(mp, pow5_split[i], j);
+		vm = mul_shift(mm, pow5_split[i], j);
+
+		if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+			j = (int32_t) q - 1 -
+				(pow5bits(i + 1) - POW5_BITCOUNT);
+			last_digit = mul_shift(mv, pow5_split[i + 1], j) % 10;
+		}
+
+		if (q <= 1) {
+			/* mv has two trailing zero bits, mp one */
+			vr_zeros = true;
+			if (even)
+				vm_zeros = mm_shift == 1;
+			else
+				vp--;
+		} else if (q < 31) {
+			vr_zeros = multiple_of_pow2(mv, q - 1);
+		}
+	}
+
+	/* Drops digits while the interval still holds a shorter number */
+	if (vm_zeros || vr_zeros) {
+		while (vp / 10 > vm / 10) {
+			vm_zeros &= vm % 10 == 0;
+			vr_zeros &= last_digit == 0;
+			last_digit = vr % 10;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+
+		if (vm_zeros) {
+			while (vm % 10 == 0) {
+				vr_zeros &= last_digit == 0;
+				last_digit = vr % 10;
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+				removed++;
+			}
+		}
+
+		/* Exactly halfway: round to even */
+		if (vr_zeros && last_digit == 5 && vr % 2 == 0)
+			last_digit = 4;
+
+		*exp = e10 + removed;
+
+		return vr + ((vr == vm && (!even || !vm_zeros)) ||
+			     last_digit >= 5);
+	}
+
+	while (vp / 10 > vm / 10) {
+		last_digit = vr % 10;
+		vr /= 10;
+		vp /= 10;
+		vm /= 10;
+		removed++;
+	}
+
+	*exp = e10 + removed;
+
+	return vr + (vr == vm || last_digit >= 5);
+}
+
+/**
+ * floatstr_shortest:
+ * @val: finite float
+ * @buf: output buffer, FLOATSTR_SIZE octets fit any float
+ * @size: size of @buf
+ *
+ * Formats @val with the fewest significant digits that parse back to the
+ * same float, the closest to @val if there are several: 21.3 instead of
+ * 21.299999237060547, which is what printing its double promotion gives.
+ * Plain notation is used for decimal exponents in [-6, 21), as JavaScript
+ * does, keeping a fraction as json-c does (21.0); exponent notation is
+ * printf's "%e" otherwise (1e+21, 1.5e-07).
+ *
+ * Returns: length of the string written to @buf, or a negative errno.
+ */
+int floatstr_shortest(float val, char *buf, size_t size)
+{
+	char str[FLOATSTR_SIZE];
+	char digits[10];
+	uint32_t bits, mantissa, exponent, output;
+	int32_t exp;
+	int ndigits, sci_exp, len = 0, i;
+
+	memcpy(&bits, &val, sizeof(bits));
+	mantissa = bits & ((1U << FLOAT_MANTISSA_BITS) - 1);
+	exponent = (bits >> FLOAT_MANTISSA_BITS) &
+					((1U << FLOAT_EXPONENT_BITS) - 1);
+
+	if (exponent == (1U << FLOAT_EXPONENT_BITS) - 1)
+		return -EINVAL;
+
+	if (exponent == 0 && mantissa == 0) {
+		output = 0;
+		exp = 0;
+	} else {
+		output = shortest_decimal(mantissa, exponent, &exp);
+	}
+
+	/* At most 9 digits: FLT_DECIMAL_DIG */
+	ndigits = 0;
+	do {
+		digits[ndigits++] = '0' + output % 10;
+		output /= 10;
+	} while (output);
+
+	for (i = 0; i < ndigits / 2; i++) {
+		char tmp = digits[i];
+
+		digits[i] = digits[ndigits - 1 - i];
+		digits[ndigits - 1 - i] = tmp;
+	}
+
+	sci_exp = exp + ndigits - 1;
+
+	if (bits >> 31)
+		str[len++] = '-';
+
+	if (sci_exp < -6 || sci_exp >= 21) {
+		str[len++] = digits[0];
+		if (ndigits > 1) {
+			str[len++] = '.';
+			for (i = 1; i < ndigits; i++)
+				str[len++] = digits[i];
+		}
+
+		str[len++] = 'e';
+		str[len++] = sci_exp < 0 ? '-' : '+';
+		if (sci_exp < 0)
+			sci_exp = -sci_exp;
+		if (sci_exp >= 10)
+			str[len++] = '0' + sci_exp / 10;
+		else
+			str[len++] = '0';
+		str[len++] = '0' + sci_exp % 10;
+	} else if (sci_exp < 0) {
+		str[len++] = '0';
+		str[len++] = '.';
+		for (i = -1; i > sci_exp; i--)
+			str[len++] = '0';
+		for (i = 0; i < ndigits; i++)
+			str[len++] = digits[i];
+	} else {
+		for (i = 0; i <= sci_exp; i++)
+			str[len++] = i < ndigits ? digits[i] : '0';
+
+		str[len++] = '.';
+		if (ndigits <= sci_exp + 1)
+			str[len++] = '0';
+		for (; i < ndigits; i++)
+			str[len++] = digits[i];
+	}
+
+	if ((size_t) len >= size)
+		return -ENOSPC;
+
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	return len;
+}
@@ -0,0 +1,374 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <ell/ell.h>
+#include <hal/linux_log.h>
+
+#include "storage.h"
+#include "log.h"
+
+#define LOG_GROUP			"Log"
+#define LOG_DEFAULT_LEVEL		LOG_LEVEL_INFO
+#define LOG_DEFAULT_EVENTS_DUMP		KNOTSTATEDIR "/knotd-events.log"
+
+#define LOG_RING_LEN			4096	/* Power of two */
+
+/*
+ * Written by any thread, read by the dump which may interrupt a writer:
+ * a record is valid when its seq is the same before and after the copy.
+ */
+struct log_record {
+	uint64_t seq;			/* Ring position + 1, 0 if writing */
+	uint64_t stamp;			/* CLOCK_MONOTONIC, ns */
+	uint64_t a;
+	uint64_t b;
+	uint32_t type;
+};
+
+enum log_level log_level = LOG_DEFAULT_LEVEL;
+
+static struct log_record ring[LOG_RING_LEN];
+static uint64_t ring_head;
+static char dump_path[PATH_MAX];
+
+static const char *level_names[] = {
+	[LOG_LEVEL_ERROR] = "error",
+	[LOG_LEVEL_WARN] = "warn",
+	[LOG_LEVEL_INFO] = "info",
+	[LOG_LEVEL_DEBUG] = "debug",
+};
+
+static const char *event_names[] = {
+	[LOG_EV_SESSION_REF] = "session_ref",
+	[LOG_EV_SESSION_UNREF] = "session_unref",
+	[LOG_EV_SESSION_STATE] = "session_state",
+	[LOG_EV_PDU_RX] = "pdu_rx",
+	[LOG_EV_PDU_TX] = "pdu_tx",
+	[LOG_EV_DATA] = "data",
+	[LOG_EV_CLOUD_RX] = "cloud_rx",
+	[LOG_EV_CLOUD_TX] = "cloud_tx",
+};
+
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+				     SIGABRT };
+
+/**
+ * log_event:
+ * @type: event type
+ * @a: first argument, see enum log_event_type
+ * @b: second argument
+ *
+ * Records an event in the ring, overwriting the oldest one. Safe to call
+ * from any thread.
+ */
+void log_event(enum log_event_type type, uint64_t a, uint64_t b)
+{
+	struct log_record *rec;
+	struct timespec ts;
+	uint64_t seq;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	seq = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+	rec = &ring[seq & (LOG_RING_LEN - 1)];
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&rec->stamp, (uint64_t) ts.tv_sec * 1000000000 +
+			 ts.tv_nsec, __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->a, a, __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->b, b, __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->type, type, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* snprintf() isn't async-signal-safe, the dump formats by hand */
+static char *put_str(char *p, const char *str)
+{
+	while (*str)
+		*p++ = *str++;
+
+	return p;
+}
+
+static char *put_uint(char *p, uint64_t val, int width)
+{
+	char tmp[20];
+	int len = 0;
+
+	do {
+		tmp[len++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+
+	while (len < width)
+		tmp[len++] = '0';
+
+	while (len)
+		*p++ = tmp[--len];
+
+	return p;
+}
+
+static char *put_hex(char *p, uint64_t val)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[16];
+	int len = 0;
+
+	do {
+		tmp[len++] = digits[val & 0xf];
+		val >>= 4;
+	} while (val);
+
+	p = put_str(p, "0x");
+	while (len)
+		*p++ = tmp[--len];
+
+	return p;
+}
+
+static char *put_stamp(char *p, uint64_t stamp)
+{
+	p = put_uint(p, stamp / 1000000000, 0);
+	*p++ = '.';
+
+	return put_uint(p, stamp % 1000000000, 9);
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t nwritten;
+
+	while (len) {
+		nwritten = write(fd, buf, len);
+		if (nwritten < 0 && errno == EINTR)
+			continue;
+		if (nwritten <= 0)
+			return;
+
+		buf += nwritten;
+		len -= nwritten;
+	}
+}
+
+/**
+ * log_events_dump:
+ * @fd: file descriptor to write to
+ *
+ * Writes the events in the ring as text, oldest first, one per line:
+ * "<monotonic seconds> <event> <a> <b>". Records being written while
+ * dumping are skipped. Async-signal-safe.
+ */
+void log_events_dump(int fd)
+{
+	struct log_record rec;
+	struct timespec ts;
+	uint64_t head, seq;
+	char line[128];
+	char *p;
+
+	head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	seq = head > LOG_RING_LEN ? head - LOG_RING_LEN : 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	p = put_str(line, "knotd events: ");
+	p = put_uint(p, head - seq, 0);
+	p = put_str(p, " of ");
+	p = put_uint(p, head, 0);
+	p = put_str(p, ", now ");
+	p = put_stamp(p, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+	*p++ = '\n';
+	write_all(fd, line, p - line);
+
+	for (; seq < head; seq++) {
+		struct log_record *slot = &ring[seq & (LOG_RING_LEN - 1)];
+
+		rec.seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		rec.stamp = __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED);
+		rec.a = __atomic_load_n(&slot->a, __ATOMIC_RELAXED);
+		rec.b = __atomic_load_n(&slot->b, __ATOMIC_RELAXED);
+		rec.type = __atomic_load_n(&slot->type, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* Being written or already overwritten */
+		if (rec.seq != seq + 1 ||
+		    __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != rec.seq)
+			continue;
+
+		if (rec.type >= LOG_EV_MAX)
+			continue;
+
+		p = put_stamp(line, rec.stamp);
+		*p++ = ' ';
+		p = put_str(p, event_names[rec.type]);
+		*p++ = ' ';
+		p = put_hex(p, rec.a);
+		*p++ = ' ';
+		p = put_uint(p, rec.b, 0);
+		*p++ = '\n';
+		write_all(fd, line, p - line);
+	}
+}
+
+static void dump_to_file(void)
+{
+	struct stat st;
+	int fd;
+
+	/* Appends to a previous dump, creates the file exclusively otherwise */
+	fd = open(dump_path, O_WRONLY | O_APPEND | O_NOFOLLOW | O_NONBLOCK |
+		  O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT)
+		fd = open(dump_path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL |
+			  O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+
+	/* Not a file left by another user for the daemon to write to */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_uid == geteuid())
+		log_events_dump(fd);
+
+	close(fd);
+}
+
+static void dump_signal_handler(int signo)
+{
+	int saved_errno = errno;
+
+	dump_to_file();
+
+	errno = saved_errno;
+}
+
+static void crash_signal_handler(int signo)
+{
+	dump_to_file();
+
+	/* SA_RESETHAND restored the default action: crash for real */
+	raise(signo);
+}
+
+static enum log_level read_level(int fd)
+{
+	char *str = storage_read_key_string(fd, LOG_GROUP, "Level");
+	enum log_level level = LOG_DEFAULT_LEVEL;
+	unsigned int i;
+
+	if (!str)
+		return level;
+
+	for (i = 0; i < L_ARRAY_SIZE(level_names); i++) {
+		if (strcasecmp(str, level_names[i]) == 0) {
+			level = i;
+			break;
+		}
+	}
+
+	if (i == L_ARRAY_SIZE(level_names))
+		hal_log_error("Invalid log level: %s", str);
+
+	l_free(str);
+
+	return level;
+}
+
+/**
+ * log_init:
+ * @configfd: configuration file descriptor returned by storage_open()
+ *
+ * Loads the "Log" group and installs the event dump signal handlers. Must
+ * be called after hal_log_init().
+ *
+ * Returns: 0 if successful and a negative error otherwise.
+ */
+int log_init(int configfd)
+{
+	struct sigaction sa;
+	char *path;
+	unsigned int i;
+
+	log_level = read_level(configfd);
+	if (log_level > LOG_LEVEL_MAX)
+		hal_log_warn("Log level %s not built in, using %s",
+			     level_names[log_level],
+			     level_names[LOG_LEVEL_MAX]);
+
+	path = storage_read_key_string(configfd, LOG_GROUP, "EventsDump");
+	snprintf(dump_path, sizeof(dump_path), "%s",
+		 path ? path : LOG_DEFAULT_EVENTS_DUMP);
+
+	if (!path && mkdir(KNOTSTATEDIR, 0700) < 0 && errno != EEXIST)
+		hal_log_error("Can't create %s: %s", KNOTSTATEDIR,
+			      strerror(errno));
+	l_free(path);
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+
+	sa.sa_handler = dump_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, NULL) < 0)
+		return -errno;
+
+	sa.sa_handler = crash_signal_handler;
+	sa.sa_flags = SA_RESETHAND;
+	for (i = 0; i < L_ARRAY_SIZE(crash_signals); i++) {
+		if (sigaction(crash_signals[i], &sa, NULL) < 0)
+			return -errno;
+	}
+
+	log_info("Log level: %s, events dump: %s",
+		 level_names[log_level], dump_path);
+
+	return 0;
+}
+
+void log_exit(void)
+{
+	unsigned int i;
+
+	signal(SIGUSR1, SIG_DFL);
+
+	for (i = 0; i < L_ARRAY_SIZE(crash_signals); i++)
+		signal(crash_signals[i], SIG_DFL);
+}
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Logging front end of hal_log. Statements more verbose than LOG_LEVEL_MAX
+ * (configure --with-log-level) are compiled out, the others are checked
+ * against the runtime level ("Level" of the "Log" group) before their
+ * arguments are evaluated: a disabled statement costs a compare.
+ *
+ * Events happening per PDU or per message go to a binary ring instead,
+ * with log_event(): a few stores, no formatting. The ring is written as
+ * text to the "EventsDump" file on SIGUSR1 or when knotd crashes.
+ */
+
+enum log_level {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+};
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX			LOG_LEVEL_DEBUG
+#endif
+
+extern enum log_level log_level;
+
+#define log_enabled(level)						\
+	((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+
+#define log_error(fmt, ...)						\
+	do {								\
+		if (log_enabled(LOG_LEVEL_ERROR))			\
+			hal_log_error(fmt, ##__VA_ARGS__);		\
+	} while (0)
+
+#define log_warn(fmt, ...)						\
+	do {								\
+		if (log_enabled(LOG_LEVEL_WARN))			\
+			hal_log_warn(fmt, ##__VA_ARGS__);		\
+	} while (0)
+
+#define log_info(fmt, ...)						\
+	do {								\
+		if (log_enabled(LOG_LEVEL_INFO))			\
+			hal_log_info(fmt, ##__VA_ARGS__);		\
+	} while (0)
+
+#define log_dbg(fmt, ...)						\
+	do {								\
+		if (log_enabled(LOG_LEVEL_DEBUG))			\
+			hal_log_dbg(fmt, ##__VA_ARGS__);		\
+	} while (0)
+
+enum log_event_type {
+	LOG_EV_SESSION_REF,		/* a: session, b: references */
+	LOG_EV_SESSION_UNREF,		/* a: session, b: references left */
+	LOG_EV_SESSION_STATE,		/* a: session, b: old << 8 | new */
+	LOG_EV_PDU_RX,			/* a: session, b: type << 8 | length */
+	LOG_EV_PDU_TX,			/* a: session, b: PDUs or octets sent */
+	LOG_EV_DATA,			/* a: session, b: sensor << 8 | type */
+	LOG_EV_CLOUD_RX,		/* a: delivery tag, b: body length */
+	LOG_EV_CLOUD_TX,		/* a: outbox length, b: body length */
+	LOG_EV_MAX
+};
+
+void log_event(enum log_event_type type, uint64_t a, uint64_t b);
+void log_events_dump(int fd);
+
+int log_init(int configfd);
+void log_exit(void);
@@ -36,6 +36,7 @@
 #include <hal/linux_log.h>
 #include "settings.h"
 #include "manager.h"
+#include "log.h"
 
 static void main_loop_quit(struct l_timeout *timeout, void *user_data)
 {
@@ -110,12 +111,17 @@ int main(int argc, char *argv[])
 		goto fail_main_loop;
 
 	hal_log_init("knotd", settings->detach);
-	hal_log_info("KNOT Gateway");
+	log_info("KNOT Gateway");
+
+	err = log_init(settings->configfd);
+	if (err)
+		log_error("Can't set up the events dump: %s (%d)",
+			  strerror(-err), -err);
 
 	err = manager_start(settings);
 	if (err) {
-		hal_log_error("Failed to start the manager: %s (%d)",
-			      strerror(-err), -err);
+		log_error("Failed to start the manager: %s (%d)",
+			  strerror(-err), -err);
 		goto fail_manager;
 	}
 
@@ -123,7 +129,7 @@ int main(int argc, char *argv[])
 	if (settings->run_as_root == false) {
 		err = run_as_user_knot();
 		if (err) {
-			hal_log_error("Failed to run as user 'knot' " \
+			log_error("Failed to run as user 'knot' " \
 				"%s (%d). Exiting ...", strerror(-err), -err);
 			goto fail_user_knot;
 		}
@@ -132,7 +138,7 @@ int main(int argc, char *argv[])
 	if (settings->detach) {
 		err = detach();
 		if (err) {
-			hal_log_error("Failed to detach. " \
+			log_error("Failed to detach. " \
 				"%s (%d). Exiting ...", strerror(-err), -err);
 			goto fail_detach;
 		}
@@ -140,7 +146,7 @@ int main(int argc, char *argv[])
 
 	l_main_loop_run();
 
-	hal_log_info("Exiting");
+	log_info("Exiting");
 
 	err = EXIT_SUCCESS;
 
@@ -149,6 +155,7 @@ fail_user_knot:
 	manager_stop();
 fail_manager:
 	l_main_exit();
+	log_exit();
 	hal_log_close();
 fail_main_loop:
 	settings_free(settings);
@@ -37,6 +37,7 @@
 #include <hal/linux_log.h>
 #include <ell/ell.h>
 
+#include "log.h"
 #include "settings.h"
 #include "msg.h"
 #include "dbus.h"
@@ -51,7 +52,7 @@ static bool property_get_token(struct l_dbus *dbus,
 	const struct settings *settings = user_data;
 
 	l_dbus_message_builder_append_basic(builder, 's', settings->token);
-	hal_log_info("Get('Token' = %s)", settings->token);
+	log_info("Get('Token' = %s)", settings->token);
 
 	return true;
 }
@@ -70,7 +71,7 @@ static struct l_dbus_message *property_set_token(struct l_dbus *dbus,
 
 	l_free(settings->token);
 	settings->token = l_strdup(token);
-	hal_log_info("Set('Token' = %s)", settings->token);
+	log_info("Set('Token' = %s)", settings->token);
 
 	storage_write_key_string(settings->configfd,
 				 "Cloud", "Token", token);
@@ -88,7 +89,7 @@ static void setup_interface(struct l_dbus_interface *interface)
 	if (!l_dbus_interface_property(interface, "Token", 0, "s",
 				       property_get_token,
 				       property_set_token))
-		hal_log_error("Can't add 'Token' property");
+		log_error("Can't add 'Token' property");
 }
 
 static void setup_complete(void *user_data)
@@ -102,26 +103,26 @@ static void setup_complete(void *user_data)
 				       SETTINGS_INTERFACE,
 				       setup_interface,
 				       NULL, false))
-		hal_log_error("dbus: unable to register %s",
-			      SETTINGS_INTERFACE);
+		log_error("dbus: unable to register %s",
+			  SETTINGS_INTERFACE);
 
 	if (!l_dbus_object_add_interface(dbus_get_bus(),
 					 path,
 					 SETTINGS_INTERFACE,
 					 settings))
-		hal_log_error("dbus: unable to add %s to %s",
-			      SETTINGS_INTERFACE, path);
+		log_error("dbus: unable to add %s to %s",
+			  SETTINGS_INTERFACE, path);
 
 	if (!l_dbus_object_add_interface(dbus_get_bus(),
 					 path,
 					 L_DBUS_INTERFACE_PROPERTIES,
 					 settings))
-		hal_log_error("dbus: unable to add %s to %s",
-			      L_DBUS_INTERFACE_PROPERTIES, path);
+		log_error("dbus: unable to add %s to %s",
+			  L_DBUS_INTERFACE_PROPERTIES, path);
 
 	err = msg_start(settings);
 	if (err < 0)
-		hal_log_error("msg_start(): %s", strerror(-err));
+		log_error("msg_start(): %s", strerror(-err));
 }
 
 int manager_start(struct settings *settings)
@@ -130,7 +131,7 @@ int manager_start(struct settings *settings)
 
 	err = dbus_start(setup_complete, settings);
 	if (err)
-		hal_log_error("dbus_start(): %s", strerror(-err));
+		log_error("dbus_start(): %s", strerror(-err));
 
 	return err;
 }
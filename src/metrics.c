@@ -0,0 +1,618 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef  _GNU_SOURCE
+#define  _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <ell/ell.h>
+#include <hal/linux_log.h>
+
+#include "log.h"
+#include "settings.h"
+#include "storage.h"
+#include "dbus.h"
+#include "trace.h"
+#include "metrics.h"
+
+#define METRICS_GROUP			"Metrics"
+/* '@': abstract namespace */
+#define METRICS_DEFAULT_SOCKET		"@knotd-metrics"
+#define METRICS_MAX_CLIENTS		8
+#define METRICS_REQUEST_MAX		1024
+
+/* Exported latency buckets: powers of two, from 1.024us to 17.2s */
+#define METRICS_LE_FIRST_SHIFT		10
+#define METRICS_LE_LAST_SHIFT		34
+
+/* Written by a single thread, read by any */
+struct metrics_shard {
+	struct metrics_shard *next;
+	int64_t value[METRICS_MAX];
+};
+
+struct metrics_client {
+	struct l_io *io;
+	char *response;
+	size_t len;
+	size_t sent;
+};
+
+struct metrics_family {
+	const char *name;
+	const char *help;
+	const char *type;
+	enum metrics_id id;
+	unsigned int len;		/* Labeled entries, 0: unlabeled */
+	const char *label;
+	const char * const *label_values; /* NULL: hexadecimal index */
+};
+
+static const char * const session_states[METRICS_SESSION_STATES] = {
+	"new", "registering", "authenticating", "schema", "ready",
+	"unregistering"
+};
+
+static const struct metrics_family families[] = {
+	{ "knotd_sessions", "Things connected, by session state",
+	  "gauge", METRICS_SESSIONS, METRICS_SESSION_STATES,
+	  "state", session_states },
+	{ "knotd_node_pdus_received_total", "PDUs received from things",
+	  "counter", METRICS_PDUS, METRICS_PDU_TYPES, "type", NULL },
+	{ "knotd_node_received_bytes_total", "Octets read from things",
+	  "counter", METRICS_NODE_RX_BYTES },
+	{ "knotd_cloud_published_total", "Messages published to the cloud",
+	  "counter", METRICS_CLOUD_PUBLISHED },
+	{ "knotd_cloud_publish_failures_total", "Failed cloud publishes",
+	  "counter", METRICS_CLOUD_PUBLISH_FAILED },
+	{ "knotd_cloud_outbox_messages", "Messages waiting to be published",
+	  "gauge", METRICS_CLOUD_OUTBOX },
+	{ "knotd_cloud_outbox_dropped_total", "Messages dropped, outbox full",
+	  "counter", METRICS_CLOUD_OUTBOX_DROPPED },
+	{ "knotd_cloud_received_total", "Messages received from the cloud",
+	  "counter", METRICS_CLOUD_RECEIVED },
+	{ "knotd_cloud_received_dropped_total",
+	  "Messages received from the cloud and not consumed",
+	  "counter", METRICS_CLOUD_RECEIVED_DROPPED },
+	{ "knotd_amqp_connects_total", "Connections to the broker",
+	  "counter", METRICS_AMQP_CONNECTS },
+	{ "knotd_amqp_disconnects_total", "Connections lost to the broker",
+	  "counter", METRICS_AMQP_DISCONNECTS },
+};
+
+static struct metrics_shard *shards;	/* Every thread that counted */
+static __thread struct metrics_shard *thread_shard;
+
+static struct l_io *server_io;
+static struct l_queue *clients;
+static bool dbus_registered;
+
+static struct metrics_shard *shard_new(void)
+{
+	struct metrics_shard *shard = l_new(struct metrics_shard, 1);
+
+	shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&shards, &shard->next, shard,
+					    true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+
+	thread_shard = shard;
+
+	return shard;
+}
+
+/**
+ * metrics_add:
+ * @id: counter or gauge
+ * @delta: value added, negative to decrease a gauge
+ *
+ * Safe to call from any thread, without contention: each thread updates
+ * its own shard.
+ */
+void metrics_add(enum metrics_id id, int64_t delta)
+{
+	struct metrics_shard *shard = thread_shard;
+
+	if (unlikely(!shard))
+		shard = shard_new();
+
+	/* Single writer: a relaxed store keeps readers from tearing it */
+	__atomic_store_n(&shard->value[id], shard->value[id] + delta,
+			 __ATOMIC_RELAXED);
+}
+
+/**
+ * metrics_read:
+ * @id: counter or gauge
+ *
+ * Returns: the sum of the shards of every thread.
+ */
+int64_t metrics_read(enum metrics_id id)
+{
+	struct metrics_shard *shard;
+	int64_t value = 0;
+
+	for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard;
+							shard = shard->next)
+		value += __atomic_load_n(&shard->value[id], __ATOMIC_RELAXED);
+
+	return value;
+}
+
+static void family_label_value(const struct metrics_family *family,
+			       unsigned int index, char *str, size_t len)
+{
+	if (family->label_values)
+		snprintf(str, len, "%s", family->label_values[index]);
+	else
+		snprintf(str, len, "0x%02x", index);
+}
+
+static void expose_family(struct l_string *out,
+			  const struct metrics_family *family)
+{
+	char label[16];
+	unsigned int i;
+	int64_t value;
+
+	l_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+			       family->name, family->help,
+			       family->name, family->type);
+
+	if (!family->len) {
+		l_string_append_printf(out, "%s %"PRId64"\n", family->name,
+				       metrics_read(family->id));
+		return;
+	}
+
+	for (i = 0; i < family->len; i++) {
+		value = metrics_read(family->id + i);
+
+		/* PDU types are sparse: skip the ones never received */
+		if (!value && !family->label_values)
+			continue;
+
+		family_label_value(family, i, label, sizeof(label));
+		l_string_append_printf(out, "%s{%s=\"%s\"} %"PRId64"\n",
+				       family->name, family->label, label,
+				       value);
+	}
+}
+
+static void expose_latency(struct l_string *out)
+{
+	struct trace_hist_snapshot snapshot;
+	const char *stage;
+	uint64_t cumulative;
+	unsigned int i;
+	unsigned int shift;
+	unsigned int bucket = 0;
+
+	l_string_append(out, "# HELP knotd_trace_latency_seconds "
+			"Time to reach each stage of the data path\n"
+			"# TYPE knotd_trace_latency_seconds histogram\n");
+
+	for (i = 0; i < TRACE_STAGE_MAX; i++) {
+		stage = trace_hist_to_str(i);
+		trace_hist_read(i, &snapshot);
+
+		/* Buckets of trace.c are finer and aligned to powers of two */
+		cumulative = 0;
+		bucket = 0;
+		for (shift = METRICS_LE_FIRST_SHIFT;
+		     shift <= METRICS_LE_LAST_SHIFT; shift++) {
+			while (bucket < TRACE_HIST_BUCKETS &&
+			       trace_hist_bucket_max(bucket) <
+						(UINT64_C(1) << shift))
+				cumulative += snapshot.count[bucket++];
+
+			l_string_append_printf(out,
+				"knotd_trace_latency_seconds_bucket"
+				"{stage=\"%s\",le=\"%.9f\"} %"PRIu64"\n",
+				stage, (UINT64_C(1) << shift) / 1e9,
+				cumulative);
+		}
+
+		l_string_append_printf(out,
+			"knotd_trace_latency_seconds_bucket"
+			"{stage=\"%s\",le=\"+Inf\"} %"PRIu64"\n"
+			"knotd_trace_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+			"knotd_trace_latency_seconds_count{stage=\"%s\"} "
+			"%"PRIu64"\n", stage, snapshot.total, stage,
+			snapshot.sum_ns / 1e9, stage, snapshot.total);
+	}
+}
+
+/* Prometheus text exposition format, version 0.0.4 */
+static char *expose(void)
+{
+	struct l_string *out = l_string_new(8192);
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(families); i++)
+		expose_family(out, &families[i]);
+
+	expose_latency(out);
+
+	return l_string_unwrap(out);
+}
+
+static void client_free(void *data)
+{
+	struct metrics_client *client = data;
+
+	l_io_destroy(client->io);
+	l_free(client->response);
+	l_free(client);
+}
+
+static void client_disconnected(struct l_io *io, void *user_data)
+{
+	struct metrics_client *client = user_data;
+
+	l_queue_remove(clients, client);
+	client_free(client);
+}
+
+static bool client_write(struct l_io *io, void *user_data)
+{
+	struct metrics_client *client = user_data;
+	ssize_t len;
+
+	len = send(l_io_get_fd(io), client->response + client->sent,
+		   client->len - client->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (len < 0 && errno == EAGAIN)
+		return true;
+
+	if (len > 0)
+		client->sent += len;
+
+	if (len > 0 && client->sent < client->len)
+		return true;
+
+	/* Done or failed: the hangup releases the client */
+	shutdown(l_io_get_fd(io), SHUT_RDWR);
+
+	return false;
+}
+
+/*
+ * Any request is answered: an HTTP one (e.g. curl --abstract-unix-socket)
+ * with an HTTP response, anything else or end of file with the bare text.
+ */
+static bool client_read(struct l_io *io, void *user_data)
+{
+	struct metrics_client *client = user_data;
+	char request[METRICS_REQUEST_MAX];
+	char *body;
+	size_t len;
+	ssize_t rlen;
+
+	rlen = recv(l_io_get_fd(io), request, sizeof(request), MSG_DONTWAIT);
+	if (rlen < 0 && errno == EAGAIN)
+		return true;
+
+	if (rlen < 0) {
+		shutdown(l_io_get_fd(io), SHUT_RDWR);
+		return false;
+	}
+
+	body = expose();
+	len = strlen(body);
+
+	if (rlen >= 4 && strncmp(request, "GET ", 4) == 0) {
+		client->response = l_strdup_printf("HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n%s", len, body);
+		l_free(body);
+	} else {
+		client->response = body;
+	}
+
+	client->len = strlen(client->response);
+
+	/* Usually sent at once, even if the peer already shut its side */
+	if (client_write(io, client))
+		l_io_set_write_handler(io, client_write, client, NULL);
+
+	return false;
+}
+
+static bool server_accept(struct l_io *io, void *user_data)
+{
+	struct metrics_client *client;
+	int fd;
+
+	fd = accept4(l_io_get_fd(io), NULL, NULL,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return true;
+
+	if (l_queue_length(clients) >= METRICS_MAX_CLIENTS) {
+		log_error("Metrics: too many clients");
+		close(fd);
+		return true;
+	}
+
+	client = l_new(struct metrics_client, 1);
+	client->io = l_io_new(fd);
+	l_io_set_close_on_destroy(client->io, true);
+	l_io_set_read_handler(client->io, client_read, client, NULL);
+	l_io_set_disconnect_handler(client->io, client_disconnected,
+				    client, NULL);
+	l_queue_push_tail(clients, client);
+
+	return true;
+}
+
+static int server_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	size_t len = strlen(path);
+	int sock;
+	int err;
+
+	if (len >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, len);
+	addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+
+	/* Abstract namespace: first character must be null */
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+	else
+		unlink(path);
+
+	if (bind(sock, (struct sockaddr *) &addr, addrlen) < 0 ||
+	    listen(sock, METRICS_MAX_CLIENTS) < 0) {
+		err = -errno;
+		close(sock);
+		return err;
+	}
+
+	return sock;
+}
+
+static struct l_dbus_message *method_get_counters(struct l_dbus *dbus,
+						  struct l_dbus_message *msg,
+						  void *user_data)
+{
+	const struct metrics_family *family;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	char name[64];
+	char label[16];
+	unsigned int i;
+	unsigned int j;
+	int64_t value;
+
+	reply = l_dbus_message_new_method_return(msg);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_enter_array(builder, "{sx}");
+
+	for (i = 0; i < L_ARRAY_SIZE(families); i++) {
+		family = &families[i];
+
+		for (j = 0; j < (family->len ? family->len : 1); j++) {
+			value = metrics_read(family->id + j);
+
+			if (family->len && !value && !family->label_values)
+				continue;
+
+			if (family->len) {
+				family_label_value(family, j, label,
+						   sizeof(label));
+				snprintf(name, sizeof(name), "%s{%s=\"%s\"}",
+					 family->name, family->label, label);
+			} else {
+				snprintf(name, sizeof(name), "%s",
+					 family->name);
+			}
+
+			l_dbus_message_builder_enter_dict(builder, "sx");
+			l_dbus_message_builder_append_basic(builder, 's', name);
+			l_dbus_message_builder_append_basic(builder, 'x',
+							    &value);
+			l_dbus_message_builder_leave_dict(builder);
+		}
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static struct l_dbus_message *method_get_latency(struct l_dbus *dbus,
+						 struct l_dbus_message *msg,
+						 void *user_data)
+{
+	struct trace_hist_snapshot snapshot;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	const char *stage;
+	uint64_t le;
+	unsigned int i;
+
+	if (!l_dbus_message_get_arguments(msg, "s", &stage))
+		return dbus_error_invalid_args(msg);
+
+	for (i = 0; i < TRACE_STAGE_MAX; i++) {
+		if (strcmp(stage, trace_hist_to_str(i)) == 0)
+			break;
+	}
+
+	if (i == TRACE_STAGE_MAX)
+		return dbus_error_invalid_args(msg);
+
+	trace_hist_read(i, &snapshot);
+
+	reply = l_dbus_message_new_method_return(msg);
+	builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_append_basic(builder, 't', &snapshot.total);
+	l_dbus_message_builder_append_basic(builder, 't', &snapshot.sum_ns);
+
+	/* Non-empty buckets: largest value (ns) and count */
+	l_dbus_message_builder_enter_array(builder, "(tt)");
+	for (i = 0; i < TRACE_HIST_BUCKETS; i++) {
+		if (!snapshot.count[i])
+			continue;
+
+		le = trace_hist_bucket_max(i);
+		l_dbus_message_builder_enter_struct(builder, "tt");
+		l_dbus_message_builder_append_basic(builder, 't', &le);
+		l_dbus_message_builder_append_basic(builder, 't',
+						    &snapshot.count[i]);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+	l_dbus_message_builder_leave_array(builder);
+
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
+static void setup_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "GetCounters", 0,
+				method_get_counters, "a{sx}", "",
+				"counters");
+	l_dbus_interface_method(interface, "GetLatency", 0,
+				method_get_latency, "tta(tt)", "s",
+				"count", "sum", "buckets", "stage");
+}
+
+static void dbus_setup(void)
+{
+	if (!l_dbus_register_interface(dbus_get_bus(), METRICS_INTERFACE,
+				       setup_interface, NULL, false)) {
+		log_error("dbus: unable to register %s",
+			  METRICS_INTERFACE);
+		return;
+	}
+
+	if (!l_dbus_object_add_interface(dbus_get_bus(), "/",
+					 METRICS_INTERFACE, NULL)) {
+		log_error("dbus: unable to add %s to /",
+			  METRICS_INTERFACE);
+		l_dbus_unregister_interface(dbus_get_bus(), METRICS_INTERFACE);
+		return;
+	}
+
+	dbus_registered = true;
+}
+
+/**
+ * metrics_start:
+ * @settings: settings, the "Metrics" group is read from its file
+ *
+ * Exports the metrics through D-Bus and, unless disabled with an empty
+ * "Socket" key, on a local socket. Counting doesn't need it.
+ *
+ * Returns: 0 if successful and a negative error otherwise.
+ */
+int metrics_start(struct settings *settings)
+{
+	char *path;
+	int sock;
+
+	dbus_setup();
+
+	path = storage_read_key_string(settings->configfd, METRICS_GROUP,
+				       "Socket");
+	if (!path)
+		path = l_strdup(METRICS_DEFAULT_SOCKET);
+
+	if (path[0] == '\0') {
+		l_free(path);
+		return 0;
+	}
+
+	sock = server_listen(path);
+	if (sock < 0) {
+		log_error("Metrics socket %s: %s", path, strerror(-sock));
+		l_free(path);
+		return sock;
+	}
+
+	server_io = l_io_new(sock);
+	l_io_set_close_on_destroy(server_io, true);
+	l_io_set_read_handler(server_io, server_accept, NULL, NULL);
+	clients = l_queue_new();
+
+	log_info("Metrics exported on %s", path);
+	l_free(path);
+
+	return 0;
+}
+
+/* After the threads counting are stopped */
+void metrics_stop(void)
+{
+	struct metrics_shard *shard;
+
+	l_queue_destroy(clients, client_free);
+	clients = NULL;
+	l_io_destroy(server_io);
+	server_io = NULL;
+
+	if (dbus_registered) {
+		l_dbus_object_remove_interface(dbus_get_bus(), "/",
+					       METRICS_INTERFACE);
+		l_dbus_unregister_interface(dbus_get_bus(), METRICS_INTERFACE);
+		dbus_registered = false;
+	}
+
+	while ((shard = shards)) {
+		shards = shard->next;
+		l_free(shard);
+	}
+
+	thread_shard = NULL;
+}
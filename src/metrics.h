@@ -0,0 +1,58 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Runtime metrics: counters and gauges kept in per-thread shards, so that
+ * the main loop and the node reader threads update them without atomic
+ * read-modify-write nor locks, summed when read. Exported with the latency
+ * histograms of trace.c in the Prometheus text format on a local socket
+ * and through the Metrics1 D-Bus interface.
+ */
+
+/* Entries of METRICS_SESSIONS: enum session_state of msg.c, in order */
+#define METRICS_SESSION_STATES		6
+/* Entries of METRICS_PDUS: one per PDU type */
+#define METRICS_PDU_TYPES		256
+
+enum metrics_id {
+	METRICS_SESSIONS,		/* Gauge, + session state */
+	METRICS_PDUS = METRICS_SESSIONS + METRICS_SESSION_STATES,
+					/* Received from things, + type */
+	METRICS_NODE_RX_BYTES = METRICS_PDUS + METRICS_PDU_TYPES,
+	METRICS_CLOUD_PUBLISHED,
+	METRICS_CLOUD_PUBLISH_FAILED,
+	METRICS_CLOUD_OUTBOX,		/* Gauge: messages waiting publish */
+	METRICS_CLOUD_OUTBOX_DROPPED,	/* Outbox full */
+	METRICS_CLOUD_RECEIVED,
+	METRICS_CLOUD_RECEIVED_DROPPED,	/* Not consumed by the handler */
+	METRICS_AMQP_CONNECTS,
+	METRICS_AMQP_DISCONNECTS,
+	METRICS_MAX
+};
+
+struct settings;
+
+void metrics_add(enum metrics_id id, int64_t delta);
+int64_t metrics_read(enum metrics_id id);
+
+int metrics_start(struct settings *settings);
+void metrics_stop(void);
@@ -41,7 +41,9 @@
 #include <amqp_framing.h>
 #include <amqp_tcp_socket.h>
 
+#include "log.h"
 #include "settings.h"
+#include "metrics.h"
 #include "mq.h"
 
 #define MQ_CONNECTION_TIMEOUT_US 10000
@@ -54,6 +56,9 @@ struct mq_context {
 	mq_connected_cb_t connected_cb;
 	void *connected_data;
 	mq_read_cb_t read_cb;
+	mq_confirm_cb_t confirm_cb;	/* Set: publisher confirms enabled */
+	void *confirm_data;
+	uint64_t publish_seq;		/* Delivery tag of the last publish */
 };
 
 static struct mq_context mq_ctx;
@@ -110,12 +115,44 @@ static char *mq_bytes_to_new_string(amqp_bytes_t data)
 	return str;
 }
 
+/* Publisher confirms arrive as methods instead of deliveries */
+static void consume_method(void)
+{
+	amqp_frame_t frame;
+	amqp_basic_ack_t *ack;
+	amqp_basic_nack_t *nack;
+
+	if (amqp_simple_wait_frame(mq_ctx.conn, &frame) < 0)
+		return;
+
+	if (frame.frame_type != AMQP_FRAME_METHOD)
+		return;
+
+	switch (frame.payload.method.id) {
+	case AMQP_BASIC_ACK_METHOD:
+		ack = frame.payload.method.decoded;
+		if (mq_ctx.confirm_cb)
+			mq_ctx.confirm_cb(ack->delivery_tag, ack->multiple,
+					  true, mq_ctx.confirm_data);
+		break;
+	case AMQP_BASIC_NACK_METHOD:
+		nack = frame.payload.method.decoded;
+		if (mq_ctx.confirm_cb)
+			mq_ctx.confirm_cb(nack->delivery_tag, nack->multiple,
+					  false, mq_ctx.confirm_data);
+		break;
+	default:
+		log_dbg("Unexpected AMQP method 0x%08x",
+			frame.payload.method.id);
+	}
+}
+
 /**
  * Callback function to consume message envelope from AMQP queue.
  *
  * Returns true on success or false if the read callback is not set.
  */
-static bool on_receive(struct l_io *io, void *user_data)
+static bool consume_message(void *user_data)
 {
 	amqp_rpc_reply_t res;
 	amqp_envelope_t envelope;
@@ -128,22 +165,30 @@ static bool on_receive(struct l_io *io, void *user_data)
 
 	res = amqp_consume_message(mq_ctx.conn, &envelope, &time_out, 0);
 
+	if (res.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION &&
+	    res.library_error == AMQP_STATUS_UNEXPECTED_STATE) {
+		consume_method();
+		return true;
+	}
+
 	if (AMQP_RESPONSE_NORMAL != res.reply_type)
 		return true;
 
-	hal_log_dbg("Receive %u, exchange %.*s routingkey %.*s\n",
+	log_event(LOG_EV_CLOUD_RX, envelope.delivery_tag,
+		  envelope.message.body.len);
+	log_dbg("Receive %u, exchange %.*s routingkey %.*s\n",
 			(unsigned)envelope.delivery_tag,
 			(int)envelope.exchange.len,
 			(char *)envelope.exchange.bytes,
 			(int)envelope.routing_key.len,
 			(char *)envelope.routing_key.bytes);
 
-	hal_log_dbg("Body: %.*s\n",
+	log_dbg("Body: %.*s\n",
 			(int)envelope.message.body.len,
 			(char *)envelope.message.body.bytes);
 
 	if (!mq_ctx.read_cb) {
-		hal_log_dbg("AMQP read callback is not set");
+		log_dbg("AMQP read callback is not set");
 		amqp_destroy_envelope(&envelope);
 		return false;
 	}
@@ -153,11 +198,14 @@ static bool on_receive(struct l_io *io, void *user_data)
 	body = mq_bytes_to_new_string(envelope.message.body);
 
 	success = mq_ctx.read_cb(exchange, routing_key, body, user_data);
-	if (!success)
+	metrics_add(METRICS_CLOUD_RECEIVED, 1);
+	if (!success) {
 		/* TODO: Add the msg on the queue again */
-		hal_log_dbg("Message envelope not consumed");
+		log_dbg("Message envelope not consumed");
+		metrics_add(METRICS_CLOUD_RECEIVED_DROPPED, 1);
+	}
 
-	hal_log_dbg("Destroy received envelope");
+	log_dbg("Destroy received envelope");
 	amqp_destroy_envelope(&envelope);
 	l_free(exchange);
 	l_free(routing_key);
@@ -166,25 +214,41 @@ static bool on_receive(struct l_io *io, void *user_data)
 	return true;
 }
 
+static bool on_receive(struct l_io *io, void *user_data)
+{
+	/*
+	 * A read may buffer several frames (e.g. confirms): consume all of
+	 * them, the socket won't be readable again for those.
+	 */
+	do {
+		if (!consume_message(user_data))
+			return false;
+	} while (amqp_frames_enqueued(mq_ctx.conn) ||
+		 amqp_data_in_buffer(mq_ctx.conn));
+
+	return true;
+}
+
 static void on_disconnect(struct l_io *io, void *user_data)
 {
 	amqp_rpc_reply_t r;
 	int err;
 
-	hal_log_info("AMQP broker disconnected");
+	log_info("AMQP broker disconnected");
+	metrics_add(METRICS_AMQP_DISCONNECTS, 1);
 	r = amqp_channel_close(mq_ctx.conn, 1, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		hal_log_error("amqp_channel_close: %s",
+		log_error("amqp_channel_close: %s",
 				mq_rpc_reply_string(r));
 
 	r = amqp_connection_close(mq_ctx.conn, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		hal_log_error("amqp_connection_close: %s",
+		log_error("amqp_connection_close: %s",
 				mq_rpc_reply_string(r));
 
 	err = amqp_destroy_connection(mq_ctx.conn);
 	if (err < 0)
-		hal_log_error("amqp_destroy_connection: %s",
+		log_error("amqp_destroy_connection: %s",
 				amqp_error_string2(err));
 
 	l_io_destroy(mq_ctx.amqp_io);
@@ -205,30 +269,30 @@ static void start_connection(struct l_timeout *ltimeout, void *user_data)
 	struct timeval timeout = { .tv_usec = MQ_CONNECTION_TIMEOUT_US };
 	int status;
 
-	hal_log_dbg("Trying to connect to rabbitmq");
+	log_dbg("Trying to connect to rabbitmq");
 	// This function will change the url after processed
 	status = amqp_parse_url(tmp_url, &cinfo);
 	if (status) {
-		hal_log_error("amqp_parse_url: %s", amqp_error_string2(status));
+		log_error("amqp_parse_url: %s", amqp_error_string2(status));
 		goto done;
 	}
 
 	mq_ctx.conn = amqp_new_connection();
 	if (!mq_ctx.conn) {
-		hal_log_error("amqp_new_connection: Error on creation");
+		log_error("amqp_new_connection: Error on creation");
 		goto done;
 	}
 
 	socket = amqp_tcp_socket_new(mq_ctx.conn);
 	if (!socket) {
-		hal_log_error("error creating tcp socket");
+		log_error("error creating tcp socket");
 		goto destroy_conn;
 	}
 
 	status = amqp_socket_open_noblock(socket, cinfo.host, cinfo.port,
 					  &timeout);
 	if (status < 0) {
-		hal_log_error("error opening socket: %s",
+		log_error("error opening socket: %s",
 					amqp_error_string2(status));
 		goto close_conn;
 	}
@@ -238,30 +302,44 @@ static void start_connection(struct l_timeout *ltimeout, void *user_data)
 		       AMQP_DEFAULT_HEARTBEAT, AMQP_SASL_METHOD_PLAIN,
 		       cinfo.user, cinfo.password);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
-		hal_log_error("amqp_login(): %s", mq_rpc_reply_string(r));
+		log_error("amqp_login(): %s", mq_rpc_reply_string(r));
 		goto close_conn;
 	}
 
-	hal_log_info("Connected to amqp://%s:%s@%s:%d/%s", cinfo.user,
-		     cinfo.password, cinfo.host, cinfo.port, cinfo.vhost);
+	log_info("Connected to amqp://%s:%s@%s:%d/%s", cinfo.user,
+		 cinfo.password, cinfo.host, cinfo.port, cinfo.vhost);
 
 	amqp_channel_open(mq_ctx.conn, 1);
 	r = amqp_get_rpc_reply(mq_ctx.conn);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL) {
-		hal_log_error("amqp_channel_open(): %s",
+		log_error("amqp_channel_open(): %s",
 				mq_rpc_reply_string(r));
 		goto close_conn;
 	}
 
+	if (mq_ctx.confirm_cb) {
+		amqp_confirm_select(mq_ctx.conn, 1);
+		r = amqp_get_rpc_reply(mq_ctx.conn);
+		if (r.reply_type != AMQP_RESPONSE_NORMAL) {
+			log_error("amqp_confirm_select(): %s",
+				  mq_rpc_reply_string(r));
+			goto close_conn;
+		}
+	}
+
+	/* Delivery tags restart on each channel */
+	mq_ctx.publish_seq = 0;
+
 	mq_ctx.amqp_io = l_io_new(amqp_get_sockfd(mq_ctx.conn));
 
 	status = l_io_set_disconnect_handler(mq_ctx.amqp_io, on_disconnect,
 					     NULL, NULL);
 	if (!status) {
-		hal_log_error("Error on set up disconnect handler");
+		log_error("Error on set up disconnect handler");
 		goto io_destroy;
 	}
 
+	metrics_add(METRICS_AMQP_CONNECTS, 1);
 	mq_ctx.connected_cb(mq_ctx.connected_data);
 	goto done;
 
@@ -271,12 +349,12 @@ io_destroy:
 close_conn:
 	r = amqp_connection_close(mq_ctx.conn, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		hal_log_error("amqp_connection_close: %s",
+		log_error("amqp_connection_close: %s",
 				mq_rpc_reply_string(r));
 destroy_conn:
 	status = amqp_destroy_connection(mq_ctx.conn);
 	if (status < 0)
-		hal_log_error("status destroy: %s", amqp_error_string2(status));
+		log_error("status destroy: %s", amqp_error_string2(status));
 
 	mq_ctx.conn = NULL;
 	l_timeout_modify_ms(ltimeout, MQ_CONNECTION_RETRY_TIMEOUT_MS);
@@ -284,9 +362,18 @@ done:
 	l_free(tmp_url);
 }
 
+/**
+ * mq_is_connected:
+ *
+ * Returns: true if the broker connection is up and false otherwise.
+ */
+bool mq_is_connected(void)
+{
+	return mq_ctx.conn != NULL;
+}
+
 /**
  * mq_publish_persistent_message:
- * @queue: queue declared previously
  * @exchange: exchange name
  * @routing_keys: routing key name
  * @headers: array of table entry with headers
@@ -294,13 +381,14 @@ done:
  * @expiration_ms: expiration property in miliseconds or 0 if no expiration time
  * @body: the message to be sent
  *
- * Publishs a persistent message in the exchange and routing key to aqueue bond,
- * so even if there is no consumer listening the message aren't lost.
+ * Publishs a persistent message in the exchange and routing key. The routing
+ * key must have been bound to a queue with mq_bind_queue() on the current
+ * connection, so even if there is no consumer listening the message aren't
+ * lost. No broker round trip is made.
  *
  * Returns: 0 if successfull and negative integer otherwise.
  */
-int8_t mq_publish_persistent_message(amqp_bytes_t queue,
-				       const char *exchange,
+int8_t mq_publish_persistent_message(const char *exchange,
 				       const char *routing_keys,
 				       amqp_table_entry_t *headers,
 				       size_t num_headers,
@@ -308,37 +396,11 @@ int8_t mq_publish_persistent_message(amqp_bytes_t queue,
 				       const char *body)
 {
 	amqp_basic_properties_t props;
-	amqp_rpc_reply_t resp;
 	char *expiration_str;
 	int8_t rc; // Return Code
 
-	/* Declare the exchange as durable */
-	amqp_exchange_declare(mq_ctx.conn, 1,
-			amqp_cstring_bytes(exchange),
-			amqp_cstring_bytes("topic"),
-			0 /* passive*/,
-			1 /* durable */,
-			0 /* auto_delete*/,
-			0 /* internal */,
-			amqp_empty_table);
-	resp = amqp_get_rpc_reply(mq_ctx.conn);
-	if (resp.reply_type != AMQP_RESPONSE_NORMAL) {
-		hal_log_error("amqp_exchange_declare(): %s",
-			      mq_rpc_reply_string(resp));
-		return -1;
-	}
-
-	/* Bind exchange to keep messages */
-	amqp_queue_bind(mq_ctx.conn, 1, queue,
-			amqp_cstring_bytes(exchange),
-			amqp_cstring_bytes(routing_keys),
-			amqp_empty_table);
-
-	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
-			       AMQP_RESPONSE_NORMAL) {
-		hal_log_error("Error while binding queue");
-		return -1;
-	}
+	if (!mq_ctx.conn)
+		return -ENOTCONN;
 
 	props._flags =	AMQP_BASIC_CONTENT_TYPE_FLAG	|
 			AMQP_BASIC_DELIVERY_MODE_FLAG;
@@ -364,8 +426,10 @@ int8_t mq_publish_persistent_message(amqp_bytes_t queue,
 			0 /* immediate */,
 			&props, amqp_cstring_bytes(body));
 	if (rc < 0)
-		hal_log_error("amqp_basic_publish(): %s",
+		log_error("amqp_basic_publish(): %s",
 				amqp_error_string2(rc));
+	else if (mq_ctx.confirm_cb)
+		mq_ctx.publish_seq++;
 
 	if (expiration_ms)
 		l_free(expiration_str);
@@ -401,13 +465,13 @@ amqp_bytes_t mq_declare_new_queue(const char *name)
 
 	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
 			       AMQP_RESPONSE_NORMAL) {
-		hal_log_error("Error declaring queue name");
+		log_error("Error declaring queue name");
 		queue.bytes = NULL;
 	}
 
 	queue = amqp_bytes_malloc_dup(r->queue);
 	if (queue.bytes == NULL)
-		hal_log_error("Out of memory while copying queue buffer");
+		log_error("Out of memory while copying queue buffer");
 
 	return queue;
 }
@@ -426,7 +490,7 @@ int mq_bind_queue(amqp_bytes_t queue,
 			      const char *exchange,
 			      const char *routing_key)
 {
-	if (exchange == NULL || routing_key == NULL)
+	if (!mq_ctx.conn || exchange == NULL || routing_key == NULL)
 		return -1;
 
 	/* Declare the exchange as durable */
@@ -447,7 +511,7 @@ int mq_bind_queue(amqp_bytes_t queue,
 
 	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
 			       AMQP_RESPONSE_NORMAL) {
-		hal_log_error("Error while binding queue");
+		log_error("Error while binding queue");
 		return -1;
 	}
 
@@ -471,7 +535,7 @@ int mq_set_read_cb(amqp_bytes_t queue, mq_read_cb_t on_read, void *user_data)
 	mq_ctx.read_cb = on_read;
 
 	if (!mq_ctx.amqp_io) {
-		hal_log_error("Error amqp service not started");
+		log_error("Error amqp service not started");
 		return -1;
 	}
 
@@ -479,7 +543,7 @@ int mq_set_read_cb(amqp_bytes_t queue, mq_read_cb_t on_read, void *user_data)
 				    user_data, NULL);
 	if (!err) {
 		l_io_destroy(mq_ctx.amqp_io);
-		hal_log_error("Error on set up read handler on AMQP io\n");
+		log_error("Error on set up read handler on AMQP io\n");
 		return -1;
 	}
 
@@ -494,13 +558,47 @@ int mq_set_read_cb(amqp_bytes_t queue, mq_read_cb_t on_read, void *user_data)
 
 	if (amqp_get_rpc_reply(mq_ctx.conn).reply_type !=
 							AMQP_RESPONSE_NORMAL) {
-		hal_log_error("Error while starting consumer");
+		log_error("Error while starting consumer");
 		return -1;
 	}
 
 	return 0;
 }
 
+/**
+ * mq_get_publish_seq:
+ *
+ * Returns: the delivery tag of the last message published on the current
+ * connection, the one later acknowledged through the confirm callback, or 0
+ * if publisher confirms are disabled.
+ */
+uint64_t mq_get_publish_seq(void)
+{
+	return mq_ctx.publish_seq;
+}
+
+/**
+ * mq_set_confirm_cb:
+ * @on_confirm: callback to be called when the broker confirms a publish
+ * @user_data: user data provided to callback
+ *
+ * Enables publisher confirms on the next connections, so it must be called
+ * before mq_start(). Confirmed messages were taken by the broker
+ * (acknowledged) or lost by it (not acknowledged).
+ *
+ * Returns: 0 if successfull and -EALREADY if already connected.
+ */
+int mq_set_confirm_cb(mq_confirm_cb_t on_confirm, void *user_data)
+{
+	if (mq_ctx.conn)
+		return -EALREADY;
+
+	mq_ctx.confirm_cb = on_confirm;
+	mq_ctx.confirm_data = user_data;
+
+	return 0;
+}
+
 int mq_start(struct settings *settings, mq_connected_cb_t on_connected,
 	     void *user_data)
 {
@@ -526,16 +624,16 @@ void mq_stop(void)
 
 	r = amqp_channel_close(mq_ctx.conn, 1, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		hal_log_error("amqp_channel_close: %s",
-			      mq_rpc_reply_string(r));
+		log_error("amqp_channel_close: %s",
+			  mq_rpc_reply_string(r));
 
 	r = amqp_connection_close(mq_ctx.conn, AMQP_REPLY_SUCCESS);
 	if (r.reply_type != AMQP_RESPONSE_NORMAL)
-		hal_log_error("amqp_connection_close: %s",
-			      mq_rpc_reply_string(r));
+		log_error("amqp_connection_close: %s",
+			  mq_rpc_reply_string(r));
 
 	err = amqp_destroy_connection(mq_ctx.conn);
 	if (err < 0)
-		hal_log_error("amqp_destroy_connection: %s",
+		log_error("amqp_destroy_connection: %s",
 				amqp_error_string2(err));
 }
@@ -28,16 +28,21 @@ typedef bool (*mq_read_cb_t) (const char *exchange,
 				   const char *body,
 				   void *user_data);
 typedef void (*mq_connected_cb_t) (void *user_data);
+typedef void (*mq_confirm_cb_t) (uint64_t delivery_tag, bool multiple,
+				 bool ack, void *user_data);
 
 int mq_bind_queue(amqp_bytes_t queue,
 			      const char *exchange,
 			      const char *routing_key);
 amqp_bytes_t mq_declare_new_queue(const char *name);
 int mq_set_read_cb(amqp_bytes_t queue, mq_read_cb_t on_read, void *user_data);
+int mq_set_confirm_cb(mq_confirm_cb_t on_confirm, void *user_data);
+uint64_t mq_get_publish_seq(void);
 int mq_start(struct settings *settings, mq_connected_cb_t connected_cb,
 	     void *user_data);
 void mq_stop(void);
-int8_t mq_publish_persistent_message(amqp_bytes_t queue, const char *exchange,
+bool mq_is_connected(void);
+int8_t mq_publish_persistent_message(const char *exchange,
 				const char *routing_keys,
 				amqp_table_entry_t *headers,
 				size_t num_headers,
@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/socket.h>
 
 #include <ell/ell.h>
@@ -43,65 +44,391 @@
 #include <knot/knot_protocol.h>
 #include <hal/linux_log.h>
 
+#include "log.h"
 #include "settings.h"
+#include "storage.h"
 #include "node.h"
 #include "device.h"
 #include "proxy.h"
+#include "schema.h"
+#include "pdubuf.h"
+#include "timewheel.h"
+#include "telemetry.h"
+#include "credential.h"
+#include "worker.h"
+#include "trace.h"
+#include "metrics.h"
 #include "cloud.h"
 #include "msg.h"
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #define KNOT_ID_LEN		17 /* 16 char + '\0' */
-#define ROLLBACK_TICKS		5 /* Equals to 5*1096ms */
+/* Fresh registration: schema expected within ~6s, unregistered otherwise */
+#define SCHEMA_TIMEOUT_MS	(512 + 5 * 1096)
+#define UNREGISTER_TIMEOUT_MS	1096 /* Waiting the thing to unregister */
+/* Cloud register/auth response: requests expire in the broker after 2s */
+#define CLOUD_TIMEOUT_MS	(4 * 1096)
 #define TIMEOUT_DEVICES_SEC	3 /* Time waiting to request for devices */
+#define SESSION_ID_NONE		INT32_MAX /* Session without device id */
+#define SESSION_TXQ_MAX		128 /* Default PDUs queued to a thing */
+#define ADMISSION_PENDING_MAX	32 /* Cloud auth/register in flight */
+#define ADMISSION_RATE		20 /* Cloud auth/register per second */
+#define ADMISSION_BURST		40
+#define ADMISSION_WAITING_MAX	1024 /* Refused things keeping their turn */
+#define ADMISSION_WAITING_TTL_MS 30000 /* Turn lost if not retried */
+#define ADMISSION_RETRY_MS	1000 /* Deferred cached credential check */
+/* The protocol has no dedicated code: things retry on cloud failure */
+#define ADMISSION_ERR_RETRY	KNOT_ERR_CLOUD_FAILURE
+
+enum txq_drop_policy {
+	TXQ_DROP_OLDEST,
+	TXQ_DROP_NEWEST,
+	TXQ_DROP_COALESCE,	/* Replace queued data of the same sensor */
+};
+
+/*
+ * Session lifecycle. SCHEMA and READY are trusted (authenticated) states.
+ *
+ * NEW --register--> REGISTERING --cloud auth--> SCHEMA --cloud schema--> READY
+ * NEW --auth--> AUTHENTICATING --cloud auth--> READY --schema--> SCHEMA
+ * NEW --auth, cached credential--> READY (the cloud revalidates it later)
+ * any --unregister request--> UNREGISTERING --response/timeout--> NEW
+ */
+enum session_state {
+	SESSION_NEW,
+	SESSION_REGISTERING,		/* Waiting cloud register and auth */
+	SESSION_AUTHENTICATING,		/* Waiting cloud auth */
+	SESSION_SCHEMA,			/* Receiving or sending schema */
+	SESSION_READY,
+	SESSION_UNREGISTERING,		/* Waiting the thing response */
+	SESSION_ANY,			/* Transition table wildcard */
+};
+
+enum session_event {
+	SESSION_EV_REGISTER,		/* Thing register request sent */
+	SESSION_EV_AUTH,		/* Thing auth request sent */
+	SESSION_EV_AUTH_OK,		/* Cloud authenticated the thing */
+	SESSION_EV_AUTH_CACHED,		/* Credential cache hit */
+	SESSION_EV_SCHEMA,		/* Schema fragment from the thing */
+	SESSION_EV_SCHEMA_OK,		/* Cloud schema response */
+	SESSION_EV_UNREGISTER,		/* Unregister request to the thing */
+	SESSION_EV_RESET,		/* Unregistered or failed */
+};
+
+enum session_deadline {
+	DEADLINE_STOP,
+	DEADLINE_START,			/* Arm the timeout of the new state */
+	DEADLINE_EXTEND,		/* Restart it if running */
+};
 
 struct session {
 	int refs;
 	struct cloud_device *device;	/* Associated cloud device */
-	bool trusted;			/* Authenticated */
-	bool device_requesting_auth;	/* Device is requesting auth message */
+	enum session_state state;
+	struct timewheel_timer deadline; /* State timeout */
 	struct node_ops *node_ops;
 	struct l_io *node_channel;	/* Radio event source */
+	struct pdubuf *rxbuf;		/* Partial PDU from stream transports */
+	struct l_queue *txq;		/* PDUs to the thing: one per pdubuf */
+	bool txq_scheduled;		/* Flush at the end of the iteration */
+	bool txq_waiting;		/* Flush when the socket is writable */
+	bool txq_paused;		/* Above high watermark: stop reading */
+	uint64_t txq_dropped;
 	int node_fd;			/* Unix socket */
+	uint32_t serial;		/* Tells reused node_fd apart */
+	bool worker;			/* Read by a worker thread */
 	uint64_t id;			/* Device identification */
-	int rollback;			/* Counter: remove if schema is not received */
 	char *uuid;			/* Device UUID */
 	char *token;			/* Device token */
-	struct l_queue *schema_list;	/* Schema accepted by cloud */
-	struct l_timeout *schema_timeout; /* Active when wait schema */
+	bool admitted;			/* Holds an admission slot */
+	bool revalidating;		/* Trusted from cache: cloud auth sent */
+	struct timewheel_timer revalidate; /* Admission retry or response */
+	struct schema *schema;		/* Schema accepted by cloud */
+	uint64_t schema_hash;		/* Content hash of 'schema' */
+	struct schema *schema_rx;	/* Fragments sent by the thing */
+	struct l_hashmap *sensors;	/* sensor_id to telemetry state */
+};
+
+static void session_register_expired(struct session *session);
+static void session_auth_expired(struct session *session);
+static void session_schema_expired(struct session *session);
+static void session_unregister_expired(struct session *session);
+static void session_revalidate_cb(struct timewheel_timer *timer,
+				  void *user_data);
+
+static const struct {
+	const char *name;
+	unsigned int timeout_ms;
+	void (*expired) (struct session *session);
+} session_states[] = {
+	[SESSION_NEW] =			{ "NEW", 0, NULL },
+	[SESSION_REGISTERING] =		{ "REGISTERING", CLOUD_TIMEOUT_MS,
+					  session_register_expired },
+	[SESSION_AUTHENTICATING] =	{ "AUTHENTICATING", CLOUD_TIMEOUT_MS,
+					  session_auth_expired },
+	[SESSION_SCHEMA] =		{ "SCHEMA", SCHEMA_TIMEOUT_MS,
+					  session_schema_expired },
+	[SESSION_READY] =		{ "READY", 0, NULL },
+	[SESSION_UNREGISTERING] =	{ "UNREGISTERING",
+					  UNREGISTER_TIMEOUT_MS,
+					  session_unregister_expired },
+};
+
+_Static_assert(SESSION_ANY == METRICS_SESSION_STATES,
+	       "metrics.h doesn't match the session states");
+
+/* First match wins: specific states before SESSION_ANY */
+static const struct {
+	enum session_state state;
+	enum session_event event;
+	enum session_state next;
+	enum session_deadline deadline;
+} session_transitions[] = {
+	/* Fresh registration: rolled back if the schema doesn't come */
+	{ SESSION_REGISTERING, SESSION_EV_AUTH_OK,
+	  SESSION_SCHEMA, DEADLINE_START },
+	{ SESSION_AUTHENTICATING, SESSION_EV_AUTH_OK,
+	  SESSION_READY, DEADLINE_STOP },
+	{ SESSION_READY, SESSION_EV_SCHEMA,
+	  SESSION_SCHEMA, DEADLINE_STOP },
+	{ SESSION_SCHEMA, SESSION_EV_SCHEMA,
+	  SESSION_SCHEMA, DEADLINE_EXTEND },
+	{ SESSION_SCHEMA, SESSION_EV_SCHEMA_OK,
+	  SESSION_READY, DEADLINE_STOP },
+	/* Lost cloud responses must not hold an admission slot forever */
+	{ SESSION_ANY, SESSION_EV_REGISTER,
+	  SESSION_REGISTERING, DEADLINE_START },
+	{ SESSION_ANY, SESSION_EV_AUTH,
+	  SESSION_AUTHENTICATING, DEADLINE_START },
+	{ SESSION_ANY, SESSION_EV_AUTH_CACHED,
+	  SESSION_READY, DEADLINE_STOP },
+	{ SESSION_ANY, SESSION_EV_UNREGISTER,
+	  SESSION_UNREGISTERING, DEADLINE_START },
+	{ SESSION_ANY, SESSION_EV_RESET,
+	  SESSION_NEW, DEADLINE_STOP },
 };
 
 static struct l_queue *session_list;
-static struct l_queue *registered_devices;
-static struct l_timeout *list_timeout;
+/* Session indexes: device id (uint64_t), UUID and node fd */
+static struct l_hashmap *session_id_map;
+static struct l_hashmap *session_uuid_map;
+static struct l_hashmap *session_fd_map;
+/* Cloud registered devices: owned by id, indexed by uuid */
+static struct l_hashmap *registered_devices;
+static struct l_hashmap *registered_uuids;
+static struct timewheel_timer list_timer;
+static uint32_t session_serial;
 static bool proxy_enabled = false;
 static bool node_enabled;
 
+/* Output queue limits, from the [Node] group of the configuration file */
+static struct {
+	unsigned int max_len;
+	unsigned int high_watermark;
+	unsigned int low_watermark;
+	enum txq_drop_policy policy;
+} txq_conf = {
+	.max_len = SESSION_TXQ_MAX,
+	.high_watermark = SESSION_TXQ_MAX * 3 / 4,
+	.low_watermark = SESSION_TXQ_MAX / 4,
+	.policy = TXQ_DROP_COALESCE,
+};
+
+/* Refused thing: UUID (auth) or device id (register) */
+struct admission_waiter {
+	char *key;
+	uint64_t since_ms;		/* First refused attempt */
+	uint64_t seen_ms;		/* Last attempt */
+};
+
+/*
+ * Admission control of the cloud auth and register requests, so that a
+ * reconnection storm doesn't pile up on the broker: a token bucket limits
+ * the rate and at most 'max_pending' requests wait a cloud response.
+ */
+static struct {
+	unsigned int max_pending;
+	unsigned int rate;
+	unsigned int burst;
+	unsigned int pending;
+	double tokens;
+	uint64_t refill_ms;
+	struct l_queue *waiting;	/* Refused things, longest waiting first */
+} admission = {
+	.max_pending = ADMISSION_PENDING_MAX,
+	.rate = ADMISSION_RATE,
+	.burst = ADMISSION_BURST,
+	.tokens = ADMISSION_BURST,
+};
+
+static bool session_node_data_cb(struct l_io *channel, void *user_data);
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void admission_waiter_free(void *data)
+{
+	struct admission_waiter *waiter = data;
+
+	l_free(waiter->key);
+	l_free(waiter);
+}
+
+static bool admission_waiter_match(const void *a, const void *b)
+{
+	const struct admission_waiter *waiter = a;
+
+	return strcmp(waiter->key, b) == 0;
+}
+
+/* Things that gave up don't keep their turn */
+static bool admission_waiter_expired(void *data, void *user_data)
+{
+	struct admission_waiter *waiter = data;
+	uint64_t *now = user_data;
+
+	if (*now - waiter->seen_ms < ADMISSION_WAITING_TTL_MS)
+		return false;
+
+	admission_waiter_free(waiter);
+	return true;
+}
+
+static unsigned int admission_available(uint64_t now)
+{
+	admission.tokens += (double) (now - admission.refill_ms) *
+						admission.rate / 1000;
+	if (admission.tokens > admission.burst)
+		admission.tokens = admission.burst;
+	admission.refill_ms = now;
+
+	if (admission.pending >= admission.max_pending)
+		return 0;
+
+	if (admission.tokens < admission.max_pending - admission.pending)
+		return admission.tokens;
+
+	return admission.max_pending - admission.pending;
+}
+
+/*
+ * Returns true if @session may send a cloud request on behalf of the thing
+ * identified by @key. Free slots go to the things refused first: a thing
+ * is admitted only if fewer refused things have waited longer than it
+ * than slots are available. The slot is held until session_release().
+ */
+static bool session_admit(struct session *session, const char *key)
+{
+	const struct l_queue_entry *entry;
+	struct admission_waiter *waiter = NULL;
+	unsigned int available;
+	unsigned int ahead = 0;
+	uint64_t now = now_ms();
+
+	if (session->admitted)
+		return true;
+
+	l_queue_foreach_remove(admission.waiting, admission_waiter_expired,
+			       &now);
+
+	available = admission_available(now);
+
+	for (entry = l_queue_get_entries(admission.waiting); entry;
+	     entry = entry->next, ahead++) {
+		if (admission_waiter_match(entry->data, key)) {
+			waiter = entry->data;
+			break;
+		}
+	}
+
+	if (ahead < available) {
+		if (waiter) {
+			log_info("[session %p] Admitted after %"PRIu64" ms",
+				 session, now - waiter->since_ms);
+			l_queue_remove(admission.waiting, waiter);
+			admission_waiter_free(waiter);
+		}
+
+		admission.tokens -= 1;
+		admission.pending++;
+		session->admitted = true;
+		return true;
+	}
+
+	log_info("[session %p] Not admitted: %u pending, %u waiting",
+		 session, admission.pending,
+		 l_queue_length(admission.waiting));
+
+	if (waiter) {
+		waiter->seen_ms = now;
+	} else if (l_queue_length(admission.waiting) < ADMISSION_WAITING_MAX) {
+		waiter = l_new(struct admission_waiter, 1);
+		waiter->key = l_strdup(key);
+		waiter->since_ms = now;
+		waiter->seen_ms = now;
+		l_queue_push_tail(admission.waiting, waiter);
+	}
+
+	return false;
+}
+
+/* Cloud response received or request abandoned */
+static void session_release(struct session *session)
+{
+	if (!session->admitted)
+		return;
+
+	session->admitted = false;
+	admission.pending--;
+}
+
 static struct session *session_ref(struct session *session)
 {
 	if (unlikely(!session))
 		return NULL;
 
-	__sync_fetch_and_add(&session->refs, 1);
-	hal_log_info("session_ref(%p): %d", session, session->refs);
+	log_event(LOG_EV_SESSION_REF, (uintptr_t) session,
+		  __sync_add_and_fetch(&session->refs, 1));
 
 	return session;
 }
 
+static void session_deadline_cb(struct timewheel_timer *timer,
+				void *user_data)
+{
+	struct session *session = user_data;
+
+	log_info("[session %p] %s: timeout", session,
+		 session_states[session->state].name);
+
+	if (session_states[session->state].expired)
+		session_states[session->state].expired(session);
+}
+
 static struct session *session_new(struct node_ops *node_ops)
 {
 	struct session *session;
 
 	session = l_new(struct session, 1);
 	session->device = NULL;
-	session->trusted = false;
-	session->device_requesting_auth = false;
+	session->state = SESSION_NEW;
+	timewheel_timer_init(&session->deadline, session_deadline_cb, session);
+	timewheel_timer_init(&session->revalidate, session_revalidate_cb,
+			     session);
 	session->refs = 0;
 	session->uuid = NULL;
 	session->token = NULL;
-	session->id = INT32_MAX;
+	session->id = SESSION_ID_NONE;
 	session->node_ops = node_ops;
-	session->schema_list = l_queue_new();
+	session->txq = l_queue_new();
+
+	metrics_add(METRICS_SESSIONS + SESSION_NEW, 1);
 
 	return session_ref(session);
 }
@@ -111,12 +438,23 @@ static void session_destroy(struct session *session)
 	if (unlikely(!session))
 		return;
 
+	if (session->worker)
+		worker_remove(session->node_fd);
 	l_io_destroy(session->node_channel);
+	pdubuf_put(session->rxbuf);
+	l_queue_destroy(session->txq, (l_queue_destroy_func_t) pdubuf_put);
 
 	l_free(session->uuid);
 	l_free(session->token);
-	l_queue_destroy(session->schema_list, l_free);
-	l_timeout_remove(session->schema_timeout);
+	schema_unref(session->schema);
+	schema_unref(session->schema_rx);
+	l_hashmap_destroy(session->sensors,
+			  (l_hashmap_destroy_func_t) telemetry_sensor_free);
+	timewheel_timer_cancel(&session->deadline);
+	timewheel_timer_cancel(&session->revalidate);
+	session_release(session);
+
+	metrics_add(METRICS_SESSIONS + session->state, -1);
 
 	l_free(session);
 }
@@ -126,35 +464,272 @@ static void session_unref(struct session *session)
 	if (unlikely(!session))
 		return;
 
-	hal_log_info("session_unref(%p): %d", session, session->refs - 1);
+	log_event(LOG_EV_SESSION_UNREF, (uintptr_t) session,
+		  session->refs - 1);
 	if (__sync_sub_and_fetch(&session->refs, 1))
 		return;
 
 	session_destroy(session);
 }
 
+/* Exposed as the QueueDepth and QueueDropped D-Bus device properties */
+static void session_txq_update_stats(struct session *session)
+{
+	struct knot_device *device;
+	char id[KNOT_ID_LEN];
+
+	if (session->id == SESSION_ID_NONE)
+		return;
+
+	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
+	device = device_get(id);
+	if (device)
+		device_set_queue_stats(device, l_queue_length(session->txq),
+				       session->txq_dropped);
+}
+
+/*
+ * Back-pressure: a thing that doesn't drain its output queue isn't read
+ * until the queue goes below the low watermark. Commands from the cloud
+ * are still queued and subject to the drop policy.
+ */
+static void session_set_reading(struct session *session, bool reading)
+{
+	if (session->worker)
+		worker_set_reading(session->node_fd, reading);
+	else if (reading)
+		l_io_set_read_handler(session->node_channel,
+				      session_node_data_cb, session, NULL);
+	else
+		l_io_set_read_handler(session->node_channel, NULL, NULL, NULL);
+}
+
+static void session_txq_watermark(struct session *session)
+{
+	unsigned int len = l_queue_length(session->txq);
+
+	if (!session->txq_paused && len >= txq_conf.high_watermark) {
+		log_info("[session %p] output queue high (%u): paused",
+			 session, len);
+		session->txq_paused = true;
+		session_set_reading(session, false);
+	} else if (session->txq_paused && len <= txq_conf.low_watermark) {
+		log_info("[session %p] output queue low (%u): resumed",
+			 session, len);
+		session->txq_paused = false;
+		session_set_reading(session, true);
+	}
+}
+
+/*
+ * Sends the queued PDUs with one system call. Returns true if PDUs remain
+ * queued and the socket has to become writable again.
+ */
+static bool session_txq_flush(struct session *session)
+{
+	struct node_ops *node_ops = session->node_ops;
+	const struct l_queue_entry *entry;
+	struct iovec iov[NODE_SENDV_MAX];
+	struct pdubuf *buf;
+	ssize_t sent;
+	size_t len;
+	int iovcnt = 0;
+
+	if (session->node_fd < 0) {
+		l_queue_clear(session->txq, (l_queue_destroy_func_t) pdubuf_put);
+		return false;
+	}
+
+	for (entry = l_queue_get_entries(session->txq);
+	     entry && iovcnt < NODE_SENDV_MAX; entry = entry->next) {
+		buf = entry->data;
+		iov[iovcnt].iov_base = buf->data + buf->head;
+		iov[iovcnt].iov_len = buf->tail - buf->head;
+		iovcnt++;
+	}
+
+	if (!iovcnt)
+		return false;
+
+	sent = node_ops->sendv(session->node_fd, iov, iovcnt);
+	if (sent == -EAGAIN || sent == -EWOULDBLOCK)
+		return true;
+
+	if (sent < 0) {
+		/* Broken connection: the disconnect handler cleans up */
+		log_error("[session %p] Can't send downstream data: %s(%d)",
+			  session, strerror(-sent), (int) -sent);
+		session->txq_dropped += l_queue_length(session->txq);
+		l_queue_clear(session->txq, (l_queue_destroy_func_t) pdubuf_put);
+		session_txq_watermark(session);
+		session_txq_update_stats(session);
+		return false;
+	}
+
+	log_event(LOG_EV_PDU_TX, (uintptr_t) session, sent);
+	log_dbg("[session %p] Sent %zd %s downstream fd(%d)", session,
+		sent, node_ops->framing == NODE_FRAMING_STREAM ?
+		"octets" : "PDUs", session->node_fd);
+
+	/* Release what was sent: PDU count or octets, stream may be partial */
+	while (sent > 0 && (buf = l_queue_peek_head(session->txq))) {
+		len = buf->tail - buf->head;
+		if (node_ops->framing == NODE_FRAMING_STREAM &&
+		    (size_t) sent < len) {
+			buf->head += sent;
+			break;
+		}
+
+		sent -= node_ops->framing == NODE_FRAMING_STREAM ? len : 1;
+		pdubuf_put(l_queue_pop_head(session->txq));
+	}
+
+	session_txq_watermark(session);
+	session_txq_update_stats(session);
+
+	return !l_queue_isempty(session->txq);
+}
+
+static bool session_node_write_cb(struct l_io *channel, void *user_data)
+{
+	struct session *session = user_data;
+
+	session->txq_waiting = session_txq_flush(session);
+
+	return session->txq_waiting;
+}
+
+static void session_txq_idle_cb(void *user_data)
+{
+	struct session *session = user_data;
+
+	session->txq_scheduled = false;
+	if (session->txq_waiting || !session_txq_flush(session))
+		return;
+
+	session->txq_waiting = true;
+	l_io_set_write_handler(session->node_channel, session_node_write_cb,
+			       session, NULL);
+}
+
+/* Data sent to a sensor: PDU header followed by the sensor id */
+static bool pdu_is_sensor_data(const void *pdu, size_t len)
+{
+	const knot_msg_header *hdr = pdu;
+
+	return len > sizeof(*hdr) && (hdr->type == KNOT_MSG_PUSH_DATA_REQ ||
+				      hdr->type == KNOT_MSG_POLL_DATA_REQ);
+}
+
+static bool txq_match_sensor(const void *data, const void *user_data)
+{
+	const struct pdubuf *buf = data;
+	const uint8_t *pdu = user_data;
+
+	/* Partially sent PDUs can't be replaced */
+	return buf->head == 0 && pdu_is_sensor_data(buf->data, buf->tail) &&
+		memcmp(buf->data, pdu, sizeof(knot_msg_header)) == 0 &&
+		buf->data[sizeof(knot_msg_header)] ==
+					pdu[sizeof(knot_msg_header)];
+}
+
+static bool txq_match_unsent(const void *data, const void *user_data)
+{
+	const struct pdubuf *buf = data;
+
+	return buf->head == 0;
+}
+
+/* Returns the buffer to store the PDU in, or NULL to drop it */
+static struct pdubuf *session_txq_slot(struct session *session,
+				       const void *pdu, size_t len)
+{
+	struct pdubuf *buf;
+
+	/* Last value wins: a newer command supersedes the queued one */
+	if (txq_conf.policy == TXQ_DROP_COALESCE &&
+	    pdu_is_sensor_data(pdu, len)) {
+		buf = l_queue_find(session->txq, txq_match_sensor, pdu);
+		if (buf) {
+			session->txq_dropped++;
+			return buf;
+		}
+	}
+
+	if (l_queue_length(session->txq) < txq_conf.max_len) {
+		buf = pdubuf_get();
+		l_queue_push_tail(session->txq, buf);
+		return buf;
+	}
+
+	session->txq_dropped++;
+
+	if (txq_conf.policy != TXQ_DROP_OLDEST)
+		return NULL;
+
+	buf = l_queue_remove_if(session->txq, txq_match_unsent, NULL);
+	if (!buf)
+		return NULL;
+
+	l_queue_push_tail(session->txq, buf);
+
+	return buf;
+}
+
+/*
+ * Queues a PDU to the thing: all the PDUs queued during one main loop
+ * iteration are sent together once the iteration is over. When the queue
+ * is full the configured drop policy applies.
+ */
+static ssize_t session_send(struct session *session, const void *pdu,
+			    size_t len)
+{
+	struct pdubuf *buf;
+
+	if (len > sizeof(buf->data))
+		return -EMSGSIZE;
+
+	buf = session_txq_slot(session, pdu, len);
+	if (!buf) {
+		log_error("[session %p] output queue full: PDU dropped",
+			  session);
+		session_txq_update_stats(session);
+		return -ENOBUFS;
+	}
+
+	memcpy(buf->data, pdu, len);
+	buf->head = 0;
+	buf->tail = len;
+
+	session_txq_watermark(session);
+
+	if (session->txq_scheduled || session->txq_waiting)
+		return len;
+
+	if (!l_idle_oneshot(session_txq_idle_cb, session_ref(session),
+			    (l_idle_destroy_cb_t) session_unref)) {
+		session_unref(session);
+		return -EIO;
+	}
+
+	session->txq_scheduled = true;
+
+	return len;
+}
+
 static void cloud_device_free(void *data)
 {
 	struct cloud_device *mydevice = data;
 	if (unlikely(!mydevice))
 		return;
 
-	l_queue_destroy(mydevice->schema, l_free);
+	schema_unref(mydevice->schema);
 	l_free(mydevice->id);
 	l_free(mydevice->uuid);
 	l_free(mydevice->name);
-	l_timeout_remove(mydevice->unreg_timeout);
 	l_free(mydevice);
 }
 
-static void schema_dup_foreach(void *data, void *user_data)
-{
-	struct l_queue *schema = user_data;
-	knot_msg_schema *msg = data;
-
-	l_queue_push_tail(schema, l_memdup(msg, sizeof(*msg)));
-}
-
 static struct cloud_device *mydevice_dup(const struct cloud_device *mydevice)
 {
 	struct cloud_device *mydevice_dup;
@@ -163,73 +738,205 @@ static struct cloud_device *mydevice_dup(const struct cloud_device *mydevice)
 	mydevice_dup->id = l_strdup(mydevice->id);
 	mydevice_dup->uuid = l_strdup(mydevice->uuid);
 	mydevice_dup->name = l_strdup(mydevice->name);
-	mydevice_dup->schema = l_queue_new();
-
-	l_queue_foreach(mydevice->schema, schema_dup_foreach,
-			mydevice_dup->schema);
+	mydevice_dup->schema = schema_ref(mydevice->schema);
 
 	return mydevice_dup;
 }
 
-static bool device_id_cmp(const void *a, const void *b)
+/* Takes @schema (interned) as the one accepted by the cloud */
+static void session_set_schema(struct session *session,
+			       struct schema *schema)
+{
+	schema_unref(session->schema);
+	session->schema = schema;
+	session->schema_hash = schema_hash(schema);
+}
+
+static struct cloud_device *registered_device_find(const char *id)
+{
+	return l_hashmap_lookup(registered_devices, id);
+}
+
+static void registered_device_add(struct cloud_device *mydevice)
 {
-	const struct cloud_device *val1 = a;
-	const char *id = b;
+	l_hashmap_insert(registered_devices, mydevice->id, mydevice);
+	l_hashmap_insert(registered_uuids, mydevice->uuid, mydevice);
+}
+
+static struct cloud_device *registered_device_remove(const char *id)
+{
+	struct cloud_device *mydevice;
 
-	return strcmp(val1->id, id) == 0 ? true : false;
+	mydevice = l_hashmap_remove(registered_devices, id);
+	if (mydevice &&
+	    l_hashmap_lookup(registered_uuids, mydevice->uuid) == mydevice)
+		l_hashmap_remove(registered_uuids, mydevice->uuid);
+
+	return mydevice;
 }
 
-static bool device_uuid_cmp(const void *a, const void *b)
+static unsigned int session_id_hash(const void *p)
 {
-	const struct cloud_device *mydevice = a;
-	const char *uuid = b;
-	return strcmp(mydevice->uuid, uuid) == 0 ? true: false;
+	uint64_t id;
+
+	memcpy(&id, p, sizeof(id));
+
+	return (unsigned int) (id ^ (id >> 32));
 }
 
-static bool schema_sensor_id_cmp(const void *entry_data, const void *user_data)
+static int session_id_compare(const void *a, const void *b)
 {
-	const knot_msg_schema *schema = entry_data;
-	unsigned int sensor_id = L_PTR_TO_UINT(user_data);
+	uint64_t id1, id2;
+
+	memcpy(&id1, a, sizeof(id1));
+	memcpy(&id2, b, sizeof(id2));
 
-	return sensor_id == schema->sensor_id;
+	return id1 < id2 ? -1 : id1 > id2;
 }
 
-static knot_msg_schema *schema_find(struct l_queue *schema,
-						unsigned int sensor_id)
+static void *session_id_copy(const void *p)
 {
-	return l_queue_find(schema,
-			    schema_sensor_id_cmp,
-			    L_UINT_TO_PTR(sensor_id));
+	return l_memdup(p, sizeof(uint64_t));
 }
 
-static bool session_node_fd_cmp(const void *entry_data, const void *user_data)
+/* Device ids are sent to the cloud as 16 lowercase hex digits */
+static bool device_id_parse(const char *str, uint64_t *id)
 {
-	const struct session *session = entry_data;
-	int node_fd = L_PTR_TO_INT(user_data);
+	if (!str || strlen(str) != KNOT_ID_LEN - 1 ||
+	    strspn(str, "0123456789abcdef") != KNOT_ID_LEN - 1)
+		return false;
 
-	return session->node_fd == node_fd;
+	*id = strtoull(str, NULL, 16);
+
+	return true;
 }
 
-static bool session_id_cmp(const void *entry_data, const void *user_data)
+static void session_index_remove(struct l_hashmap *map, const void *key,
+				 const struct session *session)
 {
-	const struct session *session = entry_data;
-	char id[KNOT_ID_LEN];
-	const char *device_id = user_data;
+	/* Another session may have taken over the key */
+	if (l_hashmap_lookup(map, key) == session)
+		l_hashmap_remove(map, key);
+}
 
-	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
+static void session_index_add(struct l_hashmap *map, const void *key,
+			      struct session *session)
+{
+	l_hashmap_remove(map, key);
+	l_hashmap_insert(map, key, session);
+}
 
-	return !strcmp(id, device_id);
+/* Telemetry state is bound to the device id and schema */
+static void session_reset_sensors(struct session *session)
+{
+	l_hashmap_destroy(session->sensors,
+			  (l_hashmap_destroy_func_t) telemetry_sensor_free);
+	session->sensors = NULL;
 }
 
-static bool session_uuid_cmp(const void *entry_data, const void *user_data)
+static void session_set_id(struct session *session, uint64_t id)
 {
-	const struct session *session = entry_data;
-	const char *uuid = user_data;
+	session_reset_sensors(session);
+
+	if (session->id != SESSION_ID_NONE)
+		session_index_remove(session_id_map, &session->id, session);
+
+	session->id = id;
+
+	if (id != SESSION_ID_NONE)
+		session_index_add(session_id_map, &id, session);
+}
 
-	if (!session->uuid)
+static void session_set_uuid(struct session *session, const char *uuid)
+{
+	if (session->uuid) {
+		session_index_remove(session_uuid_map, session->uuid, session);
+		l_free(session->uuid);
+	}
+
+	session->uuid = l_strdup(uuid);
+
+	if (uuid)
+		session_index_add(session_uuid_map, uuid, session);
+}
+
+static bool session_is_trusted(const struct session *session)
+{
+	return session->state == SESSION_SCHEMA ||
+		session->state == SESSION_READY;
+}
+
+static bool session_fsm_event(struct session *session,
+			      enum session_event event)
+{
+	enum session_state state = session->state;
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(session_transitions); i++) {
+		if (session_transitions[i].event != event)
+			continue;
+
+		if (session_transitions[i].state == state ||
+		    session_transitions[i].state == SESSION_ANY)
+			break;
+	}
+
+	if (i == L_ARRAY_SIZE(session_transitions)) {
+		log_error("[session %p] %s: unexpected event %d", session,
+			  session_states[state].name, event);
 		return false;
+	}
+
+	session->state = session_transitions[i].next;
+	metrics_add(METRICS_SESSIONS + state, -1);
+	metrics_add(METRICS_SESSIONS + session->state, 1);
+	log_event(LOG_EV_SESSION_STATE, (uintptr_t) session,
+		  state << 8 | session->state);
+	log_info("[session %p] %s -> %s", session,
+		 session_states[state].name,
+		 session_states[session->state].name);
+
+	switch (session_transitions[i].deadline) {
+	case DEADLINE_START:
+		timewheel_timer_add(&session->deadline,
+				    session_states[session->state].timeout_ms);
+		break;
+	case DEADLINE_EXTEND:
+		if (timewheel_timer_pending(&session->deadline))
+			timewheel_timer_add(&session->deadline,
+				    session_states[session->state].timeout_ms);
+		break;
+	case DEADLINE_STOP:
+		timewheel_timer_cancel(&session->deadline);
+		break;
+	}
+
+	return true;
+}
+
+/* Drops the thing identity and credentials: back to NEW */
+static void session_reset(struct session *session)
+{
+	session_set_uuid(session, NULL);
+	l_free(session->token);
+	session->token = NULL;
+	session_set_id(session, SESSION_ID_NONE);
+	session->revalidating = false;
+	timewheel_timer_cancel(&session->revalidate);
+	schema_unref(session->schema_rx);
+	session->schema_rx = NULL;
+	session_release(session);
+	session_fsm_event(session, SESSION_EV_RESET);
+}
+
+static struct session *session_lookup_id(const char *device_id)
+{
+	uint64_t id;
+
+	if (!device_id_parse(device_id, &id))
+		return NULL;
 
-	return strcmp(session->uuid, uuid) == 0 ? true : false;
+	return l_hashmap_lookup(session_id_map, &id);
 }
 
 static bool msg_register_has_valid_length(const knot_msg_register *kreq,
@@ -284,7 +991,7 @@ static int8_t msg_register(struct session *session,
 
 	if (!msg_register_has_valid_length(kreq, ilen)
 		|| !msg_register_has_valid_device_name(kreq)) {
-		hal_log_error("[session %p] Missing device name!", session);
+		log_error("[session %p] Missing device name!", session);
 		return KNOT_ERR_INVALID;
 	}
 
@@ -293,11 +1000,11 @@ static int8_t msg_register(struct session *session,
 	 * if response does not arrives in 20 seconds. If this device was
 	 * previously added we just send the uuid/token again.
 	 */
-	hal_log_info("[session %p] Registering (id 0x%016" PRIx64 ")",
-		     session, kreq->id);
+	log_info("[session %p] Registering (id 0x%016" PRIx64 ")",
+		 session, kreq->id);
 
-	if (session->trusted && kreq->id == session->id) {
-		hal_log_info("[session %p] Register: trusted device", session);
+	if (session_is_trusted(session) && kreq->id == session->id) {
+		log_info("[session %p] Register: trusted device", session);
 		msg_credential_create(krsp, session->uuid, session->token);
 		return 0;
 	}
@@ -307,16 +1014,21 @@ static int8_t msg_register(struct session *session,
 	memset(token, 0, sizeof(token));
 	snprintf(id, sizeof(id), "%016"PRIx64, kreq->id);
 
-	if (l_queue_find(registered_devices, device_id_cmp, id)) {
-		hal_log_info("[session %p] A different device is already \
-			     registered with this ID: %s", session, id);
+	if (registered_device_find(id)) {
+		log_info("[session %p] A different device is already \
+			 registered with this ID: %s", session, id);
 
 		return KNOT_ERR_CLOUD_FAILURE;
 	}
 
+	if (!session_admit(session, id))
+		return ADMISSION_ERR_RETRY;
+
 	result = cloud_register_device(id, device_name);
-	if (result != 0)
+	if (result != 0) {
+		session_release(session);
 		return result;
+	}
 
 	if (session->device)
 		goto done;
@@ -331,12 +1043,11 @@ static int8_t msg_register(struct session *session,
 	device_pending->uuid = l_strdup(id);
 	device_pending->name = l_strdup(device_name);
 	device_pending->online = false;
-	device_pending->schema = l_queue_new();
 
 	session->device = device_pending;
 done:
-	session->id = kreq->id;
-	session->rollback = 1; /* Initial counter value */
+	session_set_id(session, kreq->id);
+	session_fsm_event(session, SESSION_EV_REGISTER);
 
 	return 0;
 }
@@ -346,61 +1057,48 @@ static int8_t msg_unregister(struct session *session)
 	int8_t result;
 	char id[KNOT_ID_LEN];
 
-	if (!session->trusted) {
-		hal_log_info("[session %p] unregister: Permission denied!",
-			     session);
+	if (!session_is_trusted(session)) {
+		log_info("[session %p] unregister: Permission denied!",
+			 session);
 		return KNOT_ERR_PERM;
 	}
 
 	snprintf(id, sizeof(id), "%016"PRIX64, session->id);
-	hal_log_info("[session %p] rmnode: %s", session, id);
+	log_info("[session %p] rmnode: %s", session, id);
 
 	result = cloud_unregister_device(id);
 	if (result != 0)
 		return result;
 
-	l_timeout_remove(session->schema_timeout);
-	session->schema_timeout = NULL;
-
-	l_free(session->uuid);
-	session->uuid = NULL;
-	l_free(session->token);
-	session->token = NULL;
-	session->trusted = false;
-	session->id = INT32_MAX;
+	session_reset(session);
 
 	return 0;
 }
 
-static bool msg_unregister_req(void *user_data)
+/* Asks the thing to unregister: forgotten on response or timeout */
+static bool msg_unregister_req(struct session *session)
 {
 	knot_msg_unregister kmunreg;
-	struct session *session;
-	struct node_ops *node_ops;
-	struct cloud_device *mydevice = user_data;
 	ssize_t olen, osent;
 	void *opdu;
 	int err = 0;
 
-	session = l_queue_find(session_list, session_uuid_cmp, mydevice->uuid);
-	if (!session)
-		return false;
-
-	node_ops = session->node_ops;
-
 	kmunreg.hdr.type = KNOT_MSG_UNREG_REQ;
 	kmunreg.hdr.payload_len = 0;
 	olen = sizeof(knot_msg_unregister) + kmunreg.hdr.payload_len;
 	opdu = &kmunreg;
 
-	osent = node_ops->send(session->node_fd, opdu, olen);
+	osent = session_send(session, opdu, olen);
 	if (osent < 0) {
 		err = -osent;
-		hal_log_error("[session %p] Can't send unregister message: %s(%d)",
+		log_error("[session %p] Can't send unregister message: %s(%d)",
 				session, strerror(err), err);
 		return false;
 	}
 
+	log_info("[session %p] Sending unregister message ...", session);
+	session_fsm_event(session, SESSION_EV_UNREGISTER);
+
 	return true;
 }
 
@@ -411,36 +1109,133 @@ static void device_forget_destroy(struct cloud_device *mydevice)
 	if (!mydevice)
 		return;
 
-	device = device_get(mydevice->id);
-
-	if (device_forget(device))
-		hal_log_info("Removing proxy for %s", mydevice->id);
+	credential_cache_forget(mydevice->id);
+	device = device_get(mydevice->id);
+
+	if (device_forget(device))
+		log_info("Removing proxy for %s", mydevice->id);
+
+	mydevice = registered_device_remove(mydevice->id);
+
+	cloud_device_free(mydevice);
+}
+
+static int8_t msg_unregister_resp(struct session *session)
+{
+	if (session->state != SESSION_UNREGISTERING)
+		return KNOT_ERR_PERM;
+
+	device_forget_destroy(session->device);
+	session->device = NULL;
+	session_reset(session);
+
+	return 0;
+}
+
+/*
+ * Forget device and destroy its proxy if the unregister response isn't
+ * received within UNREGISTER_TIMEOUT_MS. Looked up again: the cloud may
+ * have removed it meanwhile.
+ */
+static void session_unregister_forget(struct session *session)
+{
+	char id[KNOT_ID_LEN];
+
+	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
+	device_forget_destroy(registered_device_find(id));
+	session->device = NULL;
+}
+
+static void session_unregister_expired(struct session *session)
+{
+	log_info("[session %p] Unregister response not received", session);
+
+	session_unregister_forget(session);
+	session_reset(session);
+}
+
+/* Response to a request answered asynchronously */
+static ssize_t session_send_result(struct session *session, uint8_t type,
+				   int8_t result)
+{
+	knot_msg msg;
+	ssize_t osent;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.hdr.type = type;
+	msg.hdr.payload_len = sizeof(msg.action.result);
+	msg.action.result = result;
+
+	osent = session_send(session, &msg,
+			     sizeof(msg.hdr) + msg.hdr.payload_len);
+	if (osent < 0)
+		log_error("[session %p] Can't send response %s(%zd)",
+			  session, strerror(-osent), -osent);
+
+	return osent;
+}
+
+/*
+ * Background cloud authentication of a cached credential. It takes an
+ * admission slot like any other: when none is available the check is
+ * deferred, not skipped, and the session stays trusted meanwhile.
+ */
+static void session_revalidate(struct session *session)
+{
+	if (!session_is_trusted(session) || !session->token)
+		return;
+
+	if (!session_admit(session, session->uuid)) {
+		timewheel_timer_add(&session->revalidate, ADMISSION_RETRY_MS);
+		return;
+	}
 
-	mydevice = l_queue_remove_if(registered_devices, device_id_cmp,
-			mydevice->id);
+	/* Cloud unreachable: revalidated at the next reconnection */
+	if (cloud_auth_device(session->device->id, session->token) != 0) {
+		session_release(session);
+		return;
+	}
 
-	cloud_device_free(mydevice);
+	session->revalidating = true;
+	timewheel_timer_add(&session->revalidate, CLOUD_TIMEOUT_MS);
 }
 
-static int8_t msg_unregister_resp(struct session *session)
+static void session_revalidate_cb(struct timewheel_timer *timer,
+				  void *user_data)
 {
-	device_forget_destroy(session->device);
-	session->device = NULL;
+	struct session *session = user_data;
 
-	return 0;
+	/* Response lost: the slot goes back and the check is retried */
+	if (session->revalidating) {
+		log_info("[session %p] Revalidation: timeout", session);
+		session->revalidating = false;
+		session_release(session);
+	}
+
+	session_revalidate(session);
 }
 
 /*
- * Forget device and destroy its proxy if the unregister response isn't
- * received within 1096 seconds.
+ * Reconnection fast path: the thing is trusted at once and the cloud
+ * authentication runs in background. A rejection resets the session.
  */
-static void unregister_callback(struct l_timeout *timeout, void *user_data)
+static int8_t msg_auth_cached(struct session *session)
 {
-	struct cloud_device *mydevice = user_data;
+	struct knot_device *device = device_get(session->device->id);
 
-	hal_log_info("Unregister response not received");
+	log_info("[session %p] Credential cached: trusted", session);
 
-	device_forget_destroy(mydevice);
+	session_fsm_event(session, SESSION_EV_AUTH_CACHED);
+	session_set_schema(session, schema_ref(session->device->schema));
+
+	if (device)
+		device_set_online(device, true);
+
+	session_revalidate(session);
+
+	session_send_result(session, KNOT_MSG_AUTH_RSP, 0);
+
+	return 0;
 }
 
 /* Mandatory before any operation */
@@ -451,26 +1246,17 @@ static int8_t msg_auth(struct session *session,
 	char token[KNOT_PROTOCOL_TOKEN_LEN + 1];
 	int8_t result;
 
-	if (session->trusted) {
-		hal_log_info("[session %p] Authenticated already", session);
+	if (session_is_trusted(session)) {
+		log_info("[session %p] Authenticated already", session);
 		return 0;
 	}
 
-	if (session->device_requesting_auth) {
-		hal_log_info("[session %p] Authentication in progress",
+	if (session->state == SESSION_AUTHENTICATING) {
+		log_info("[session %p] Authentication in progress",
 								       session);
 		return 0;
 	}
 
-	session->device = l_queue_find(registered_devices, device_uuid_cmp,
-				       kmauth->uuid);
-	if (!session->device)
-		return KNOT_ERR_PERM;
-
-
-	/* Set Id */
-	session->id = strtoull(session->device->id, NULL, 16);
-
 	/*
 	 * PDU is not null-terminated. Copy UUID and token to
 	 * a null-terminated stringmanage link overload or not connected .
@@ -480,26 +1266,38 @@ static int8_t msg_auth(struct session *session,
 
 	memcpy(uuid, kmauth->uuid, sizeof(kmauth->uuid));
 	memcpy(token, kmauth->token, sizeof(kmauth->token));
+
+	session->device = l_hashmap_lookup(registered_uuids, uuid);
+	if (!session->device)
+		return KNOT_ERR_PERM;
+
+	/* Set Id */
+	session_set_id(session, strtoull(session->device->id, NULL, 16));
+
 	/* Set UUID & token: Used at property_changed */
-	session->uuid = l_strdup(uuid);
+	session_set_uuid(session, uuid);
 	session->token = l_strdup(token);
 
-	hal_log_info("[session %p] Authenticating UUID: %s, TOKEN: %s",
-		     session, uuid, token);
+	log_info("[session %p] Authenticating UUID: %s, TOKEN: %s",
+		 session, uuid, token);
 
-	session->device_requesting_auth = true;
-	result = cloud_auth_device(session->device->id, token);
+	if (credential_cache_verify(session->device->id, token))
+		return msg_auth_cached(session);
+
+	if (!session_admit(session, uuid)) {
+		session_reset(session);
+		return ADMISSION_ERR_RETRY;
+	}
 
+	result = cloud_auth_device(session->device->id, token);
 	if (result != 0) {
-		l_free(session->uuid);
-		l_free(session->token);
-		session->token = NULL;
-		session->uuid = NULL;
+		session_reset(session);
 		return result;
 	}
 
-	l_queue_foreach(session->device->schema, schema_dup_foreach,
-			session->schema_list);
+	session_fsm_event(session, SESSION_EV_AUTH);
+
+	session_set_schema(session, schema_ref(session->device->schema));
 
 	return 0;
 }
@@ -515,16 +1313,16 @@ static int8_t msg_schema(struct session *session,
 				   schema->values.value_type,
 				   schema->values.unit);
 	if (err) {
-		hal_log_error("Invalid schema!");
+		log_error("Invalid schema!");
 		return err;
 	}
 
-	if (!session->trusted) {
-		hal_log_info("[session %p] schema: not authorized!", session);
+	if (!session_is_trusted(session)) {
+		log_info("[session %p] schema: not authorized!", session);
 		return KNOT_ERR_PERM;
 	}
 
-	session->rollback = 1; /* Reset schema rollback ticks */
+	session_fsm_event(session, SESSION_EV_SCHEMA);
 
 	/*
 	 * {
@@ -535,28 +1333,87 @@ static int8_t msg_schema(struct session *session,
 	 * }
 	 */
 
-	if (!schema_find(session->schema_list, schema->sensor_id))
-		l_queue_push_tail(session->schema_list,
-				  l_memdup(schema, sizeof(*schema)));
+	if (!session->schema_rx)
+		session->schema_rx = schema_new();
 
-	if (eof) {
-		snprintf(id, sizeof(id), "%016"PRIx64, session->id);
-		result = cloud_update_schema(id, session->schema_list);
+	schema_add(session->schema_rx, schema);
+
+	if (!eof)
+		return 0;
+
+	/* Thing reboot: same schema as accepted, no cloud round trip */
+	if (schema_count(session->schema) &&
+	    schema_hash(session->schema_rx) == session->schema_hash &&
+	    schema_equal(session->schema_rx, session->schema)) {
+		log_info("[session %p] Schema unchanged", session);
+		schema_unref(session->schema_rx);
+		session->schema_rx = NULL;
+		session_fsm_event(session, SESSION_EV_SCHEMA_OK);
+		session_send_result(session, KNOT_MSG_SCHM_END_RSP, 0);
+		return 0;
 	}
 
-	if (result < 0) {
-		l_queue_destroy(session->schema_list, l_free);
-		session->schema_list = NULL;
+	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
+	result = cloud_update_schema(id, session->schema_rx);
+
+	/* Discard the partial schema: the thing has to send it again */
+	if (result) {
+		schema_unref(session->schema_rx);
+		session->schema_rx = NULL;
 	}
 
 	return result;
 }
 
+static int session_publish_data(uint8_t sensor_id, uint8_t value_type,
+				const knot_value_type *value,
+				uint8_t value_len, void *user_data)
+{
+	struct session *session = user_data;
+	char id[KNOT_ID_LEN];
+
+	if (!session_is_trusted(session))
+		return -EPERM;
+
+	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
+
+	return cloud_publish_data(id, sensor_id, value_type, value,
+				  value_len);
+}
+
+static struct telemetry_sensor *session_get_sensor(struct session *session,
+						   uint8_t sensor_id)
+{
+	struct telemetry_sensor *sensor;
+	struct telemetry_policy policy;
+	char id[KNOT_ID_LEN];
+
+	if (!session->sensors)
+		session->sensors = l_hashmap_new();
+
+	sensor = l_hashmap_lookup(session->sensors, L_UINT_TO_PTR(sensor_id));
+	if (sensor)
+		return sensor;
+
+	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
+	if (telemetry_find_policy(id, sensor_id, &policy))
+		log_info("[session %p] sensor:%d, min interval:%ums, "
+			 "deadband:%g, max age:%ums", session, sensor_id,
+			 policy.min_interval_ms, policy.deadband,
+			 policy.max_age_ms);
+
+	sensor = telemetry_sensor_new(&policy, sensor_id,
+				      session_publish_data, session);
+	l_hashmap_insert(session->sensors, L_UINT_TO_PTR(sensor_id), sensor);
+
+	return sensor;
+}
+
 static int8_t msg_data(struct session *session, const knot_msg_data *kmdata)
 {
 	const knot_msg_schema *schema;
-	char id[KNOT_ID_LEN];
-	int8_t result;
+	struct telemetry_sensor *sensor;
+	int err;
 	uint8_t sensor_id;
 	uint8_t kval_len;
 	/*
@@ -565,31 +1422,37 @@ static int8_t msg_data(struct session *session, const knot_msg_data *kmdata)
 	 */
 	const knot_value_type *kvalue = &(kmdata->payload);
 
-	if (!session->trusted) {
-		hal_log_info("[session %p] data: Permission denied!", session);
+	if (!session_is_trusted(session)) {
+		log_info("[session %p] data: Permission denied!", session);
 		return KNOT_ERR_PERM;
 	}
 
-	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
 	sensor_id = kmdata->sensor_id;
-	schema = schema_find(session->schema_list, sensor_id);
+	schema = schema_find(session->schema, sensor_id);
 	if (!schema) {
-		hal_log_info("[session %p] sensor_id(0x%02x): data type mismatch!",
-			     session, sensor_id);
+		log_info("[session %p] sensor_id(0x%02x): data type mismatch!",
+			 session, sensor_id);
 		return KNOT_ERR_INVALID;
 	}
 
-	hal_log_info("[session %p] sensor:%d, unit:%d, value_type:%d", session,
-		     sensor_id, schema->values.unit, schema->values.value_type);
+	log_event(LOG_EV_DATA, (uintptr_t) session,
+		  sensor_id << 8 | schema->values.value_type);
+	log_dbg("[session %p] sensor:%d, unit:%d, value_type:%d", session,
+		sensor_id, schema->values.unit, schema->values.value_type);
 
+	/* Rate limit, deadband and coalescing: see telemetry.c */
+	sensor = session_get_sensor(session, sensor_id);
 	kval_len = kmdata->hdr.payload_len - sizeof(kmdata->sensor_id);
-	result = cloud_publish_data(id, sensor_id, schema->values.value_type,
-				    kvalue, kval_len);
-	if (result < 0)
-		goto done;
+	err = telemetry_sensor_update(sensor, schema->values.value_type,
+				      kvalue, kval_len);
 
-done:
-	return result;
+	/* The thing only understands KNoT results */
+	if (err == -EPERM)
+		return KNOT_ERR_PERM;
+	if (err < 0)
+		return KNOT_ERR_INVALID;
+
+	return err;
 }
 
 /*
@@ -615,24 +1478,26 @@ static int8_t msg_setdata_resp(struct session *session,
 
 	const knot_value_type *kvalue = &(kmdata->payload);
 
-	if (!session->trusted) {
-		hal_log_info("[session %p] setdata: Permission denied!",
-			     session);
+	if (!session_is_trusted(session)) {
+		log_info("[session %p] setdata: Permission denied!",
+			 session);
 		return KNOT_ERR_PERM;
 	}
 
 	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
 	sensor_id = kmdata->sensor_id;
-	schema = schema_find(session->schema_list, sensor_id);
+	schema = schema_find(session->schema, sensor_id);
 	if (!schema) {
-		hal_log_info("[session %p] sensor_id(0x%02x): data type mismatch!",
-			     session, sensor_id);
+		log_info("[session %p] sensor_id(0x%02x): data type mismatch!",
+			 session, sensor_id);
 		return KNOT_ERR_INVALID;
 	}
 
-	hal_log_info("[session %p] sensor:%d, unit:%d, value_type:%d",
-		     session, sensor_id, schema->values.unit,
-		     schema->values.value_type);
+	log_event(LOG_EV_DATA, (uintptr_t) session,
+		  sensor_id << 8 | schema->values.value_type);
+	log_dbg("[session %p] sensor:%d, unit:%d, value_type:%d",
+		session, sensor_id, schema->values.unit,
+		schema->values.value_type);
 
 	kval_len = kmdata->hdr.payload_len - sizeof(kmdata->sensor_id);
 	result = cloud_publish_data(id, sensor_id, schema->values.value_type,
@@ -640,48 +1505,61 @@ static int8_t msg_setdata_resp(struct session *session,
 	if (result != 0)
 		return result;
 
-	hal_log_info("[session %p] THING %s updated data for sensor %d",
-		     session, session->uuid, sensor_id);
+	telemetry_sensor_cache(session_get_sensor(session, sensor_id),
+			       schema->values.value_type, kvalue, kval_len);
+
+	log_dbg("[session %p] THING %s updated data for sensor %d",
+		session, session->uuid, sensor_id);
 
 	return 0;
 }
 
-static void schema_rollback_cb(struct l_timeout *timeout, void *user_data)
+/* Registration not completed: roll it back */
+static void session_schema_expired(struct session *session)
 {
-	struct session *session = user_data;
 	char id[KNOT_ID_LEN];
 
-	if (!session->rollback)
-		return;
+	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
 
-	if (session->rollback <= ROLLBACK_TICKS) {
-		l_timeout_modify_ms(timeout, 1096);
-		hal_log_info("[session %p] Waiting schema...", session);
-		session->rollback++;
+	if (!session->uuid) {
+		log_info("[session %p] Device not registered. Removing %s \
+			 (rollback)", session, id);
+		session_reset(session);
 		return;
 	}
 
-	session->rollback = 0;
+	log_info("[session %p] Removing %s (rollback)", session,
+		 session->uuid);
 
-	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
+	/* Send unregister request to device */
+	if (!msg_unregister_req(session))
+		session_reset(session);
+}
 
-	if (!session->uuid) {
-		hal_log_info("[session %p] Device not registered. Removing %s \
-			     (rollback)", session, id);
+/*
+ * Cloud register or auth response lost: the admission slot is released
+ * by the reset and the thing is asked to retry later.
+ */
+static void session_register_expired(struct session *session)
+{
+	struct cloud_device *mydevice = session->device;
+
+	/* Registered, auth lost: REG_RSP with the credentials already sent */
+	if (mydevice && registered_device_find(mydevice->id) == mydevice) {
+		session_reset(session);
 		return;
 	}
 
-	hal_log_info("[session %p] Removing %s (rollback)", session,
-		     session->uuid);
+	cloud_device_free(mydevice);
+	session->device = NULL;
+	session_reset(session);
+	session_send_result(session, KNOT_MSG_REG_RSP, ADMISSION_ERR_RETRY);
+}
 
-	/* Send unregister request to device */
-	if (msg_unregister_req(session->device)) {
-		hal_log_info("Sending unregister message ...");
-		/* Start unregister timeout */
-		session->device->unreg_timeout = l_timeout_create_ms(1096,
-							unregister_callback,
-							session->device, NULL);
-	}
+static void session_auth_expired(struct session *session)
+{
+	session_reset(session);
+	session_send_result(session, KNOT_MSG_AUTH_RSP, ADMISSION_ERR_RETRY);
 }
 
 static ssize_t msg_process(struct session *session,
@@ -696,8 +1574,8 @@ static ssize_t msg_process(struct session *session,
 
 	/* Verify if output PDU has a min length */
 	if (omtu < sizeof(knot_msg)) {
-		hal_log_error("[session %p] Output PDU: invalid PDU length",
-			      session);
+		log_error("[session %p] Output PDU: invalid PDU length",
+			  session);
 		return -EINVAL;
 	}
 
@@ -706,21 +1584,23 @@ static ssize_t msg_process(struct session *session,
 
 	/* At least header should be received */
 	if (ilen < sizeof(knot_msg_header)) {
-		hal_log_error("[session %p] KNOT PDU: invalid minimum length",
-			      session);
+		log_error("[session %p] KNOT PDU: invalid minimum length",
+			  session);
 		return -EINVAL;
 	}
 
 	/* Checking PDU length consistency */
 	plen = sizeof(kreq->hdr) + kreq->hdr.payload_len;
 	if (ilen != plen) {
-		hal_log_error("[session %p] KNOT PDU: len mismatch %ld/%ld",
-			      session, ilen, plen);
+		log_error("[session %p] KNOT PDU: len mismatch %ld/%ld",
+			  session, ilen, plen);
 		return -EINVAL;
 	}
 
-	hal_log_info("[session %p] KNOT OP: 0x%02X LEN: %02x",
-		     session, kreq->hdr.type, kreq->hdr.payload_len);
+	log_event(LOG_EV_PDU_RX, (uintptr_t) session,
+		  kreq->hdr.type << 8 | kreq->hdr.payload_len);
+	log_dbg("[session %p] KNOT OP: 0x%02X LEN: %02x",
+		session, kreq->hdr.type, kreq->hdr.payload_len);
 
 	switch (kreq->hdr.type) {
 	case KNOT_MSG_REG_REQ:
@@ -792,23 +1672,33 @@ static void session_node_disconnected_cb(struct l_io *channel, void *user_data)
 	char id[KNOT_ID_LEN];
 
 	/* ELL returns -1 when calling l_io_get_fd() at disconnected callback */
-	session = l_queue_remove_if(session_list,
-				    session_node_fd_cmp,
-				    L_INT_TO_PTR(session->node_fd));
+	if (session->worker)
+		worker_remove(session->node_fd);
+	session_index_remove(session_fd_map, L_INT_TO_PTR(session->node_fd),
+			     session);
+	l_queue_remove(session_list, session);
+
+	/* Queued PDUs are dropped at the next flush */
+	session->node_fd = -1;
 
-	hal_log_info("[session %p] disconnected (node)", session);
+	log_info("[session %p] disconnected (node)", session);
 
 	snprintf(id, sizeof(id), "%016"PRIx64, session->id);
-	if (session->rollback) {
+	if (session->state == SESSION_REGISTERING ||
+	    session->state == SESSION_SCHEMA) {
 		device_destroy(id);
-		hal_log_info("[session %p] Removing %s (rollback)",
-			     session, session->uuid);
+		log_info("[session %p] Removing %s (rollback)",
+			 session, session->uuid);
+	} else if (session->state == SESSION_UNREGISTERING) {
+		/* The unregister timeout dies with the session */
+		session_unregister_forget(session);
 	}
 
 	device = device_get(id);
 	if (device)
 		device_set_online(device, false);
 
+	session_reset(session);
 	session_unref(session);
 }
 
@@ -823,6 +1713,7 @@ static void session_node_destroy_to(struct l_timeout *timeout,
 {
 	struct l_io *channel = user_data;
 
+	worker_remove(l_io_get_fd(channel));
 	l_io_destroy(channel);
 }
 
@@ -841,49 +1732,177 @@ static void on_node_channel_data_error(struct l_io *channel)
 			 NULL);
 }
 
+/* @stamp: trace_now() when the PDU was read */
+static void session_process_pdu(struct session *session,
+				const void *ipdu, size_t ilen, uint64_t stamp)
+{
+	struct pdubuf *obuf;
+	ssize_t sentbytes, olen;
+
+	if (ilen >= sizeof(knot_msg_header))
+		metrics_add(METRICS_PDUS +
+			    ((const knot_msg_header *) ipdu)->type, 1);
+
+	obuf = pdubuf_get();
+
+	/*
+	 * Non-blocking: cloud requests are queued and published later.
+	 * Cloud responses are handled by on_cloud_receive().
+	 */
+	trace_begin(stamp);
+	olen = msg_process(session, ipdu, ilen, obuf->data, sizeof(obuf->data));
+	trace_end();
+	/* olen: output length or -errno */
+	if (olen < 0) {
+		/* Server didn't reply any error */
+		log_error("[session %p] KNOT IoT cloud error: %s(%zd)",
+			  session, strerror(-olen), -olen);
+		goto done;
+	}
+
+	/* If there are no octets to be sent */
+	if (!olen)
+		goto done;
+
+	/* Response from the gateway: error or response for the given command */
+	sentbytes = session_send(session, obuf->data, olen);
+	if (sentbytes < 0)
+		log_error("[session %p] node_ops: %s(%zd)",
+			  session, strerror(-sentbytes), -sentbytes);
+
+done:
+	pdubuf_put(obuf);
+}
+
+/* Processes every complete PDU of a stream, keeping the partial one */
+static void session_node_frame(struct session *session, struct pdubuf *buf)
+{
+	const knot_msg_header *hdr;
+	size_t plen;
+
+	/* payload_len delimits the PDUs */
+	while (buf->tail - buf->head >= sizeof(*hdr)) {
+		hdr = (const knot_msg_header *) (buf->data + buf->head);
+		plen = sizeof(*hdr) + hdr->payload_len;
+		if (buf->tail - buf->head < plen)
+			break;
+
+		session_process_pdu(session, hdr, plen, buf->stamp);
+		buf->head += plen;
+	}
+
+	if (buf->head == buf->tail) {
+		pdubuf_put(buf);
+		return;
+	}
+
+	/* Partial PDU: smaller than PDUBUF_SIZE, wait for the remaining */
+	pdubuf_compact(buf);
+	session->rxbuf = buf;
+}
+
 static bool session_node_data_cb(struct l_io *channel, void *user_data)
 {
 	struct session *session = user_data;
 	struct node_ops *node_ops = session->node_ops;
-	uint8_t ipdu[512], opdu[512]; /* FIXME: */
-	ssize_t recvbytes, sentbytes, olen;
+	struct pdubuf *buf;
+	ssize_t recvbytes;
+	size_t len;
 	int node_socket;
 	int err;
 
 	node_socket = l_io_get_fd(channel);
 
-	recvbytes = node_ops->recv(node_socket, ipdu, sizeof(ipdu));
+	/* Stream transports may have left a partial PDU behind */
+	buf = session->rxbuf ? session->rxbuf : pdubuf_get();
+	session->rxbuf = NULL;
+
+	if (node_ops->framing == NODE_FRAMING_DATAGRAM)
+		len = MIN(node_ops->mtu, sizeof(buf->data));
+	else
+		len = sizeof(buf->data) - buf->tail;
+
+	recvbytes = node_ops->recv(node_socket, buf->data + buf->tail, len);
 	if (recvbytes <= 0) {
 		err = errno;
-		hal_log_error("[session %p] readv(): %s(%d)",
-			      session, strerror(err), err);
+		log_error("[session %p] readv(): %s(%d)",
+			  session, strerror(err), err);
+		pdubuf_put(buf);
 		on_node_channel_data_error(channel);
 		return false;
 	}
 
-	/* Blocking: Wait until response from cloud is received */
-	olen = msg_process(session, ipdu, recvbytes, opdu, sizeof(opdu));
-	/* olen: output length or -errno */
-	if (olen < 0) {
-		/* Server didn't reply any error */
-		hal_log_error("[session %p] KNOT IoT cloud error: %s(%zd)",
-			      session, strerror(-olen), -olen);
-		return true;
-	}
+	buf->tail += recvbytes;
+	buf->stamp = trace_now();
+	metrics_add(METRICS_NODE_RX_BYTES, recvbytes);
 
-	/* If there are no octets to be sent */
-	if (!olen)
+	if (node_ops->framing == NODE_FRAMING_DATAGRAM) {
+		session_process_pdu(session, buf->data, buf->tail,
+				    buf->stamp);
+		pdubuf_put(buf);
 		return true;
+	}
 
-	/* Response from the gateway: error or response for the given command */
-	sentbytes = node_ops->send(node_socket, opdu, olen);
-	if (sentbytes < 0)
-		hal_log_error("[session %p] node_ops: %s(%zd)",
-			      session, strerror(-sentbytes), -sentbytes);
+	session_node_frame(session, buf);
 
 	return true;
 }
 
+/* Buffer read by a worker thread: appended to the partial PDU, if any */
+static void session_node_input(struct session *session, struct pdubuf *in)
+{
+	struct pdubuf *buf;
+	size_t len;
+
+	if (session->node_ops->framing == NODE_FRAMING_DATAGRAM) {
+		session_process_pdu(session, in->data, in->tail, in->stamp);
+		pdubuf_put(in);
+		return;
+	}
+
+	if (!session->rxbuf) {
+		session_node_frame(session, in);
+		return;
+	}
+
+	/* A partial PDU is shorter than NODE_MTU_DEFAULT: always progresses */
+	while (in->head < in->tail) {
+		buf = session->rxbuf ? session->rxbuf : pdubuf_get();
+		session->rxbuf = NULL;
+
+		len = MIN(sizeof(buf->data) - buf->tail, in->tail - in->head);
+		memcpy(buf->data + buf->tail, in->data + in->head, len);
+		buf->tail += len;
+		buf->stamp = in->stamp;
+		in->head += len;
+
+		session_node_frame(session, buf);
+	}
+
+	pdubuf_put(in);
+}
+
+static void session_worker_input(int fd, uint32_t serial, struct pdubuf *buf,
+				 void *user_data)
+{
+	struct session *session;
+
+	session = l_hashmap_lookup(session_fd_map, L_INT_TO_PTR(fd));
+	if (!session || session->serial != serial) {
+		/* Read before the session was gone */
+		pdubuf_put(buf);
+		return;
+	}
+
+	if (!buf) {
+		log_error("[session %p] node hangup", session);
+		on_node_channel_data_error(session->node_channel);
+		return;
+	}
+
+	session_node_input(session, buf);
+}
+
 static struct l_io *create_node_channel(int node_socket,
 					struct session *session)
 {
@@ -891,14 +1910,24 @@ static struct l_io *create_node_channel(int node_socket,
 
 	channel = l_io_new(node_socket);
 	if (channel == NULL) {
-		hal_log_error("Can't create node channel");
+		log_error("Can't create node channel");
 		return NULL;
 	}
 
 	l_io_set_close_on_destroy(channel, true);
 
-	l_io_set_read_handler(channel, session_node_data_cb,
-			      session, NULL);
+	/* Non-zero: tells sessions reusing the same socket number apart */
+	if (++session_serial == 0)
+		session_serial++;
+	session->serial = session_serial;
+
+	/* Read by a worker thread, if enabled */
+	if (worker_add(node_socket, session->serial) == 0)
+		session->worker = true;
+	else
+		l_io_set_read_handler(channel, session_node_data_cb,
+				      session, NULL);
+
 	l_io_set_disconnect_handler(channel,
 				    session_node_disconnected_cb,
 				    session_ref(session),
@@ -921,7 +1950,7 @@ static struct session *session_create(struct node_ops *node_ops,
 	}
 	session->node_fd = client_socket; /* Required to manage disconnections */
 
-	hal_log_info("[session %p] Session created", session);
+	log_info("[session %p] Session created", session);
 
 	return session;
 }
@@ -937,6 +1966,7 @@ static bool session_accept_cb(struct node_ops *node_ops, int client_socket)
 	}
 
 	l_queue_push_head(session_list, session);
+	l_hashmap_insert(session_fd_map, L_INT_TO_PTR(client_socket), session);
 
 	return true;
 }
@@ -945,24 +1975,22 @@ static bool handle_device_added(struct session *session, const char *device_id,
 				const char *token, const char *error)
 {
 	struct knot_device *device_dbus = device_get(device_id);
-	const struct node_ops *node_ops;
 	knot_msg_credential msg;
 	ssize_t olen, osent;
 	int err, result;
 
-	node_ops = session->node_ops;
-
 	if (error) {
-		hal_log_error("Receive register error: %s", error);
+		log_error("Receive register error: %s", error);
 		cloud_device_free(session->device);
 		session->device = NULL;
+		session_reset(session);
 		goto send;
 	}
 
 	/* Tracks 'proxy' devices that belongs to Cloud. */
-	hal_log_info("Device added: %s", device_id);
+	log_info("Device added: %s", device_id);
 
-	l_queue_push_head(registered_devices, session->device);
+	registered_device_add(session->device);
 
 	if (!device_dbus) {
 		if (!session->device)
@@ -978,18 +2006,13 @@ static bool handle_device_added(struct session *session, const char *device_id,
 	}
 
 	device_set_uuid(device_dbus, session->device->uuid);
-	session->device->unreg_timeout = NULL;
-	session->trusted = false;
-	session->uuid = l_strdup(session->device->uuid);
+	session_set_uuid(session, session->device->uuid);
 	session->token = l_strdup(token);
 
-	session->device_requesting_auth = false;
+	/* Still REGISTERING: the auth response isn't sent to the thing */
 	result = cloud_auth_device(device_id, session->token);
 	if (result != 0) {
-		l_free(session->uuid);
-		l_free(session->token);
-		session->uuid = NULL;
-		session->token = NULL;
+		session_reset(session);
 		return true;
 	}
 
@@ -1001,18 +2024,11 @@ send:
 	msg.result = error ? KNOT_ERR_CLOUD_FAILURE : 0;
 	olen = sizeof(msg.hdr) + msg.hdr.payload_len;
 
-	osent = node_ops->send(session->node_fd, &msg, olen);
+	osent = session_send(session, &msg, olen);
 	if (osent < 0) {
 		err = -osent;
-		hal_log_error("[session %p] Can't send register response %s(%d)"
-			      , session, strerror(err), err);
-	} else if (!error) {
-		if (session->schema_timeout)
-			l_timeout_remove(session->schema_timeout);
-
-		session->schema_timeout = l_timeout_create_ms(512,
-							schema_rollback_cb,
-							session, NULL);
+		log_error("[session %p] Can't send register response %s(%d)"
+			  , session, strerror(err), err);
 	}
 
 	return true;
@@ -1021,36 +2037,32 @@ send:
 static bool handle_device_removed(const char *device_id, const char *err)
 {
 	struct knot_device *device = device_get(device_id);
-	struct cloud_device *mydevice = l_queue_find(registered_devices,
-						 device_id_cmp,
-						 device_id);
+	struct cloud_device *mydevice = registered_device_find(device_id);
+	struct session *session = NULL;
 
 	/* Tracks 'proxy' devices removed from Cloud. */
 	if (device == NULL) {
 		/* Other service or created by external apps(eg: ktool) */
-		hal_log_error("Device %s not found!", device_id);
+		log_error("Device %s not found!", device_id);
 		return true;
 	}
 
 	if (err) {
-		hal_log_error("Received error unregister message: %s", err);
+		log_error("Received error unregister message: %s", err);
 		device_reply_forget_failed(device, err);
 		return true;
 	}
 
-	hal_log_info("Device removed: %s", device_id);
+	log_info("Device removed: %s", device_id);
+
+	if (mydevice)
+		session = l_hashmap_lookup(session_uuid_map, mydevice->uuid);
 
 	/* Send unregister request to device */
-	if(msg_unregister_req(mydevice)) {
-		hal_log_info("Sending unregister message ...");
-		/* Start unregister timeout */
-		mydevice->unreg_timeout = l_timeout_create_ms(1096,
-							unregister_callback,
-							mydevice, NULL);
+	if (session && msg_unregister_req(session))
 		return true;
-	}
 
-	hal_log_info("Unregister message can't be sent!!");
+	log_info("Unregister message can't be sent!!");
 
 	device_forget_destroy(mydevice);
 	return false;
@@ -1060,44 +2072,63 @@ static bool handle_device_auth(struct session *session, const char *device_id,
 			       const char *error)
 {
 	struct knot_device *device = device_get(device_id);
-	bool authenticated = true;
-	ssize_t osent;
-	int osent_err;
-	knot_msg msg;
+	bool authenticated = !error;
+
+	/* Background check of a credential taken from the cache */
+	if (session->revalidating && session_is_trusted(session)) {
+		session->revalidating = false;
+		timewheel_timer_cancel(&session->revalidate);
+		session_release(session);
+		if (authenticated) {
+			credential_cache_store(device_id, session->token);
+			return true;
+		}
+
+		log_error("[session %p] Cached credential rejected",
+			  session);
+		credential_cache_forget(device_id);
+		if (device) {
+			device_send_signal_notify(device, error);
+			device_set_online(device, false);
+		}
+
+		session_reset(session);
+		return true;
+	}
+
+	session_release(session);
 
-	if (!session->device_requesting_auth)
+	/* Registration authenticates on behalf of the thing: no response */
+	if (session->state == SESSION_REGISTERING)
 		goto done;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.hdr.type = KNOT_MSG_AUTH_RSP;
-	msg.hdr.payload_len = sizeof(msg.action.result);
+	if (session->state != SESSION_AUTHENTICATING) {
+		log_error("[session %p] Unexpected auth response",
+			  session);
+		return true;
+	}
 
 	if (error) {
-		hal_log_error("[session %p] Not Authorized", session);
+		log_error("[session %p] Not Authorized", session);
 		if (device)
 			device_send_signal_notify(device, error);
-		msg.action.result = KNOT_ERR_PERM;
-		l_free(session->uuid);
-		l_free(session->token);
-		session->uuid = NULL;
-		session->token = NULL;
-		authenticated = false;
 	}
 
-	osent = session->node_ops->send(session->node_fd, &msg,
-					sizeof(msg.hdr) + msg.hdr.payload_len);
-	if (osent < 0) {
-		osent_err = -osent;
-		hal_log_error("[session %p] Can't send msg response  %s(%d)",
-			      session, strerror(osent_err), osent_err);
+	if (session_send_result(session, KNOT_MSG_AUTH_RSP,
+				error ? KNOT_ERR_PERM : 0) < 0)
 		return false;
-	}
 
 done:
 	if (device)
 		device_set_online(device, authenticated);
 
-	session->trusted = authenticated;
+	if (authenticated) {
+		credential_cache_store(device_id, session->token);
+		session_fsm_event(session, SESSION_EV_AUTH_OK);
+	} else {
+		credential_cache_forget(device_id);
+		session_reset(session);
+	}
 
 	return true;
 }
@@ -1117,39 +2148,48 @@ static bool handle_schema_updated(struct session *session,
 
 	device = device_get(device_id);
 	if (!device) {
-		hal_log_error("Device dbus not found!");
+		log_error("Device dbus not found!");
 		return true;
 	}
 
 	if (err) {
-		hal_log_error("%s", err);
+		log_error("%s", err);
 
 		msg.action.result = KNOT_ERR_CLOUD_FAILURE;
 		result = true;
 
 		device_send_signal_notify(device, err);
+		schema_unref(session->schema_rx);
+		session->schema_rx = NULL;
 	}
 
-	osent = session->node_ops->send(session->node_fd, &msg,
-					sizeof(msg.hdr) + msg.hdr.payload_len);
+	osent = session_send(session, &msg,
+			     sizeof(msg.hdr) + msg.hdr.payload_len);
 	if (osent < 0) {
 		osent_err = -osent;
-		hal_log_error("[session %p] Can't send msg response %s(%d)",
-			      session, strerror(osent_err), osent_err);
+		log_error("[session %p] Can't send msg response %s(%d)",
+			  session, strerror(osent_err), osent_err);
 		return result;
 	}
 
 	device_set_registered(device, true);
 
-	l_queue_foreach(session->schema_list, schema_dup_foreach,
-			session->device->schema);
+	/* Telemetry state is bound to the schema */
+	if (session->schema_rx) {
+		session_reset_sensors(session);
+		session_set_schema(session, schema_intern(session->schema_rx));
+		session->schema_rx = NULL;
+	}
+
+	schema_unref(session->device->schema);
+	session->device->schema = schema_ref(session->schema);
 
 	/*
 	 * For security reason, remove from rollback avoiding clonning attack.
 	 * If schema is being sent means that credentals (UUID/token) has been
 	 * properly received (registration complete).
 	 */
-	session->rollback = 0; /* Rollback disabled */
+	session_fsm_event(session, SESSION_EV_SCHEMA_OK);
 
 	return true;
 }
@@ -1160,13 +2200,13 @@ static void forget_if_unknown(struct knot_device *device, void *user_data)
 
 	/* registered_devices contains cloud registered devices */
 
-	if (l_queue_find(registered_devices, device_id_cmp, id))
+	if (registered_device_find(id))
 		return; /* match: belongs to service & cloud */
 
-	hal_log_info("Device %s not found at Cloud", id);
+	log_info("Device %s not found at Cloud", id);
 
 	if (device_forget(device))
-		hal_log_info("Removing proxy for %s", id);
+		log_info("Removing proxy for %s", id);
 }
 
 static void service_ready(const char *service, void *user_data)
@@ -1175,7 +2215,7 @@ static void service_ready(const char *service, void *user_data)
 	 * Service proxy objects retrieved from low level service.
 	 * Gets called after notifying all ELL client proxies.
 	 */
-	hal_log_info("Service proxy %s is ready", service);
+	log_info("Service proxy %s is ready", service);
 
 	/* Step3: Remove if needed. For each service proxy: find at cloud? */
 	proxy_foreach(service, forget_if_unknown, NULL);
@@ -1188,7 +2228,7 @@ static void proxy_ready(void *user_data)
 	 * proxy. At this point, cloud device list is properly retrieved.
 	 */
 
-	hal_log_info("Protocol proxy is ready");
+	log_info("Protocol proxy is ready");
 
 	/* Step2: Getting service (device) proxies. eg: nrfd objects  */
 	if (proxy_start("br.org.cesar.knot.nrf", NULL,
@@ -1208,19 +2248,20 @@ static void create_devices_dbus(void *data, void *user_data)
 	if (device_dbus)
 		device_set_uuid(device_dbus, mydevice->uuid);
 
-	l_queue_push_head(registered_devices, mydevice_dup(mydevice));
+	/* Device list may be received again: keep the tracked device */
+	if (!registered_device_find(mydevice->id))
+		registered_device_add(mydevice_dup(mydevice));
 }
 
 static bool handle_cloud_msg_list(struct l_queue *devices, const char *err)
 {
 	if (err) {
-		hal_log_error("Received List devices error: %s", err);
-		l_timeout_modify(list_timeout, TIMEOUT_DEVICES_SEC);
+		log_error("Received List devices error: %s", err);
+		timewheel_timer_add(&list_timer, TIMEOUT_DEVICES_SEC * 1000);
 		return true;
 	}
 
-	l_timeout_remove(list_timeout);
-	list_timeout = NULL;
+	timewheel_timer_cancel(&list_timer);
 	l_queue_foreach(devices, create_devices_dbus, NULL);
 	proxy_ready(NULL);
 
@@ -1236,7 +2277,6 @@ static bool handle_cloud_msg_list(struct l_queue *devices, const char *err)
 static void send_push_data_msg_foreach(void *data, void *user_data)
 {
 	struct session *session = user_data;
-	struct node_ops *node_ops = session->node_ops;
 	knot_msg_data *msg = data;
 	ssize_t olen, osent;
 	void *opdu;
@@ -1248,36 +2288,41 @@ static void send_push_data_msg_foreach(void *data, void *user_data)
 	opdu = msg;
 	olen = sizeof(msg->hdr) + msg->hdr.payload_len;
 
-	osent = node_ops->send(session->node_fd, opdu, olen);
-	hal_log_info("[session %p] Sending downstream data fd(%d)...",
-		     session, session->node_fd);
-
+	osent = session_send(session, opdu, olen);
 	if (osent < 0)
-		hal_log_error("[session %p] Can't send downstream data: %s(%d)",
-			      session, strerror(-osent), (int)-osent);
+		log_error("[session %p] Can't send downstream data: %s(%d)",
+			  session, strerror(-osent), (int)-osent);
 }
 
 static void send_pool_data_msg_foreach(void *data, void *user_data)
 {
-	const struct session *session = user_data;
-	struct node_ops *node_ops = session->node_ops;
-	knot_msg_schema *schema_found;
+	struct session *session = user_data;
+	const knot_msg_schema *schema_found;
+	struct telemetry_sensor *sensor;
 	uint8_t *sensor_id = data;
 	knot_msg_item item;
 	ssize_t olen, osent;
 	void *opdu;
 
-	schema_found = schema_find(session->schema_list,
-				  (unsigned int) *sensor_id);
+	schema_found = schema_find(session->schema, *sensor_id);
 	if (!schema_found) {
-		hal_log_error("[session %p] Can't send downstream data: schema \
-			      not found", session);
+		log_error("[session %p] Can't send downstream data: schema \
+			  not found", session);
 		return;
 	}
 
 	if (!sensor_id) {
-		hal_log_error("[session %p] Can't send downstream data: \
-			      sensor_id not found", session);
+		log_error("[session %p] Can't send downstream data: \
+			  sensor_id not found", session);
+		return;
+	}
+
+	/* Fresh enough (MaxAge): answer without a radio round trip */
+	sensor = session->sensors ? l_hashmap_lookup(session->sensors,
+					L_UINT_TO_PTR(*sensor_id)) : NULL;
+	if (sensor && telemetry_sensor_publish_cached(sensor) == 0) {
+		log_dbg("[session %p] sensor:%d answered from cache",
+			session, *sensor_id);
 		return;
 	}
 
@@ -1287,13 +2332,10 @@ static void send_pool_data_msg_foreach(void *data, void *user_data)
 	olen = sizeof(item);
 	opdu = &item;
 
-	osent = node_ops->send(session->node_fd, opdu, olen);
-	hal_log_info("[session %p] Sending downstream data fd(%d)...",
-		     session, session->node_fd);
-
+	osent = session_send(session, opdu, olen);
 	if (osent < 0)
-		hal_log_error("[session %p] Can't send downstream data: %s(%d)",
-			      session, strerror(-osent), (int)-osent);
+		log_error("[session %p] Can't send downstream data: %s(%d)",
+			  session, strerror(-osent), (int)-osent);
 }
 
 /**
@@ -1311,8 +2353,7 @@ static bool handle_cloud_msg_downstream(struct session *session,
 
 static bool on_cloud_receive(const struct cloud_msg *msg, void *user_data)
 {
-	struct session *session = l_queue_find(session_list, session_id_cmp,
-					       msg->device_id);
+	struct session *session = session_lookup_id(msg->device_id);
 
 	/**
 	 * Verify if thing session exists otherwise requeue the message.
@@ -1320,13 +2361,20 @@ static bool on_cloud_receive(const struct cloud_msg *msg, void *user_data)
 	 * processed.
 	 */
 	if (!session && msg->type != UNREGISTER_MSG && msg->type != LIST_MSG) {
-		hal_log_error("Unable to find the session with id: %s",
+		log_error("Unable to find the session with id: %s",
 				msg->device_id);
 		return false;
 	}
 
 	switch (msg->type) {
 	case UPDATE_MSG:
+		/* No schema accepted yet to validate the values against */
+		if (!msg->list) {
+			log_error("[session %p] update before the schema: "
+				  "requeued", session);
+			return false;
+		}
+
 		return handle_cloud_msg_downstream(session, msg->list,
 						   send_push_data_msg_foreach);
 	case REQUEST_MSG:
@@ -1349,11 +2397,19 @@ static bool on_cloud_receive(const struct cloud_msg *msg, void *user_data)
 	}
 }
 
-static void list_timeout_cb(struct l_timeout *timeout, void *user_data)
+static const struct schema *on_cloud_schema(const char *device_id,
+					    void *user_data)
+{
+	struct session *session = session_lookup_id(device_id);
+
+	return session ? session->schema : NULL;
+}
+
+static void list_timeout_cb(struct timewheel_timer *timer, void *user_data)
 {
 	if (cloud_list_devices() < 0) {
-		hal_log_error("Unable to list devices");
-		l_timeout_modify(list_timeout, TIMEOUT_DEVICES_SEC);
+		log_error("Unable to list devices");
+		timewheel_timer_add(timer, TIMEOUT_DEVICES_SEC * 1000);
 	}
 }
 
@@ -1361,51 +2417,170 @@ static void on_cloud_connected(void *user_data)
 {
 	int err;
 
-	hal_log_info("Cloud CONNECTED");
-	err = cloud_set_read_handler(on_cloud_receive, NULL);
+	log_info("Cloud CONNECTED");
+	err = cloud_set_read_handler(on_cloud_receive, on_cloud_schema, NULL);
 	if (err < 0) {
-		hal_log_error("cloud_set_read_handler(): %s", strerror(-err));
+		log_error("cloud_set_read_handler(): %s", strerror(-err));
 		return;
 	}
 
-	list_timeout = l_timeout_create_ms(1, /* start in oneshot */
-				list_timeout_cb,
-				NULL, NULL);
+	timewheel_timer_add(&list_timer, 1); /* start in oneshot */
+}
+
+static void txq_load_settings(int fd)
+{
+	static const char * const policies[] = {
+		[TXQ_DROP_OLDEST] = "oldest",
+		[TXQ_DROP_NEWEST] = "newest",
+		[TXQ_DROP_COALESCE] = "coalesce",
+	};
+	char *policy;
+	unsigned int i;
+	int val;
+
+	if (storage_read_key_int(fd, "Node", "QueueLength", &val) == 0 &&
+	    val > 0) {
+		txq_conf.max_len = val;
+		txq_conf.high_watermark = val * 3 / 4;
+		txq_conf.low_watermark = val / 4;
+	}
+
+	if (storage_read_key_int(fd, "Node", "HighWatermark", &val) == 0 &&
+	    val > 0 && (unsigned int) val <= txq_conf.max_len)
+		txq_conf.high_watermark = val;
+
+	if (storage_read_key_int(fd, "Node", "LowWatermark", &val) == 0 &&
+	    val >= 0 && (unsigned int) val < txq_conf.high_watermark)
+		txq_conf.low_watermark = val;
+
+	policy = storage_read_key_string(fd, "Node", "DropPolicy");
+	for (i = 0; policy && i < L_ARRAY_SIZE(policies); i++) {
+		if (strcmp(policy, policies[i]) == 0) {
+			txq_conf.policy = i;
+			break;
+		}
+	}
+
+	if (policy && i == L_ARRAY_SIZE(policies))
+		log_error("Invalid DropPolicy: %s", policy);
+
+	l_free(policy);
+
+	log_info("Output queue: length %u, watermarks %u/%u, drop %s",
+		 txq_conf.max_len, txq_conf.high_watermark,
+		 txq_conf.low_watermark, policies[txq_conf.policy]);
+}
+
+static void admission_load_settings(int fd)
+{
+	int val;
+
+	if (storage_read_key_int(fd, "Node", "MaxPendingAuth", &val) == 0 &&
+	    val > 0)
+		admission.max_pending = val;
+
+	if (storage_read_key_int(fd, "Node", "AuthRate", &val) == 0 &&
+	    val > 0)
+		admission.rate = val;
+
+	if (storage_read_key_int(fd, "Node", "AuthBurst", &val) == 0 &&
+	    val > 0)
+		admission.burst = val;
+
+	admission.tokens = admission.burst;
+	admission.refill_ms = now_ms();
+	admission.waiting = l_queue_new();
+
+	log_info("Admission: %u pending, %u/s, burst %u",
+		 admission.max_pending, admission.rate, admission.burst);
 }
 
 int msg_start(struct settings *settings)
 {
 	int err;
 
-	registered_devices = l_queue_new();
+	registered_devices = l_hashmap_string_new();
+	registered_uuids = l_hashmap_string_new();
 	session_list = l_queue_new();
 
+	session_id_map = l_hashmap_new();
+	l_hashmap_set_hash_function(session_id_map, session_id_hash);
+	l_hashmap_set_compare_function(session_id_map, session_id_compare);
+	l_hashmap_set_key_copy_function(session_id_map, session_id_copy);
+	l_hashmap_set_key_free_function(session_id_map, l_free);
+
+	session_uuid_map = l_hashmap_string_new();
+	session_fd_map = l_hashmap_new();
+
+	timewheel_timer_init(&list_timer, list_timeout_cb, NULL);
+
 	err = device_start();
 	if (err < 0) {
-		hal_log_error("device_start(): %s", strerror(-err));
+		log_error("device_start(): %s", strerror(-err));
 		return err;
 	}
 
+	txq_load_settings(settings->configfd);
+
+	/* Before the workers: they stamp the PDUs they read */
+	err = trace_load(settings->configfd);
+	if (err < 0)
+		log_error("trace_load(): %s", strerror(-err));
+
+	err = metrics_start(settings);
+	if (err < 0)
+		log_error("metrics_start(): %s", strerror(-err));
+
+	if (settings->workers) {
+		err = worker_start(settings->workers, session_worker_input,
+				   NULL);
+		if (err < 0)
+			log_error("worker_start(): %s", strerror(-err));
+	}
+	admission_load_settings(settings->configfd);
+
+	err = telemetry_load(settings->configfd);
+	if (err < 0)
+		log_error("telemetry_load(): %s", strerror(-err));
+
+	err = credential_cache_load(settings->configfd);
+	if (err < 0)
+		log_error("credential_cache_load(): %s", strerror(-err));
+
 	err = cloud_start(settings, on_cloud_connected, NULL);
 	if (err < 0)
-		hal_log_error("cloud_start(): %s", strerror(-err));
+		log_error("cloud_start(): %s", strerror(-err));
 
 	return 0;
 }
 
 void msg_stop(void)
 {
-	if (list_timeout)
-		l_timeout_remove(list_timeout);
+	timewheel_timer_cancel(&list_timer);
 
+	worker_stop();
 	node_stop();
 	if (proxy_enabled)
 		proxy_stop();
 	cloud_stop();
 	device_stop();
 
-	l_queue_destroy(registered_devices, cloud_device_free);
+	l_hashmap_destroy(registered_uuids, NULL);
+	l_hashmap_destroy(registered_devices, cloud_device_free);
+
+	l_hashmap_destroy(session_id_map, NULL);
+	l_hashmap_destroy(session_uuid_map, NULL);
+	l_hashmap_destroy(session_fd_map, NULL);
 
 	l_queue_destroy(session_list,
 			(l_queue_destroy_func_t) session_unref);
+	l_queue_destroy(admission.waiting, admission_waiter_free);
+	admission.waiting = NULL;
+
+	telemetry_unload();
+	trace_unload();
+	credential_cache_unload();
+	pdubuf_pool_clear();
+	timewheel_stop();
+	metrics_stop();
 }
@@ -33,6 +33,7 @@
 
 #include <hal/linux_log.h>
 
+#include "log.h"
 #include "node.h"
 
 static int tcp6_probe(void)
@@ -58,7 +59,7 @@ static int tcp6_listen(void)
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable,
 						sizeof(enable)) == -1) {
 		err = errno;
-		hal_log_error("tcp6 setsockopt(SO_REUSEADDR): %s(%d)",
+		log_error("tcp6 setsockopt(SO_REUSEADDR): %s(%d)",
 							strerror(err), err);
 		close(sock);
 		return -err;
@@ -67,7 +68,7 @@ static int tcp6_listen(void)
 	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable,
 						sizeof(enable)) == -1) {
 		err = errno;
-		hal_log_error("tcp6 setsockopt(TCP_NODELAY): %s(%d)",
+		log_error("tcp6 setsockopt(TCP_NODELAY): %s(%d)",
 							strerror(err), err);
 		close(sock);
 		return -err;
@@ -114,13 +115,32 @@ static ssize_t tcp6_send(int sockfd, const void *buffer, size_t len)
 	return send(sockfd, buffer, len, 0);
 }
 
+static ssize_t tcp6_sendv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = iovcnt;
+
+	ret = sendmsg(sockfd, &msg, MSG_DONTWAIT);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
 struct node_ops tcp6_ops = {
 	.name = "TCP6",
+	.mtu = NODE_MTU_DEFAULT,
+	.framing = NODE_FRAMING_STREAM,
 	.probe = tcp6_probe,
 	.remove = tcp6_remove,
 
 	.listen = tcp6_listen,
 	.accept = tcp6_accept,
 	.recv = tcp6_recv,
-	.send = tcp6_send
+	.send = tcp6_send,
+	.sendv = tcp6_sendv
 };
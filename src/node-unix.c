@@ -23,6 +23,10 @@
 #include <config.h>
 #endif
 
+#ifndef  _GNU_SOURCE
+#define  _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
@@ -94,13 +98,39 @@ static ssize_t unix_send(int sockfd, const void *buffer, size_t len)
 	return send(sockfd, buffer, len, 0);
 }
 
+/* SOCK_SEQPACKET: each iovec is a record, sent in a single system call */
+static ssize_t unix_sendv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+	struct mmsghdr msgs[NODE_SENDV_MAX];
+	int i;
+	int ret;
+
+	if (iovcnt > NODE_SENDV_MAX)
+		iovcnt = NODE_SENDV_MAX;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < iovcnt; i++) {
+		msgs[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = sendmmsg(sockfd, msgs, iovcnt, MSG_DONTWAIT);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
 struct node_ops unix_ops = {
 	.name = "Unix",
+	.mtu = NODE_MTU_DEFAULT,
+	.framing = NODE_FRAMING_DATAGRAM,
 	.probe = unix_probe,
 	.remove = unix_remove,
 
 	.listen = unix_listen,
 	.accept = unix_accept,
 	.recv = unix_recv,
-	.send = unix_send
+	.send = unix_send,
+	.sendv = unix_sendv
 };
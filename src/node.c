@@ -28,6 +28,7 @@
 
 #include <hal/linux_log.h>
 
+#include "log.h"
 #include "node.h"
 
 struct on_accept_data {
@@ -63,7 +64,7 @@ static int node_listen(const struct node_ops *node_ops)
 
 	server_socket = node_ops->listen();
 	if (server_socket < 0) {
-		hal_log_error("%p listen(): %s(%d)", node_ops,
+		log_error("%p listen(): %s(%d)", node_ops,
 			strerror(-server_socket), -server_socket);
 
 		node_ops->remove();
@@ -79,7 +80,7 @@ static bool try_accept(struct node_ops *node_ops,
 
 	client_socket = node_ops->accept(server_socket);
 	if (client_socket < 0) {
-		hal_log_error("%p accept(): %s(%d)",
+		log_error("%p accept(): %s(%d)",
 			node_ops, strerror(-client_socket), -client_socket);
 		return false;
 	}
@@ -113,22 +114,22 @@ static struct l_io  *create_channel(int server_socket,
 
 	channel = l_io_new(server_socket);
 	if (channel == NULL) {
-		hal_log_error("Failed to create ELL channel for socket %d",
-			      server_socket);
+		log_error("Failed to create ELL channel for socket %d",
+			  server_socket);
 		return NULL;
 	}
 
 	if (fcntl(server_socket, F_SETFL, O_NONBLOCK) == -1) {
 		err = errno;
-		hal_log_error("Failed to change socket (%d) to non-blocking: %s(%d)",
-			      server_socket, strerror(err), err);
+		log_error("Failed to change socket (%d) to non-blocking: %s(%d)",
+			  server_socket, strerror(err), err);
 		return NULL;
 	}
 
 	l_io_set_close_on_destroy(channel, true);
 
-	hal_log_info("node_ops(%p): (%s) created accept channel",
-		     node_ops, node_ops->name);
+	log_info("node_ops(%p): (%s) created accept channel",
+		 node_ops, node_ops->name);
 
 	return channel;
 }
@@ -20,7 +20,18 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
+
+/* Largest KNoT PDU: 2 octets header and up to UINT8_MAX payload octets */
+#define NODE_MTU_DEFAULT	(2 + UINT8_MAX)
+#define NODE_SENDV_MAX		64 /* PDUs per sendv() call */
+
+enum node_framing {
+	NODE_FRAMING_DATAGRAM,	/* recv() returns exactly one PDU */
+	NODE_FRAMING_STREAM,	/* PDUs split and merged: use payload_len */
+};
 
 /*
  * This 'driver' intends to be an abstraction for Radio technologies or
@@ -28,6 +39,8 @@
  */
 struct node_ops {
 	const char *name;
+	size_t mtu;			/* Largest PDU the transport carries */
+	enum node_framing framing;
 	int (*probe) (void);
 	void (*remove) (void);
 
@@ -35,6 +48,11 @@ struct node_ops {
 	int (*accept) (int srv_sockfd); /* Returns a 'pollable' FD */
 	ssize_t (*recv) (int sockfd, void *buffer, size_t len);
 	ssize_t (*send) (int sockfd, const void *buffer, size_t len);
+	/*
+	 * Non-blocking gather send of one PDU per iovec. Returns the amount
+	 * of PDUs (datagram) or octets (stream) sent, or -errno.
+	 */
+	ssize_t (*sendv) (int sockfd, const struct iovec *iov, int iovcnt);
 };
 
 typedef bool (*on_accepted)(struct node_ops *node_ops, int client_socket);
@@ -25,6 +25,10 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <ell/ell.h>
 #include <hal/linux_log.h>
@@ -34,163 +38,236 @@
 
 #include <json-c/json.h>
 
+#include "log.h"
+#include "arena.h"
+#include "base64.h"
+#include "floatstr.h"
+#include "schema.h"
 #include "parser.h"
 
 #define MIN(x,y) ((x)<(y)?(x):(y))
 
 /*
- * Parsing knot_value_type attribute
+ * Downstream value decoders, one per schema value_type. Each one validates
+ * the JSON value against the type declared by the thing, coercing it when
+ * lossless, and returns the payload length or a negative errno.
  */
-static int parse_json2data(json_object *jobj, knot_value_type *kvalue)
+typedef int (*value_decoder_t) (json_object *jobj, knot_value_type *kvalue);
+
+static int decode_int(json_object *jobj, knot_value_type *kvalue)
 {
-	json_object *jobjkey;
-	const char *str;
-	uint8_t *u8val;
-	size_t olen = 0;
+	int64_t val;
+	double dval;
 
-	jobjkey = jobj;
-	switch (json_object_get_type(jobjkey)) {
-	case json_type_boolean:
-		kvalue->val_b = json_object_get_boolean(jobjkey);
-		olen = sizeof(kvalue->val_b);
+	switch (json_object_get_type(jobj)) {
+	case json_type_int:
+		val = json_object_get_int64(jobj);
 		break;
 	case json_type_double:
-		/* FIXME: how to handle overflow? */
-		kvalue->val_f = (float) json_object_get_double(jobjkey);
-		olen = sizeof(kvalue->val_f);
-		break;
-	case json_type_int:
+		/* Accept only integral values, e.g.: 10.0 */
+		dval = json_object_get_double(jobj);
+		if (dval != trunc(dval) || dval < INT32_MIN || dval > INT32_MAX)
+			return -EINVAL;
 
-		kvalue->val_i = json_object_get_int(jobjkey);
-		olen = sizeof(kvalue->val_i);
+		val = (int64_t) dval;
 		break;
+	case json_type_boolean:
 	case json_type_string:
-		str = json_object_get_string(jobjkey);
-		u8val = l_base64_decode(str, strlen(str), &olen);
-		if (!u8val)
-			break;
+	case json_type_null:
+	case json_type_object:
+	case json_type_array:
+	default:
+		return -EINVAL;
+	}
+
+	if (val < INT32_MIN || val > INT32_MAX)
+		return -ERANGE;
 
-		if (olen > KNOT_DATA_RAW_SIZE)
-			olen = KNOT_DATA_RAW_SIZE; /* truncate */
+	kvalue->val_i = val;
+
+	return sizeof(kvalue->val_i);
+}
+
+static int decode_float(json_object *jobj, knot_value_type *kvalue)
+{
+	double val;
 
-		memcpy(kvalue->raw, u8val, olen);
-		l_free(u8val);
+	switch (json_object_get_type(jobj)) {
+	case json_type_int:
+	case json_type_double:
+		val = json_object_get_double(jobj);
 		break;
-	/* FIXME: not implemented */
+	case json_type_boolean:
+	case json_type_string:
 	case json_type_null:
 	case json_type_object:
 	case json_type_array:
 	default:
-		break;
+		return -EINVAL;
 	}
 
-	return olen;
+	if (!isfinite(val) || fabs(val) > FLT_MAX)
+		return -ERANGE;
+
+	kvalue->val_f = (float) val;
+
+	return sizeof(kvalue->val_f);
 }
 
-struct l_queue *parser_schema_to_list(const char *json_str)
+static int decode_bool(json_object *jobj, knot_value_type *kvalue)
 {
-	json_object *jobjarray, *jobjentry, *jobjkey;
-	struct l_queue *list;
-	knot_msg_schema *entry;
-	int sensor_id, value_type, unit, type_id;
-	uint64_t i;
-	const char *name;
+	int64_t val;
 
-	jobjarray = json_tokener_parse(json_str);
-	if (!jobjarray)
-		return NULL;
+	switch (json_object_get_type(jobj)) {
+	case json_type_boolean:
+		kvalue->val_b = json_object_get_boolean(jobj);
+		break;
+	case json_type_int:
+		/* Accept 0 and 1 only */
+		val = json_object_get_int64(jobj);
+		if (val != 0 && val != 1)
+			return -EINVAL;
 
-	if (json_object_get_type(jobjarray) != json_type_array) {
-		json_object_put(jobjarray);
-		return NULL;
+		kvalue->val_b = val;
+		break;
+	case json_type_double:
+	case json_type_string:
+	case json_type_null:
+	case json_type_object:
+	case json_type_array:
+	default:
+		return -EINVAL;
 	}
 
-	list = l_queue_new();
-	/* Expected JSON object is in the following format:
-	 *
-	 * [ {"sensor_id": x, "value_type": w,
-	 *		"unit": z "type_id": y, "name": "foo"}]
-	 * }
-	 */
+	return sizeof(kvalue->val_b);
+}
 
-	for (i = 0; i < json_object_array_length(jobjarray); i++) {
+static int decode_raw(json_object *jobj, knot_value_type *kvalue)
+{
+	ssize_t olen;
+	size_t len;
 
-		jobjentry = json_object_array_get_idx(jobjarray, i);
+	if (json_object_get_type(jobj) != json_type_string)
+		return -EINVAL;
 
-		/* Getting 'sensor_id' */
-		if (!json_object_object_get_ex(jobjentry, "sensor_id",
-								&jobjkey))
-			goto done;
+	/* Cheap early reject, base64_decode() checks the decoded length */
+	len = json_object_get_string_len(jobj);
+	if (len > BASE64_ENCODED_LEN(sizeof(kvalue->raw)))
+		return -EMSGSIZE;
 
-		if (json_object_get_type(jobjkey) != json_type_int)
-			goto done;
+	/* Reject instead of truncating: the thing can't store it */
+	olen = base64_decode(json_object_get_string(jobj), len,
+			     kvalue->raw, sizeof(kvalue->raw));
+	if (olen == -EMSGSIZE)
+		return -EMSGSIZE;
 
-		sensor_id = json_object_get_int(jobjkey);
+	return olen < 0 ? -EINVAL : olen;
+}
 
-		/* Getting 'value_type' */
-		if (!json_object_object_get_ex(jobjentry, "value_type",
-								&jobjkey))
-			goto done;
+static const value_decoder_t value_decoders[] = {
+	[KNOT_VALUE_TYPE_INT] = decode_int,
+	[KNOT_VALUE_TYPE_FLOAT] = decode_float,
+	[KNOT_VALUE_TYPE_BOOL] = decode_bool,
+	[KNOT_VALUE_TYPE_RAW] = decode_raw,
+};
 
-		if (json_object_get_type(jobjkey) != json_type_int)
-			goto done;
+static value_decoder_t find_decoder(const struct schema *schema,
+				    uint8_t sensor_id)
+{
+	const knot_msg_schema *entry;
+	uint8_t value_type;
 
-		value_type = json_object_get_int(jobjkey);
+	entry = schema_find(schema, sensor_id);
+	if (!entry)
+		return NULL;
 
-		/* Getting 'unit' */
-		if (!json_object_object_get_ex(jobjentry, "unit", &jobjkey))
-			goto done;
+	value_type = entry->values.value_type;
+	if (value_type >= L_ARRAY_SIZE(value_decoders))
+		return NULL;
 
-		if (json_object_get_type(jobjkey) != json_type_int)
-			goto done;
+	return value_decoders[value_type];
+}
 
-		unit = json_object_get_int(jobjkey);
+/*
+ * Schema entry descriptor: JSON key, JSON type and knot_msg_schema member.
+ * Drives both schema_item_create_obj() and parser_schema_from_json().
+ */
+#define SCHEMA_FIELDS(F)						\
+	F("sensor_id",	int,	sensor_id)				\
+	F("value_type",	int,	values.value_type)			\
+	F("unit",	int,	values.unit)				\
+	F("type_id",	int,	values.type_id)				\
+	F("name",	string,	values.name)
+
+#define SCHEMA_GET_int(dst, jobj)					\
+	(dst) = json_object_get_int(jobj)
+#define SCHEMA_GET_string(dst, jobj)					\
+	strncpy((dst), json_object_get_string(jobj), sizeof(dst) - 1)
+
+#define SCHEMA_FIELD_DECODE(key, type, member)				\
+	if (!json_object_object_get_ex(jobjentry, key, &jobjkey) ||	\
+	    json_object_get_type(jobjkey) != json_type_##type)		\
+		goto done;						\
+	SCHEMA_GET_##type(entry.member, jobjkey);
+
+#define SCHEMA_FIELD_ENCODE(key, type, member)				\
+	json_object_object_add(json_schema, key,			\
+			       json_object_new_##type(schema->member));
+
+/**
+ * parser_schema_from_json:
+ * @jobjarray: JSON array of schema entries
+ *
+ * Decodes a schema as sent by the cloud. Decoding stops at the first
+ * malformed entry.
+ *
+ * Returns: interned schema, released with schema_unref(), or NULL if no
+ * entry could be decoded.
+ */
+struct schema *parser_schema_from_json(json_object *jobjarray)
+{
+	json_object *jobjentry, *jobjkey;
+	struct schema *schema;
+	knot_msg_schema entry;
+	uint64_t i;
 
-		/* Getting 'type_id' */
-		if (!json_object_object_get_ex(jobjentry, "type_id", &jobjkey))
-			goto done;
+	if (json_object_get_type(jobjarray) != json_type_array)
+		return NULL;
 
-		if (json_object_get_type(jobjkey) != json_type_int)
-			goto done;
+	schema = schema_new();
+	/* Expected JSON object is in the following format:
+	 *
+	 * [ {"sensor_id": x, "value_type": w,
+	 *		"unit": z "type_id": y, "name": "foo"}]
+	 * }
+	 */
 
-		type_id = json_object_get_int(jobjkey);
+	for (i = 0; i < json_object_array_length(jobjarray); i++) {
 
-		/* Getting 'name' */
-		if (!json_object_object_get_ex(jobjentry, "name", &jobjkey))
-			goto done;
+		jobjentry = json_object_array_get_idx(jobjarray, i);
+		memset(&entry, 0, sizeof(entry));
 
-		if (json_object_get_type(jobjkey) != json_type_string)
-			goto done;
+		SCHEMA_FIELDS(SCHEMA_FIELD_DECODE)
 
-		name = json_object_get_string(jobjkey);
 		/*
 		 * Validation not required: validation has been performed
 		 * previously when schema has been submitted to the cloud.
 		 */
-		entry = l_new(knot_msg_schema, 1);
-		entry->sensor_id = sensor_id;
-		entry->values.value_type = value_type;
-		entry->values.unit = unit;
-		entry->values.type_id = type_id;
-		strncpy(entry->values.name, name,
-						sizeof(entry->values.name) - 1);
-
-		l_queue_push_tail(list, entry);
+		schema_add(schema, &entry);
 	}
 
 done:
-	json_object_put(jobjarray);
-
-	if (l_queue_isempty(list)) {
-		l_queue_destroy(list, NULL);
-		list = NULL;
+	if (!schema_count(schema)) {
+		schema_unref(schema);
+		return NULL;
 	}
 
-	return list;
+	return schema_intern(schema);
 }
 
 struct l_queue *parser_queue_from_json_array(json_object *jobj,
-					parser_json_array_item_cb foreach_cb)
+					parser_json_array_item_cb foreach_cb,
+					void *user_data)
 {
 	json_object *jobjentry, *jarray;
 	struct l_queue *list;
@@ -211,7 +288,7 @@ struct l_queue *parser_queue_from_json_array(json_object *jobj,
 	for (i = 0; i < len; i++) {
 		jobjentry = json_object_array_get_idx(jarray, i);
 
-		item = foreach_cb(jobjentry);
+		item = foreach_cb(jobjentry, user_data);
 		if (item)
 			l_queue_push_tail(list, item);
 	}
@@ -219,7 +296,7 @@ struct l_queue *parser_queue_from_json_array(json_object *jobj,
 	return list;
 }
 
-struct l_queue *parser_request_to_list(json_object *jso)
+struct l_queue *parser_request_to_list(json_object *jso, struct arena *arena)
 {
 	struct l_queue *list;
 	json_object *json_array;
@@ -243,15 +320,15 @@ struct l_queue *parser_request_to_list(json_object *jso)
 
 		sensor_id = json_object_get_int(jobjentry);
 
-		if (!l_queue_push_tail(list,
-				l_memdup(&sensor_id, sizeof(sensor_id))))
+		if (!l_queue_push_tail(list, arena_memdup(arena, &sensor_id,
+							  sizeof(sensor_id))))
 			goto fail;
 	}
 
 	return list;
 
 fail:
-	l_queue_destroy(list, l_free);
+	l_queue_destroy(list, NULL);
 	return NULL;
 }
 
@@ -278,15 +355,30 @@ json_object *parser_sensorid_to_json(const char *key, struct l_queue *list)
 	return setdatajobj;
 }
 
-struct l_queue *parser_update_to_list(json_object *jso)
+/**
+ * parser_update_to_list:
+ * @jso: data update JSON object received from cloud
+ * @schema: schema of the target thing
+ * @arena: arena to allocate the messages from
+ *
+ * Creates a list of KNOT_MSG_PUSH_DATA_REQ messages from a data update.
+ * Each value is validated against (and coerced to) the value type declared
+ * in @schema for its sensor, so that an invalid update is rejected at
+ * the gateway instead of being sent over the air.
+ *
+ * Returns: list of knot_msg_data or NULL if any of the values is invalid.
+ */
+struct l_queue *parser_update_to_list(json_object *jso,
+				      const struct schema *schema,
+				      struct arena *arena)
 {
 	json_object *json_array;
 	json_object *json_data;
 	json_object *jobjkey;
+	value_decoder_t decode;
 	knot_msg_data *msg;
 	struct l_queue *list;
 	uint64_t i;
-	int jtype;
 	int olen;
 	uint8_t sensor_id;
 
@@ -311,21 +403,23 @@ struct l_queue *parser_update_to_list(json_object *jso)
 
 		sensor_id = json_object_get_int(jobjkey);
 
-		/* Getting 'value' */
-		if (!json_object_object_get_ex(json_data, "value", &jobjkey))
+		decode = find_decoder(schema, sensor_id);
+		if (!decode) {
+			log_error("Update rejected: unknown sensor %u",
+				  sensor_id);
 			goto fail;
+		}
 
-		jtype = json_object_get_type(jobjkey);
-		if (jtype != json_type_int &&
-		jtype != json_type_double && jtype != json_type_boolean &&
-			jtype != json_type_string)
+		/* Getting 'value' */
+		if (!json_object_object_get_ex(json_data, "value", &jobjkey))
 			goto fail;
 
-		msg = l_new(knot_msg_data, 1);
+		msg = arena_alloc(arena, sizeof(*msg));
 
-		olen = parse_json2data(jobjkey, &msg->payload);
+		olen = decode(jobjkey, &msg->payload);
 		if (olen <= 0) {
-			l_free(msg);
+			log_error("Update rejected: invalid value for sensor %u",
+				  sensor_id);
 			goto fail;
 		}
 
@@ -333,16 +427,14 @@ struct l_queue *parser_update_to_list(json_object *jso)
 		msg->hdr.type = KNOT_MSG_PUSH_DATA_REQ;
 		msg->hdr.payload_len = olen + sizeof(msg->sensor_id);
 
-		if (!l_queue_push_tail(list, msg)) {
-			l_free(msg);
+		if (!l_queue_push_tail(list, msg))
 			goto fail;
-		}
 	}
 
 	return list;
 
 fail:
-	l_queue_destroy(list, l_free);
+	l_queue_destroy(list, NULL);
 	return NULL;
 }
 
@@ -357,9 +449,16 @@ static int knot_value_as_int(const knot_value_type *data)
 /*
  * TODO: consider moving this to knot-protocol
  */
-static double knot_value_as_double(const knot_value_type *data)
+static json_object *knot_value_as_double(const knot_value_type *data)
 {
-	return (double) data->val_f;
+	char str[FLOATSTR_SIZE];
+
+	/* NaN and infinities are left to json-c */
+	if (!isfinite(data->val_f) ||
+	    floatstr_shortest(data->val_f, str, sizeof(str)) < 0)
+		return json_object_new_double(data->val_f);
+
+	return json_object_new_double_s(data->val_f, str);
 }
 
 /*
@@ -370,19 +469,12 @@ static bool knot_value_as_boolean(const knot_value_type *data)
 	return data->val_b;
 }
 
-static char *knot_value_as_raw(const knot_value_type *data,
-			       uint8_t kval_len, size_t *encoded_len)
+static ssize_t knot_value_as_raw(const knot_value_type *data,
+				 uint8_t kval_len, char *encoded,
+				 size_t encoded_size)
 {
-	char *encoded;
-	size_t olen;
-
-	encoded = l_base64_encode(data->raw, kval_len, 0, &olen);
-	if (!encoded)
-		return NULL;
-
-	*encoded_len = olen;
-
-	return encoded;
+	return base64_encode(data->raw, MIN(kval_len, sizeof(data->raw)),
+			     encoded, encoded_size);
 }
 
 json_object *parser_data_create_object(const char *device_id, uint8_t sensor_id,
@@ -393,8 +485,8 @@ json_object *parser_data_create_object(const char *device_id, uint8_t sensor_id,
 	json_object *json_msg;
 	json_object *data;
 	json_object *json_array;
-	char *encoded;
-	size_t encoded_len;
+	char encoded[BASE64_ENCODED_LEN(KNOT_DATA_RAW_SIZE) + 1];
+	ssize_t encoded_len;
 
 	json_msg = json_object_new_object();
 	json_array = json_object_new_array();
@@ -412,7 +504,7 @@ json_object *parser_data_create_object(const char *device_id, uint8_t sensor_id,
 		break;
 	case KNOT_VALUE_TYPE_FLOAT:
 		json_object_object_add(data, "value",
-			json_object_new_double(knot_value_as_double(value)));
+				       knot_value_as_double(value));
 		break;
 	case KNOT_VALUE_TYPE_BOOL:
 		json_object_object_add(data, "value",
@@ -420,8 +512,9 @@ json_object *parser_data_create_object(const char *device_id, uint8_t sensor_id,
 		break;
 	case KNOT_VALUE_TYPE_RAW:
 		/* Encode as base64 */
-		encoded = knot_value_as_raw(value, kval_len, &encoded_len);
-		if (!encoded)
+		encoded_len = knot_value_as_raw(value, kval_len, encoded,
+					       sizeof(encoded));
+		if (encoded_len < 0)
 			goto fail;
 
 		json_object_object_add(data, "value",
@@ -453,93 +546,42 @@ fail:
 	return NULL;
 }
 
-json_object *parser_device_json_create(const char *device_id,
-				       const char *device_name)
-{
-	json_object *device;
-
-	device = json_object_new_object();
-	if (!device)
-		return NULL;
-
-	json_object_object_add(device, "name",
-			       json_object_new_string(device_name));
-	json_object_object_add(device, "id",
-			       json_object_new_string(device_id));
-
-	/*
-	 * Returned JSON object is in the following format:
-	 *
-	 * { "id": "fbe64efa6c7f717e",
-	 *   "name": "KNoT Thing"
-	 * }
-	 */
-	return device;
-}
-
-json_object *parser_auth_json_create(const char *device_id,
-				     const char *device_token)
-{
-	json_object *auth;
+#define PARSER_FIELD_ADD(field)						\
+	json_object_object_add(jobj, #field, json_object_new_string(field));
 
-	auth = json_object_new_object();
-	if (!auth)
-		return NULL;
-
-	json_object_object_add(auth, "id",
-			       json_object_new_string(device_id));
-	json_object_object_add(auth, "token",
-			       json_object_new_string(device_token));
-
-	/*
-	 * Returned JSON object is in the following format:
-	 *
-	 * { "id": "fbe64efa6c7f717e",
-	 *   "token": "0c20c12e2ac058d0513d81dc58e33b2f9ff8c83d"
-	 * }
-	 */
-	return auth;
+/*
+ * Defines parser_<msg>_json_create() for each PARSER_ID_MESSAGES entry,
+ * creating a JSON object in the following format:
+ *
+ * { "id": "fbe64efa6c7f717e",
+ *   "<field>": "<value>", ...
+ * }
+ */
+#define PARSER_DEFINE_ENCODER(msg, fields)				\
+json_object *parser_##msg##_json_create(const char *id			\
+					fields(PARSER_FIELD_PARAM))	\
+{									\
+	json_object *jobj;						\
+									\
+	jobj = json_object_new_object();				\
+	if (!jobj)							\
+		return NULL;						\
+									\
+	PARSER_FIELD_ADD(id)						\
+	fields(PARSER_FIELD_ADD)					\
+									\
+	return jobj;							\
 }
 
-json_object *parser_unregister_json_create(const char *device_id)
-{
-	json_object *unreg;
-
-	unreg = json_object_new_object();
-	if (!unreg)
-		return NULL;
-
-	json_object_object_add(unreg, "id",
-			       json_object_new_string(device_id));
-
-	/*
-	 * Returned JSON object is in the following format:
-	 *
-	 * { "id": "fbe64efa6c7f717e" }
-	 */
-	return unreg;
-}
+PARSER_ID_MESSAGES(PARSER_DEFINE_ENCODER)
 
-static json_object *schema_item_create_obj(knot_msg_schema *schema)
+static json_object *schema_item_create_obj(const knot_msg_schema *schema)
 {
 	json_object *json_schema;
 
 	json_schema = json_object_new_object();
 
-	json_object_object_add(json_schema, "sensor_id",
-				       json_object_new_int(schema->sensor_id));
-	json_object_object_add(json_schema, "value_type",
-				json_object_new_int(
-					schema->values.value_type));
-	json_object_object_add(json_schema, "unit",
-				json_object_new_int(
-					schema->values.unit));
-	json_object_object_add(json_schema, "type_id",
-				json_object_new_int(
-					schema->values.type_id));
-	json_object_object_add(json_schema, "name",
-				json_object_new_string(
-					schema->values.name));
+	SCHEMA_FIELDS(SCHEMA_FIELD_ENCODE)
 
 	/*
 	 * Returned JSON object is in the following format:
@@ -556,18 +598,18 @@ static json_object *schema_item_create_obj(knot_msg_schema *schema)
 	return json_schema;
 }
 
-static void schema_item_create_and_append(void *data, void *user_data)
+static void schema_item_create_and_append(const knot_msg_schema *entry,
+					  void *user_data)
 {
-	knot_msg_schema *schema = data;
-	json_object *schema_list = user_data;
+	json_object *json_schema_array = user_data;
 	json_object *item;
 
-	item = schema_item_create_obj(schema);
-	json_object_array_add(schema_list, item);
+	item = schema_item_create_obj(entry);
+	json_object_array_add(json_schema_array, item);
 }
 
 json_object *parser_schema_create_object(const char *device_id,
-					 struct l_queue *schema_list)
+					 const struct schema *schema)
 {
 	json_object *json_msg;
 	json_object *json_schema_array;
@@ -578,7 +620,7 @@ json_object *parser_schema_create_object(const char *device_id,
 	json_object_object_add(json_msg, "id",
 			       json_object_new_string(device_id));
 
-	l_queue_foreach(schema_list, schema_item_create_and_append,
+	schema_foreach(schema, schema_item_create_and_append,
 			json_schema_array);
 
 	json_object_object_add(json_msg, "schema", json_schema_array);
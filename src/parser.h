@@ -19,26 +19,51 @@
  *
  */
 
-typedef void *(*parser_json_array_item_cb) (json_object *array_item);
+typedef void *(*parser_json_array_item_cb) (json_object *array_item,
+					    void *user_data);
 
-struct l_queue *parser_schema_to_list(const char *json_str);
+struct arena;
+struct schema;
+
+struct schema *parser_schema_from_json(json_object *jobjarray);
 struct l_queue *parser_queue_from_json_array(json_object *jobj,
-				parser_json_array_item_cb foreach_cb);
+				parser_json_array_item_cb foreach_cb,
+				void *user_data);
 
-struct l_queue *parser_request_to_list(json_object *jso);
+struct l_queue *parser_request_to_list(json_object *jso, struct arena *arena);
 json_object *parser_sensorid_to_json(const char *key, struct l_queue *list);
-struct l_queue *parser_update_to_list(json_object *jso);
+struct l_queue *parser_update_to_list(json_object *jso,
+				      const struct schema *schema,
+				      struct arena *arena);
 
 json_object *parser_data_create_object(const char *device_id, uint8_t sensor_id,
 				uint8_t value_type,
 				const knot_value_type *value,
 				uint8_t kval_len);
-json_object *parser_device_json_create(const char *device_id,
-				       const char *device_name);
-json_object *parser_auth_json_create(const char *device_id,
-				     const char *device_token);
-json_object *parser_unregister_json_create(const char *device_id);
+
+/*
+ * Northbound messages made of the device id and string fields:
+ * M(msg, fields) declares parser_<msg>_json_create(id, fields...), where
+ * fields(F) expands F(field) for each field after the id. Encoders only:
+ * knotd never receives these, southbound messages are CLOUD_EVENTS entries.
+ */
+#define PARSER_DEVICE_FIELDS(F)		F(name)
+#define PARSER_AUTH_FIELDS(F)		F(token)
+#define PARSER_UNREGISTER_FIELDS(F)
+
+#define PARSER_ID_MESSAGES(M)						\
+	M(device, PARSER_DEVICE_FIELDS)					\
+	M(auth, PARSER_AUTH_FIELDS)					\
+	M(unregister, PARSER_UNREGISTER_FIELDS)
+
+#define PARSER_FIELD_PARAM(field)	, const char *field
+#define PARSER_DECLARE_ENCODER(msg, fields)				\
+	json_object *parser_##msg##_json_create(const char *id		\
+					fields(PARSER_FIELD_PARAM));
+
+PARSER_ID_MESSAGES(PARSER_DECLARE_ENCODER)
+
 json_object *parser_schema_create_object(const char *device_id,
-					 struct l_queue *schema_list);
+					 const struct schema *schema);
 const char *parser_get_key_str_from_json_obj(json_object *jso, const char *key);
 bool parser_is_key_str_or_null(const json_object *jso, const char *key);
@@ -0,0 +1,130 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <ell/ell.h>
+
+#include "pdubuf.h"
+
+#define PDUBUF_POOL_MAX		64 /* Idle buffers kept for reuse */
+
+static struct pdubuf *pool;
+static unsigned int pool_len;
+static unsigned int pool_max = PDUBUF_POOL_MAX;
+
+/**
+ * pdubuf_get:
+ *
+ * Takes an empty buffer from the pool, allocating one if the pool is empty.
+ *
+ * Returns: a buffer to be released with pdubuf_put().
+ */
+struct pdubuf *pdubuf_get(void)
+{
+	struct pdubuf *buf = pool;
+
+	if (!buf)
+		return l_new(struct pdubuf, 1);
+
+	pool = buf->next;
+	pool_len--;
+
+	buf->next = NULL;
+	buf->head = 0;
+	buf->tail = 0;
+	buf->stamp = 0;
+
+	return buf;
+}
+
+void pdubuf_put(struct pdubuf *buf)
+{
+	if (unlikely(!buf))
+		return;
+
+	if (pool_len >= pool_max) {
+		l_free(buf);
+		return;
+	}
+
+	buf->next = pool;
+	pool = buf;
+	pool_len++;
+}
+
+/* Moves the unprocessed octets to the beginning of the buffer */
+void pdubuf_compact(struct pdubuf *buf)
+{
+	size_t len = buf->tail - buf->head;
+
+	if (!buf->head)
+		return;
+
+	if (len)
+		memmove(buf->data, buf->data + buf->head, len);
+
+	buf->head = 0;
+	buf->tail = len;
+}
+
+/**
+ * pdubuf_pool_reserve:
+ * @count: idle buffers to keep on top of the default, may be negative
+ *
+ * Grows or shrinks the pool, for users keeping many buffers in flight
+ * between two visits to the main loop: the node reader threads.
+ */
+void pdubuf_pool_reserve(int count)
+{
+	struct pdubuf *buf;
+
+	if (count < 0 && (unsigned int) -count > pool_max - PDUBUF_POOL_MAX)
+		pool_max = PDUBUF_POOL_MAX;
+	else
+		pool_max += count;
+
+	while (pool_len > pool_max) {
+		buf = pool;
+		pool = buf->next;
+		pool_len--;
+		l_free(buf);
+	}
+}
+
+void pdubuf_pool_clear(void)
+{
+	struct pdubuf *buf;
+
+	while (pool) {
+		buf = pool;
+		pool = buf->next;
+		l_free(buf);
+	}
+
+	pool_len = 0;
+}
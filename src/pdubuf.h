@@ -0,0 +1,43 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Fixed size PDU buffers recycled through a free list, so that reading
+ * from and writing to things doesn't hit the allocator on each event.
+ * Received data is kept between 'head' and 'tail': a stream transport may
+ * leave a partial PDU in the buffer until the next read.
+ */
+
+#define PDUBUF_SIZE		1024
+
+struct pdubuf {
+	struct pdubuf *next;		/* Free list */
+	size_t head;			/* First unprocessed octet */
+	size_t tail;			/* End of valid data */
+	uint64_t stamp;			/* trace_now() of the last read */
+	uint8_t data[PDUBUF_SIZE];
+};
+
+struct pdubuf *pdubuf_get(void);
+void pdubuf_put(struct pdubuf *buf);
+void pdubuf_compact(struct pdubuf *buf);
+void pdubuf_pool_reserve(int count);
+void pdubuf_pool_clear(void);
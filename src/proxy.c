@@ -30,6 +30,7 @@
 
 #include "hal/linux_log.h"
 
+#include "log.h"
 #include "dbus.h"
 #include "device.h"
 #include "proxy.h"
@@ -94,7 +95,7 @@ static void ellproxy_destroy(const void *key, void *value, void *user_data)
 static void service_appeared(struct l_dbus *dbus, void *user_data)
 {
 	struct service_proxy *proxy = user_data;
-	hal_log_info("Service appeared: %s", proxy->name);
+	log_info("Service appeared: %s", proxy->name);
 	proxy->ellproxy_list = l_hashmap_string_new();
 }
 
@@ -102,7 +103,7 @@ static void service_disappeared(struct l_dbus *dbus, void *user_data)
 {
 	struct service_proxy *proxy = user_data;
 
-	hal_log_info("Service disappeared: %s", proxy->name);
+	log_info("Service disappeared: %s", proxy->name);
 
 	/* FIXME: Investigate if proxy should be released */
 	l_hashmap_foreach(proxy->ellproxy_list, ellproxy_destroy, NULL);
@@ -137,12 +138,12 @@ static void added(struct l_dbus_proxy *ellproxy, void *user_data)
 		/* Ownership belongs to device.c */
 		device = device_create(id, name, paired, false, false);
 		if (!device) {
-			hal_log_error("Can't create device: %s", id);
+			log_error("Can't create device: %s", id);
 			return;
 		}
 	}
 
-	hal_log_info("Id: %s proxy added: %s %s",
+	log_info("Id: %s proxy added: %s %s",
 			     id, path, interface);
 	l_hashmap_insert(proxy->ellproxy_list, id, ellproxy);
 }
@@ -158,7 +159,7 @@ static void removed(struct l_dbus_proxy *ellproxy, void *user_data)
 		return;
 
 	/* Debug purpose only */
-	hal_log_info("proxy removed: %s %s", path, interface);
+	log_info("proxy removed: %s %s", path, interface);
 	if (!l_dbus_proxy_get_property(ellproxy, "Id", "s", &id))
 		return;
 
@@ -202,7 +203,7 @@ static void property_changed(struct l_dbus_proxy *ellproxy,
 		return;
 	}
 
-	hal_log_info("property changed: %s (%s %s)", propname, path, interface);
+	log_info("property changed: %s (%s %s)", propname, path, interface);
 }
 
 static struct service_proxy *watch_create(const char *service,
@@ -248,7 +249,7 @@ int proxy_start(const char *service, const char *path, const char *interface,
 		proxy_ready_func_t ready_cb, void *user_data)
 {
 
-	hal_log_info("D-Bus Proxy");
+	log_info("D-Bus Proxy");
 
 	/*
 	 * TODO: Add API to allow registering proxies dynamically.
@@ -0,0 +1,315 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <ell/ell.h>
+
+#include <knot/knot_protocol.h>
+
+#include "schema.h"
+
+#define SENSOR_ID_MAX		UINT8_MAX
+
+struct schema {
+	int refs;
+	bool interned;					/* Shared: immutable */
+	uint64_t hash;					/* Set once interned */
+	uint32_t valid[(SENSOR_ID_MAX + 1) / 32];	/* Bitmap by sensor_id */
+	uint8_t slot[SENSOR_ID_MAX + 1];		/* sensor_id to entry */
+	unsigned int count;
+	unsigned int size;				/* Allocated entries */
+	knot_msg_schema *entry;
+};
+
+/* Interned schemas by content hash: key points to schema->hash */
+static struct l_hashmap *interned;
+
+static inline bool schema_is_valid(const struct schema *schema,
+				   uint8_t sensor_id)
+{
+	return schema->valid[sensor_id / 32] & (1U << (sensor_id % 32));
+}
+
+struct schema *schema_new(void)
+{
+	struct schema *schema = l_new(struct schema, 1);
+
+	schema->refs = 1;
+
+	return schema;
+}
+
+struct schema *schema_ref(struct schema *schema)
+{
+	if (unlikely(!schema))
+		return NULL;
+
+	schema->refs++;
+
+	return schema;
+}
+
+void schema_unref(struct schema *schema)
+{
+	if (unlikely(!schema))
+		return;
+
+	if (--schema->refs)
+		return;
+
+	if (schema->interned) {
+		l_hashmap_remove(interned, &schema->hash);
+		if (l_hashmap_isempty(interned)) {
+			l_hashmap_destroy(interned, NULL);
+			interned = NULL;
+		}
+	}
+
+	l_free(schema->entry);
+	l_free(schema);
+}
+
+/**
+ * schema_add:
+ * @schema: schema
+ * @entry: sensor schema
+ *
+ * Adds a copy of @entry to @schema unless its sensor_id is already
+ * present. Interned schemas can't be changed.
+ *
+ * Returns: true if @entry was added and false if the sensor_id is taken.
+ */
+bool schema_add(struct schema *schema, const knot_msg_schema *entry)
+{
+	uint8_t sensor_id = entry->sensor_id;
+
+	if (schema->interned || schema_is_valid(schema, sensor_id))
+		return false;
+
+	if (schema->count == schema->size) {
+		schema->size = schema->size ? schema->size * 2 : 4;
+		schema->entry = l_realloc(schema->entry,
+					  schema->size * sizeof(*entry));
+	}
+
+	memcpy(&schema->entry[schema->count], entry, sizeof(*entry));
+	schema->slot[sensor_id] = schema->count++;
+	schema->valid[sensor_id / 32] |= 1U << (sensor_id % 32);
+
+	return true;
+}
+
+/**
+ * schema_find:
+ * @schema: schema
+ * @sensor_id: sensor id
+ *
+ * Returns: schema of @sensor_id or NULL if it isn't part of @schema.
+ */
+const knot_msg_schema *schema_find(const struct schema *schema,
+				   uint8_t sensor_id)
+{
+	if (unlikely(!schema) || !schema_is_valid(schema, sensor_id))
+		return NULL;
+
+	return &schema->entry[schema->slot[sensor_id]];
+}
+
+void schema_foreach(const struct schema *schema,
+		    schema_foreach_func_t function, void *user_data)
+{
+	unsigned int i;
+
+	if (unlikely(!schema))
+		return;
+
+	for (i = 0; i < schema->count; i++)
+		function(&schema->entry[i], user_data);
+}
+
+unsigned int schema_count(const struct schema *schema)
+{
+	return schema ? schema->count : 0;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *octet = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= octet[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * schema_hash:
+ * @schema: schema
+ *
+ * Content hash (FNV-1a) of @schema. Entries are hashed in sensor_id order
+ * and names up to their length, so that the same sensors sent in a
+ * different order or through different buffers hash the same.
+ *
+ * Returns: 64-bit hash of @schema.
+ */
+uint64_t schema_hash(const struct schema *schema)
+{
+	const knot_msg_schema *entry;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned int sensor_id;
+	uint8_t name_len;
+
+	if (unlikely(!schema))
+		return hash;
+
+	if (schema->interned)
+		return schema->hash;
+
+	for (sensor_id = 0; sensor_id <= SENSOR_ID_MAX; sensor_id++) {
+		if (!schema_is_valid(schema, sensor_id))
+			continue;
+
+		entry = &schema->entry[schema->slot[sensor_id]];
+		hash = fnv1a(hash, &entry->sensor_id,
+			     sizeof(entry->sensor_id));
+		hash = fnv1a(hash, &entry->values.type_id,
+			     sizeof(entry->values.type_id));
+		hash = fnv1a(hash, &entry->values.value_type,
+			     sizeof(entry->values.value_type));
+		hash = fnv1a(hash, &entry->values.unit,
+			     sizeof(entry->values.unit));
+		name_len = strnlen(entry->values.name,
+				   sizeof(entry->values.name));
+		hash = fnv1a(hash, &name_len, sizeof(name_len));
+		hash = fnv1a(hash, entry->values.name, name_len);
+	}
+
+	return hash;
+}
+
+/**
+ * schema_equal:
+ * @a: schema
+ * @b: schema
+ *
+ * Compares the content of two schemas, regardless of the order their
+ * entries were added in. Equal hashes don't make equal schemas.
+ *
+ * Returns: true if @a and @b declare the same sensors.
+ */
+bool schema_equal(const struct schema *a, const struct schema *b)
+{
+	const knot_msg_schema *ea, *eb;
+	unsigned int sensor_id;
+
+	if (a == b)
+		return true;
+
+	if (unlikely(!a || !b))
+		return false;
+
+	if (a->count != b->count ||
+	    memcmp(a->valid, b->valid, sizeof(a->valid)) != 0)
+		return false;
+
+	for (sensor_id = 0; sensor_id <= SENSOR_ID_MAX; sensor_id++) {
+		if (!schema_is_valid(a, sensor_id))
+			continue;
+
+		ea = &a->entry[a->slot[sensor_id]];
+		eb = &b->entry[b->slot[sensor_id]];
+		if (ea->values.type_id != eb->values.type_id ||
+		    ea->values.value_type != eb->values.value_type ||
+		    ea->values.unit != eb->values.unit ||
+		    strncmp(ea->values.name, eb->values.name,
+			    sizeof(ea->values.name)))
+			return false;
+	}
+
+	return true;
+}
+
+static unsigned int hash_key_hash(const void *p)
+{
+	const uint64_t *hash = p;
+
+	return *hash ^ (*hash >> 32);
+}
+
+static int hash_key_compare(const void *a, const void *b)
+{
+	const uint64_t *hash_a = a;
+	const uint64_t *hash_b = b;
+
+	return *hash_a < *hash_b ? -1 : *hash_a > *hash_b;
+}
+
+/**
+ * schema_intern:
+ * @schema: schema, consumed
+ *
+ * Shares schemas of same content: things running the same firmware, and
+ * their registered devices, hold one instance. The returned schema is
+ * immutable and released with schema_unref().
+ *
+ * Returns: the interned schema equal to @schema, which may be @schema.
+ */
+struct schema *schema_intern(struct schema *schema)
+{
+	struct schema *found;
+	uint64_t hash;
+
+	if (unlikely(!schema) || schema->interned)
+		return schema;
+
+	if (!interned) {
+		interned = l_hashmap_new();
+		l_hashmap_set_hash_function(interned, hash_key_hash);
+		l_hashmap_set_compare_function(interned, hash_key_compare);
+	}
+
+	hash = schema_hash(schema);
+	found = l_hashmap_lookup(interned, &hash);
+	if (found && schema_equal(found, schema)) {
+		schema_unref(schema);
+		return schema_ref(found);
+	}
+
+	/* Hash collision: the first one stays shared, this one private */
+	if (found)
+		return schema;
+
+	schema->hash = hash;
+	schema->interned = true;
+	l_hashmap_insert(interned, &schema->hash, schema);
+
+	return schema;
+}
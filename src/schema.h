@@ -0,0 +1,44 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Thing schema: sensors indexed directly by sensor_id (uint8_t) through a
+ * validity bitmap, with the entries kept in insertion order. Schemas are
+ * reference counted; once interned they are shared and immutable.
+ */
+
+struct schema;
+
+typedef void (*schema_foreach_func_t) (const knot_msg_schema *entry,
+				       void *user_data);
+
+struct schema *schema_new(void);
+struct schema *schema_ref(struct schema *schema);
+void schema_unref(struct schema *schema);
+struct schema *schema_intern(struct schema *schema);
+bool schema_add(struct schema *schema, const knot_msg_schema *entry);
+const knot_msg_schema *schema_find(const struct schema *schema,
+				   uint8_t sensor_id);
+void schema_foreach(const struct schema *schema,
+		    schema_foreach_func_t function, void *user_data);
+unsigned int schema_count(const struct schema *schema);
+uint64_t schema_hash(const struct schema *schema);
+bool schema_equal(const struct schema *a, const struct schema *b);
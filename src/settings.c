@@ -53,6 +53,8 @@ static void usage(void)
 		"\t-r, --user-root         Run as root(default is knot)\n"
 		"\t-R, --rabbitmq-url      Connect with a different url "
 		"amqp://[$USERNAME[:$PASSWORD]\\@]$HOST[:$PORT]/[$VHOST]\n"
+		"\t-w, --workers           Threads reading the things "
+		"(default 0: main loop)\n"
 		"\t-H, --help              Show help options\n");
 }
 
@@ -61,6 +63,7 @@ static const struct option main_options[] = {
 	{ "rabbitmq-url",	required_argument,	NULL, 'R' },
 	{ "nodetach",		no_argument,		NULL, 'n' },
 	{ "user-root",		no_argument,		NULL, 'r' },
+	{ "workers",		required_argument,	NULL, 'w' },
 	{ "help",		no_argument,		NULL, 'H' },
 	{ }
 };
@@ -70,7 +73,7 @@ static int parse_args(int argc, char *argv[], struct settings *settings)
 	int opt;
 
 	for (;;) {
-		opt = getopt_long(argc, argv, "c:R:nrH",
+		opt = getopt_long(argc, argv, "c:R:nrw:H",
 				  main_options, NULL);
 		if (opt < 0)
 			break;
@@ -88,6 +91,9 @@ static int parse_args(int argc, char *argv[], struct settings *settings)
 		case 'r':
 			settings->run_as_root = true;
 			break;
+		case 'w':
+			settings->workers = strtoul(optarg, NULL, 10);
+			break;
 		case 'H':
 			usage();
 			settings->help = true;
@@ -26,6 +26,8 @@ struct settings {
 	char *token;
 	char *rabbitmq_url;
 
+	unsigned int workers;	/* Node reader threads, 0: main loop only */
+
 	bool help;
 	bool detach;
 	bool run_as_root;
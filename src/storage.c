@@ -123,6 +123,25 @@ void storage_foreach_nrf24_keys(int fd,
 	l_free(groups);
 }
 
+void storage_foreach_group(int fd, storage_foreach_group_func_t func,
+			   void *user_data)
+{
+	struct l_settings *settings;
+	char **groups;
+	int i;
+
+	settings = l_hashmap_lookup(storage_list, L_INT_TO_PTR(fd));
+	if (!settings)
+		return;
+
+	groups = l_settings_get_groups(settings);
+
+	for (i = 0; groups[i] != NULL; i++)
+		func(fd, groups[i], user_data);
+
+	l_strfreev(groups);
+}
+
 int storage_write_key_string(int fd, const char *group,
 			     const char *key, const char *value)
 {
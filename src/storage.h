@@ -25,6 +25,12 @@ typedef void (*storage_foreach_func_t) (const char *mac, const char *id,
 void storage_foreach_nrf24_keys(int fd,
 				storage_foreach_func_t func, void *user_data);
 
+typedef void (*storage_foreach_group_func_t) (int fd, const char *group,
+					      void *user_data);
+
+void storage_foreach_group(int fd, storage_foreach_group_func_t func,
+			   void *user_data);
+
 int storage_write_key_string(int fd, const char *group,
 			     const char *key, const char *value);
 
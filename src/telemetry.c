@@ -0,0 +1,447 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include <ell/ell.h>
+
+#include <knot/knot_types.h>
+#include <knot/knot_protocol.h>
+#include <hal/linux_log.h>
+
+#include "log.h"
+#include "storage.h"
+#include "timewheel.h"
+#include "telemetry.h"
+
+#define TELEMETRY_GROUP		"Telemetry"
+#define TELEMETRY_KEY_LEN	32 /* "<device id> <sensor id>" */
+
+/*
+ * A configuration group. Unset keys are inherited from the less specific
+ * groups: "Telemetry <id> <sensor>" -> "Telemetry <id>" -> "Telemetry".
+ */
+struct telemetry_rule {
+	bool has_min_interval;
+	bool has_deadband;
+	bool has_max_age;
+	struct telemetry_policy policy;
+};
+
+struct telemetry_sensor {
+	struct telemetry_policy policy;
+	uint8_t sensor_id;
+	telemetry_publish_func_t publish;
+	void *user_data;
+	bool has_sent;			/* 'sent' holds the last published */
+	uint64_t sent_ms;
+	knot_value_type sent;
+	uint8_t sent_len;
+	bool has_pending;		/* Coalesced, waiting MinInterval */
+	uint8_t pending_type;
+	knot_value_type pending;
+	uint8_t pending_len;
+	struct timewheel_timer timer;
+	bool has_cached;		/* Last value received from the thing */
+	uint64_t cached_ms;
+	uint8_t cached_type;
+	knot_value_type cached;
+	uint8_t cached_len;
+};
+
+static struct l_hashmap *rules;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* "Telemetry", "Telemetry <id>" or "Telemetry <id> <sensor>" to map key */
+static bool group_to_key(const char *group, char *key, size_t key_size)
+{
+	const char *suffix;
+	const char *sep;
+	char *end;
+	unsigned long sensor_id;
+
+	if (strncmp(group, TELEMETRY_GROUP, strlen(TELEMETRY_GROUP)) != 0)
+		return false;
+
+	suffix = group + strlen(TELEMETRY_GROUP);
+	if (*suffix == '\0') {
+		key[0] = '\0';
+		return true;
+	}
+
+	if (*suffix != ' ' || *(++suffix) == '\0')
+		return false;
+
+	sep = strchr(suffix, ' ');
+	if (!sep)
+		return snprintf(key, key_size, "%s", suffix) <
+							(int) key_size;
+
+	/* Normalize the sensor id so that lookups are exact */
+	sensor_id = strtoul(sep + 1, &end, 0);
+	if (sep[1] == '\0' || *end != '\0' || sensor_id > UINT8_MAX)
+		return false;
+
+	return snprintf(key, key_size, "%.*s %lu", (int) (sep - suffix),
+			suffix, sensor_id) < (int) key_size;
+}
+
+static void load_group(int fd, const char *group, void *user_data)
+{
+	struct telemetry_rule *rule;
+	char key[TELEMETRY_KEY_LEN];
+	char *deadband;
+	char *end;
+	int interval;
+	int max_age;
+
+	if (strncmp(group, TELEMETRY_GROUP, strlen(TELEMETRY_GROUP)) != 0)
+		return;
+
+	if (!group_to_key(group, key, sizeof(key)) ||
+	    l_hashmap_lookup(rules, key)) {
+		log_error("Telemetry: ignoring group [%s]", group);
+		return;
+	}
+
+	rule = l_new(struct telemetry_rule, 1);
+
+	if (storage_read_key_int(fd, group, "MinInterval", &interval) == 0) {
+		rule->has_min_interval = true;
+		rule->policy.min_interval_ms = interval > 0 ? interval : 0;
+	}
+
+	deadband = storage_read_key_string(fd, group, "Deadband");
+	if (deadband) {
+		rule->policy.deadband = strtod(deadband, &end);
+		if (end == deadband || *end != '\0' ||
+		    !isfinite(rule->policy.deadband) ||
+		    rule->policy.deadband < 0) {
+			log_error("Telemetry: invalid Deadband in [%s]",
+				  group);
+			rule->policy.deadband = 0;
+		} else {
+			rule->has_deadband = true;
+		}
+		l_free(deadband);
+	}
+
+	if (storage_read_key_int(fd, group, "MaxAge", &max_age) == 0) {
+		rule->has_max_age = true;
+		rule->policy.max_age_ms = max_age > 0 ? max_age : 0;
+	}
+
+	log_info("Telemetry [%s]: MinInterval=%u Deadband=%g MaxAge=%u",
+		 group, rule->policy.min_interval_ms,
+		 rule->policy.deadband, rule->policy.max_age_ms);
+
+	l_hashmap_insert(rules, key, rule);
+}
+
+/**
+ * telemetry_load:
+ * @fd: configuration file descriptor returned by storage_open()
+ *
+ * Reads the "Telemetry" groups of the configuration file.
+ *
+ * Returns: 0 on success or a negative errno otherwise.
+ */
+int telemetry_load(int fd)
+{
+	if (rules)
+		return -EALREADY;
+
+	rules = l_hashmap_string_new();
+	storage_foreach_group(fd, load_group, NULL);
+
+	return 0;
+}
+
+void telemetry_unload(void)
+{
+	l_hashmap_destroy(rules, l_free);
+	rules = NULL;
+}
+
+static void rule_merge(struct telemetry_policy *policy, const char *key)
+{
+	const struct telemetry_rule *rule = l_hashmap_lookup(rules, key);
+
+	if (!rule)
+		return;
+
+	if (rule->has_min_interval)
+		policy->min_interval_ms = rule->policy.min_interval_ms;
+
+	if (rule->has_deadband)
+		policy->deadband = rule->policy.deadband;
+
+	if (rule->has_max_age)
+		policy->max_age_ms = rule->policy.max_age_ms;
+}
+
+/**
+ * telemetry_find_policy:
+ * @device_id: thing id (16 hexadecimal digits)
+ * @sensor_id: sensor id
+ * @policy: resolved policy
+ *
+ * Resolves the policy of a sensor, the most specific group wins.
+ *
+ * Returns: false if no policy applies and values shall be forwarded as-is.
+ */
+bool telemetry_find_policy(const char *device_id, uint8_t sensor_id,
+			   struct telemetry_policy *policy)
+{
+	char key[TELEMETRY_KEY_LEN];
+
+	memset(policy, 0, sizeof(*policy));
+
+	if (!rules || l_hashmap_isempty(rules))
+		return false;
+
+	rule_merge(policy, "");
+	rule_merge(policy, device_id);
+	snprintf(key, sizeof(key), "%s %u", device_id, sensor_id);
+	rule_merge(policy, key);
+
+	return policy->min_interval_ms || policy->deadband > 0 ||
+		policy->max_age_ms;
+}
+
+/* Is 'value' close enough to the last published value to be dropped? */
+static bool within_deadband(const struct telemetry_sensor *sensor,
+			    uint8_t value_type, const knot_value_type *value,
+			    uint8_t value_len)
+{
+	double deadband = sensor->policy.deadband;
+
+	if (!sensor->has_sent || deadband <= 0)
+		return false;
+
+	switch (value_type) {
+	case KNOT_VALUE_TYPE_INT:
+		return fabs((double) value->val_i -
+			    (double) sensor->sent.val_i) < deadband;
+	case KNOT_VALUE_TYPE_FLOAT:
+		return fabs((double) value->val_f -
+			    (double) sensor->sent.val_f) < deadband;
+	default:
+		/* BOOL and RAW have no magnitude: forward on change only */
+		return value_len == sensor->sent_len &&
+			memcmp(value, &sensor->sent, value_len) == 0;
+	}
+}
+
+static int sensor_publish(struct telemetry_sensor *sensor,
+			  uint8_t value_type, const knot_value_type *value,
+			  uint8_t value_len)
+{
+	int err;
+
+	/* Negative errno or KNoT error: the value didn't reach the cloud */
+	err = sensor->publish(sensor->sensor_id, value_type, value, value_len,
+			      sensor->user_data);
+	if (err)
+		return err;
+
+	sensor->has_sent = true;
+	sensor->sent_ms = now_ms();
+	memcpy(&sensor->sent, value, value_len);
+	sensor->sent_len = value_len;
+
+	return err;
+}
+
+static void pending_timeout_cb(struct timewheel_timer *timer,
+			       void *user_data)
+{
+	struct telemetry_sensor *sensor = user_data;
+	int err;
+
+	if (!sensor->has_pending)
+		return;
+
+	sensor->has_pending = false;
+	err = sensor_publish(sensor, sensor->pending_type, &sensor->pending,
+			     sensor->pending_len);
+	if (err < 0)
+		log_error("Telemetry: sensor %u: %s", sensor->sensor_id,
+			  strerror(-err));
+	else if (err)
+		log_error("Telemetry: sensor %u: KNoT error %d",
+			  sensor->sensor_id, err);
+}
+
+struct telemetry_sensor *telemetry_sensor_new(
+				const struct telemetry_policy *policy,
+				uint8_t sensor_id,
+				telemetry_publish_func_t publish,
+				void *user_data)
+{
+	struct telemetry_sensor *sensor;
+
+	sensor = l_new(struct telemetry_sensor, 1);
+	sensor->policy = *policy;
+	sensor->sensor_id = sensor_id;
+	sensor->publish = publish;
+	sensor->user_data = user_data;
+	timewheel_timer_init(&sensor->timer, pending_timeout_cb, sensor);
+
+	return sensor;
+}
+
+/* Pending coalesced values are discarded */
+void telemetry_sensor_free(struct telemetry_sensor *sensor)
+{
+	if (unlikely(!sensor))
+		return;
+
+	timewheel_timer_cancel(&sensor->timer);
+	l_free(sensor);
+}
+
+/**
+ * telemetry_sensor_update:
+ * @sensor: sensor state
+ * @value_type: KNOT_VALUE_TYPE_*
+ * @value: value received from the thing
+ * @value_len: length of @value
+ *
+ * Applies the sensor policy to a new value: values inside the deadband of
+ * the last published one are dropped, and values arriving before
+ * MinInterval elapses are coalesced, the latest one being published when
+ * the interval expires.
+ *
+ * Returns: 0 if the value was published, dropped or deferred, otherwise
+ * the publish error: a negative errno or a KNoT error.
+ */
+int telemetry_sensor_update(struct telemetry_sensor *sensor,
+			    uint8_t value_type,
+			    const knot_value_type *value, uint8_t value_len)
+{
+	uint64_t elapsed;
+
+	if (value_len > sizeof(*value))
+		return -EINVAL;
+
+	telemetry_sensor_cache(sensor, value_type, value, value_len);
+
+	if (within_deadband(sensor, value_type, value, value_len)) {
+		/* Last value wins: it supersedes any pending one */
+		sensor->has_pending = false;
+		timewheel_timer_cancel(&sensor->timer);
+		return 0;
+	}
+
+	elapsed = now_ms() - sensor->sent_ms;
+	if (!sensor->has_sent || elapsed >= sensor->policy.min_interval_ms) {
+		sensor->has_pending = false;
+		timewheel_timer_cancel(&sensor->timer);
+		return sensor_publish(sensor, value_type, value, value_len);
+	}
+
+	sensor->pending_type = value_type;
+	memcpy(&sensor->pending, value, value_len);
+	sensor->pending_len = value_len;
+
+	if (sensor->has_pending)
+		return 0;
+
+	sensor->has_pending = true;
+	timewheel_timer_add(&sensor->timer,
+			    sensor->policy.min_interval_ms - elapsed);
+
+	return 0;
+}
+
+/**
+ * telemetry_sensor_cache:
+ * @sensor: sensor state
+ * @value_type: KNOT_VALUE_TYPE_*
+ * @value: value received from the thing
+ * @value_len: length of @value
+ *
+ * Records the last value reported by the thing. telemetry_sensor_update()
+ * already does it; this is for values published bypassing the policy.
+ */
+void telemetry_sensor_cache(struct telemetry_sensor *sensor,
+			    uint8_t value_type,
+			    const knot_value_type *value, uint8_t value_len)
+{
+	if (!sensor->policy.max_age_ms || value_len > sizeof(*value))
+		return;
+
+	sensor->has_cached = true;
+	sensor->cached_ms = now_ms();
+	sensor->cached_type = value_type;
+	memcpy(&sensor->cached, value, value_len);
+	sensor->cached_len = value_len;
+}
+
+/**
+ * telemetry_sensor_publish_cached:
+ * @sensor: sensor state
+ *
+ * Answers a cloud data request with the cached value, bypassing MinInterval
+ * and Deadband since the value was explicitly requested.
+ *
+ * Returns: 0 if published, -ENOENT if the cached value is missing or older
+ * than MaxAge and the thing has to be polled, or the publish error.
+ */
+int telemetry_sensor_publish_cached(struct telemetry_sensor *sensor)
+{
+	int err;
+
+	if (!sensor->has_cached ||
+	    now_ms() - sensor->cached_ms > sensor->policy.max_age_ms)
+		return -ENOENT;
+
+	err = sensor_publish(sensor, sensor->cached_type, &sensor->cached,
+			     sensor->cached_len);
+	if (err)
+		return err;
+
+	/* The cloud is up to date: a coalesced value is now stale */
+	sensor->has_pending = false;
+	timewheel_timer_cancel(&sensor->timer);
+
+	return err;
+}
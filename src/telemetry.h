@@ -0,0 +1,61 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Per-sensor telemetry policy: rate limit (MinInterval), deadband and
+ * last-value-wins coalescing of the data sent by things before it is
+ * published to the cloud, plus a last-value cache answering cloud data
+ * requests without polling the thing (MaxAge). Rules come from the
+ * "Telemetry" groups of the configuration file; sensors without a rule are
+ * forwarded untouched and never answered from the cache.
+ */
+
+struct telemetry_policy {
+	uint32_t min_interval_ms;	/* 0: no rate limit */
+	double deadband;		/* 0: forward every value */
+	uint32_t max_age_ms;		/* 0: always poll the thing */
+};
+
+struct telemetry_sensor;
+
+typedef int (*telemetry_publish_func_t) (uint8_t sensor_id,
+					 uint8_t value_type,
+					 const knot_value_type *value,
+					 uint8_t value_len, void *user_data);
+
+int telemetry_load(int fd);
+void telemetry_unload(void);
+bool telemetry_find_policy(const char *device_id, uint8_t sensor_id,
+			   struct telemetry_policy *policy);
+
+struct telemetry_sensor *telemetry_sensor_new(
+				const struct telemetry_policy *policy,
+				uint8_t sensor_id,
+				telemetry_publish_func_t publish,
+				void *user_data);
+void telemetry_sensor_free(struct telemetry_sensor *sensor);
+int telemetry_sensor_update(struct telemetry_sensor *sensor,
+			    uint8_t value_type,
+			    const knot_value_type *value, uint8_t value_len);
+void telemetry_sensor_cache(struct telemetry_sensor *sensor,
+			    uint8_t value_type,
+			    const knot_value_type *value, uint8_t value_len);
+int telemetry_sensor_publish_cached(struct telemetry_sensor *sensor);
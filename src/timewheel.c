@@ -0,0 +1,243 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <ell/ell.h>
+
+#include "timewheel.h"
+
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4 /* 2^24 ticks: ~37 hours */
+#define WHEEL_MAX_TICKS		((UINT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/* Level 'n' slots span WHEEL_SIZE^n ticks: cascaded down when reached */
+static struct timewheel_timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_tick;		/* Next tick to process */
+static unsigned int pending_count;
+static struct l_timeout *ticker;
+static bool ticking;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_link(struct timewheel_timer **head,
+		       struct timewheel_timer *timer)
+{
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void timer_unlink(struct timewheel_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static void wheel_insert(struct timewheel_timer *timer)
+{
+	uint64_t delta;
+	unsigned int level;
+	unsigned int idx;
+
+	if (timer->expires < wheel_tick)
+		timer->expires = wheel_tick;
+
+	delta = timer->expires - wheel_tick;
+	if (delta > WHEEL_MAX_TICKS) {
+		delta = WHEEL_MAX_TICKS;
+		timer->expires = wheel_tick + delta;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < (UINT64_C(1) << (WHEEL_BITS * (level + 1))))
+			break;
+	}
+
+	idx = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	timer_link(&wheel[level][idx], timer);
+}
+
+/* Re-inserts the timers of a slot: they land on lower levels */
+static unsigned int cascade(unsigned int level)
+{
+	unsigned int idx = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	struct timewheel_timer *list = wheel[level][idx];
+	struct timewheel_timer *timer;
+
+	wheel[level][idx] = NULL;
+
+	while ((timer = list)) {
+		list = timer->next;
+		wheel_insert(timer);
+	}
+
+	return idx;
+}
+
+static void wheel_advance(uint64_t now)
+{
+	struct timewheel_timer *list;
+	struct timewheel_timer *timer;
+	unsigned int level;
+	unsigned int idx;
+
+	while (wheel_tick <= now && pending_count) {
+		idx = wheel_tick & WHEEL_MASK;
+
+		/* Wrapped around: bring the next slot of upper levels down */
+		for (level = 1; !idx && level < WHEEL_LEVELS; level++) {
+			if (cascade(level))
+				break;
+		}
+
+		wheel_tick++;
+
+		list = wheel[0][idx];
+		wheel[0][idx] = NULL;
+		if (list)
+			list->pprev = &list;
+
+		/* Callbacks may arm and cancel any timer, including these */
+		while ((timer = list)) {
+			timer_unlink(timer);
+			pending_count--;
+			timer->func(timer, timer->user_data);
+		}
+	}
+
+	/* Nothing pending: skip idle ticks */
+	if (wheel_tick <= now)
+		wheel_tick = now + 1;
+}
+
+static void ticker_cb(struct l_timeout *timeout, void *user_data)
+{
+	wheel_advance(now_ms() / TIMEWHEEL_TICK_MS);
+
+	ticking = pending_count > 0;
+	if (ticking)
+		l_timeout_modify_ms(timeout, TIMEWHEEL_TICK_MS);
+}
+
+void timewheel_timer_init(struct timewheel_timer *timer,
+			  timewheel_func_t func, void *user_data)
+{
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->expires = 0;
+	timer->func = func;
+	timer->user_data = user_data;
+}
+
+/**
+ * timewheel_timer_add:
+ * @timer: timer initialized by timewheel_timer_init()
+ * @timeout_ms: milliseconds from now, rounded up to TIMEWHEEL_TICK_MS
+ *
+ * Arms @timer, re-arming it if already pending. The callback runs once.
+ */
+void timewheel_timer_add(struct timewheel_timer *timer,
+			 unsigned int timeout_ms)
+{
+	uint64_t now = now_ms();
+
+	if (timer->pprev) {
+		timer_unlink(timer);
+		pending_count--;
+	}
+
+	if (!pending_count && wheel_tick <= now / TIMEWHEEL_TICK_MS)
+		wheel_tick = now / TIMEWHEEL_TICK_MS + 1;
+
+	/* Never early: the first tick at or after the deadline */
+	timer->expires = (now + timeout_ms + TIMEWHEEL_TICK_MS - 1) /
+							TIMEWHEEL_TICK_MS;
+	wheel_insert(timer);
+	pending_count++;
+
+	if (ticking)
+		return;
+
+	if (!ticker)
+		ticker = l_timeout_create_ms(TIMEWHEEL_TICK_MS, ticker_cb,
+					     NULL, NULL);
+	else
+		l_timeout_modify_ms(ticker, TIMEWHEEL_TICK_MS);
+
+	ticking = true;
+}
+
+void timewheel_timer_cancel(struct timewheel_timer *timer)
+{
+	if (!timer->pprev)
+		return;
+
+	timer_unlink(timer);
+	pending_count--;
+}
+
+bool timewheel_timer_pending(const struct timewheel_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+/* Pending timers are left unlinked: owners are being destroyed */
+void timewheel_stop(void)
+{
+	struct timewheel_timer *timer;
+	unsigned int level;
+	unsigned int idx;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		for (idx = 0; idx < WHEEL_SIZE; idx++) {
+			while ((timer = wheel[level][idx]))
+				timer_unlink(timer);
+		}
+	}
+
+	pending_count = 0;
+	l_timeout_remove(ticker);
+	ticker = NULL;
+	ticking = false;
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Hierarchical timing wheel shared by all sessions and devices, driven by
+ * a single l_timeout ticking while timers are pending. Timers are embedded
+ * in their owner: arming and cancelling are O(1) and don't allocate.
+ */
+
+#define TIMEWHEEL_TICK_MS	8
+
+struct timewheel_timer;
+
+typedef void (*timewheel_func_t) (struct timewheel_timer *timer,
+				  void *user_data);
+
+struct timewheel_timer {
+	struct timewheel_timer *next;
+	struct timewheel_timer **pprev;	/* NULL: not pending */
+	uint64_t expires;		/* Tick */
+	timewheel_func_t func;
+	void *user_data;
+};
+
+void timewheel_timer_init(struct timewheel_timer *timer,
+			  timewheel_func_t func, void *user_data);
+void timewheel_timer_add(struct timewheel_timer *timer,
+			 unsigned int timeout_ms);
+void timewheel_timer_cancel(struct timewheel_timer *timer);
+bool timewheel_timer_pending(const struct timewheel_timer *timer);
+
+void timewheel_stop(void);
@@ -0,0 +1,424 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <ell/ell.h>
+#include <hal/linux_log.h>
+
+#include "log.h"
+#include "storage.h"
+#include "trace.h"
+
+#define TRACE_GROUP			"Trace"
+#define TRACE_DEFAULT_SAMPLE		1
+#define TRACE_DEFAULT_LOG_INTERVAL	600	/* Seconds */
+
+#define HIST_SUB_MASK		((1 << TRACE_HIST_SUB_BITS) - 1)
+
+/*
+ * Recorded from the main loop and read from anywhere: relaxed atomics keep
+ * each counter consistent without locks, a snapshot may be off by the
+ * samples recorded while it is taken.
+ */
+struct trace_hist {
+	uint64_t count[TRACE_HIST_BUCKETS];
+	uint64_t sum_ns;
+};
+
+static const char *stage_names[] = {
+	[TRACE_STAGE_RECV] = "total",
+	[TRACE_STAGE_PROCESS] = "process",
+	[TRACE_STAGE_ENCODE] = "encode",
+	[TRACE_STAGE_PUBLISH] = "publish",
+	[TRACE_STAGE_ACK] = "ack",
+};
+
+static struct trace_hist hists[TRACE_STAGE_MAX];
+
+/* Read by worker threads: set before they start */
+static unsigned int sample;		/* One of every 'sample' PDUs, 0: off */
+static bool headers;
+static bool confirms;
+
+static unsigned int sample_count;
+static uint64_t id_base;
+static uint32_t id_seq;
+static struct trace current;		/* PDU being processed, if traced */
+
+static struct l_timeout *summary_timeout;
+static unsigned int log_interval;	/* Seconds */
+static uint64_t summary_last_total;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int hist_index(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns <= HIST_SUB_MASK)
+		return ns;
+
+	/* Octave of the value, then its TRACE_HIST_SUB_BITS next bits */
+	msb = 63 - __builtin_clzll(ns);
+
+	return ((msb - TRACE_HIST_SUB_BITS + 1) << TRACE_HIST_SUB_BITS) |
+		((ns >> (msb - TRACE_HIST_SUB_BITS)) & HIST_SUB_MASK);
+}
+
+static uint64_t hist_bucket_min(unsigned int index)
+{
+	unsigned int msb;
+
+	if (index <= HIST_SUB_MASK)
+		return index;
+
+	msb = (index >> TRACE_HIST_SUB_BITS) + TRACE_HIST_SUB_BITS - 1;
+
+	return (UINT64_C(1) << msb) |
+		((uint64_t) (index & HIST_SUB_MASK) <<
+					(msb - TRACE_HIST_SUB_BITS));
+}
+
+static void hist_add(enum trace_stage stage, uint64_t from, uint64_t to)
+{
+	struct trace_hist *hist = &hists[stage];
+	/* Stamps taken by worker threads: don't trust their ordering */
+	uint64_t ns = to > from ? to - from : 0;
+
+	__atomic_fetch_add(&hist->count[hist_index(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+static void summary_log(struct l_timeout *timeout, void *user_data)
+{
+	struct trace_hist_snapshot snapshot;
+	unsigned int stage;
+
+	trace_hist_read(TRACE_HIST_TOTAL, &snapshot);
+	if (snapshot.total == summary_last_total)
+		goto done;
+
+	summary_last_total = snapshot.total;
+
+	for (stage = 0; stage < TRACE_STAGE_MAX; stage++) {
+		trace_hist_read(stage, &snapshot);
+		if (!snapshot.total)
+			continue;
+
+		log_info("Trace %s: %"PRIu64" samples, p50 %"PRIu64
+			 "us p99 %"PRIu64"us max %"PRIu64"us",
+			 stage_names[stage], snapshot.total,
+			 trace_hist_percentile(&snapshot, 500) / 1000,
+			 trace_hist_percentile(&snapshot, 990) / 1000,
+			 trace_hist_percentile(&snapshot, 1000) / 1000);
+	}
+
+done:
+	l_timeout_modify(timeout, log_interval);
+}
+
+static bool read_key_bool(int fd, const char *key)
+{
+	char *str = storage_read_key_string(fd, TRACE_GROUP, key);
+	bool value = str && strcasecmp(str, "true") == 0;
+
+	l_free(str);
+
+	return value;
+}
+
+/**
+ * trace_load:
+ * @fd: configuration file descriptor returned by storage_open()
+ *
+ * Loads the "Trace" group. Must be called before the node reader threads
+ * are started.
+ *
+ * Returns: 0 if successful and a negative error otherwise.
+ */
+int trace_load(int fd)
+{
+	uint32_t random;
+	int val;
+
+	sample = TRACE_DEFAULT_SAMPLE;
+	log_interval = TRACE_DEFAULT_LOG_INTERVAL;
+
+	if (storage_read_key_int(fd, TRACE_GROUP, "Sample", &val) == 0 &&
+	    val >= 0)
+		sample = val;
+
+	if (storage_read_key_int(fd, TRACE_GROUP, "LogInterval", &val) == 0 &&
+	    val >= 0)
+		log_interval = val;
+
+	headers = read_key_bool(fd, "Headers");
+	confirms = read_key_bool(fd, "Confirms");
+
+	/* Trace ids of different runs don't collide */
+	l_getrandom(&random, sizeof(random));
+	id_base = (uint64_t) random << 32;
+
+	if (!sample)
+		return 0;
+
+	log_info("Tracing 1/%u PDUs, headers:%s, confirms:%s", sample,
+		 headers ? "on" : "off", confirms ? "on" : "off");
+
+	if (log_interval)
+		summary_timeout = l_timeout_create(log_interval, summary_log,
+						   NULL, NULL);
+
+	return 0;
+}
+
+void trace_unload(void)
+{
+	l_timeout_remove(summary_timeout);
+	summary_timeout = NULL;
+	sample = 0;
+}
+
+bool trace_headers_enabled(void)
+{
+	return sample && headers;
+}
+
+bool trace_confirms_enabled(void)
+{
+	return sample && confirms;
+}
+
+/**
+ * trace_now:
+ *
+ * Safe to call from any thread.
+ *
+ * Returns: the monotonic time in nanoseconds, or 0 if tracing is disabled.
+ */
+uint64_t trace_now(void)
+{
+	if (!sample)
+		return 0;
+
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+/**
+ * trace_begin:
+ * @recv_stamp: trace_now() when the PDU was read from the node
+ *
+ * Starts tracing the PDU about to be processed, if sampled. The trace is
+ * picked by the first northbound data published while processing it.
+ */
+void trace_begin(uint64_t recv_stamp)
+{
+	if (!recv_stamp || ++sample_count < sample)
+		return;
+
+	sample_count = 0;
+
+	memset(&current, 0, sizeof(current));
+	current.id = id_base | ++id_seq;
+	current.stamp[TRACE_STAGE_RECV] = recv_stamp;
+	current.stamp[TRACE_STAGE_PROCESS] = trace_now();
+}
+
+/**
+ * trace_end:
+ *
+ * Drops the trace of the processed PDU if nothing was published, e.g. a
+ * value coalesced by the telemetry policy.
+ */
+void trace_end(void)
+{
+	current.id = 0;
+}
+
+/**
+ * trace_take:
+ * @trace: trace to be filled
+ *
+ * Moves the trace of the PDU being processed to @trace, once encoded.
+ *
+ * Returns: false if the PDU isn't traced.
+ */
+bool trace_take(struct trace *trace)
+{
+	if (!current.id) {
+		trace->id = 0;
+		return false;
+	}
+
+	current.stamp[TRACE_STAGE_ENCODE] = trace_now();
+	*trace = current;
+	current.id = 0;
+
+	return true;
+}
+
+/**
+ * trace_publish:
+ * @trace: trace taken with trace_take()
+ *
+ * Stamps the publish and records the stages crossed so far. Samples that
+ * never reach the broker (discarded or expired in the outbox) aren't
+ * recorded.
+ */
+void trace_publish(struct trace *trace)
+{
+	unsigned int stage;
+
+	if (!trace->id)
+		return;
+
+	trace->stamp[TRACE_STAGE_PUBLISH] = trace_now();
+
+	for (stage = TRACE_STAGE_PROCESS; stage <= TRACE_STAGE_PUBLISH; stage++)
+		hist_add(stage, trace->stamp[stage - 1], trace->stamp[stage]);
+
+	hist_add(TRACE_HIST_TOTAL, trace->stamp[TRACE_STAGE_RECV],
+		 trace->stamp[TRACE_STAGE_PUBLISH]);
+}
+
+/**
+ * trace_ack:
+ * @trace: trace recorded with trace_publish()
+ *
+ * Stamps and records the broker acknowledgement of a published sample.
+ */
+void trace_ack(struct trace *trace)
+{
+	if (!trace->id)
+		return;
+
+	trace->stamp[TRACE_STAGE_ACK] = trace_now();
+	hist_add(TRACE_STAGE_ACK, trace->stamp[TRACE_STAGE_PUBLISH],
+		 trace->stamp[TRACE_STAGE_ACK]);
+}
+
+/**
+ * trace_to_realtime:
+ * @stamp: monotonic stamp
+ *
+ * Returns: @stamp in nanoseconds since the Epoch, to be compared with clocks
+ * of other hosts.
+ */
+uint64_t trace_to_realtime(uint64_t stamp)
+{
+	return clock_ns(CLOCK_REALTIME) - (clock_ns(CLOCK_MONOTONIC) - stamp);
+}
+
+const char *trace_hist_to_str(enum trace_stage stage)
+{
+	if (stage >= TRACE_STAGE_MAX)
+		return NULL;
+
+	return stage_names[stage];
+}
+
+/**
+ * trace_hist_read:
+ * @stage: stage, or TRACE_HIST_TOTAL
+ * @snapshot: copy of the histogram
+ *
+ * Reads the time spent reaching @stage from the previous one. Safe to call
+ * from any thread.
+ */
+void trace_hist_read(enum trace_stage stage,
+		     struct trace_hist_snapshot *snapshot)
+{
+	const struct trace_hist *hist = &hists[stage];
+	unsigned int i;
+
+	snapshot->total = 0;
+	snapshot->sum_ns = __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED);
+
+	for (i = 0; i < TRACE_HIST_BUCKETS; i++) {
+		snapshot->count[i] = __atomic_load_n(&hist->count[i],
+						     __ATOMIC_RELAXED);
+		snapshot->total += snapshot->count[i];
+	}
+}
+
+/**
+ * trace_hist_bucket_max:
+ * @index: bucket index
+ *
+ * Returns: the largest value in nanoseconds counted in the bucket. Buckets
+ * are 1/8 of a power of two wide.
+ */
+uint64_t trace_hist_bucket_max(unsigned int index)
+{
+	if (index + 1 >= TRACE_HIST_BUCKETS)
+		return UINT64_MAX;
+
+	return hist_bucket_min(index + 1) - 1;
+}
+
+/**
+ * trace_hist_percentile:
+ * @snapshot: histogram read with trace_hist_read()
+ * @permille: 500 for the median, 1000 for the maximum
+ *
+ * Returns: upper bound in nanoseconds of the percentile, 0 if empty.
+ */
+uint64_t trace_hist_percentile(const struct trace_hist_snapshot *snapshot,
+			       unsigned int permille)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (!snapshot->total)
+		return 0;
+
+	target = (snapshot->total * permille + 999) / 1000;
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < TRACE_HIST_BUCKETS; i++) {
+		seen += snapshot->count[i];
+		if (seen >= target)
+			return trace_hist_bucket_max(i);
+	}
+
+	return trace_hist_bucket_max(TRACE_HIST_BUCKETS - 1);
+}
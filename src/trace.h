@@ -0,0 +1,78 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Latency tracing of the data sent by things. A PDU read from a node is
+ * stamped (monotonic clock) at each stage it crosses on its way to the
+ * broker and the time spent between stages is accumulated in lock-free
+ * log-linear histograms. Optionally the trace is attached to the published
+ * message as AMQP headers and, with publisher confirms, closed by the
+ * broker acknowledgement. Settings come from the "Trace" group of the
+ * configuration file.
+ */
+
+enum trace_stage {
+	TRACE_STAGE_RECV,		/* Read from the node socket */
+	TRACE_STAGE_PROCESS,		/* Handed to msg_process() */
+	TRACE_STAGE_ENCODE,		/* Encoded and queued to the outbox */
+	TRACE_STAGE_PUBLISH,		/* Written to the broker connection */
+	TRACE_STAGE_ACK,		/* Confirmed by the broker */
+	TRACE_STAGE_MAX
+};
+
+/* Histogram of TRACE_STAGE_RECV: end to end, from node recv to publish */
+#define TRACE_HIST_TOTAL	TRACE_STAGE_RECV
+
+#define TRACE_HIST_SUB_BITS	3
+#define TRACE_HIST_BUCKETS	((64 - TRACE_HIST_SUB_BITS + 1) << \
+				 TRACE_HIST_SUB_BITS)
+
+struct trace {
+	uint64_t id;				/* 0: not traced */
+	uint64_t stamp[TRACE_STAGE_MAX];	/* Monotonic ns */
+};
+
+struct trace_hist_snapshot {
+	uint64_t count[TRACE_HIST_BUCKETS];
+	uint64_t total;				/* Samples */
+	uint64_t sum_ns;
+};
+
+int trace_load(int fd);
+void trace_unload(void);
+bool trace_headers_enabled(void);
+bool trace_confirms_enabled(void);
+
+uint64_t trace_now(void);
+void trace_begin(uint64_t recv_stamp);
+void trace_end(void);
+bool trace_take(struct trace *trace);
+void trace_publish(struct trace *trace);
+void trace_ack(struct trace *trace);
+uint64_t trace_to_realtime(uint64_t stamp);
+
+const char *trace_hist_to_str(enum trace_stage stage);
+void trace_hist_read(enum trace_stage stage,
+		     struct trace_hist_snapshot *snapshot);
+uint64_t trace_hist_bucket_max(unsigned int index);
+uint64_t trace_hist_percentile(const struct trace_hist_snapshot *snapshot,
+			       unsigned int permille);
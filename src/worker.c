@@ -0,0 +1,501 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <ell/ell.h>
+
+#include <hal/linux_log.h>
+
+#include "log.h"
+#include "pdubuf.h"
+#include "trace.h"
+#include "metrics.h"
+#include "worker.h"
+
+#define WORKER_MAX		64
+#define WORKER_EVENTS_MAX	64 /* Sockets read per wake up */
+#define WORKER_INBOX_MAX	256 /* Buffers waiting the main loop */
+#define WORKER_SPARE_MAX	WORKER_INBOX_MAX /* Pool buffers handed over */
+#define WORKER_STOP		UINT64_MAX /* epoll key of the stop eventfd */
+
+struct worker_input {
+	int fd;
+	uint32_t serial;
+	struct pdubuf *buf;		/* NULL: hangup */
+};
+
+struct worker {
+	pthread_t thread;
+	int epoll_fd;
+	int stop_fd;			/* Wakes the thread up to stop */
+	int inbox_fd;			/* Wakes the main loop up */
+	struct l_io *inbox_io;
+	struct worker_input *batch;	/* Main loop side of the inbox */
+	pthread_mutex_t lock;		/* Protects the fields below */
+	pthread_cond_t drained;
+	struct worker_input *inbox;	/* WORKER_INBOX_MAX entries */
+	unsigned int inbox_len;
+	bool notified;			/* inbox_fd written, not drained yet */
+	struct pdubuf *spare;		/* Taken from the pool by the main loop */
+	unsigned int spare_len;
+	struct l_hashmap *serials;	/* fd to serial of the socket owner */
+	bool stopping;
+};
+
+static struct worker *workers;
+static unsigned int worker_count;
+static worker_input_func_t input_func;
+static void *input_data;
+
+static struct worker *worker_for(int fd)
+{
+	return &workers[fd % worker_count];
+}
+
+static uint64_t event_key(int fd, uint32_t serial)
+{
+	return (uint64_t) serial << 32 | (uint32_t) fd;
+}
+
+/* Called with the lock held */
+static struct pdubuf *worker_buf_get(struct worker *worker)
+{
+	struct pdubuf *buf = worker->spare;
+
+	/* Not pdubuf_get(): the pool belongs to the main loop */
+	if (!buf)
+		return l_new(struct pdubuf, 1);
+
+	worker->spare = buf->next;
+	worker->spare_len--;
+	buf->next = NULL;
+
+	return buf;
+}
+
+/* Called with the lock held */
+static void worker_buf_put(struct worker *worker, struct pdubuf *buf)
+{
+	buf->next = worker->spare;
+	worker->spare = buf;
+	worker->spare_len++;
+}
+
+/* Called from the main loop: tops the spare buffers up from the pool */
+static void worker_spare_fill(struct worker *worker)
+{
+	struct pdubuf *list = NULL;
+	struct pdubuf *buf;
+	unsigned int want;
+	unsigned int i;
+
+	pthread_mutex_lock(&worker->lock);
+	want = worker->spare_len < WORKER_SPARE_MAX ?
+				WORKER_SPARE_MAX - worker->spare_len : 0;
+	pthread_mutex_unlock(&worker->lock);
+
+	for (i = 0; i < want; i++) {
+		buf = pdubuf_get();
+		buf->next = list;
+		list = buf;
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	while (list) {
+		buf = list;
+		list = buf->next;
+		worker_buf_put(worker, buf);
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/* Called with the lock held: recv() only on sockets still registered */
+static void worker_read(struct worker *worker, const struct epoll_event *ev)
+{
+	struct worker_input *input;
+	struct pdubuf *buf;
+	int fd = (int) (uint32_t) ev->data.u64;
+	uint32_t serial = ev->data.u64 >> 32;
+	ssize_t len;
+
+	/* Closed, or closed and reused, after epoll_wait() returned */
+	if (L_PTR_TO_UINT(l_hashmap_lookup(worker->serials,
+					   L_INT_TO_PTR(fd))) != serial)
+		return;
+
+	buf = worker_buf_get(worker);
+
+	len = recv(fd, buf->data, sizeof(buf->data), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+		worker_buf_put(worker, buf);
+		return;
+	}
+
+	if (len <= 0) {
+		/* Reported once: the main loop closes the socket */
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		l_hashmap_remove(worker->serials, L_INT_TO_PTR(fd));
+		worker_buf_put(worker, buf);
+		buf = NULL;
+	} else {
+		buf->head = 0;
+		buf->tail = len;
+		buf->stamp = trace_now();
+		metrics_add(METRICS_NODE_RX_BYTES, len);
+	}
+
+	input = &worker->inbox[worker->inbox_len++];
+	input->fd = fd;
+	input->serial = serial;
+	input->buf = buf;
+}
+
+static void *worker_thread(void *user_data)
+{
+	struct worker *worker = user_data;
+	struct epoll_event events[WORKER_EVENTS_MAX];
+	uint64_t val = 1;
+	bool notify;
+	int n, i;
+
+	for (;;) {
+		/* Back-pressure: the main loop doesn't keep up */
+		pthread_mutex_lock(&worker->lock);
+		while (!worker->stopping && worker->inbox_len >
+		       WORKER_INBOX_MAX - WORKER_EVENTS_MAX)
+			pthread_cond_wait(&worker->drained, &worker->lock);
+		pthread_mutex_unlock(&worker->lock);
+
+		n = epoll_wait(worker->epoll_fd, events, WORKER_EVENTS_MAX, -1);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		pthread_mutex_lock(&worker->lock);
+
+		if (worker->stopping) {
+			pthread_mutex_unlock(&worker->lock);
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u64 == WORKER_STOP)
+				continue;
+
+			worker_read(worker, &events[i]);
+		}
+
+		/* One wake up per batch the main loop hasn't drained yet */
+		notify = worker->inbox_len && !worker->notified;
+		if (notify)
+			worker->notified = true;
+
+		pthread_mutex_unlock(&worker->lock);
+
+		if (notify && write(worker->inbox_fd, &val, sizeof(val)) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static bool worker_inbox_cb(struct l_io *io, void *user_data)
+{
+	struct worker *worker = user_data;
+	struct worker_input *batch;
+	unsigned int len;
+	unsigned int i;
+	uint64_t val;
+
+	if (read(worker->inbox_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		log_error("worker inbox: %s(%d)", strerror(errno), errno);
+
+	/* Swaps the inbox out: the worker keeps reading meanwhile */
+	pthread_mutex_lock(&worker->lock);
+	batch = worker->inbox;
+	len = worker->inbox_len;
+	worker->inbox = worker->batch;
+	worker->inbox_len = 0;
+	worker->notified = false;
+	pthread_cond_signal(&worker->drained);
+	pthread_mutex_unlock(&worker->lock);
+
+	worker->batch = batch;
+
+	/* Buffers processed here go back to the pool ... */
+	for (i = 0; i < len; i++)
+		input_func(batch[i].fd, batch[i].serial, batch[i].buf,
+			   input_data);
+
+	/* ... and are handed over again for the next reads */
+	worker_spare_fill(worker);
+
+	return true;
+}
+
+static int worker_init(struct worker *worker)
+{
+	struct epoll_event ev;
+	int err;
+
+	worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	worker->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	worker->inbox_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (worker->epoll_fd < 0 || worker->stop_fd < 0 ||
+	    worker->inbox_fd < 0)
+		return -errno;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = WORKER_STOP;
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->stop_fd,
+		      &ev) < 0)
+		return -errno;
+
+	worker->inbox = l_new(struct worker_input, WORKER_INBOX_MAX);
+	worker->batch = l_new(struct worker_input, WORKER_INBOX_MAX);
+	worker->serials = l_hashmap_new();
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->drained, NULL);
+
+	/* Drained batches return to the pool before refilling the spares */
+	pdubuf_pool_reserve(WORKER_INBOX_MAX);
+	worker_spare_fill(worker);
+
+	worker->inbox_io = l_io_new(worker->inbox_fd);
+	l_io_set_read_handler(worker->inbox_io, worker_inbox_cb, worker, NULL);
+
+	err = pthread_create(&worker->thread, NULL, worker_thread, worker);
+	if (err) {
+		l_io_destroy(worker->inbox_io);
+		worker->inbox_io = NULL;
+		return -err;
+	}
+
+	return 0;
+}
+
+static void worker_cleanup(struct worker *worker)
+{
+	uint64_t val = 1;
+	unsigned int i;
+
+	if (worker->inbox_io) {
+		pthread_mutex_lock(&worker->lock);
+		worker->stopping = true;
+		pthread_cond_signal(&worker->drained);
+		pthread_mutex_unlock(&worker->lock);
+
+		if (write(worker->stop_fd, &val, sizeof(val)) < 0)
+			log_error("worker stop: %s(%d)", strerror(errno),
+				  errno);
+
+		pthread_join(worker->thread, NULL);
+		l_io_destroy(worker->inbox_io);
+		pthread_cond_destroy(&worker->drained);
+		pthread_mutex_destroy(&worker->lock);
+	}
+
+	/* Not delivered: the sockets are gone with the workers */
+	for (i = 0; i < worker->inbox_len; i++)
+		pdubuf_put(worker->inbox[i].buf);
+
+	while (worker->spare)
+		pdubuf_put(worker_buf_get(worker));
+
+	if (worker->inbox)
+		pdubuf_pool_reserve(-WORKER_INBOX_MAX);
+
+	l_free(worker->inbox);
+	l_free(worker->batch);
+	l_hashmap_destroy(worker->serials, NULL);
+
+	if (worker->epoll_fd >= 0)
+		close(worker->epoll_fd);
+	if (worker->stop_fd >= 0)
+		close(worker->stop_fd);
+	if (worker->inbox_fd >= 0)
+		close(worker->inbox_fd);
+}
+
+/**
+ * worker_start:
+ * @count: amount of reader threads, up to 64
+ * @func: called from the main loop for each buffer received
+ * @user_data: user data passed to @func
+ *
+ * Starts the node reader threads. Sockets are spread across the workers
+ * by file descriptor.
+ *
+ * Returns: 0 on success or a negative errno otherwise.
+ */
+int worker_start(unsigned int count, worker_input_func_t func,
+		 void *user_data)
+{
+	unsigned int i;
+	int err;
+
+	if (workers)
+		return -EALREADY;
+
+	if (!count || count > WORKER_MAX || !func)
+		return -EINVAL;
+
+	workers = l_new(struct worker, count);
+	for (i = 0; i < count; i++) {
+		workers[i].epoll_fd = -1;
+		workers[i].stop_fd = -1;
+		workers[i].inbox_fd = -1;
+	}
+
+	input_func = func;
+	input_data = user_data;
+
+	for (worker_count = 0; worker_count < count; worker_count++) {
+		err = worker_init(&workers[worker_count]);
+		if (err < 0) {
+			log_error("worker %u: %s(%d)", worker_count,
+				  strerror(-err), -err);
+			worker_count++;
+			worker_stop();
+			return err;
+		}
+	}
+
+	log_info("%u node reader threads", count);
+
+	return 0;
+}
+
+void worker_stop(void)
+{
+	unsigned int i;
+
+	if (!workers)
+		return;
+
+	for (i = 0; i < worker_count; i++)
+		worker_cleanup(&workers[i]);
+
+	l_free(workers);
+	workers = NULL;
+	worker_count = 0;
+}
+
+bool worker_enabled(void)
+{
+	return workers != NULL;
+}
+
+/**
+ * worker_add:
+ * @fd: node socket
+ * @serial: non-zero id of the socket owner, given back with its buffers
+ *
+ * Hands reading @fd over to a worker. @serial tells buffers read from a
+ * previous socket of the same number apart.
+ *
+ * Returns: 0 on success or a negative errno otherwise.
+ */
+int worker_add(int fd, uint32_t serial)
+{
+	struct worker *worker;
+	struct epoll_event ev;
+	int err = 0;
+
+	if (!workers || fd < 0 || !serial)
+		return -EINVAL;
+
+	worker = worker_for(fd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.u64 = event_key(fd, serial);
+
+	pthread_mutex_lock(&worker->lock);
+
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		err = -errno;
+	} else {
+		l_hashmap_remove(worker->serials, L_INT_TO_PTR(fd));
+		l_hashmap_insert(worker->serials, L_INT_TO_PTR(fd),
+				 L_UINT_TO_PTR(serial));
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	return err;
+}
+
+/* Must be called before @fd is closed: it may be reused right after */
+void worker_remove(int fd)
+{
+	struct worker *worker;
+
+	if (!workers || fd < 0)
+		return;
+
+	worker = worker_for(fd);
+
+	pthread_mutex_lock(&worker->lock);
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	l_hashmap_remove(worker->serials, L_INT_TO_PTR(fd));
+	pthread_mutex_unlock(&worker->lock);
+}
+
+/* Pauses or resumes reading @fd: output queue watermarks */
+void worker_set_reading(int fd, bool reading)
+{
+	struct worker *worker;
+	struct epoll_event ev;
+	uint32_t serial;
+
+	if (!workers || fd < 0)
+		return;
+
+	worker = worker_for(fd);
+
+	pthread_mutex_lock(&worker->lock);
+
+	serial = L_PTR_TO_UINT(l_hashmap_lookup(worker->serials,
+						L_INT_TO_PTR(fd)));
+	if (serial) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = reading ? EPOLLIN | EPOLLRDHUP : 0;
+		ev.data.u64 = event_key(fd, serial);
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+}
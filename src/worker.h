@@ -0,0 +1,41 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Node reader threads. ELL runs a single main loop per process, so the
+ * workers only take the receive side of the node sockets: each one polls
+ * its share of the sockets, reads them and hands the received buffers to
+ * the main loop, where sessions, cloud and D-Bus state stay.
+ */
+
+struct pdubuf;
+
+/* @buf: received octets, owned by the callee; NULL on hangup or error */
+typedef void (*worker_input_func_t) (int fd, uint32_t serial,
+				     struct pdubuf *buf, void *user_data);
+
+int worker_start(unsigned int count, worker_input_func_t func,
+		 void *user_data);
+void worker_stop(void);
+bool worker_enabled(void);
+int worker_add(int fd, uint32_t serial);
+void worker_remove(int fd);
+void worker_set_reading(int fd, bool reading);
@@ -0,0 +1,2423 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ell/ell.h>
+#include <json-c/json.h>
+
+#include <hal/linux_log.h>
+
+#include "mockbroker.h"
+
+#define MB_FRAME_METHOD			1
+#define MB_FRAME_HEADER			2
+#define MB_FRAME_BODY			3
+#define MB_FRAME_HEARTBEAT		8
+#define MB_FRAME_END			0xce
+#define MB_FRAME_OVERHEAD		8 /* Type, channel, size and end */
+#define MB_FRAME_MIN			4096
+#define MB_FRAME_MAX			131072
+#define MB_CHANNEL_MAX			2047
+#define MB_READ_SIZE			65536
+
+#define MB_CLASS_BASIC			60
+
+#define MB_METHOD(class, id)		((uint32_t) (class) << 16 | (id))
+#define MB_CONNECTION_START		MB_METHOD(10, 10)
+#define MB_CONNECTION_START_OK		MB_METHOD(10, 11)
+#define MB_CONNECTION_TUNE		MB_METHOD(10, 30)
+#define MB_CONNECTION_TUNE_OK		MB_METHOD(10, 31)
+#define MB_CONNECTION_OPEN		MB_METHOD(10, 40)
+#define MB_CONNECTION_OPEN_OK		MB_METHOD(10, 41)
+#define MB_CONNECTION_CLOSE		MB_METHOD(10, 50)
+#define MB_CONNECTION_CLOSE_OK		MB_METHOD(10, 51)
+#define MB_CONNECTION_BLOCKED		MB_METHOD(10, 60)
+#define MB_CONNECTION_UNBLOCKED		MB_METHOD(10, 61)
+#define MB_CHANNEL_OPEN			MB_METHOD(20, 10)
+#define MB_CHANNEL_OPEN_OK		MB_METHOD(20, 11)
+#define MB_CHANNEL_CLOSE		MB_METHOD(20, 40)
+#define MB_CHANNEL_CLOSE_OK		MB_METHOD(20, 41)
+#define MB_EXCHANGE_DECLARE		MB_METHOD(40, 10)
+#define MB_EXCHANGE_DECLARE_OK		MB_METHOD(40, 11)
+#define MB_QUEUE_DECLARE		MB_METHOD(50, 10)
+#define MB_QUEUE_DECLARE_OK		MB_METHOD(50, 11)
+#define MB_QUEUE_BIND			MB_METHOD(50, 20)
+#define MB_QUEUE_BIND_OK		MB_METHOD(50, 21)
+#define MB_BASIC_QOS			MB_METHOD(60, 10)
+#define MB_BASIC_QOS_OK			MB_METHOD(60, 11)
+#define MB_BASIC_CONSUME		MB_METHOD(60, 20)
+#define MB_BASIC_CONSUME_OK		MB_METHOD(60, 21)
+#define MB_BASIC_PUBLISH		MB_METHOD(60, 40)
+#define MB_BASIC_DELIVER		MB_METHOD(60, 60)
+#define MB_BASIC_ACK			MB_METHOD(60, 80)
+#define MB_BASIC_REJECT			MB_METHOD(60, 90)
+#define MB_BASIC_NACK			MB_METHOD(60, 120)
+#define MB_CONFIRM_SELECT		MB_METHOD(85, 10)
+#define MB_CONFIRM_SELECT_OK		MB_METHOD(85, 11)
+
+/* Reply codes */
+#define MB_REPLY_SUCCESS		200
+#define MB_NOT_FOUND			404
+#define MB_RESOURCE_LOCKED		405
+#define MB_PRECONDITION_FAILED		406
+#define MB_FRAME_ERROR			501
+#define MB_SYNTAX_ERROR			502
+#define MB_COMMAND_INVALID		503
+#define MB_CHANNEL_ERROR		504
+#define MB_UNEXPECTED_FRAME		505
+#define MB_NOT_IMPLEMENTED		540
+
+/* Cloud side of knotd, see test/mock-connector.py */
+#define MB_EXCHANGE_CLOUD		"connIn"
+#define MB_EXCHANGE_FOG			"connOut"
+#define MB_QUEUE_CLOUD			"connIn-messages"
+#define MB_TOKEN_SIZE			20
+#define MB_DEVICE_ID_SIZE		8
+
+static const uint8_t protocol_header[] = { 'A', 'M', 'Q', 'P', 0, 0, 9, 1 };
+
+struct mb_buffer {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+struct mb_reader {
+	const uint8_t *data;
+	size_t len;
+	size_t off;
+	bool err;
+};
+
+struct mb_message {
+	unsigned int refs;
+	char *exchange;
+	char *routing_key;
+	uint8_t *props;			/* Property flags and list, raw */
+	size_t props_len;
+	uint8_t *body;
+	size_t body_len;
+};
+
+struct mb_channel {
+	uint16_t id;
+	bool closing;			/* channel.close sent by the broker */
+	bool confirm;
+	uint64_t publish_seq;
+	uint64_t delivery_tag;
+	struct l_queue *unacked;	/* struct mb_delivery */
+	struct mb_message *incoming;	/* Publish waiting for its content */
+	uint64_t incoming_size;
+	bool incoming_header;
+};
+
+struct mb_delivery {
+	uint64_t tag;
+	struct mb_queue *queue;
+	struct mb_message *msg;
+};
+
+enum mb_state {
+	MB_STATE_HEADER,
+	MB_STATE_START_OK,
+	MB_STATE_TUNE_OK,
+	MB_STATE_OPEN,
+	MB_STATE_RUNNING,
+	MB_STATE_CLOSING,
+};
+
+struct mb_conn {
+	struct l_io *io;
+	enum mb_state state;
+	struct mb_buffer rx;
+	struct mb_buffer tx;
+	struct l_queue *channels;	/* struct mb_channel */
+	uint32_t frame_max;
+	uint16_t heartbeat;
+	struct l_timeout *heartbeat_to;
+	uint64_t last_rx_ms;
+	uint64_t last_tx_ms;
+	bool blocked_capable;		/* Client handles connection.blocked */
+	bool publisher;
+	bool reading;
+	bool writing;
+	bool drop_on_flush;
+	bool dead;
+	struct l_timeout *destroy_to;
+};
+
+struct mb_queue;
+
+struct mb_consumer {
+	char *tag;
+	struct mb_queue *queue;
+	struct mb_conn *conn;		/* NULL: in-process consumer */
+	uint16_t channel;
+	bool no_ack;
+	mock_broker_consume_func_t func;
+	void *user_data;
+};
+
+struct mb_queue {
+	char *name;
+	struct l_queue *messages;
+	struct l_queue *consumers;
+	struct mb_conn *owner;		/* Exclusive queues only */
+	bool auto_delete;
+};
+
+enum mb_exchange_type {
+	MB_EXCHANGE_DIRECT,
+	MB_EXCHANGE_FANOUT,
+	MB_EXCHANGE_TOPIC,
+};
+
+struct mb_binding {
+	struct mb_queue *queue;
+	char *key;
+};
+
+struct mb_exchange {
+	enum mb_exchange_type type;
+	struct l_queue *bindings;
+};
+
+/* Publish waiting for the injected latency */
+struct mb_route {
+	uint64_t due_ms;
+	struct mb_message *msg;
+	struct mb_conn *conn;		/* Publisher to confirm, if any */
+	uint16_t channel;
+	uint64_t seq;
+};
+
+struct mock_broker {
+	struct l_io *io;
+	uint16_t port;
+	struct l_hashmap *exchanges;
+	struct l_hashmap *queues;
+	struct l_queue *conns;
+	struct l_queue *routes;		/* struct mb_route, FIFO */
+	struct l_timeout *route_to;
+	bool route_armed;
+	unsigned int serial;		/* Server generated names */
+	uint16_t heartbeat;
+	unsigned int latency_ms;
+	unsigned int loss_permille;
+	unsigned int loss_acc;
+	bool blocked;
+	bool side_effect;
+};
+
+static struct mock_broker broker;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Output encoding */
+
+static void buf_put(struct mb_buffer *buf, const void *data, size_t len)
+{
+	size_t size;
+
+	if (buf->len + len > buf->size) {
+		size = buf->size ? buf->size : MB_FRAME_MIN;
+		while (size < buf->len + len)
+			size *= 2;
+
+		buf->data = l_realloc(buf->data, size);
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void buf_consume(struct mb_buffer *buf, size_t len)
+{
+	buf->len -= len;
+	memmove(buf->data, buf->data + len, buf->len);
+}
+
+static void buf_put_u8(struct mb_buffer *buf, uint8_t val)
+{
+	buf_put(buf, &val, 1);
+}
+
+static void buf_put_u16(struct mb_buffer *buf, uint16_t val)
+{
+	uint8_t be[2] = { val >> 8, val };
+
+	buf_put(buf, be, sizeof(be));
+}
+
+static void buf_put_u32(struct mb_buffer *buf, uint32_t val)
+{
+	uint8_t be[4] = { val >> 24, val >> 16, val >> 8, val };
+
+	buf_put(buf, be, sizeof(be));
+}
+
+static void buf_put_u64(struct mb_buffer *buf, uint64_t val)
+{
+	buf_put_u32(buf, val >> 32);
+	buf_put_u32(buf, val);
+}
+
+static void buf_patch_u32(struct mb_buffer *buf, size_t off, uint32_t val)
+{
+	buf->data[off] = val >> 24;
+	buf->data[off + 1] = val >> 16;
+	buf->data[off + 2] = val >> 8;
+	buf->data[off + 3] = val;
+}
+
+static void buf_put_shortstr(struct mb_buffer *buf, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (len > UINT8_MAX)
+		len = UINT8_MAX;
+
+	buf_put_u8(buf, len);
+	buf_put(buf, str, len);
+}
+
+static void buf_put_longstr(struct mb_buffer *buf, const char *str)
+{
+	buf_put_u32(buf, strlen(str));
+	buf_put(buf, str, strlen(str));
+}
+
+/* Returns the offset of the table length, patched by table_end() */
+static size_t table_begin(struct mb_buffer *buf)
+{
+	size_t off = buf->len;
+
+	buf_put_u32(buf, 0);
+
+	return off;
+}
+
+static void table_end(struct mb_buffer *buf, size_t off)
+{
+	buf_patch_u32(buf, off, buf->len - off - 4);
+}
+
+static void table_put_bool(struct mb_buffer *buf, const char *key, bool val)
+{
+	buf_put_shortstr(buf, key);
+	buf_put_u8(buf, 't');
+	buf_put_u8(buf, val);
+}
+
+static void table_put_string(struct mb_buffer *buf, const char *key,
+			     const char *val)
+{
+	buf_put_shortstr(buf, key);
+	buf_put_u8(buf, 'S');
+	buf_put_longstr(buf, val);
+}
+
+/* Returns the offset of the frame payload, patched by frame_end() */
+static size_t frame_begin(struct mb_buffer *buf, uint8_t type,
+			  uint16_t channel)
+{
+	buf_put_u8(buf, type);
+	buf_put_u16(buf, channel);
+	buf_put_u32(buf, 0);
+
+	return buf->len;
+}
+
+static void frame_end(struct mb_buffer *buf, size_t off)
+{
+	buf_patch_u32(buf, off - 4, buf->len - off);
+	buf_put_u8(buf, MB_FRAME_END);
+}
+
+/* Input decoding: errors are sticky and checked once per method */
+
+static uint64_t rd_uint(struct mb_reader *rd, size_t len)
+{
+	uint64_t val = 0;
+	size_t i;
+
+	if (rd->err || rd->len - rd->off < len) {
+		rd->err = true;
+		return 0;
+	}
+
+	for (i = 0; i < len; i++)
+		val = val << 8 | rd->data[rd->off++];
+
+	return val;
+}
+
+static uint8_t rd_u8(struct mb_reader *rd)
+{
+	return rd_uint(rd, 1);
+}
+
+static uint16_t rd_u16(struct mb_reader *rd)
+{
+	return rd_uint(rd, 2);
+}
+
+static uint32_t rd_u32(struct mb_reader *rd)
+{
+	return rd_uint(rd, 4);
+}
+
+static uint64_t rd_u64(struct mb_reader *rd)
+{
+	return rd_uint(rd, 8);
+}
+
+static void rd_shortstr(struct mb_reader *rd, char str[UINT8_MAX + 1])
+{
+	size_t len = rd_u8(rd);
+
+	str[0] = '\0';
+	if (rd->err || rd->len - rd->off < len) {
+		rd->err = true;
+		return;
+	}
+
+	memcpy(str, rd->data + rd->off, len);
+	str[len] = '\0';
+	rd->off += len;
+}
+
+/* Long strings and tables: @sub covers the content */
+static void rd_block(struct mb_reader *rd, struct mb_reader *sub)
+{
+	size_t len = rd_u32(rd);
+
+	memset(sub, 0, sizeof(*sub));
+	if (rd->err || rd->len - rd->off < len) {
+		rd->err = true;
+		return;
+	}
+
+	sub->data = rd->data + rd->off;
+	sub->len = len;
+	rd->off += len;
+}
+
+static bool table_find(struct mb_reader table, const char *key,
+		       uint8_t *kind, struct mb_reader *value)
+{
+	char name[UINT8_MAX + 1];
+	size_t len;
+
+	while (!table.err && table.off < table.len) {
+		rd_shortstr(&table, name);
+		*kind = rd_u8(&table);
+
+		switch (*kind) {
+		case 'S':
+		case 'x':
+		case 'A':
+		case 'F':
+			rd_block(&table, value);
+			len = 0;
+			break;
+		case 't':
+		case 'b':
+		case 'B':
+			len = 1;
+			break;
+		case 's':
+		case 'u':
+		case 'U':
+			len = 2;
+			break;
+		case 'i':
+		case 'I':
+		case 'f':
+			len = 4;
+			break;
+		case 'D':
+			len = 5;
+			break;
+		case 'l':
+		case 'L':
+		case 'd':
+		case 'T':
+			len = 8;
+			break;
+		case 'V':
+			len = 0;
+			break;
+		default:
+			return false;
+		}
+
+		if (len) {
+			if (table.len - table.off < len)
+				return false;
+
+			value->data = table.data + table.off;
+			value->len = len;
+			value->off = 0;
+			value->err = false;
+			table.off += len;
+		}
+
+		if (!table.err && strcmp(name, key) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static bool table_get_bool(struct mb_reader table, const char *key)
+{
+	struct mb_reader value;
+	uint8_t kind;
+
+	if (!table_find(table, key, &kind, &value) || kind != 't')
+		return false;
+
+	return rd_u8(&value) != 0;
+}
+
+/* Messages */
+
+static struct mb_message *message_new(const char *exchange,
+				      const char *routing_key)
+{
+	struct mb_message *msg;
+
+	msg = l_new(struct mb_message, 1);
+	msg->refs = 1;
+	msg->exchange = l_strdup(exchange);
+	msg->routing_key = l_strdup(routing_key);
+
+	return msg;
+}
+
+static struct mb_message *message_ref(struct mb_message *msg)
+{
+	msg->refs++;
+
+	return msg;
+}
+
+static void message_unref(void *data)
+{
+	struct mb_message *msg = data;
+
+	if (--msg->refs)
+		return;
+
+	l_free(msg->exchange);
+	l_free(msg->routing_key);
+	l_free(msg->props);
+	l_free(msg->body);
+	l_free(msg);
+}
+
+/* Connections: output */
+
+static bool conn_write_cb(struct l_io *io, void *user_data);
+
+static void conn_kick(struct mb_conn *conn)
+{
+	if (conn->dead || conn->writing || !conn->tx.len)
+		return;
+
+	conn->writing = true;
+	l_io_set_write_handler(conn->io, conn_write_cb, conn, NULL);
+}
+
+static size_t method_begin(struct mb_conn *conn, uint16_t channel,
+			   uint32_t method)
+{
+	size_t off = frame_begin(&conn->tx, MB_FRAME_METHOD, channel);
+
+	buf_put_u32(&conn->tx, method);
+
+	return off;
+}
+
+static void method_end(struct mb_conn *conn, size_t off)
+{
+	frame_end(&conn->tx, off);
+	conn_kick(conn);
+}
+
+static void send_method(struct mb_conn *conn, uint16_t channel,
+			uint32_t method)
+{
+	method_end(conn, method_begin(conn, channel, method));
+}
+
+static void send_close(struct mb_conn *conn, uint16_t channel,
+		       uint32_t close, uint16_t code, const char *text,
+		       uint32_t method)
+{
+	size_t off = method_begin(conn, channel, close);
+
+	buf_put_u16(&conn->tx, code);
+	buf_put_shortstr(&conn->tx, text);
+	buf_put_u16(&conn->tx, method >> 16);
+	buf_put_u16(&conn->tx, method & 0xffff);
+	method_end(conn, off);
+}
+
+static void send_content(struct mb_conn *conn, uint16_t channel,
+			 const struct mb_message *msg)
+{
+	size_t off, pos, chunk;
+	size_t max = conn->frame_max - MB_FRAME_OVERHEAD;
+
+	off = frame_begin(&conn->tx, MB_FRAME_HEADER, channel);
+	buf_put_u16(&conn->tx, MB_CLASS_BASIC);
+	buf_put_u16(&conn->tx, 0); /* weight */
+	buf_put_u64(&conn->tx, msg->body_len);
+	buf_put(&conn->tx, msg->props, msg->props_len);
+	frame_end(&conn->tx, off);
+
+	for (pos = 0; pos < msg->body_len; pos += chunk) {
+		chunk = msg->body_len - pos;
+		if (chunk > max)
+			chunk = max;
+
+		off = frame_begin(&conn->tx, MB_FRAME_BODY, channel);
+		buf_put(&conn->tx, msg->body + pos, chunk);
+		frame_end(&conn->tx, off);
+	}
+
+	conn_kick(conn);
+}
+
+static void send_blocked(struct mb_conn *conn)
+{
+	size_t off;
+
+	if (!conn->blocked_capable)
+		return;
+
+	if (!broker.blocked) {
+		send_method(conn, 0, MB_CONNECTION_UNBLOCKED);
+		return;
+	}
+
+	off = method_begin(conn, 0, MB_CONNECTION_BLOCKED);
+	buf_put_shortstr(&conn->tx, "mock broker blocked");
+	method_end(conn, off);
+}
+
+static void conn_drop(struct mb_conn *conn);
+
+static void conn_close_after_flush(struct mb_conn *conn)
+{
+	conn->drop_on_flush = true;
+
+	if (!conn->tx.len)
+		conn_drop(conn);
+	else
+		conn_kick(conn);
+}
+
+static void conn_error(struct mb_conn *conn, uint16_t code, const char *text,
+		       uint32_t method)
+{
+	if (conn->state == MB_STATE_CLOSING)
+		return;
+
+	hal_log_info("[broker %p] connection error %u: %s", conn, code, text);
+
+	/* Before the handshake completes there is nobody to answer */
+	if (conn->state != MB_STATE_RUNNING) {
+		conn_drop(conn);
+		return;
+	}
+
+	send_close(conn, 0, MB_CONNECTION_CLOSE, code, text, method);
+	conn->state = MB_STATE_CLOSING;
+}
+
+/* Queues and routing */
+
+static void queue_dispatch(struct mb_queue *queue);
+static void queue_destroy(struct mb_queue *queue);
+
+static struct mb_channel *channel_find(struct mb_conn *conn, uint16_t id)
+{
+	const struct l_queue_entry *entry;
+	struct mb_channel *channel;
+
+	for (entry = l_queue_get_entries(conn->channels); entry;
+							entry = entry->next) {
+		channel = entry->data;
+		if (channel->id == id)
+			return channel;
+	}
+
+	return NULL;
+}
+
+static void consumer_free(void *data)
+{
+	struct mb_consumer *consumer = data;
+
+	l_free(consumer->tag);
+	l_free(consumer);
+}
+
+static void consumer_deliver(struct mb_consumer *consumer,
+			     struct mb_message *msg)
+{
+	struct mb_channel *channel;
+	struct mb_delivery *delivery;
+	size_t off;
+
+	if (consumer->func) {
+		consumer->func(msg->exchange, msg->routing_key, msg->body,
+			       msg->body_len, consumer->user_data);
+		message_unref(msg);
+		return;
+	}
+
+	channel = channel_find(consumer->conn, consumer->channel);
+	if (!channel || consumer->conn->dead) {
+		message_unref(msg);
+		return;
+	}
+
+	channel->delivery_tag++;
+
+	off = method_begin(consumer->conn, channel->id, MB_BASIC_DELIVER);
+	buf_put_shortstr(&consumer->conn->tx, consumer->tag);
+	buf_put_u64(&consumer->conn->tx, channel->delivery_tag);
+	buf_put_u8(&consumer->conn->tx, 0); /* redelivered */
+	buf_put_shortstr(&consumer->conn->tx, msg->exchange);
+	buf_put_shortstr(&consumer->conn->tx, msg->routing_key);
+	method_end(consumer->conn, off);
+	send_content(consumer->conn, channel->id, msg);
+
+	if (consumer->no_ack) {
+		message_unref(msg);
+		return;
+	}
+
+	delivery = l_new(struct mb_delivery, 1);
+	delivery->tag = channel->delivery_tag;
+	delivery->queue = consumer->queue;
+	delivery->msg = msg;
+	l_queue_push_tail(channel->unacked, delivery);
+}
+
+/* Messages go round robin to the queue consumers */
+static void queue_dispatch(struct mb_queue *queue)
+{
+	struct mb_consumer *consumer;
+	struct mb_message *msg;
+
+	while (!l_queue_isempty(queue->messages)) {
+		consumer = l_queue_pop_head(queue->consumers);
+		if (!consumer)
+			break;
+
+		l_queue_push_tail(queue->consumers, consumer);
+		msg = l_queue_pop_head(queue->messages);
+		consumer_deliver(consumer, msg);
+	}
+}
+
+static struct mb_queue *queue_new(const char *name, struct mb_conn *owner,
+				  bool auto_delete)
+{
+	struct mb_queue *queue;
+
+	queue = l_new(struct mb_queue, 1);
+	queue->name = name[0] ? l_strdup(name) :
+			l_strdup_printf("amq.gen-%u", ++broker.serial);
+	queue->messages = l_queue_new();
+	queue->consumers = l_queue_new();
+	queue->owner = owner;
+	queue->auto_delete = auto_delete;
+
+	l_hashmap_insert(broker.queues, queue->name, queue);
+
+	return queue;
+}
+
+static bool binding_remove_queue(void *data, void *user_data)
+{
+	struct mb_binding *binding = data;
+
+	if (binding->queue != user_data)
+		return false;
+
+	l_free(binding->key);
+	l_free(binding);
+
+	return true;
+}
+
+static void exchange_unbind_queue(const void *key, void *value,
+				  void *user_data)
+{
+	struct mb_exchange *exchange = value;
+
+	l_queue_foreach_remove(exchange->bindings, binding_remove_queue,
+			       user_data);
+}
+
+static void queue_free(void *data)
+{
+	struct mb_queue *queue = data;
+
+	l_hashmap_foreach(broker.exchanges, exchange_unbind_queue, queue);
+	l_queue_destroy(queue->messages, message_unref);
+	l_queue_destroy(queue->consumers, consumer_free);
+	l_free(queue->name);
+	l_free(queue);
+}
+
+static void queue_destroy(struct mb_queue *queue)
+{
+	l_hashmap_remove(broker.queues, queue->name);
+	queue_free(queue);
+}
+
+static bool topic_match(const char *pattern, const char *key);
+
+static const char *topic_next(const char *word, size_t len)
+{
+	return word[len] == '.' ? word + len + 1 : NULL;
+}
+
+/* '*' matches exactly one word and '#' zero or more words */
+static bool topic_match(const char *pattern, const char *key)
+{
+	size_t plen, klen;
+
+	if (!pattern)
+		return !key;
+
+	plen = strcspn(pattern, ".");
+	if (plen == 1 && pattern[0] == '#') {
+		for (;;) {
+			if (topic_match(topic_next(pattern, plen), key))
+				return true;
+
+			if (!key)
+				return false;
+
+			key = topic_next(key, strcspn(key, "."));
+		}
+	}
+
+	if (!key)
+		return false;
+
+	klen = strcspn(key, ".");
+	if (!(plen == 1 && pattern[0] == '*') &&
+	    (plen != klen || strncmp(pattern, key, plen) != 0))
+		return false;
+
+	return topic_match(topic_next(pattern, plen), topic_next(key, klen));
+}
+
+static bool binding_match(const struct mb_exchange *exchange,
+			  const struct mb_binding *binding, const char *key)
+{
+	switch (exchange->type) {
+	case MB_EXCHANGE_FANOUT:
+		return true;
+	case MB_EXCHANGE_TOPIC:
+		return topic_match(binding->key, key);
+	case MB_EXCHANGE_DIRECT:
+	default:
+		return strcmp(binding->key, key) == 0;
+	}
+}
+
+static void exchange_route(struct mb_message *msg)
+{
+	const struct l_queue_entry *entry;
+	struct mb_exchange *exchange;
+	struct mb_binding *binding;
+	struct mb_queue *queue;
+	struct l_queue *matched;
+
+	/* Default exchange: routing key is the queue name */
+	if (msg->exchange[0] == '\0') {
+		queue = l_hashmap_lookup(broker.queues, msg->routing_key);
+		if (!queue)
+			return;
+
+		l_queue_push_tail(queue->messages, message_ref(msg));
+		queue_dispatch(queue);
+		return;
+	}
+
+	exchange = l_hashmap_lookup(broker.exchanges, msg->exchange);
+	if (!exchange)
+		return;
+
+	/* A queue gets one copy even if several of its bindings match */
+	matched = l_queue_new();
+	for (entry = l_queue_get_entries(exchange->bindings); entry;
+							entry = entry->next) {
+		binding = entry->data;
+		if (!binding_match(exchange, binding, msg->routing_key))
+			continue;
+
+		if (l_queue_find(matched, NULL, binding->queue))
+			continue;
+
+		l_queue_push_tail(matched, binding->queue);
+	}
+
+	/* Dispatch may publish (in-process consumers): copy first */
+	while ((queue = l_queue_pop_head(matched))) {
+		l_queue_push_tail(queue->messages, message_ref(msg));
+		queue_dispatch(queue);
+	}
+
+	l_queue_destroy(matched, NULL);
+}
+
+/* Deterministic: every 1000 / permille messages one is lost */
+static bool route_lost(void)
+{
+	if (!broker.loss_permille)
+		return false;
+
+	broker.loss_acc += broker.loss_permille;
+	if (broker.loss_acc < 1000)
+		return false;
+
+	broker.loss_acc -= 1000;
+
+	return true;
+}
+
+static void route_deliver(struct mb_route *route)
+{
+	struct mb_channel *channel = NULL;
+	bool lost = route_lost();
+	size_t off;
+
+	if (!lost)
+		exchange_route(route->msg);
+
+	if (route->conn)
+		channel = channel_find(route->conn, route->channel);
+
+	/* Lost messages are nacked so that confirming publishers see it */
+	if (channel && channel->confirm && !route->conn->dead) {
+		off = method_begin(route->conn, channel->id,
+				   lost ? MB_BASIC_NACK : MB_BASIC_ACK);
+		buf_put_u64(&route->conn->tx, route->seq);
+		buf_put_u8(&route->conn->tx, 0); /* multiple, requeue */
+		method_end(route->conn, off);
+	}
+
+	message_unref(route->msg);
+	l_free(route);
+}
+
+static void route_expired(struct l_timeout *timeout, void *user_data);
+
+static void route_arm(void)
+{
+	struct mb_route *route = l_queue_peek_head(broker.routes);
+	uint64_t now = now_ms();
+	uint64_t delay;
+
+	if (!route || broker.route_armed)
+		return;
+
+	delay = route->due_ms > now ? route->due_ms - now : 1;
+	broker.route_armed = true;
+
+	if (broker.route_to)
+		l_timeout_modify_ms(broker.route_to, delay);
+	else
+		broker.route_to = l_timeout_create_ms(delay, route_expired,
+						      NULL, NULL);
+}
+
+static void route_expired(struct l_timeout *timeout, void *user_data)
+{
+	struct mb_route *route;
+	uint64_t now = now_ms();
+
+	broker.route_armed = false;
+
+	while ((route = l_queue_peek_head(broker.routes)) &&
+	       route->due_ms <= now) {
+		l_queue_pop_head(broker.routes);
+		route_deliver(route);
+	}
+
+	route_arm();
+}
+
+static void route_submit(struct mb_message *msg, struct mb_conn *conn,
+			 uint16_t channel, uint64_t seq)
+{
+	struct mb_route *route;
+
+	route = l_new(struct mb_route, 1);
+	route->msg = msg;
+	route->conn = conn;
+	route->channel = channel;
+	route->seq = seq;
+
+	if (!broker.latency_ms) {
+		route_deliver(route);
+		return;
+	}
+
+	route->due_ms = now_ms() + broker.latency_ms;
+	l_queue_push_tail(broker.routes, route);
+
+	if (!broker.route_to) {
+		broker.route_to = l_timeout_create_ms(broker.latency_ms,
+						      route_expired,
+						      NULL, NULL);
+		broker.route_armed = true;
+		return;
+	}
+
+	route_arm();
+}
+
+static void route_forget_conn(void *data, void *user_data)
+{
+	struct mb_route *route = data;
+
+	if (route->conn == user_data)
+		route->conn = NULL;
+}
+
+/* Channels */
+
+static struct mb_channel *channel_new(struct mb_conn *conn, uint16_t id)
+{
+	struct mb_channel *channel;
+
+	channel = l_new(struct mb_channel, 1);
+	channel->id = id;
+	channel->unacked = l_queue_new();
+	l_queue_push_tail(conn->channels, channel);
+
+	return channel;
+}
+
+struct consumer_match {
+	struct mb_conn *conn;
+	uint16_t channel;		/* 0: any channel */
+	struct l_queue *emptied;	/* Auto-delete candidates */
+};
+
+static bool consumer_remove_match(void *data, void *user_data)
+{
+	struct mb_consumer *consumer = data;
+	struct consumer_match *match = user_data;
+
+	if (consumer->conn != match->conn ||
+	    (match->channel && consumer->channel != match->channel))
+		return false;
+
+	consumer_free(consumer);
+
+	return true;
+}
+
+static void queue_remove_consumers(const void *key, void *value,
+				   void *user_data)
+{
+	struct mb_queue *queue = value;
+	struct consumer_match *match = user_data;
+
+	if (!l_queue_foreach_remove(queue->consumers, consumer_remove_match,
+				    match))
+		return;
+
+	if (queue->auto_delete && l_queue_isempty(queue->consumers))
+		l_queue_push_tail(match->emptied, queue);
+}
+
+static void channel_free(struct mb_conn *conn, struct mb_channel *channel)
+{
+	struct consumer_match match = {
+		.conn = conn,
+		.channel = channel->id,
+		.emptied = l_queue_new(),
+	};
+	struct l_queue *requeue = l_queue_new();
+	struct mb_delivery *delivery;
+	struct mb_queue *queue;
+
+	l_queue_remove(conn->channels, channel);
+	l_hashmap_foreach(broker.queues, queue_remove_consumers, &match);
+
+	/* Unacked messages go back to the head, in their original order */
+	while ((delivery = l_queue_pop_head(channel->unacked)))
+		l_queue_push_head(requeue, delivery);
+
+	while ((delivery = l_queue_pop_head(requeue))) {
+		queue = delivery->queue;
+		l_queue_push_head(queue->messages, delivery->msg);
+		l_free(delivery);
+
+		if (!l_queue_find(match.emptied, NULL, queue))
+			queue_dispatch(queue);
+	}
+
+	while ((queue = l_queue_pop_head(match.emptied)))
+		queue_destroy(queue);
+
+	l_queue_destroy(match.emptied, NULL);
+	l_queue_destroy(requeue, NULL);
+
+	if (channel->incoming)
+		message_unref(channel->incoming);
+
+	l_queue_destroy(channel->unacked, NULL);
+	l_free(channel);
+}
+
+struct ack_match {
+	uint64_t tag;
+	bool multiple;
+	bool requeue;
+	struct l_queue *requeued;	/* struct mb_delivery */
+};
+
+static bool delivery_settle(void *data, void *user_data)
+{
+	struct mb_delivery *delivery = data;
+	struct ack_match *match = user_data;
+
+	if (delivery->tag != match->tag &&
+	    !(match->multiple && (!match->tag || delivery->tag < match->tag)))
+		return false;
+
+	/* Dispatched later: it may add to the list being walked */
+	if (match->requeue) {
+		l_queue_push_tail(match->requeued, delivery);
+		return true;
+	}
+
+	message_unref(delivery->msg);
+	l_free(delivery);
+
+	return true;
+}
+
+/* Method handlers: @rd is positioned after the method id */
+
+static void handle_start_ok(struct mb_conn *conn, struct mb_reader *rd)
+{
+	struct mb_reader props, caps;
+	uint8_t kind;
+	size_t off;
+
+	rd_block(rd, &props);
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR",
+			   MB_CONNECTION_START_OK);
+		return;
+	}
+
+	if (table_find(props, "capabilities", &kind, &caps) && kind == 'F')
+		conn->blocked_capable = table_get_bool(caps,
+						       "connection.blocked");
+
+	/* Any mechanism and credentials are accepted */
+	off = method_begin(conn, 0, MB_CONNECTION_TUNE);
+	buf_put_u16(&conn->tx, MB_CHANNEL_MAX);
+	buf_put_u32(&conn->tx, MB_FRAME_MAX);
+	buf_put_u16(&conn->tx, broker.heartbeat);
+	method_end(conn, off);
+
+	conn->state = MB_STATE_TUNE_OK;
+}
+
+static void heartbeat_expired(struct l_timeout *timeout, void *user_data)
+{
+	struct mb_conn *conn = user_data;
+	uint64_t now = now_ms();
+	uint64_t interval = conn->heartbeat * 1000;
+	size_t off;
+
+	/* Blocked publishers are not read: their silence is expected */
+	if (conn->reading && now - conn->last_rx_ms > 2 * interval) {
+		hal_log_info("[broker %p] missed heartbeats", conn);
+		conn_drop(conn);
+		return;
+	}
+
+	if (now - conn->last_tx_ms >= interval / 2) {
+		off = frame_begin(&conn->tx, MB_FRAME_HEARTBEAT, 0);
+		frame_end(&conn->tx, off);
+		conn_kick(conn);
+	}
+
+	l_timeout_modify_ms(timeout, interval / 2);
+}
+
+static void handle_tune_ok(struct mb_conn *conn, struct mb_reader *rd)
+{
+	uint32_t frame_max;
+
+	rd_u16(rd); /* channel-max */
+	frame_max = rd_u32(rd);
+	conn->heartbeat = rd_u16(rd);
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR",
+			   MB_CONNECTION_TUNE_OK);
+		return;
+	}
+
+	if (!frame_max || frame_max > MB_FRAME_MAX)
+		frame_max = MB_FRAME_MAX;
+	if (frame_max < MB_FRAME_MIN)
+		frame_max = MB_FRAME_MIN;
+
+	conn->frame_max = frame_max;
+
+	if (conn->heartbeat)
+		conn->heartbeat_to = l_timeout_create_ms(
+					conn->heartbeat * 500,
+					heartbeat_expired, conn, NULL);
+
+	conn->state = MB_STATE_OPEN;
+}
+
+static void handle_open(struct mb_conn *conn, struct mb_reader *rd)
+{
+	char vhost[UINT8_MAX + 1];
+	size_t off;
+
+	rd_shortstr(rd, vhost);
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR",
+			   MB_CONNECTION_OPEN);
+		return;
+	}
+
+	off = method_begin(conn, 0, MB_CONNECTION_OPEN_OK);
+	buf_put_shortstr(&conn->tx, "");
+	method_end(conn, off);
+
+	conn->state = MB_STATE_RUNNING;
+	hal_log_info("[broker %p] connection open, vhost '%s'", conn, vhost);
+
+	if (broker.blocked)
+		send_blocked(conn);
+}
+
+static void channel_error(struct mb_conn *conn, struct mb_channel *channel,
+			  uint16_t code, const char *text, uint32_t method)
+{
+	hal_log_info("[broker %p] channel %u error %u: %s", conn,
+		     channel->id, code, text);
+
+	send_close(conn, channel->id, MB_CHANNEL_CLOSE, code, text, method);
+	channel->closing = true;
+}
+
+static void handle_exchange_declare(struct mb_conn *conn,
+				    struct mb_channel *channel,
+				    struct mb_reader *rd)
+{
+	char name[UINT8_MAX + 1], type_name[UINT8_MAX + 1];
+	enum mb_exchange_type type;
+	struct mb_exchange *exchange;
+	struct mb_reader args;
+	uint8_t bits;
+
+	rd_u16(rd); /* ticket */
+	rd_shortstr(rd, name);
+	rd_shortstr(rd, type_name);
+	bits = rd_u8(rd);
+	rd_block(rd, &args);
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR",
+			   MB_EXCHANGE_DECLARE);
+		return;
+	}
+
+	exchange = l_hashmap_lookup(broker.exchanges, name);
+
+	if (strcmp(type_name, "topic") == 0) {
+		type = MB_EXCHANGE_TOPIC;
+	} else if (strcmp(type_name, "direct") == 0) {
+		type = MB_EXCHANGE_DIRECT;
+	} else if (strcmp(type_name, "fanout") == 0) {
+		type = MB_EXCHANGE_FANOUT;
+	} else if (!(bits & 0x01)) {
+		conn_error(conn, MB_COMMAND_INVALID, "COMMAND_INVALID",
+			   MB_EXCHANGE_DECLARE);
+		return;
+	} else {
+		type = exchange ? exchange->type : MB_EXCHANGE_DIRECT;
+	}
+
+	if (!exchange && (bits & 0x01)) {
+		channel_error(conn, channel, MB_NOT_FOUND, "NOT_FOUND",
+			      MB_EXCHANGE_DECLARE);
+		return;
+	}
+
+	if (exchange && exchange->type != type) {
+		channel_error(conn, channel, MB_PRECONDITION_FAILED,
+			      "PRECONDITION_FAILED", MB_EXCHANGE_DECLARE);
+		return;
+	}
+
+	if (!exchange) {
+		exchange = l_new(struct mb_exchange, 1);
+		exchange->type = type;
+		exchange->bindings = l_queue_new();
+		l_hashmap_insert(broker.exchanges, name, exchange);
+	}
+
+	if (!(bits & 0x10))
+		send_method(conn, channel->id, MB_EXCHANGE_DECLARE_OK);
+}
+
+static void handle_queue_declare(struct mb_conn *conn,
+				 struct mb_channel *channel,
+				 struct mb_reader *rd)
+{
+	char name[UINT8_MAX + 1];
+	struct mb_queue *queue;
+	struct mb_reader args;
+	uint8_t bits;
+	size_t off;
+
+	rd_u16(rd); /* ticket */
+	rd_shortstr(rd, name);
+	bits = rd_u8(rd);
+	rd_block(rd, &args);
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR",
+			   MB_QUEUE_DECLARE);
+		return;
+	}
+
+	queue = name[0] ? l_hashmap_lookup(broker.queues, name) : NULL;
+
+	if (!queue && (bits & 0x01)) {
+		channel_error(conn, channel, MB_NOT_FOUND, "NOT_FOUND",
+			      MB_QUEUE_DECLARE);
+		return;
+	}
+
+	if (queue && queue->owner && queue->owner != conn) {
+		channel_error(conn, channel, MB_RESOURCE_LOCKED,
+			      "RESOURCE_LOCKED", MB_QUEUE_DECLARE);
+		return;
+	}
+
+	if (!queue)
+		queue = queue_new(name, bits & 0x04 ? conn : NULL,
+				  bits & 0x08);
+
+	if (bits & 0x10)
+		return;
+
+	off = method_begin(conn, channel->id, MB_QUEUE_DECLARE_OK);
+	buf_put_shortstr(&conn->tx, queue->name);
+	buf_put_u32(&conn->tx, l_queue_length(queue->messages));
+	buf_put_u32(&conn->tx, l_queue_length(queue->consumers));
+	method_end(conn, off);
+}
+
+static bool binding_match_key(const void *data, const void *user_data)
+{
+	const struct mb_binding *binding = data;
+	const struct mb_binding *other = user_data;
+
+	return binding->queue == other->queue &&
+					strcmp(binding->key, other->key) == 0;
+}
+
+static int queue_bind(struct mb_queue *queue, const char *name,
+		      const char *key)
+{
+	struct mb_exchange *exchange;
+	struct mb_binding *binding;
+	struct mb_binding match = { .queue = queue, .key = (char *) key };
+
+	exchange = l_hashmap_lookup(broker.exchanges, name);
+	if (!exchange)
+		return -ENOENT;
+
+	if (l_queue_find(exchange->bindings, binding_match_key, &match))
+		return 0;
+
+	binding = l_new(struct mb_binding, 1);
+	binding->queue = queue;
+	binding->key = l_strdup(key);
+	l_queue_push_tail(exchange->bindings, binding);
+
+	return 0;
+}
+
+static void handle_queue_bind(struct mb_conn *conn,
+			      struct mb_channel *channel,
+			      struct mb_reader *rd)
+{
+	char name[UINT8_MAX + 1], exchange[UINT8_MAX + 1];
+	char key[UINT8_MAX + 1];
+	struct mb_queue *queue;
+	struct mb_reader args;
+	uint8_t bits;
+
+	rd_u16(rd); /* ticket */
+	rd_shortstr(rd, name);
+	rd_shortstr(rd, exchange);
+	rd_shortstr(rd, key);
+	bits = rd_u8(rd);
+	rd_block(rd, &args);
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR",
+			   MB_QUEUE_BIND);
+		return;
+	}
+
+	queue = l_hashmap_lookup(broker.queues, name);
+	if (!queue || queue_bind(queue, exchange, key) < 0) {
+		channel_error(conn, channel, MB_NOT_FOUND, "NOT_FOUND",
+			      MB_QUEUE_BIND);
+		return;
+	}
+
+	if (!(bits & 0x01))
+		send_method(conn, channel->id, MB_QUEUE_BIND_OK);
+}
+
+static void handle_basic_consume(struct mb_conn *conn,
+				 struct mb_channel *channel,
+				 struct mb_reader *rd)
+{
+	char name[UINT8_MAX + 1], tag[UINT8_MAX + 1];
+	struct mb_consumer *consumer;
+	struct mb_queue *queue;
+	struct mb_reader args;
+	uint8_t bits;
+	size_t off;
+
+	rd_u16(rd); /* ticket */
+	rd_shortstr(rd, name);
+	rd_shortstr(rd, tag);
+	bits = rd_u8(rd);
+	rd_block(rd, &args);
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR",
+			   MB_BASIC_CONSUME);
+		return;
+	}
+
+	queue = l_hashmap_lookup(broker.queues, name);
+	if (!queue) {
+		channel_error(conn, channel, MB_NOT_FOUND, "NOT_FOUND",
+			      MB_BASIC_CONSUME);
+		return;
+	}
+
+	consumer = l_new(struct mb_consumer, 1);
+	consumer->tag = tag[0] ? l_strdup(tag) :
+			l_strdup_printf("amq.ctag-%u", ++broker.serial);
+	consumer->queue = queue;
+	consumer->conn = conn;
+	consumer->channel = channel->id;
+	consumer->no_ack = bits & 0x02;
+	l_queue_push_tail(queue->consumers, consumer);
+
+	if (!(bits & 0x08)) {
+		off = method_begin(conn, channel->id, MB_BASIC_CONSUME_OK);
+		buf_put_shortstr(&conn->tx, consumer->tag);
+		method_end(conn, off);
+	}
+
+	queue_dispatch(queue);
+}
+
+static void handle_basic_publish(struct mb_conn *conn,
+				 struct mb_channel *channel,
+				 struct mb_reader *rd)
+{
+	char exchange[UINT8_MAX + 1], key[UINT8_MAX + 1];
+
+	rd_u16(rd); /* ticket */
+	rd_shortstr(rd, exchange);
+	rd_shortstr(rd, key);
+	rd_u8(rd); /* mandatory, immediate: unroutable are dropped */
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR",
+			   MB_BASIC_PUBLISH);
+		return;
+	}
+
+	if (exchange[0] && !l_hashmap_lookup(broker.exchanges, exchange)) {
+		channel_error(conn, channel, MB_NOT_FOUND, "NOT_FOUND",
+			      MB_BASIC_PUBLISH);
+		return;
+	}
+
+	if (channel->incoming)
+		message_unref(channel->incoming);
+
+	channel->incoming = message_new(exchange, key);
+	channel->incoming_header = false;
+	channel->incoming_size = 0;
+	conn->publisher = true;
+}
+
+static void handle_basic_settle(struct mb_conn *conn,
+				struct mb_channel *channel,
+				struct mb_reader *rd, uint32_t method)
+{
+	struct ack_match match;
+	struct mb_delivery *delivery;
+	uint8_t bits;
+
+	match.tag = rd_u64(rd);
+	bits = rd_u8(rd);
+	if (rd->err) {
+		conn_error(conn, MB_SYNTAX_ERROR, "SYNTAX_ERROR", method);
+		return;
+	}
+
+	switch (method) {
+	case MB_BASIC_ACK:
+		match.multiple = bits & 0x01;
+		match.requeue = false;
+		break;
+	case MB_BASIC_REJECT:
+		match.multiple = false;
+		match.requeue = bits & 0x01;
+		break;
+	case MB_BASIC_NACK:
+	default:
+		match.multiple = bits & 0x01;
+		match.requeue = bits & 0x02;
+		break;
+	}
+
+	match.requeued = l_queue_new();
+	l_queue_foreach_remove(channel->unacked, delivery_settle, &match);
+
+	while ((delivery = l_queue_pop_head(match.requeued))) {
+		l_queue_push_tail(delivery->queue->messages, delivery->msg);
+		queue_dispatch(delivery->queue);
+		l_free(delivery);
+	}
+
+	l_queue_destroy(match.requeued, NULL);
+}
+
+static void handle_channel_method(struct mb_conn *conn, uint16_t id,
+				  uint32_t method, struct mb_reader *rd)
+{
+	struct mb_channel *channel = channel_find(conn, id);
+	size_t off;
+
+	if (method == MB_CHANNEL_OPEN) {
+		if (channel || !id || id > MB_CHANNEL_MAX) {
+			conn_error(conn, MB_CHANNEL_ERROR, "CHANNEL_ERROR",
+				   method);
+			return;
+		}
+
+		channel_new(conn, id);
+		off = method_begin(conn, id, MB_CHANNEL_OPEN_OK);
+		buf_put_u32(&conn->tx, 0); /* reserved long string */
+		method_end(conn, off);
+		return;
+	}
+
+	if (!channel) {
+		conn_error(conn, MB_CHANNEL_ERROR, "CHANNEL_ERROR", method);
+		return;
+	}
+
+	if (method == MB_CHANNEL_CLOSE) {
+		channel_free(conn, channel);
+		send_method(conn, id, MB_CHANNEL_CLOSE_OK);
+		return;
+	}
+
+	if (method == MB_CHANNEL_CLOSE_OK) {
+		channel_free(conn, channel);
+		return;
+	}
+
+	/* Waiting the close-ok: everything else is discarded */
+	if (channel->closing)
+		return;
+
+	switch (method) {
+	case MB_EXCHANGE_DECLARE:
+		handle_exchange_declare(conn, channel, rd);
+		break;
+	case MB_QUEUE_DECLARE:
+		handle_queue_declare(conn, channel, rd);
+		break;
+	case MB_QUEUE_BIND:
+		handle_queue_bind(conn, channel, rd);
+		break;
+	case MB_BASIC_QOS:
+		/* Accepted, prefetch limits are not enforced */
+		send_method(conn, id, MB_BASIC_QOS_OK);
+		break;
+	case MB_BASIC_CONSUME:
+		handle_basic_consume(conn, channel, rd);
+		break;
+	case MB_BASIC_PUBLISH:
+		handle_basic_publish(conn, channel, rd);
+		break;
+	case MB_BASIC_ACK:
+	case MB_BASIC_REJECT:
+	case MB_BASIC_NACK:
+		handle_basic_settle(conn, channel, rd, method);
+		break;
+	case MB_CONFIRM_SELECT:
+		channel->confirm = true;
+		if (!(rd_u8(rd) & 0x01))
+			send_method(conn, id, MB_CONFIRM_SELECT_OK);
+		break;
+	default:
+		conn_error(conn, MB_NOT_IMPLEMENTED, "NOT_IMPLEMENTED",
+			   method);
+		break;
+	}
+}
+
+static void handle_method(struct mb_conn *conn, uint16_t id,
+			  struct mb_reader *rd)
+{
+	uint32_t method = rd_u32(rd);
+
+	switch (conn->state) {
+	case MB_STATE_START_OK:
+		if (method == MB_CONNECTION_START_OK)
+			handle_start_ok(conn, rd);
+		else
+			conn_error(conn, MB_COMMAND_INVALID, "COMMAND_INVALID",
+				   method);
+		return;
+	case MB_STATE_TUNE_OK:
+		if (method == MB_CONNECTION_TUNE_OK)
+			handle_tune_ok(conn, rd);
+		else
+			conn_error(conn, MB_COMMAND_INVALID, "COMMAND_INVALID",
+				   method);
+		return;
+	case MB_STATE_OPEN:
+		if (method == MB_CONNECTION_OPEN)
+			handle_open(conn, rd);
+		else
+			conn_error(conn, MB_COMMAND_INVALID, "COMMAND_INVALID",
+				   method);
+		return;
+	case MB_STATE_CLOSING:
+		if (method == MB_CONNECTION_CLOSE)
+			send_method(conn, 0, MB_CONNECTION_CLOSE_OK);
+
+		if (method == MB_CONNECTION_CLOSE ||
+		    method == MB_CONNECTION_CLOSE_OK)
+			conn_close_after_flush(conn);
+		return;
+	case MB_STATE_HEADER:
+	case MB_STATE_RUNNING:
+	default:
+		break;
+	}
+
+	if (method == MB_CONNECTION_CLOSE) {
+		send_method(conn, 0, MB_CONNECTION_CLOSE_OK);
+		conn->state = MB_STATE_CLOSING;
+		conn_close_after_flush(conn);
+		return;
+	}
+
+	if (!id) {
+		conn_error(conn, MB_NOT_IMPLEMENTED, "NOT_IMPLEMENTED",
+			   method);
+		return;
+	}
+
+	handle_channel_method(conn, id, method, rd);
+}
+
+static void publish_complete(struct mb_conn *conn,
+			     struct mb_channel *channel)
+{
+	struct mb_message *msg = channel->incoming;
+
+	channel->incoming = NULL;
+	route_submit(msg, conn, channel->id,
+		     channel->confirm ? ++channel->publish_seq : 0);
+}
+
+static void handle_content(struct mb_conn *conn, uint8_t type, uint16_t id,
+			   const uint8_t *payload, size_t len)
+{
+	struct mb_channel *channel = channel_find(conn, id);
+	struct mb_message *msg;
+	struct mb_reader rd = { .data = payload, .len = len };
+
+	if (!channel || channel->closing)
+		return;
+
+	msg = channel->incoming;
+	if (!msg || channel->incoming_header != (type == MB_FRAME_BODY)) {
+		conn_error(conn, MB_UNEXPECTED_FRAME, "UNEXPECTED_FRAME", 0);
+		return;
+	}
+
+	if (type == MB_FRAME_HEADER) {
+		rd_u16(&rd); /* class */
+		rd_u16(&rd); /* weight */
+		channel->incoming_size = rd_u64(&rd);
+		if (rd.err || len - rd.off < 2) {
+			conn_error(conn, MB_FRAME_ERROR, "FRAME_ERROR", 0);
+			return;
+		}
+
+		/* Properties are forwarded as received */
+		msg->props = l_memdup(payload + rd.off, len - rd.off);
+		msg->props_len = len - rd.off;
+		msg->body = l_malloc(channel->incoming_size ?
+				     channel->incoming_size : 1);
+		channel->incoming_header = true;
+	} else {
+		if (msg->body_len + len > channel->incoming_size) {
+			conn_error(conn, MB_FRAME_ERROR, "FRAME_ERROR", 0);
+			return;
+		}
+
+		memcpy(msg->body + msg->body_len, payload, len);
+		msg->body_len += len;
+	}
+
+	if (msg->body_len == channel->incoming_size)
+		publish_complete(conn, channel);
+}
+
+static void handle_frame(struct mb_conn *conn, uint8_t type, uint16_t id,
+			 const uint8_t *payload, size_t len)
+{
+	struct mb_reader rd = { .data = payload, .len = len };
+
+	switch (type) {
+	case MB_FRAME_METHOD:
+		handle_method(conn, id, &rd);
+		break;
+	case MB_FRAME_HEADER:
+	case MB_FRAME_BODY:
+		handle_content(conn, type, id, payload, len);
+		break;
+	case MB_FRAME_HEARTBEAT:
+		break;
+	default:
+		conn_error(conn, MB_FRAME_ERROR, "FRAME_ERROR", 0);
+		break;
+	}
+}
+
+static bool conn_handshake(struct mb_conn *conn)
+{
+	struct mb_buffer *tx = &conn->tx;
+	size_t off, table, caps;
+
+	if (conn->rx.len < sizeof(protocol_header))
+		return true;
+
+	if (memcmp(conn->rx.data, protocol_header,
+		   sizeof(protocol_header)) != 0) {
+		/* Tell the client which protocol is spoken and hang up */
+		buf_put(tx, protocol_header, sizeof(protocol_header));
+		conn_close_after_flush(conn);
+		return false;
+	}
+
+	buf_consume(&conn->rx, sizeof(protocol_header));
+
+	off = method_begin(conn, 0, MB_CONNECTION_START);
+	buf_put_u8(tx, 0);
+	buf_put_u8(tx, 9);
+	table = table_begin(tx);
+	table_put_string(tx, "product", "KNoT mock broker");
+	buf_put_shortstr(tx, "capabilities");
+	buf_put_u8(tx, 'F');
+	caps = table_begin(tx);
+	table_put_bool(tx, "publisher_confirms", true);
+	table_put_bool(tx, "basic.nack", true);
+	table_put_bool(tx, "connection.blocked", true);
+	table_end(tx, caps);
+	table_end(tx, table);
+	buf_put_longstr(tx, "PLAIN AMQPLAIN");
+	buf_put_longstr(tx, "en_US");
+	method_end(conn, off);
+
+	conn->state = MB_STATE_START_OK;
+
+	return true;
+}
+
+static void conn_set_reading(struct mb_conn *conn, bool reading);
+
+static bool conn_read_cb(struct l_io *io, void *user_data)
+{
+	struct mb_conn *conn = user_data;
+	const uint8_t *frame;
+	uint32_t size;
+	size_t off = 0;
+	ssize_t nbytes;
+
+	if (conn->dead)
+		return false;
+
+	if (conn->rx.size - conn->rx.len < MB_READ_SIZE) {
+		conn->rx.size = conn->rx.len + MB_READ_SIZE;
+		conn->rx.data = l_realloc(conn->rx.data, conn->rx.size);
+	}
+
+	nbytes = read(l_io_get_fd(io), conn->rx.data + conn->rx.len,
+		      conn->rx.size - conn->rx.len);
+	if (nbytes <= 0) {
+		if (nbytes < 0 && (errno == EAGAIN || errno == EINTR))
+			return true;
+
+		conn_drop(conn);
+		return false;
+	}
+
+	conn->rx.len += nbytes;
+	conn->last_rx_ms = now_ms();
+
+	if (conn->state == MB_STATE_HEADER && !conn_handshake(conn))
+		return false;
+
+	while (!conn->dead && conn->state != MB_STATE_HEADER &&
+	       conn->rx.len - off >= MB_FRAME_OVERHEAD) {
+		frame = conn->rx.data + off;
+		size = (uint32_t) frame[3] << 24 | frame[4] << 16 |
+							frame[5] << 8 | frame[6];
+
+		if (size > conn->frame_max - MB_FRAME_OVERHEAD) {
+			conn_error(conn, MB_FRAME_ERROR, "FRAME_ERROR", 0);
+			conn_close_after_flush(conn);
+			conn->reading = false;
+			return false;
+		}
+
+		if (conn->rx.len - off < size + MB_FRAME_OVERHEAD)
+			break;
+
+		if (frame[7 + size] != MB_FRAME_END) {
+			conn_drop(conn);
+			break;
+		}
+
+		handle_frame(conn, frame[0], frame[1] << 8 | frame[2],
+			     frame + 7, size);
+		off += size + MB_FRAME_OVERHEAD;
+	}
+
+	if (conn->dead)
+		return false;
+
+	buf_consume(&conn->rx, off);
+
+	/* Like RabbitMQ: stop reading publishers while blocked */
+	if (broker.blocked && conn->publisher) {
+		conn->reading = false;
+		return false;
+	}
+
+	return true;
+}
+
+static void conn_set_reading(struct mb_conn *conn, bool reading)
+{
+	if (conn->dead || conn->reading == reading)
+		return;
+
+	conn->reading = reading;
+	conn->last_rx_ms = now_ms();
+	l_io_set_read_handler(conn->io, reading ? conn_read_cb : NULL,
+			      conn, NULL);
+}
+
+static bool conn_write_cb(struct l_io *io, void *user_data)
+{
+	struct mb_conn *conn = user_data;
+	ssize_t nbytes;
+
+	if (conn->dead)
+		return false;
+
+	nbytes = send(l_io_get_fd(io), conn->tx.data, conn->tx.len,
+		      MSG_NOSIGNAL);
+	if (nbytes < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return true;
+
+		conn_drop(conn);
+		conn->writing = false;
+		return false;
+	}
+
+	buf_consume(&conn->tx, nbytes);
+	conn->last_tx_ms = now_ms();
+
+	if (conn->tx.len)
+		return true;
+
+	conn->writing = false;
+
+	if (conn->drop_on_flush)
+		conn_drop(conn);
+
+	return false;
+}
+
+static void queue_collect_owned(const void *key, void *value,
+				void *user_data)
+{
+	struct mb_queue *queue = value;
+	struct l_queue *owned = user_data;
+
+	if (queue->owner == l_queue_peek_head(owned))
+		l_queue_push_tail(owned, queue);
+}
+
+static void conn_destroy(struct mb_conn *conn)
+{
+	struct mb_channel *channel;
+	struct mb_queue *queue;
+	struct l_queue *owned = l_queue_new();
+
+	hal_log_info("[broker %p] connection closed", conn);
+
+	while ((channel = l_queue_peek_head(conn->channels)))
+		channel_free(conn, channel);
+
+	/* Exclusive queues go away with their owner */
+	l_queue_push_tail(owned, conn);
+	l_hashmap_foreach(broker.queues, queue_collect_owned, owned);
+	l_queue_pop_head(owned);
+
+	l_queue_foreach(broker.routes, route_forget_conn, conn);
+	l_queue_remove(broker.conns, conn);
+
+	while ((queue = l_queue_pop_head(owned)))
+		queue_destroy(queue);
+
+	l_queue_destroy(owned, NULL);
+	l_queue_destroy(conn->channels, NULL);
+	l_timeout_remove(conn->heartbeat_to);
+	l_timeout_remove(conn->destroy_to);
+	l_io_destroy(conn->io);
+	l_free(conn->rx.data);
+	l_free(conn->tx.data);
+	l_free(conn);
+}
+
+static void conn_destroy_to(struct l_timeout *timeout, void *user_data)
+{
+	conn_destroy(user_data);
+}
+
+static void conn_drop(struct mb_conn *conn)
+{
+	if (conn->dead)
+		return;
+
+	conn->dead = true;
+
+	/* Never free from inside the l_io callbacks */
+	conn->destroy_to = l_timeout_create_ms(1, conn_destroy_to, conn,
+					       NULL);
+}
+
+static void conn_disconnect_cb(struct l_io *io, void *user_data)
+{
+	conn_drop(user_data);
+}
+
+static bool accept_cb(struct l_io *io, void *user_data)
+{
+	struct mb_conn *conn;
+	int fd, one = 1;
+
+	fd = accept4(l_io_get_fd(io), NULL, NULL,
+		     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		hal_log_error("broker accept(): %s (%d)", strerror(errno),
+			      errno);
+		return true;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	conn = l_new(struct mb_conn, 1);
+	conn->state = MB_STATE_HEADER;
+	conn->channels = l_queue_new();
+	conn->frame_max = MB_FRAME_MIN;
+	conn->last_rx_ms = now_ms();
+	conn->last_tx_ms = conn->last_rx_ms;
+	conn->io = l_io_new(fd);
+	l_io_set_close_on_destroy(conn->io, true);
+	l_io_set_disconnect_handler(conn->io, conn_disconnect_cb, conn, NULL);
+	conn_set_reading(conn, true);
+
+	l_queue_push_tail(broker.conns, conn);
+
+	return true;
+}
+
+/* Cloud side: answers knotd like test/mock-connector.py */
+
+static const char *connector_reply_key(const char *key)
+{
+	static const char *const map[][2] = {
+		{ "device.register",	"device.registered" },
+		{ "device.unregister",	"device.unregistered" },
+		{ "device.cmd.auth",	"device.auth" },
+		{ "device.cmd.list",	"device.list" },
+		{ "schema.update",	"schema.updated" },
+	};
+	size_t i;
+
+	for (i = 0; i < L_ARRAY_SIZE(map); i++)
+		if (strcmp(map[i][0], key) == 0)
+			return map[i][1];
+
+	return NULL;
+}
+
+static json_object *connector_hex_new(size_t len)
+{
+	uint8_t random[MB_TOKEN_SIZE];
+	char hex[2 * MB_TOKEN_SIZE + 1];
+	size_t i;
+
+	l_getrandom(random, len);
+	for (i = 0; i < len; i++)
+		sprintf(hex + 2 * i, "%02x", random[i]);
+
+	return json_object_new_string(hex);
+}
+
+static json_object *connector_device_new(const char *name)
+{
+	json_object *device, *schema, *sensor;
+
+	sensor = json_object_new_object();
+	json_object_object_add(sensor, "sensor_id", json_object_new_int(0));
+	json_object_object_add(sensor, "value_type", json_object_new_int(3));
+	json_object_object_add(sensor, "unit", json_object_new_int(0));
+	json_object_object_add(sensor, "type_id", json_object_new_int(65521));
+	json_object_object_add(sensor, "name", json_object_new_string("LED"));
+
+	schema = json_object_new_array();
+	json_object_array_add(schema, sensor);
+
+	device = json_object_new_object();
+	json_object_object_add(device, "id",
+			       connector_hex_new(MB_DEVICE_ID_SIZE));
+	json_object_object_add(device, "name", json_object_new_string(name));
+	json_object_object_add(device, "schema", schema);
+
+	return device;
+}
+
+static void connector_consume(const char *exchange, const char *routing_key,
+			      const void *body, size_t len, void *user_data)
+{
+	const char *reply_key;
+	json_object *jobj, *devices;
+	char *str;
+
+	/* Data is accepted silently */
+	reply_key = connector_reply_key(routing_key);
+	if (!reply_key)
+		return;
+
+	str = l_strndup(body, len);
+	jobj = json_tokener_parse(str);
+	l_free(str);
+
+	if (!jobj || json_object_get_type(jobj) != json_type_object) {
+		hal_log_error("[broker] connector: invalid %s", routing_key);
+		goto done;
+	}
+
+	json_object_object_add(jobj, "error", broker.side_effect ?
+			       json_object_new_string("error mocked") : NULL);
+
+	if (strcmp(routing_key, "device.register") == 0) {
+		json_object_object_add(jobj, "token",
+				       connector_hex_new(MB_TOKEN_SIZE));
+		json_object_object_del(jobj, "name");
+	} else if (strcmp(routing_key, "device.cmd.auth") == 0) {
+		json_object_object_del(jobj, "token");
+	} else if (strcmp(routing_key, "device.cmd.list") == 0) {
+		devices = json_object_new_array();
+		json_object_array_add(devices, connector_device_new("test"));
+		json_object_array_add(devices, connector_device_new("test2"));
+		json_object_object_add(jobj, "devices", devices);
+	} else if (strcmp(routing_key, "schema.update") == 0) {
+		json_object_object_del(jobj, "schema");
+	}
+
+	mock_broker_publish(MB_EXCHANGE_FOG, reply_key,
+			    json_object_to_json_string(jobj));
+
+done:
+	if (jobj)
+		json_object_put(jobj);
+}
+
+static int exchange_declare(const char *name, enum mb_exchange_type type)
+{
+	struct mb_exchange *exchange;
+
+	exchange = l_hashmap_lookup(broker.exchanges, name);
+	if (exchange)
+		return exchange->type == type ? 0 : -EEXIST;
+
+	exchange = l_new(struct mb_exchange, 1);
+	exchange->type = type;
+	exchange->bindings = l_queue_new();
+	l_hashmap_insert(broker.exchanges, name, exchange);
+
+	return 0;
+}
+
+static void consumer_add(struct mb_queue *queue,
+			 mock_broker_consume_func_t func, void *user_data)
+{
+	struct mb_consumer *consumer;
+
+	consumer = l_new(struct mb_consumer, 1);
+	consumer->tag = l_strdup_printf("amq.ctag-%u", ++broker.serial);
+	consumer->queue = queue;
+	consumer->func = func;
+	consumer->user_data = user_data;
+	consumer->no_ack = true;
+	l_queue_push_tail(queue->consumers, consumer);
+
+	queue_dispatch(queue);
+}
+
+static void exchange_free(void *data)
+{
+	struct mb_exchange *exchange = data;
+	struct mb_binding *binding;
+
+	while ((binding = l_queue_pop_head(exchange->bindings))) {
+		l_free(binding->key);
+		l_free(binding);
+	}
+
+	l_queue_destroy(exchange->bindings, NULL);
+	l_free(exchange);
+}
+
+static void route_free(void *data)
+{
+	struct mb_route *route = data;
+
+	message_unref(route->msg);
+	l_free(route);
+}
+
+/**
+ * mock_broker_start:
+ * @port: loopback TCP port, 0 picks a free one
+ *
+ * Starts accepting AMQP connections on the ELL main loop.
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int mock_broker_start(uint16_t port)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd, err, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0 ||
+	    getsockname(fd, (struct sockaddr *) &addr, &addrlen) < 0) {
+		err = -errno;
+		hal_log_error("broker socket: %s (%d)", strerror(-err), -err);
+		close(fd);
+		return err;
+	}
+
+	memset(&broker, 0, sizeof(broker));
+	broker.port = ntohs(addr.sin_port);
+	broker.exchanges = l_hashmap_string_new();
+	broker.queues = l_hashmap_string_new();
+	broker.conns = l_queue_new();
+	broker.routes = l_queue_new();
+
+	broker.io = l_io_new(fd);
+	l_io_set_close_on_destroy(broker.io, true);
+	l_io_set_read_handler(broker.io, accept_cb, NULL, NULL);
+
+	hal_log_info("Mock broker listening on 127.0.0.1:%u", broker.port);
+
+	return 0;
+}
+
+/**
+ * mock_broker_stop:
+ *
+ * Closes every connection and drops all exchanges, queues and messages.
+ */
+void mock_broker_stop(void)
+{
+	struct mb_conn *conn;
+
+	if (!broker.io)
+		return;
+
+	while ((conn = l_queue_peek_head(broker.conns)))
+		conn_destroy(conn);
+
+	l_queue_destroy(broker.routes, route_free);
+	l_timeout_remove(broker.route_to);
+	l_hashmap_destroy(broker.queues, queue_free);
+	l_hashmap_destroy(broker.exchanges, exchange_free);
+	l_queue_destroy(broker.conns, NULL);
+	l_io_destroy(broker.io);
+
+	memset(&broker, 0, sizeof(broker));
+}
+
+/**
+ * mock_broker_get_port:
+ *
+ * Returns: the TCP port the broker listens on.
+ */
+uint16_t mock_broker_get_port(void)
+{
+	return broker.port;
+}
+
+/**
+ * mock_broker_consume:
+ * @exchange: existing exchange name
+ * @binding_key: binding key, topic wildcards allowed
+ * @func: called for every message routed to the binding
+ * @user_data: user data provided to @func
+ *
+ * Consumes from a private queue inside the broker process.
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int mock_broker_consume(const char *exchange, const char *binding_key,
+			mock_broker_consume_func_t func, void *user_data)
+{
+	struct mb_queue *queue;
+
+	if (!l_hashmap_lookup(broker.exchanges, exchange))
+		return -ENOENT;
+
+	queue = queue_new("", NULL, false);
+	queue_bind(queue, exchange, binding_key);
+	consumer_add(queue, func, user_data);
+
+	return 0;
+}
+
+/**
+ * mock_broker_publish:
+ * @exchange: exchange name, "" for the default exchange
+ * @routing_key: routing key
+ * @body: message body
+ *
+ * Publishes a message without properties, subject to the injected
+ * latency and loss.
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int mock_broker_publish(const char *exchange, const char *routing_key,
+			const char *body)
+{
+	struct mb_message *msg;
+
+	if (exchange[0] && !l_hashmap_lookup(broker.exchanges, exchange))
+		return -ENOENT;
+
+	msg = message_new(exchange, routing_key);
+	msg->props = l_new(uint8_t, 2); /* No property flags */
+	msg->props_len = 2;
+	msg->body_len = strlen(body);
+	msg->body = l_memdup(body, msg->body_len + 1);
+
+	route_submit(msg, NULL, 0, 0);
+
+	return 0;
+}
+
+/**
+ * mock_broker_set_connector:
+ * @side_effect: answer every command with an error
+ *
+ * Declares the knotd exchanges and answers the cloud commands published
+ * to them, like test/mock-connector.py does.
+ *
+ * Returns: 0 if successful and a negative errno otherwise.
+ */
+int mock_broker_set_connector(bool side_effect)
+{
+	static const char *const keys[] = {
+		"device.*", "device.cmd.*", "schema.*", "data.*",
+	};
+	struct mb_queue *queue;
+	size_t i;
+
+	broker.side_effect = side_effect;
+
+	if (exchange_declare(MB_EXCHANGE_CLOUD, MB_EXCHANGE_TOPIC) < 0 ||
+	    exchange_declare(MB_EXCHANGE_FOG, MB_EXCHANGE_TOPIC) < 0)
+		return -EEXIST;
+
+	queue = l_hashmap_lookup(broker.queues, MB_QUEUE_CLOUD);
+	if (queue)
+		return 0;
+
+	queue = queue_new(MB_QUEUE_CLOUD, NULL, false);
+	for (i = 0; i < L_ARRAY_SIZE(keys); i++)
+		queue_bind(queue, MB_EXCHANGE_CLOUD, keys[i]);
+
+	consumer_add(queue, connector_consume, NULL);
+
+	return 0;
+}
+
+/**
+ * mock_broker_set_heartbeat:
+ * @seconds: heartbeat proposed on connection.tune, 0 disables
+ *
+ * Applies to connections opened afterwards.
+ */
+void mock_broker_set_heartbeat(uint16_t seconds)
+{
+	broker.heartbeat = seconds;
+}
+
+/**
+ * mock_broker_set_latency:
+ * @ms: delay between a publish and its routing
+ *
+ * Delays deliveries and publisher confirms alike.
+ */
+void mock_broker_set_latency(unsigned int ms)
+{
+	broker.latency_ms = ms;
+}
+
+/**
+ * mock_broker_set_loss:
+ * @permille: messages lost per thousand published
+ *
+ * Lost messages are never routed; publishers in confirm mode get a nack.
+ */
+void mock_broker_set_loss(unsigned int permille)
+{
+	broker.loss_permille = permille > 1000 ? 1000 : permille;
+	broker.loss_acc = 0;
+}
+
+static void conn_update_blocked(void *data, void *user_data)
+{
+	struct mb_conn *conn = data;
+
+	if (conn->dead || conn->state != MB_STATE_RUNNING)
+		return;
+
+	send_blocked(conn);
+
+	if (!broker.blocked)
+		conn_set_reading(conn, true);
+}
+
+/**
+ * mock_broker_set_blocked:
+ * @blocked: resource alarm state
+ *
+ * Sends connection.blocked or connection.unblocked to the clients that
+ * support it. While blocked, publishing connections are not read.
+ */
+void mock_broker_set_blocked(bool blocked)
+{
+	if (broker.blocked == blocked)
+		return;
+
+	broker.blocked = blocked;
+	l_queue_foreach(broker.conns, conn_update_blocked, NULL);
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Mock AMQP 0-9-1 broker: speaks the part of the protocol knotd and
+ * librabbitmq use (declare, bind, consume, publish, ack, confirms and
+ * heartbeats) on a loopback TCP port, driven by the ELL main loop.
+ * Optionally answers the cloud commands like test/mock-connector.py and
+ * injects latency, loss and connection.blocked.
+ */
+
+typedef void (*mock_broker_consume_func_t) (const char *exchange,
+					    const char *routing_key,
+					    const void *body, size_t len,
+					    void *user_data);
+
+int mock_broker_start(uint16_t port);
+void mock_broker_stop(void);
+uint16_t mock_broker_get_port(void);
+
+int mock_broker_consume(const char *exchange, const char *binding_key,
+			mock_broker_consume_func_t func, void *user_data);
+int mock_broker_publish(const char *exchange, const char *routing_key,
+			const char *body);
+
+int mock_broker_set_connector(bool side_effect);
+void mock_broker_set_heartbeat(uint16_t seconds);
+void mock_broker_set_latency(unsigned int ms);
+void mock_broker_set_loss(unsigned int permille);
+void mock_broker_set_blocked(bool blocked);
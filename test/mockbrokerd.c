@@ -0,0 +1,190 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+/*
+ * Standalone mock broker: replaces RabbitMQ plus test/mock-connector.py
+ * for knotd performance and regression runs on a single machine.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include <ell/ell.h>
+
+#include <hal/linux_log.h>
+
+#include "mockbroker.h"
+
+#define DEFAULT_PORT		5672
+
+static unsigned int opt_port = DEFAULT_PORT;
+static bool opt_side_effect;
+static unsigned int opt_latency;
+static unsigned int opt_loss;
+static unsigned int opt_heartbeat;
+static unsigned int opt_block_cycle;
+
+static void block_expired(struct l_timeout *timeout, void *user_data)
+{
+	static bool blocked;
+
+	blocked = !blocked;
+	hal_log_info("Mock broker %s", blocked ? "blocked" : "unblocked");
+	mock_broker_set_blocked(blocked);
+
+	l_timeout_modify(timeout, opt_block_cycle);
+}
+
+static void signal_handler(uint32_t signo, void *user_data)
+{
+	switch (signo) {
+	case SIGINT:
+	case SIGTERM:
+		l_main_quit();
+		break;
+	}
+}
+
+static void usage(void)
+{
+	printf("mockbrokerd - Mock AMQP broker for knotd\n"
+		"Usage:\n");
+	printf("\tmockbrokerd [options]\n");
+	printf("Options:\n"
+		"\t-p, --port		Loopback TCP port. Default: 5672\n"
+		"\t-s, --with-side-effect	Answer commands with an error\n"
+		"\t-l, --latency		Routing delay in milliseconds\n"
+		"\t-L, --loss		Messages lost per thousand\n"
+		"\t-H, --heartbeat		Heartbeat proposed, in seconds\n"
+		"\t-b, --block-cycle	Toggle connection.blocked every "
+		"N seconds\n"
+		"\t-h, --help		Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "port",		required_argument,	NULL, 'p' },
+	{ "with-side-effect",	no_argument,		NULL, 's' },
+	{ "latency",		required_argument,	NULL, 'l' },
+	{ "loss",		required_argument,	NULL, 'L' },
+	{ "heartbeat",		required_argument,	NULL, 'H' },
+	{ "block-cycle",	required_argument,	NULL, 'b' },
+	{ "help",		no_argument,		NULL, 'h' },
+	{ }
+};
+
+static int parse_args(int argc, char *argv[])
+{
+	int opt;
+
+	for (;;) {
+		opt = getopt_long(argc, argv, "p:sl:L:H:b:h",
+				  main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 'p':
+			opt_port = atoi(optarg);
+			break;
+		case 's':
+			opt_side_effect = true;
+			break;
+		case 'l':
+			opt_latency = atoi(optarg);
+			break;
+		case 'L':
+			opt_loss = atoi(optarg);
+			break;
+		case 'H':
+			opt_heartbeat = atoi(optarg);
+			break;
+		case 'b':
+			opt_block_cycle = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (argc - optind > 0 || opt_port > UINT16_MAX ||
+	    opt_heartbeat > UINT16_MAX) {
+		fprintf(stderr, "Invalid command line parameters\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct l_timeout *block_to = NULL;
+	int err;
+
+	if (parse_args(argc, argv) < 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if (!l_main_init())
+		return EXIT_FAILURE;
+
+	hal_log_init("mockbrokerd", false);
+
+	err = mock_broker_start(opt_port);
+	if (err < 0) {
+		hal_log_error("Can't start: %s (%d)", strerror(-err), -err);
+		goto done;
+	}
+
+	mock_broker_set_connector(opt_side_effect);
+	mock_broker_set_latency(opt_latency);
+	mock_broker_set_loss(opt_loss);
+	mock_broker_set_heartbeat(opt_heartbeat);
+
+	if (opt_block_cycle)
+		block_to = l_timeout_create(opt_block_cycle, block_expired,
+					    NULL, NULL);
+
+	l_main_run_with_signal(signal_handler, NULL);
+
+	l_timeout_remove(block_to);
+	mock_broker_stop();
+
+done:
+	hal_log_close();
+	l_main_exit();
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
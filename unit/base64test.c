@@ -0,0 +1,209 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include <ell/ell.h>
+
+#include "src/base64.h"
+
+#define FUZZ_ROUNDS		10000
+#define FUZZ_MAX_LEN		64
+#define BENCH_ROUNDS		1000000
+#define BENCH_LEN		16 /* KNOT_DATA_RAW_SIZE */
+#define FUZZ_SEED		0x4b4e6f56 /* Override with BASE64TEST_SEED */
+
+static uint64_t elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+						now.tv_nsec - start->tv_nsec;
+}
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+}
+
+static void encode_test(const void *test_data)
+{
+	uint8_t in[FUZZ_MAX_LEN];
+	char out[BASE64_ENCODED_LEN(FUZZ_MAX_LEN) + 1];
+	char *ref;
+	size_t ref_len, len;
+	ssize_t olen;
+	int i;
+
+	for (i = 0; i < FUZZ_ROUNDS; i++) {
+		len = 1 + rand() % FUZZ_MAX_LEN;
+		fill_random(in, len);
+
+		ref = l_base64_encode(in, len, 0, &ref_len);
+		assert(ref);
+
+		olen = base64_encode(in, len, out, sizeof(out));
+		assert(olen == (ssize_t) ref_len);
+		assert(memcmp(out, ref, ref_len) == 0);
+		assert(out[olen] == '\0');
+
+		l_free(ref);
+	}
+
+	/* No room for the null character */
+	assert(base64_encode(in, 3, out, 4) == -ENOSPC);
+}
+
+static void decode_test(const void *test_data)
+{
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+		"0123456789+/= \n*";
+	char in[BASE64_ENCODED_LEN(FUZZ_MAX_LEN) + 1];
+	uint8_t out[FUZZ_MAX_LEN];
+	uint8_t *ref;
+	size_t ref_len, len, j;
+	ssize_t olen;
+	char *encoded;
+	int i;
+
+	/* Arbitrary input, valid or not: results must match ELL's */
+	for (i = 0; i < FUZZ_ROUNDS; i++) {
+		len = 1 + rand() % (sizeof(in) - 1);
+		for (j = 0; j < len; j++)
+			in[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+
+		ref = l_base64_decode(in, len, &ref_len);
+		olen = base64_decode(in, len, out, sizeof(out));
+
+		if (!ref) {
+			assert(olen == -EINVAL);
+			continue;
+		}
+
+		if (ref_len > sizeof(out)) {
+			assert(olen == -EMSGSIZE);
+			l_free(ref);
+			continue;
+		}
+
+		assert(olen == (ssize_t) ref_len);
+		assert(memcmp(out, ref, ref_len) == 0);
+		l_free(ref);
+	}
+
+	/* Round trip of valid encodings */
+	for (i = 0; i < FUZZ_ROUNDS; i++) {
+		len = 1 + rand() % FUZZ_MAX_LEN;
+		fill_random(out, len);
+
+		encoded = l_base64_encode(out, len, 0, &ref_len);
+		ref = l_base64_decode(encoded, ref_len, &ref_len);
+		assert(ref && ref_len == len);
+
+		memset(out, 0, sizeof(out));
+		olen = base64_decode(encoded, strlen(encoded), out,
+				     sizeof(out));
+		assert(olen == (ssize_t) len);
+		assert(memcmp(out, ref, len) == 0);
+
+		l_free(encoded);
+		l_free(ref);
+	}
+
+	/* Never truncated to the output buffer size */
+	assert(base64_decode("AAECAwQF", 8, out, 4) == -EMSGSIZE);
+	assert(base64_decode("AAECAwQF", 8, out, 6) == 6);
+	assert(memcmp(out, "\x00\x01\x02\x03\x04\x05", 6) == 0);
+
+	/* 24 unpadded characters: 18 octets, more than a raw value holds */
+	assert(base64_decode("AAECAwQFBgcICQoLDA0ODxAR", 24, out,
+			     BENCH_LEN) == -EMSGSIZE);
+	assert(base64_decode("AAECAwQFBgcICQoLDA0ODxAR", 24, out,
+			     18) == 18);
+}
+
+static void throughput_test(const void *test_data)
+{
+	uint8_t in[BENCH_LEN];
+	char out[BASE64_ENCODED_LEN(BENCH_LEN) + 1];
+	struct timespec start;
+	uint64_t ell_ns, local_ns;
+	size_t olen;
+	char *encoded;
+	uint8_t *decoded;
+	int i;
+
+	fill_random(in, sizeof(in));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		encoded = l_base64_encode(in, sizeof(in), 0, &olen);
+		decoded = l_base64_decode(encoded, olen, &olen);
+		l_free(encoded);
+		l_free(decoded);
+	}
+	ell_ns = elapsed_ns(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		olen = base64_encode(in, sizeof(in), out, sizeof(out));
+		base64_decode(out, olen, in, sizeof(in));
+	}
+	local_ns = elapsed_ns(&start);
+
+	printf("%d-byte round trips: ell %.1f ns/op, base64 %.1f ns/op\n",
+	       BENCH_LEN, (double) ell_ns / BENCH_ROUNDS,
+	       (double) local_ns / BENCH_ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *env;
+	unsigned int seed = FUZZ_SEED;
+
+	l_test_init(&argc, &argv);
+
+	/* Failures print the seed: BASE64TEST_SEED=<seed> reproduces them */
+	env = getenv("BASE64TEST_SEED");
+	if (env)
+		seed = strtoul(env, NULL, 0);
+
+	printf("base64test: seed %#x\n", seed);
+	srand(seed);
+
+	l_test_add("/base64/encode", encode_test, NULL);
+	l_test_add("/base64/decode", decode_test, NULL);
+	l_test_add("/base64/throughput", throughput_test, NULL);
+
+	return l_test_run();
+}
@@ -43,6 +43,11 @@
 /* device name for the register */
 #define	KTEST_DEVICE_NAME			"ktest_unit_test"
 
+/* Things reconnecting at once and attempts until all are registered */
+#define	KTEST_STORM_CLIENTS			128
+#define	KTEST_STORM_ROUNDS			200
+#define	KTEST_STORM_BACKOFF_US			100000
+
 static uint64_t reg_id = 0x0123456789abcdef;
 static int sockfd;
 static char uuid128[KNOT_PROTOCOL_UUID_LEN];
@@ -345,6 +350,100 @@ static void unregister_valid_device_test(const void *test_data)
 	assert(kresp.action.result == 0);
 }
 
+/*
+ * Reconnection storm: every client sends its register request before any
+ * response is read. knotd admits part of them and asks the others to
+ * retry later (KNOT_ERR_CLOUD_FAILURE); all must eventually be registered.
+ * A registered client unregisters at once: knotd rolls back registrations
+ * whose schema doesn't come within ~6s, less than the storm takes. Until
+ * the cloud authenticates the new device the unregister is refused with
+ * KNOT_ERR_PERM and retried in the next round.
+ */
+static void reconnect_storm_test(const void *test_data)
+{
+	enum { STORM_REGISTER, STORM_UNREGISTER, STORM_DONE };
+	int fds[KTEST_STORM_CLIENTS];
+	int state[KTEST_STORM_CLIENTS];
+	unsigned int done = 0, refused = 0, round;
+	knot_msg req, rsp;
+	ssize_t plen;
+	int i;
+
+	for (i = 0; i < KTEST_STORM_CLIENTS; i++) {
+		fds[i] = unix_connect();
+		assert(fds[i] > 0);
+		state[i] = STORM_REGISTER;
+	}
+
+	for (round = 0; round < KTEST_STORM_ROUNDS &&
+	     done < KTEST_STORM_CLIENTS; round++) {
+		for (i = 0; i < KTEST_STORM_CLIENTS; i++) {
+			memset(&req, 0, sizeof(req));
+
+			switch (state[i]) {
+			case STORM_REGISTER:
+				req.hdr.type = KNOT_MSG_REG_REQ;
+				req.hdr.payload_len = strlen(KTEST_DEVICE_NAME);
+				req.reg.id = reg_id + 1 + i;
+				strcpy(req.reg.devName, KTEST_DEVICE_NAME);
+				plen = sizeof(req.reg.hdr) +
+							req.hdr.payload_len;
+				break;
+			case STORM_UNREGISTER:
+				req.hdr.type = KNOT_MSG_UNREG_REQ;
+				req.hdr.payload_len = 0;
+				plen = sizeof(req.unreg);
+				break;
+			default:
+				continue;
+			}
+
+			assert(write(fds[i], &req, plen) == plen);
+		}
+
+		for (i = 0; i < KTEST_STORM_CLIENTS; i++) {
+			if (state[i] == STORM_DONE)
+				continue;
+
+			memset(&rsp, 0, sizeof(rsp));
+			assert(read(fds[i], &rsp, sizeof(rsp)) > 0);
+
+			if (state[i] == STORM_UNREGISTER) {
+				assert(rsp.hdr.type == KNOT_MSG_UNREG_RSP);
+				if (rsp.action.result == KNOT_ERR_PERM)
+					continue;
+
+				assert(rsp.action.result == 0);
+				state[i] = STORM_DONE;
+				done++;
+				continue;
+			}
+
+			assert(rsp.hdr.type == KNOT_MSG_REG_RSP);
+
+			if (rsp.action.result == 0) {
+				state[i] = STORM_UNREGISTER;
+				continue;
+			}
+
+			assert(rsp.action.result == KNOT_ERR_CLOUD_FAILURE);
+			refused++;
+		}
+
+		if (done < KTEST_STORM_CLIENTS)
+			usleep(KTEST_STORM_BACKOFF_US);
+	}
+
+	printf("storm: %u registered, %u retries in %u rounds\n",
+	       done, refused, round);
+	assert(done == KTEST_STORM_CLIENTS);
+
+	for (i = 0; i < KTEST_STORM_CLIENTS; i++)
+		assert(close(fds[i]) == 0);
+
+	reg_id += KTEST_STORM_CLIENTS;
+}
+
 static void tcp_connect_test(const void *test_data)
 {
 	sockfd = tcp_connect();
@@ -440,5 +539,7 @@ int main(int argc, char *argv[])
 				unregister_valid_device_test, NULL);
 	l_test_add("/9/tcp_close", unix_close_test, NULL);
 
+	l_test_add("/10/reconnect_storm", reconnect_storm_test, NULL);
+
 	return l_test_run();
 }
@@ -0,0 +1,253 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <ell/ell.h>
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+#include "test/mockbroker.h"
+
+#define TEST_PUBLISHES		10
+#define TEST_TIMEOUT_US		500000
+
+/* Filled by the client thread, read once it has finished */
+struct client_result {
+	uint16_t port;
+	unsigned int acks;
+	unsigned int nacks;
+	char reply[512];
+	int done_fd;
+};
+
+static amqp_connection_state_t client_connect(uint16_t port)
+{
+	amqp_connection_state_t conn = amqp_new_connection();
+	amqp_socket_t *socket = amqp_tcp_socket_new(conn);
+	amqp_rpc_reply_t r;
+
+	assert(socket);
+	assert(amqp_socket_open(socket, "127.0.0.1", port) == 0);
+
+	r = amqp_login(conn, "/", AMQP_DEFAULT_MAX_CHANNELS,
+		       AMQP_DEFAULT_FRAME_SIZE, AMQP_DEFAULT_HEARTBEAT,
+		       AMQP_SASL_METHOD_PLAIN, "guest", "guest");
+	assert(r.reply_type == AMQP_RESPONSE_NORMAL);
+
+	amqp_channel_open(conn, 1);
+	assert(amqp_get_rpc_reply(conn).reply_type == AMQP_RESPONSE_NORMAL);
+
+	amqp_confirm_select(conn, 1);
+	assert(amqp_get_rpc_reply(conn).reply_type == AMQP_RESPONSE_NORMAL);
+
+	return conn;
+}
+
+static void client_publish(amqp_connection_state_t conn, const char *key,
+			   const char *body)
+{
+	assert(amqp_basic_publish(conn, 1, amqp_cstring_bytes("connIn"),
+				  amqp_cstring_bytes(key), 0, 0, NULL,
+				  amqp_cstring_bytes(body)) == 0);
+}
+
+/* Collects deliveries and confirms until @confirms (and a reply) arrived */
+static void client_wait(amqp_connection_state_t conn,
+			struct client_result *result, unsigned int confirms,
+			bool reply)
+{
+	struct timeval timeout = { 0, TEST_TIMEOUT_US };
+	amqp_envelope_t envelope;
+	amqp_rpc_reply_t r;
+	amqp_frame_t frame;
+
+	while (result->acks + result->nacks < confirms ||
+	       (reply && result->reply[0] == '\0')) {
+		amqp_maybe_release_buffers(conn);
+		r = amqp_consume_message(conn, &envelope, &timeout, 0);
+
+		if (r.reply_type == AMQP_RESPONSE_NORMAL) {
+			snprintf(result->reply, sizeof(result->reply), "%.*s",
+				 (int) envelope.message.body.len,
+				 (char *) envelope.message.body.bytes);
+			amqp_destroy_envelope(&envelope);
+			continue;
+		}
+
+		/* Confirms are not deliveries: read them as plain frames */
+		assert(r.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION &&
+		       r.library_error == AMQP_STATUS_UNEXPECTED_STATE);
+		assert(amqp_simple_wait_frame(conn, &frame) == 0);
+		assert(frame.frame_type == AMQP_FRAME_METHOD);
+
+		if (frame.payload.method.id == AMQP_BASIC_ACK_METHOD)
+			result->acks++;
+		else if (frame.payload.method.id == AMQP_BASIC_NACK_METHOD)
+			result->nacks++;
+	}
+}
+
+static void client_close(amqp_connection_state_t conn)
+{
+	amqp_channel_close(conn, 1, AMQP_REPLY_SUCCESS);
+	amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
+	amqp_destroy_connection(conn);
+}
+
+static void *register_client(void *user_data)
+{
+	struct client_result *result = user_data;
+	amqp_connection_state_t conn = client_connect(result->port);
+	amqp_queue_declare_ok_t *declare;
+
+	declare = amqp_queue_declare(conn, 1, amqp_empty_bytes, 0, 0, 1, 1,
+				     amqp_empty_table);
+	assert(declare);
+	amqp_queue_bind(conn, 1, declare->queue,
+			amqp_cstring_bytes("connOut"),
+			amqp_cstring_bytes("device.registered"),
+			amqp_empty_table);
+	amqp_basic_consume(conn, 1, declare->queue, amqp_empty_bytes,
+			   0, 1, 0, amqp_empty_table);
+	assert(amqp_get_rpc_reply(conn).reply_type == AMQP_RESPONSE_NORMAL);
+
+	client_publish(conn, "device.register",
+		       "{\"id\":\"0123456789abcdef\",\"name\":\"thing\"}");
+	client_wait(conn, result, 1, true);
+	client_close(conn);
+
+	assert(write(result->done_fd, "", 1) == 1);
+
+	return NULL;
+}
+
+static void *lossy_client(void *user_data)
+{
+	struct client_result *result = user_data;
+	amqp_connection_state_t conn = client_connect(result->port);
+	unsigned int i;
+
+	for (i = 0; i < TEST_PUBLISHES; i++)
+		client_publish(conn, "data.publish",
+			       "{\"id\":\"0123456789abcdef\",\"data\":[]}");
+
+	client_wait(conn, result, TEST_PUBLISHES, false);
+	client_close(conn);
+
+	assert(write(result->done_fd, "", 1) == 1);
+
+	return NULL;
+}
+
+static bool client_done(struct l_io *io, void *user_data)
+{
+	l_main_quit();
+
+	return false;
+}
+
+/* Broker on the main loop, blocking librabbitmq client in a thread */
+static void run_client(void *(*client)(void *), struct client_result *result)
+{
+	struct l_io *io;
+	pthread_t thread;
+	int fds[2];
+
+	assert(pipe(fds) == 0);
+
+	result->port = mock_broker_get_port();
+	result->done_fd = fds[1];
+
+	io = l_io_new(fds[0]);
+	l_io_set_read_handler(io, client_done, NULL, NULL);
+
+	assert(pthread_create(&thread, NULL, client, result) == 0);
+	l_main_run();
+	assert(pthread_join(thread, NULL) == 0);
+
+	l_io_destroy(io);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void connector_test(const void *test_data)
+{
+	struct client_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	assert(l_main_init());
+	assert(mock_broker_start(0) == 0);
+	assert(mock_broker_set_connector(false) == 0);
+
+	run_client(register_client, &result);
+
+	printf("reply: %s\n", result.reply);
+	assert(result.acks == 1 && result.nacks == 0);
+	assert(strstr(result.reply, "\"token\""));
+	assert(!strstr(result.reply, "\"name\""));
+
+	mock_broker_stop();
+	l_main_exit();
+}
+
+static void loss_test(const void *test_data)
+{
+	struct client_result result;
+
+	memset(&result, 0, sizeof(result));
+
+	assert(l_main_init());
+	assert(mock_broker_start(0) == 0);
+	assert(mock_broker_set_connector(false) == 0);
+	mock_broker_set_loss(500);
+	mock_broker_set_latency(10);
+
+	run_client(lossy_client, &result);
+
+	printf("acks %u nacks %u\n", result.acks, result.nacks);
+	assert(result.acks == TEST_PUBLISHES / 2);
+	assert(result.nacks == TEST_PUBLISHES / 2);
+
+	mock_broker_stop();
+	l_main_exit();
+}
+
+int main(int argc, char *argv[])
+{
+	l_test_init(&argc, &argv);
+
+	l_test_add("/mockbroker/connector", connector_test, NULL);
+	l_test_add("/mockbroker/loss", loss_test, NULL);
+
+	return l_test_run();
+}
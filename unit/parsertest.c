@@ -0,0 +1,403 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <assert.h>
+
+#include <ell/ell.h>
+
+#include <knot/knot_types.h>
+#include <knot/knot_protocol.h>
+
+#include <json-c/json.h>
+
+#include "src/arena.h"
+#include "src/schema.h"
+#include "src/floatstr.h"
+#include "src/parser.h"
+
+#define ARENA_BLOCK_SIZE	4096
+#define FLOAT_ROUNDS		1000000
+#define FLOAT_SEED		0x4b4e6f54 /* Fixed: failures are reproducible */
+#define SCHEMA_ROUNDS		1000
+#define SCHEMA_SEED		0x4b4e6f55
+
+#define SENSOR_INT		1
+#define SENSOR_FLOAT		2
+#define SENSOR_BOOL		3
+#define SENSOR_RAW		4
+
+static struct schema *schema;
+static struct arena *arena;
+
+static void schema_add_sensor(uint8_t sensor_id, uint8_t value_type)
+{
+	knot_msg_schema entry;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.sensor_id = sensor_id;
+	entry.values.value_type = value_type;
+	snprintf(entry.values.name, sizeof(entry.values.name), "sensor%u",
+		 sensor_id);
+
+	assert(schema_add(schema, &entry));
+}
+
+/* Parses the "data" array of a data update and returns the message list */
+static struct l_queue *update_to_list(const char *data)
+{
+	struct l_queue *list;
+	json_object *jso;
+	char *json;
+
+	json = l_strdup_printf("{\"id\":\"0123456789abcdef\",\"data\":%s}",
+			       data);
+	jso = json_tokener_parse(json);
+	assert(jso);
+
+	list = parser_update_to_list(jso, schema, arena);
+
+	json_object_put(jso);
+	l_free(json);
+
+	return list;
+}
+
+static void update_valid_test(const void *test_data)
+{
+	const struct l_queue_entry *entry;
+	const knot_msg_data *msg;
+	struct l_queue *list;
+
+	list = update_to_list("[{\"sensor_id\":1,\"value\":-10},"
+			      "{\"sensor_id\":1,\"value\":10.0},"
+			      "{\"sensor_id\":2,\"value\":21.5},"
+			      "{\"sensor_id\":2,\"value\":3},"
+			      "{\"sensor_id\":3,\"value\":true},"
+			      "{\"sensor_id\":3,\"value\":0},"
+			      "{\"sensor_id\":4,\"value\":\"AAEC\"}]");
+	assert(list);
+	assert(l_queue_length(list) == 7);
+
+	entry = l_queue_get_entries(list);
+
+	msg = entry->data;
+	assert(msg->hdr.type == KNOT_MSG_PUSH_DATA_REQ);
+	assert(msg->sensor_id == SENSOR_INT && msg->payload.val_i == -10);
+	assert(msg->hdr.payload_len == 1 + sizeof(int32_t));
+
+	msg = (entry = entry->next)->data;
+	assert(msg->sensor_id == SENSOR_INT && msg->payload.val_i == 10);
+
+	msg = (entry = entry->next)->data;
+	assert(msg->sensor_id == SENSOR_FLOAT && msg->payload.val_f == 21.5f);
+	assert(msg->hdr.payload_len == 1 + sizeof(float));
+
+	msg = (entry = entry->next)->data;
+	assert(msg->sensor_id == SENSOR_FLOAT && msg->payload.val_f == 3.0f);
+
+	msg = (entry = entry->next)->data;
+	assert(msg->sensor_id == SENSOR_BOOL && msg->payload.val_b);
+	assert(msg->hdr.payload_len == 1 + sizeof(bool));
+
+	msg = (entry = entry->next)->data;
+	assert(msg->sensor_id == SENSOR_BOOL && !msg->payload.val_b);
+
+	msg = (entry = entry->next)->data;
+	assert(msg->sensor_id == SENSOR_RAW && msg->hdr.payload_len == 1 + 3);
+	assert(msg->payload.raw[0] == 0 && msg->payload.raw[1] == 1 &&
+	       msg->payload.raw[2] == 2);
+
+	l_queue_destroy(list, NULL);
+	arena_reset(arena);
+}
+
+/* Values not matching the type declared in the schema are rejected */
+static void update_wrong_type_test(const void *test_data)
+{
+	static const char * const updates[] = {
+		"[{\"sensor_id\":1,\"value\":\"10\"}]",
+		"[{\"sensor_id\":1,\"value\":1.5}]",
+		"[{\"sensor_id\":1,\"value\":true}]",
+		"[{\"sensor_id\":1,\"value\":4294967296}]",
+		"[{\"sensor_id\":2,\"value\":\"21.5\"}]",
+		"[{\"sensor_id\":2,\"value\":1e39}]",
+		"[{\"sensor_id\":3,\"value\":2}]",
+		"[{\"sensor_id\":3,\"value\":\"true\"}]",
+		"[{\"sensor_id\":4,\"value\":5}]",
+		"[{\"sensor_id\":4,\"value\":\"A\"}]",
+		"[{\"sensor_id\":4,\"value\":\"AAECAwQFBgcICQoLDA0ODxAR\"}]",
+		/* One invalid value rejects the whole update */
+		"[{\"sensor_id\":1,\"value\":1},{\"sensor_id\":3,\"value\":7}]",
+	};
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(updates); i++)
+		assert(!update_to_list(updates[i]));
+
+	arena_reset(arena);
+}
+
+static void update_unknown_sensor_test(const void *test_data)
+{
+	assert(!update_to_list("[{\"sensor_id\":9,\"value\":1}]"));
+	assert(!update_to_list("[{\"sensor_id\":1,\"value\":1},"
+			       "{\"sensor_id\":9,\"value\":1}]"));
+
+	arena_reset(arena);
+}
+
+static void update_missing_value_test(const void *test_data)
+{
+	assert(!update_to_list("[{\"sensor_id\":1}]"));
+	assert(!update_to_list("[{\"value\":1}]"));
+	assert(!update_to_list("[{\"sensor_id\":\"1\",\"value\":1}]"));
+	assert(!update_to_list("[1]"));
+
+	arena_reset(arena);
+}
+
+static const struct {
+	float val;
+	const char *str;
+} float_cases[] = {
+	{ 21.3f,		"21.3" },
+	{ -21.3f,		"-21.3" },
+	{ 1.0f,			"1.0" },
+	{ 0.1f,			"0.1" },
+	{ 0.0f,			"0.0" },
+	{ -0.0f,		"-0.0" },
+	{ 123456789.0f,		"123456790.0" },
+	{ 16777216.0f,		"16777216.0" },
+	/* Normal and denormal limits */
+	{ FLT_MAX,		"3.4028235e+38" },
+	{ FLT_MIN,		"1.1754944e-38" },
+	{ 0x1.fffffcp-127f,	"1.1754942e-38" },
+	{ 0x1p-147f,		"6e-45" },
+	{ 0x1p-149f,		"1e-45" },
+	/* Plain notation for decimal exponents in [-6, 21) */
+	{ 1e21f,		"1e+21" },
+	{ 1e20f,		"100000000000000000000.0" },
+	{ 9.99999e20f,		"999999000000000000000.0" },
+	{ 1e-6f,		"0.000001" },
+	{ 1.5e-6f,		"0.0000015" },
+	{ 9.9999e-7f,		"9.9999e-07" },
+	{ 1e-7f,		"1e-07" },
+};
+
+static void float_cases_test(const void *test_data)
+{
+	char str[FLOATSTR_SIZE];
+	unsigned int i;
+	int len;
+
+	for (i = 0; i < L_ARRAY_SIZE(float_cases); i++) {
+		len = floatstr_shortest(float_cases[i].val, str, sizeof(str));
+		if (len < 0 || strcmp(str, float_cases[i].str)) {
+			printf("%a: \"%s\", expected \"%s\"\n",
+			       float_cases[i].val, len < 0 ? "" : str,
+			       float_cases[i].str);
+			assert(false);
+		}
+
+		assert(len == (int) strlen(str));
+	}
+
+	assert(floatstr_shortest(INFINITY, str, sizeof(str)) == -EINVAL);
+	assert(floatstr_shortest(NAN, str, sizeof(str)) == -EINVAL);
+	assert(floatstr_shortest(21.3f, str, 4) == -ENOSPC);
+	assert(floatstr_shortest(21.3f, str, 5) == 4);
+}
+
+/* Random bit patterns parse back to the same float, sign included */
+static void float_round_trip_test(const void *test_data)
+{
+	char str[FLOATSTR_SIZE];
+	uint32_t bits, parsed_bits;
+	float val, parsed;
+	unsigned int i;
+
+	srand(FLOAT_SEED);
+
+	for (i = 0; i < FLOAT_ROUNDS; i++) {
+		bits = (uint32_t) rand() << 16 ^ (uint32_t) rand();
+		memcpy(&val, &bits, sizeof(val));
+		if (!isfinite(val))
+			continue;
+
+		assert(floatstr_shortest(val, str, sizeof(str)) > 0);
+
+		parsed = strtof(str, NULL);
+		memcpy(&parsed_bits, &parsed, sizeof(parsed_bits));
+		if (parsed_bits != bits) {
+			printf("%08x: \"%s\"\n", bits, str);
+			assert(false);
+		}
+	}
+}
+
+/* Float values are published with their shortest representation */
+static void float_publish_test(const void *test_data)
+{
+	knot_value_type value;
+	json_object *jso;
+
+	memset(&value, 0, sizeof(value));
+	value.val_f = 21.3f;
+
+	jso = parser_data_create_object("0123456789abcdef", SENSOR_FLOAT,
+					KNOT_VALUE_TYPE_FLOAT, &value,
+					sizeof(value.val_f));
+	assert(jso);
+	assert(strstr(json_object_to_json_string_ext(jso,
+						     JSON_C_TO_STRING_PLAIN),
+		      "\"value\":21.3}"));
+
+	json_object_put(jso);
+}
+
+/* Encodes and decodes through the wire format, as the cloud echoes it */
+static struct schema *schema_round_trip(const struct schema *sch)
+{
+	struct schema *decoded;
+	json_object *jso, *parsed, *jarray;
+
+	jso = parser_schema_create_object("0123456789abcdef", sch);
+	assert(jso);
+
+	parsed = json_tokener_parse(json_object_to_json_string(jso));
+	assert(parsed);
+	assert(json_object_object_get_ex(parsed, "schema", &jarray));
+
+	decoded = parser_schema_from_json(jarray);
+
+	json_object_put(parsed);
+	json_object_put(jso);
+
+	return decoded;
+}
+
+/* Random schemas survive SCHEMA_FIELDS encoding then decoding */
+static void schema_round_trip_test(const void *test_data)
+{
+	knot_msg_schema entry;
+	struct schema *sch, *decoded;
+	unsigned int i, j, count, len;
+
+	srand(SCHEMA_SEED);
+
+	for (i = 0; i < SCHEMA_ROUNDS; i++) {
+		sch = schema_new();
+		count = 1 + rand() % 16;
+
+		while (schema_count(sch) < count) {
+			memset(&entry, 0, sizeof(entry));
+			entry.sensor_id = rand();
+			entry.values.value_type = rand();
+			entry.values.unit = rand();
+			entry.values.type_id = rand();
+
+			len = rand() % sizeof(entry.values.name);
+			for (j = 0; j < len; j++)
+				entry.values.name[j] = ' ' + rand() % 95;
+
+			schema_add(sch, &entry);
+		}
+
+		decoded = schema_round_trip(sch);
+		assert(decoded);
+		assert(schema_count(decoded) == count);
+		assert(schema_equal(decoded, sch));
+
+		schema_unref(decoded);
+		schema_unref(sch);
+	}
+}
+
+#define ID_FIELD_ARG(field)	, #field "-value"
+#define ID_FIELD_COUNT(field)	+ 1
+#define ID_FIELD_CHECK(field)						\
+	assert(!strcmp(parser_get_key_str_from_json_obj(parsed, #field),	\
+		       #field "-value"));
+
+/* Each PARSER_ID_MESSAGES entry encodes the id plus its listed fields */
+#define ID_MESSAGE_ROUND_TRIP(msg, fields)				\
+	jso = parser_##msg##_json_create("0123456789abcdef"		\
+					 fields(ID_FIELD_ARG));		\
+	assert(jso);							\
+	parsed = json_tokener_parse(json_object_to_json_string(jso));	\
+	assert(parsed);							\
+	assert(!strcmp(parser_get_key_str_from_json_obj(parsed, "id"),	\
+		       "0123456789abcdef"));				\
+	fields(ID_FIELD_CHECK)						\
+	assert(json_object_object_length(parsed) ==			\
+	       1 fields(ID_FIELD_COUNT));				\
+	json_object_put(parsed);					\
+	json_object_put(jso);
+
+static void id_messages_round_trip_test(const void *test_data)
+{
+	json_object *jso, *parsed;
+
+	PARSER_ID_MESSAGES(ID_MESSAGE_ROUND_TRIP)
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	l_test_init(&argc, &argv);
+
+	arena = arena_new(ARENA_BLOCK_SIZE);
+	schema = schema_new();
+	schema_add_sensor(SENSOR_INT, KNOT_VALUE_TYPE_INT);
+	schema_add_sensor(SENSOR_FLOAT, KNOT_VALUE_TYPE_FLOAT);
+	schema_add_sensor(SENSOR_BOOL, KNOT_VALUE_TYPE_BOOL);
+	schema_add_sensor(SENSOR_RAW, KNOT_VALUE_TYPE_RAW);
+
+	l_test_add("/parser/update/valid", update_valid_test, NULL);
+	l_test_add("/parser/update/wrong-type", update_wrong_type_test, NULL);
+	l_test_add("/parser/update/unknown-sensor",
+		   update_unknown_sensor_test, NULL);
+	l_test_add("/parser/update/missing-value",
+		   update_missing_value_test, NULL);
+	l_test_add("/parser/float/cases", float_cases_test, NULL);
+	l_test_add("/parser/float/round-trip", float_round_trip_test, NULL);
+	l_test_add("/parser/float/publish", float_publish_test, NULL);
+	l_test_add("/parser/schema/round-trip", schema_round_trip_test, NULL);
+	l_test_add("/parser/id-messages/round-trip",
+		   id_messages_round_trip_test, NULL);
+
+	ret = l_test_run();
+
+	schema_unref(schema);
+	arena_free(arena);
+
+	return ret;
+}
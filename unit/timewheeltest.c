@@ -0,0 +1,228 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <assert.h>
+#include <sys/resource.h>
+
+#include <ell/ell.h>
+
+#include "src/timewheel.h"
+
+#define EXPIRE_TIMERS		2000
+#define EXPIRE_MAX_MS		300
+#define BENCH_SESSIONS		10000
+#define BENCH_TIMEOUT_MS	5000 /* Never reached */
+
+struct expire_timer {
+	struct timewheel_timer timer;
+	uint64_t deadline_ms;
+	bool cancelled;
+	bool fired;
+};
+
+static unsigned int expire_left;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000ULL +
+						now.tv_nsec - start->tv_nsec;
+}
+
+static unsigned int open_fds(void)
+{
+	struct dirent *entry;
+	unsigned int count = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir)))
+		if (entry->d_name[0] != '.')
+			count++;
+
+	closedir(dir);
+
+	return count;
+}
+
+static void expire_cb(struct timewheel_timer *timer, void *user_data)
+{
+	struct expire_timer *t = user_data;
+
+	assert(!t->cancelled && !t->fired);
+	assert(now_ms() >= t->deadline_ms);
+
+	t->fired = true;
+	if (--expire_left == 0)
+		l_main_quit();
+}
+
+static void expire_test(const void *test_data)
+{
+	struct expire_timer *timers;
+	unsigned int ms;
+	int i;
+
+	assert(l_main_init());
+
+	timers = l_new(struct expire_timer, EXPIRE_TIMERS);
+	expire_left = EXPIRE_TIMERS;
+
+	for (i = 0; i < EXPIRE_TIMERS; i++) {
+		ms = rand() % EXPIRE_MAX_MS;
+		timewheel_timer_init(&timers[i].timer, expire_cb, &timers[i]);
+		timers[i].deadline_ms = now_ms() + ms;
+		timewheel_timer_add(&timers[i].timer, ms);
+	}
+
+	/* Cancelled and re-armed timers must not fire in between */
+	for (i = 0; i < EXPIRE_TIMERS; i += 3) {
+		timewheel_timer_cancel(&timers[i].timer);
+		timers[i].cancelled = true;
+		expire_left--;
+	}
+
+	for (i = 1; i < EXPIRE_TIMERS; i += 3) {
+		timers[i].deadline_ms = now_ms() + EXPIRE_MAX_MS;
+		timewheel_timer_add(&timers[i].timer, EXPIRE_MAX_MS);
+	}
+
+	l_main_run();
+
+	for (i = 0; i < EXPIRE_TIMERS; i++) {
+		assert(timers[i].fired != timers[i].cancelled);
+		assert(!timewheel_timer_pending(&timers[i].timer));
+	}
+
+	timewheel_stop();
+	l_free(timers);
+	l_main_exit();
+}
+
+static void dummy_timeout_cb(struct l_timeout *timeout, void *user_data)
+{
+}
+
+static void dummy_timer_cb(struct timewheel_timer *timer, void *user_data)
+{
+}
+
+/* One deadline per session: timing wheel vs one l_timeout (timerfd) each */
+static void bench_test(const void *test_data)
+{
+	struct timewheel_timer *timers;
+	struct l_timeout **timeouts;
+	struct timespec start;
+	struct rlimit rlim;
+	uint64_t arm_ns, cancel_ns;
+	unsigned int base_fds, fds;
+	int created;
+	int i;
+
+	/* Give l_timeout a chance: each one is a file descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	assert(l_main_init());
+	base_fds = open_fds();
+
+	timeouts = l_new(struct l_timeout *, BENCH_SESSIONS);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (created = 0; created < BENCH_SESSIONS; created++) {
+		timeouts[created] = l_timeout_create_ms(BENCH_TIMEOUT_MS,
+							dummy_timeout_cb,
+							NULL, NULL);
+		if (!timeouts[created])
+			break;
+	}
+	arm_ns = elapsed_ns(&start);
+	fds = open_fds() - base_fds;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < created; i++)
+		l_timeout_remove(timeouts[i]);
+	cancel_ns = elapsed_ns(&start);
+
+	printf("l_timeout: %d/%d armed, %.1f ns arm, %.1f ns cancel, %u fds\n",
+	       created, BENCH_SESSIONS, (double) arm_ns / (created ? : 1),
+	       (double) cancel_ns / (created ? : 1), fds);
+
+	l_free(timeouts);
+
+	timers = l_new(struct timewheel_timer, BENCH_SESSIONS);
+	for (i = 0; i < BENCH_SESSIONS; i++)
+		timewheel_timer_init(&timers[i], dummy_timer_cb, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_SESSIONS; i++)
+		timewheel_timer_add(&timers[i], BENCH_TIMEOUT_MS);
+	arm_ns = elapsed_ns(&start);
+	fds = open_fds() - base_fds;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_SESSIONS; i++)
+		timewheel_timer_cancel(&timers[i]);
+	cancel_ns = elapsed_ns(&start);
+
+	printf("timewheel: %d armed, %.1f ns arm, %.1f ns cancel, %u fds\n",
+	       BENCH_SESSIONS, (double) arm_ns / BENCH_SESSIONS,
+	       (double) cancel_ns / BENCH_SESSIONS, fds);
+
+	timewheel_stop();
+	l_free(timers);
+	l_main_exit();
+}
+
+int main(int argc, char *argv[])
+{
+	l_test_init(&argc, &argv);
+
+	srand(time(NULL));
+
+	l_test_add("/timewheel/expire", expire_test, NULL);
+	l_test_add("/timewheel/bench", bench_test, NULL);
+
+	return l_test_run();
+}
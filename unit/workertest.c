@@ -0,0 +1,224 @@
+/*
+ * This file is part of the KNOT Project
+ *
+ * Copyright (c) 2019, CESAR. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <ell/ell.h>
+
+#include "src/pdubuf.h"
+#include "src/worker.h"
+
+#define BENCH_SOCKETS		64 /* Simulated things */
+#define BENCH_WRITERS		4
+#define BENCH_PDUS		5000 /* Per socket */
+#define BENCH_PDU_LEN		16
+#define BENCH_WORKERS_MAX	8
+
+struct bench_socket {
+	int fd[2];			/* fd[0]: worker side */
+	uint32_t next_seq;		/* Expected from the worker side */
+	bool hangup;
+};
+
+static struct bench_socket sockets[BENCH_SOCKETS];
+static unsigned int pdus_left;
+static unsigned int hangups_left;
+
+static struct bench_socket *socket_find(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_SOCKETS; i++)
+		if (sockets[i].fd[0] == fd)
+			return &sockets[i];
+
+	return NULL;
+}
+
+static void input_cb(int fd, uint32_t serial, struct pdubuf *buf,
+		     void *user_data)
+{
+	struct bench_socket *sock = socket_find(fd);
+	uint32_t seq;
+
+	assert(sock);
+	assert(serial == (uint32_t) (sock - sockets) + 1);
+
+	if (!buf) {
+		assert(!sock->hangup);
+		sock->hangup = true;
+		if (--hangups_left == 0)
+			l_main_quit();
+		return;
+	}
+
+	/* SOCK_SEQPACKET: one PDU per buffer, in order per socket */
+	assert(buf->tail == BENCH_PDU_LEN);
+	memcpy(&seq, buf->data, sizeof(seq));
+	assert(seq == sock->next_seq);
+	sock->next_seq++;
+
+	pdubuf_put(buf);
+
+	if (--pdus_left == 0 && !hangups_left)
+		l_main_quit();
+}
+
+static void *writer_thread(void *user_data)
+{
+	unsigned int first = L_PTR_TO_UINT(user_data);
+	uint8_t pdu[BENCH_PDU_LEN];
+	uint32_t seq;
+	unsigned int i;
+
+	memset(pdu, 0, sizeof(pdu));
+
+	for (seq = 0; seq < BENCH_PDUS; seq++) {
+		memcpy(pdu, &seq, sizeof(seq));
+		for (i = first; i < BENCH_SOCKETS; i += BENCH_WRITERS)
+			assert(write(sockets[i].fd[1], pdu, sizeof(pdu)) ==
+							sizeof(pdu));
+	}
+
+	return NULL;
+}
+
+static void sockets_open(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_SOCKETS; i++) {
+		memset(&sockets[i], 0, sizeof(sockets[i]));
+		assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0,
+				  sockets[i].fd) == 0);
+		assert(worker_add(sockets[i].fd[0], i + 1) == 0);
+	}
+}
+
+static void sockets_close(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_SOCKETS; i++) {
+		worker_remove(sockets[i].fd[0]);
+		close(sockets[i].fd[0]);
+		if (sockets[i].fd[1] >= 0)
+			close(sockets[i].fd[1]);
+	}
+}
+
+/* Peer closed: reported once, after the data sent before */
+static void hangup_test(const void *test_data)
+{
+	uint8_t pdu[BENCH_PDU_LEN];
+	unsigned int i;
+
+	assert(worker_start(2, input_cb, NULL) == 0);
+	sockets_open();
+
+	memset(pdu, 0, sizeof(pdu));
+	pdus_left = BENCH_SOCKETS;
+	hangups_left = BENCH_SOCKETS;
+
+	for (i = 0; i < BENCH_SOCKETS; i++) {
+		assert(write(sockets[i].fd[1], pdu, sizeof(pdu)) ==
+							sizeof(pdu));
+		close(sockets[i].fd[1]);
+		sockets[i].fd[1] = -1;
+	}
+
+	l_main_run();
+
+	for (i = 0; i < BENCH_SOCKETS; i++)
+		assert(sockets[i].hangup && sockets[i].next_seq == 1);
+
+	sockets_close();
+	worker_stop();
+	pdubuf_pool_clear();
+}
+
+/* PDUs per second from BENCH_SOCKETS things, from 1 to N workers */
+static void bench_test(const void *test_data)
+{
+	pthread_t writers[BENCH_WRITERS];
+	struct timespec start, end;
+	unsigned int workers;
+	unsigned int i;
+	double secs;
+
+	for (workers = 1; workers <= BENCH_WORKERS_MAX; workers *= 2) {
+		assert(worker_start(workers, input_cb, NULL) == 0);
+		sockets_open();
+
+		pdus_left = BENCH_SOCKETS * BENCH_PDUS;
+		hangups_left = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (i = 0; i < BENCH_WRITERS; i++)
+			assert(pthread_create(&writers[i], NULL, writer_thread,
+					      L_UINT_TO_PTR(i)) == 0);
+
+		l_main_run();
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		for (i = 0; i < BENCH_WRITERS; i++)
+			pthread_join(writers[i], NULL);
+
+		secs = (end.tv_sec - start.tv_sec) +
+				(end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%u worker(s): %u PDUs in %.3f s, %.0f PDUs/s\n",
+		       workers, BENCH_SOCKETS * BENCH_PDUS, secs,
+		       BENCH_SOCKETS * BENCH_PDUS / secs);
+
+		sockets_close();
+		worker_stop();
+	}
+
+	pdubuf_pool_clear();
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	l_test_init(&argc, &argv);
+	l_main_init();
+
+	l_test_add("/worker/hangup", hangup_test, NULL);
+	l_test_add("/worker/bench", bench_test, NULL);
+
+	ret = l_test_run();
+
+	l_main_exit();
+
+	return ret;
+}